@@ -0,0 +1,156 @@
+/* This is a version of server.c that serves many clients at the same time,
+ * using the event driven server core in evserver.c. It listens on port 1234
+ * and answers to the same ListFilesRequests, so it works with client.c.
+ *
+ * The requests are decoded and the responses encoded by a pool of worker
+ * threads, while one thread handles the network connections.
+ * Stop the server with Ctrl-C to see the statistics.
+ */
+
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pb_encode.h>
+#include <pb_decode.h>
+
+#include "fileproto.pb.h"
+#include "evserver.h"
+
+static struct evserver *g_server;
+
+/* Same as in server.c: encode the FileInfo entries one at a time as they
+ * are read from the directory. */
+static bool listdir_callback(pb_ostream_t *stream, const pb_field_t *field, void * const *arg)
+{
+    DIR *dir = (DIR*) *arg;
+    struct dirent *file;
+    FileInfo fileinfo = {};
+
+    while ((file = readdir(dir)) != NULL)
+    {
+        fileinfo.inode = file->d_ino;
+        strncpy(fileinfo.name, file->d_name, sizeof(fileinfo.name));
+        fileinfo.name[sizeof(fileinfo.name) - 1] = '\0';
+
+        if (!pb_encode_tag_for_field(stream, field))
+            return false;
+
+        if (!pb_encode_submessage(stream, FileInfo_fields, &fileinfo))
+            return false;
+    }
+
+    return true;
+}
+
+/* Called by the worker threads with a whole request in the input stream.
+ * The response is collected into a buffer, which the server then sends. */
+static bool handle_request(pb_istream_t *input, pb_ostream_t *output, void *arg)
+{
+    ListFilesRequest request = {};
+    ListFilesResponse response = {};
+    DIR *directory;
+    bool status;
+
+    (void)arg;
+
+    if (!pb_decode(input, ListFilesRequest_fields, &request))
+    {
+        printf("Decode failed: %s\n", PB_GET_ERROR(input));
+        return false;
+    }
+
+    directory = opendir(request.path);
+    if (directory == NULL)
+    {
+        response.has_path_error = true;
+        response.path_error = true;
+    }
+    else
+    {
+        response.file.funcs.encode = &listdir_callback;
+        response.file.arg = directory;
+    }
+
+    status = pb_encode(output, ListFilesResponse_fields, &response);
+    if (!status)
+        printf("Encoding failed: %s\n", PB_GET_ERROR(output));
+
+    if (directory != NULL)
+        closedir(directory);
+
+    return status;
+}
+
+static void stop_handler(int signum)
+{
+    (void)signum;
+    evserver_stop(g_server);
+}
+
+int main(int argc, char **argv)
+{
+    struct evserver_config config = {};
+    struct evserver_stats stats;
+    struct sockaddr_in servaddr;
+    int listenfd;
+    int reuse = 1;
+
+    /* Optional argument: the number of worker threads */
+    if (argc > 1)
+        config.workers = (unsigned)atoi(argv[1]);
+
+    /* Listen on localhost:1234 for TCP connections */
+    listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    memset(&servaddr, 0, sizeof(servaddr));
+    servaddr.sin_family = AF_INET;
+    servaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    servaddr.sin_port = htons(1234);
+    if (bind(listenfd, (struct sockaddr*)&servaddr, sizeof(servaddr)) != 0)
+    {
+        perror("bind");
+        return 1;
+    }
+
+    if (listen(listenfd, SOMAXCONN) != 0)
+    {
+        perror("listen");
+        return 1;
+    }
+
+    /* The requests end with a zero tag, and the client reads the
+     * response until the connection is closed. */
+    config.frame = evserver_frame_terminated;
+    config.handler = handle_request;
+    config.close_after_response = true;
+
+    g_server = evserver_create(listenfd, &config);
+    if (g_server == NULL)
+    {
+        perror("evserver_create");
+        return 1;
+    }
+
+    signal(SIGINT, stop_handler);
+    signal(SIGTERM, stop_handler);
+
+    if (!evserver_run(g_server))
+        perror("evserver_run");
+
+    evserver_get_stats(g_server, &stats);
+    printf("\n%lu connections, %lu requests, %lu errors\n",
+           stats.accepted, stats.requests, stats.errors);
+
+    evserver_destroy(g_server);
+    close(listenfd);
+    return 0;
+}
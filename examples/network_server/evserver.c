@@ -0,0 +1,618 @@
+/* Event driven server core, see evserver.h.
+ *
+ * The connections are registered to epoll with EPOLLONESHOT, and are
+ * armed again only when the event thread wants to read or write them.
+ * While a worker has a connection, it is not armed, so the connection
+ * is never accessed from two threads at the same time.
+ */
+
+#define _GNU_SOURCE
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <pb_encode.h>
+#include <pb_decode.h>
+
+#include "evserver.h"
+
+#define MAX_EVENTS 64
+
+enum conn_state {
+    CONN_READING,   /* Waiting for the rest of a request */
+    CONN_BUSY,      /* Request is queued or being handled by a worker */
+    CONN_WRITING    /* Sending the response */
+};
+
+struct conn {
+    int fd;
+    enum conn_state state;
+    bool eof;       /* The client has closed its end */
+    bool failed;    /* The handler returned false */
+
+    uint8_t *in;
+    size_t in_len;
+    size_t in_size;
+    size_t scanned; /* For the framing function */
+    size_t frame_len;
+
+    uint8_t *out;
+    size_t out_len;
+    size_t out_size;
+    size_t out_pos;
+
+    struct conn *next;          /* In the work or done queue */
+    struct conn *prev_all;      /* In the list of all connections */
+    struct conn *next_all;
+};
+
+struct conn_queue {
+    struct conn *head;
+    struct conn *tail;
+};
+
+struct evserver {
+    struct evserver_config config;
+    int listenfd;
+    int epollfd;
+    int wakefd;
+    volatile sig_atomic_t stop;
+
+    pthread_t *threads;
+    unsigned thread_count;
+
+    /* Shared with the workers */
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;
+    struct conn_queue work;
+    struct conn_queue done;
+    bool quit;
+
+    /* Only used by the event thread */
+    struct conn *all;
+    struct evserver_stats stats;
+};
+
+/**************************************
+ * Framing of the incoming requests   *
+ **************************************/
+
+/* Stream over the received bytes, which tells whether a read failed
+ * because the rest of the request has not arrived yet. */
+struct scan_state {
+    const uint8_t *buf;
+    size_t len;
+    size_t pos;
+    bool short_read;
+};
+
+static bool scan_callback(pb_istream_t *stream, uint8_t *buf, size_t count)
+{
+    struct scan_state *state = (struct scan_state*)stream->state;
+
+    if (state->len - state->pos < count)
+    {
+        state->short_read = true;
+        return false;
+    }
+
+    if (buf != NULL)
+        memcpy(buf, state->buf + state->pos, count);
+    state->pos += count;
+    return true;
+}
+
+size_t evserver_frame_terminated(const uint8_t *buf, size_t len, size_t *scanned)
+{
+    struct scan_state state = {buf, len, 0, false};
+    pb_istream_t stream = {&scan_callback, &state, SIZE_MAX};
+
+    /* The fields before *scanned are already known to be whole */
+    state.pos = *scanned;
+
+    for (;;)
+    {
+        pb_wire_type_t wire_type;
+        uint32_t tag;
+        bool eof;
+
+        if (!pb_decode_tag(&stream, &wire_type, &tag, &eof))
+        {
+            if (eof)
+                return state.pos;
+            break;
+        }
+
+        if (!pb_skip_field(&stream, wire_type))
+            break;
+
+        *scanned = state.pos;
+    }
+
+    return state.short_read ? EVSERVER_NEED_MORE : EVSERVER_BAD_FRAME;
+}
+
+size_t evserver_frame_delimited(const uint8_t *buf, size_t len, size_t *scanned)
+{
+    struct scan_state state = {buf, len, 0, false};
+    pb_istream_t stream = {&scan_callback, &state, SIZE_MAX};
+    uint32_t size;
+
+    (void)scanned;
+
+    if (!pb_decode_varint32(&stream, &size))
+        return state.short_read ? EVSERVER_NEED_MORE : EVSERVER_BAD_FRAME;
+
+    if (len - state.pos < size)
+        return EVSERVER_NEED_MORE;
+
+    return state.pos + size;
+}
+
+/**************************************
+ * Worker threads                     *
+ **************************************/
+
+static void queue_push(struct conn_queue *queue, struct conn *conn)
+{
+    conn->next = NULL;
+    if (queue->tail)
+        queue->tail->next = conn;
+    else
+        queue->head = conn;
+    queue->tail = conn;
+}
+
+static struct conn *queue_pop(struct conn_queue *queue)
+{
+    struct conn *conn = queue->head;
+
+    if (conn)
+    {
+        queue->head = conn->next;
+        if (queue->head == NULL)
+            queue->tail = NULL;
+    }
+    return conn;
+}
+
+/* Collect the response into the output buffer of the connection. The
+ * max_size of the stream limits the size of the buffer. */
+static bool output_callback(pb_ostream_t *stream, const uint8_t *buf, size_t count)
+{
+    struct conn *conn = (struct conn*)stream->state;
+
+    if (conn->out_size - conn->out_len < count)
+    {
+        size_t size = conn->out_size ? conn->out_size : 256;
+        uint8_t *out;
+
+        while (size - conn->out_len < count)
+            size *= 2;
+
+        out = realloc(conn->out, size);
+        if (out == NULL)
+            return false;
+
+        conn->out = out;
+        conn->out_size = size;
+    }
+
+    memcpy(conn->out + conn->out_len, buf, count);
+    conn->out_len += count;
+    return true;
+}
+
+static void handle_request(struct evserver *server, struct conn *conn)
+{
+    pb_istream_t input = pb_istream_from_buffer(conn->in, conn->frame_len);
+    pb_ostream_t output = {&output_callback, conn, server->config.max_response_size, 0};
+
+    conn->out_len = 0;
+    conn->out_pos = 0;
+    conn->failed = !server->config.handler(&input, &output, server->config.arg);
+}
+
+static void wake_event_thread(struct evserver *server)
+{
+    uint64_t one = 1;
+
+    if (write(server->wakefd, &one, sizeof(one)) != sizeof(one))
+    {
+        /* The counter is already non-zero, so the event thread will wake up */
+    }
+}
+
+static void *worker_main(void *arg)
+{
+    struct evserver *server = (struct evserver*)arg;
+
+    pthread_mutex_lock(&server->lock);
+    for (;;)
+    {
+        struct conn *conn;
+
+        while (!server->quit && server->work.head == NULL)
+            pthread_cond_wait(&server->work_ready, &server->lock);
+
+        if (server->quit)
+            break;
+
+        conn = queue_pop(&server->work);
+        pthread_mutex_unlock(&server->lock);
+
+        handle_request(server, conn);
+
+        pthread_mutex_lock(&server->lock);
+        queue_push(&server->done, conn);
+        wake_event_thread(server);
+    }
+    pthread_mutex_unlock(&server->lock);
+
+    return NULL;
+}
+
+/**************************************
+ * Event thread                       *
+ **************************************/
+
+static void close_conn(struct evserver *server, struct conn *conn)
+{
+    close(conn->fd);
+
+    if (conn->prev_all)
+        conn->prev_all->next_all = conn->next_all;
+    else
+        server->all = conn->next_all;
+    if (conn->next_all)
+        conn->next_all->prev_all = conn->prev_all;
+
+    free(conn->in);
+    free(conn->out);
+    free(conn);
+    server->stats.connections--;
+}
+
+static bool arm(struct evserver *server, struct conn *conn, uint32_t events)
+{
+    struct epoll_event event;
+
+    memset(&event, 0, sizeof(event));
+    event.events = events | EPOLLRDHUP | EPOLLONESHOT;
+    event.data.ptr = conn;
+    return epoll_ctl(server->epollfd, EPOLL_CTL_MOD, conn->fd, &event) == 0;
+}
+
+/* Pass the next whole request in the input buffer to the workers, or
+ * wait for more data. */
+static void next_request(struct evserver *server, struct conn *conn)
+{
+    size_t len = EVSERVER_NEED_MORE;
+
+    if (conn->in_len > 0)
+        len = server->config.frame(conn->in, conn->in_len, &conn->scanned);
+
+    if (len == EVSERVER_BAD_FRAME ||
+        (len == EVSERVER_NEED_MORE && conn->in_len >= server->config.max_request_size))
+    {
+        server->stats.errors++;
+        close_conn(server, conn);
+        return;
+    }
+
+    if (len == EVSERVER_NEED_MORE)
+    {
+        if (conn->eof || !arm(server, conn, EPOLLIN))
+            close_conn(server, conn);
+        return;
+    }
+
+    conn->frame_len = len;
+    conn->state = CONN_BUSY;
+
+    pthread_mutex_lock(&server->lock);
+    queue_push(&server->work, conn);
+    pthread_cond_signal(&server->work_ready);
+    pthread_mutex_unlock(&server->lock);
+}
+
+static void read_request(struct evserver *server, struct conn *conn)
+{
+    size_t max_size = server->config.max_request_size;
+
+    while (!conn->eof)
+    {
+        ssize_t result;
+
+        if (conn->in_len == conn->in_size)
+        {
+            size_t size = conn->in_size ? conn->in_size * 2 : 512;
+            uint8_t *in;
+
+            if (conn->in_size >= max_size)
+                break;
+            if (size > max_size)
+                size = max_size;
+
+            in = realloc(conn->in, size);
+            if (in == NULL)
+            {
+                close_conn(server, conn);
+                return;
+            }
+            conn->in = in;
+            conn->in_size = size;
+        }
+
+        result = read(conn->fd, conn->in + conn->in_len, conn->in_size - conn->in_len);
+
+        if (result > 0)
+            conn->in_len += (size_t)result;
+        else if (result == 0)
+            conn->eof = true;
+        else if (errno == EAGAIN || errno == EWOULDBLOCK)
+            break;
+        else if (errno != EINTR)
+        {
+            close_conn(server, conn);
+            return;
+        }
+    }
+
+    next_request(server, conn);
+}
+
+static void write_response(struct evserver *server, struct conn *conn)
+{
+    while (conn->out_pos < conn->out_len)
+    {
+        ssize_t result = send(conn->fd, conn->out + conn->out_pos,
+                              conn->out_len - conn->out_pos, MSG_NOSIGNAL);
+
+        if (result >= 0)
+            conn->out_pos += (size_t)result;
+        else if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            if (!arm(server, conn, EPOLLOUT))
+                close_conn(server, conn);
+            return;
+        }
+        else if (errno != EINTR)
+        {
+            close_conn(server, conn);
+            return;
+        }
+    }
+
+    if (server->config.close_after_response)
+    {
+        close_conn(server, conn);
+        return;
+    }
+
+    /* Keep the bytes after the request, which may be the next request */
+    conn->in_len -= conn->frame_len;
+    memmove(conn->in, conn->in + conn->frame_len, conn->in_len);
+    conn->scanned = 0;
+    conn->state = CONN_READING;
+    next_request(server, conn);
+}
+
+static void accept_connections(struct evserver *server)
+{
+    for (;;)
+    {
+        struct epoll_event event;
+        struct conn *conn;
+        int fd;
+
+        fd = accept4(server->listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+            return; /* EAGAIN, or the client went away, or out of descriptors */
+
+        conn = calloc(1, sizeof(struct conn));
+        if (conn == NULL)
+        {
+            close(fd);
+            return;
+        }
+
+        conn->fd = fd;
+        conn->state = CONN_READING;
+
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+        event.data.ptr = conn;
+        if (epoll_ctl(server->epollfd, EPOLL_CTL_ADD, fd, &event) != 0)
+        {
+            close(fd);
+            free(conn);
+            return;
+        }
+
+        conn->next_all = server->all;
+        if (server->all)
+            server->all->prev_all = conn;
+        server->all = conn;
+
+        server->stats.accepted++;
+        server->stats.connections++;
+    }
+}
+
+static void process_completions(struct evserver *server)
+{
+    struct conn_queue done;
+    struct conn *conn;
+    uint64_t count;
+
+    if (read(server->wakefd, &count, sizeof(count)) != sizeof(count))
+    {
+        /* Already cleared, the queue may still have entries */
+    }
+
+    pthread_mutex_lock(&server->lock);
+    done = server->done;
+    server->done.head = server->done.tail = NULL;
+    pthread_mutex_unlock(&server->lock);
+
+    while ((conn = queue_pop(&done)) != NULL)
+    {
+        server->stats.requests++;
+
+        if (conn->failed)
+        {
+            server->stats.errors++;
+            close_conn(server, conn);
+            continue;
+        }
+
+        conn->state = CONN_WRITING;
+        write_response(server, conn);
+    }
+}
+
+bool evserver_run(struct evserver *server)
+{
+    struct epoll_event events[MAX_EVENTS];
+
+    while (!server->stop)
+    {
+        int count, i;
+
+        count = epoll_wait(server->epollfd, events, MAX_EVENTS, -1);
+        if (count < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+
+        for (i = 0; i < count; i++)
+        {
+            void *ptr = events[i].data.ptr;
+
+            if (ptr == &server->listenfd)
+                accept_connections(server);
+            else if (ptr == &server->wakefd)
+                process_completions(server);
+            else if (((struct conn*)ptr)->state == CONN_READING)
+                read_request(server, (struct conn*)ptr);
+            else
+                write_response(server, (struct conn*)ptr);
+        }
+    }
+
+    return true;
+}
+
+void evserver_stop(struct evserver *server)
+{
+    server->stop = 1;
+    wake_event_thread(server);
+}
+
+/**************************************
+ * Setup                              *
+ **************************************/
+
+static bool add_fd(struct evserver *server, int *fd)
+{
+    struct epoll_event event;
+
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = fd;
+    return epoll_ctl(server->epollfd, EPOLL_CTL_ADD, *fd, &event) == 0;
+}
+
+struct evserver *evserver_create(int listenfd, const struct evserver_config *config)
+{
+    struct evserver *server;
+    unsigned workers;
+
+    server = calloc(1, sizeof(struct evserver));
+    if (server == NULL)
+        return NULL;
+
+    server->config = *config;
+    if (server->config.max_request_size == 0)
+        server->config.max_request_size = 4096;
+    if (server->config.max_response_size == 0)
+        server->config.max_response_size = 1024 * 1024;
+
+    workers = server->config.workers;
+    if (workers == 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = (cpus > 0) ? (unsigned)cpus : 1;
+    }
+
+    server->listenfd = listenfd;
+    server->epollfd = epoll_create1(EPOLL_CLOEXEC);
+    server->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    pthread_mutex_init(&server->lock, NULL);
+    pthread_cond_init(&server->work_ready, NULL);
+    server->threads = calloc(workers, sizeof(pthread_t));
+
+    if (server->epollfd < 0 || server->wakefd < 0 || server->threads == NULL ||
+        fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK) != 0 ||
+        !add_fd(server, &server->listenfd) || !add_fd(server, &server->wakefd))
+    {
+        evserver_destroy(server);
+        return NULL;
+    }
+
+    while (server->thread_count < workers)
+    {
+        if (pthread_create(&server->threads[server->thread_count], NULL,
+                           worker_main, server) != 0)
+        {
+            evserver_destroy(server);
+            return NULL;
+        }
+        server->thread_count++;
+    }
+
+    return server;
+}
+
+void evserver_destroy(struct evserver *server)
+{
+    unsigned i;
+
+    pthread_mutex_lock(&server->lock);
+    server->quit = true;
+    pthread_cond_broadcast(&server->work_ready);
+    pthread_mutex_unlock(&server->lock);
+
+    for (i = 0; i < server->thread_count; i++)
+        pthread_join(server->threads[i], NULL);
+
+    while (server->all)
+        close_conn(server, server->all);
+
+    if (server->epollfd >= 0)
+        close(server->epollfd);
+    if (server->wakefd >= 0)
+        close(server->wakefd);
+
+    pthread_cond_destroy(&server->work_ready);
+    pthread_mutex_destroy(&server->lock);
+    free(server->threads);
+    free(server);
+}
+
+void evserver_get_stats(struct evserver *server, struct evserver_stats *stats)
+{
+    *stats = server->stats;
+}
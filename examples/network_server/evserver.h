@@ -0,0 +1,87 @@
+/* Event driven server core for nanopb protocols on Linux.
+ *
+ * One thread waits for socket events with epoll and does all the socket
+ * IO without blocking. The bytes received from each connection are
+ * collected into a buffer of the connection, until the framing function
+ * finds a whole request in it. The request is then passed to a pool of
+ * worker threads, which decode it and encode the response into an output
+ * buffer of the connection. The event thread sends the response, and then
+ * looks for the next request. Each connection has at most one request
+ * being handled at a time, so the responses are sent in order.
+ *
+ * Example usage:
+ *   struct evserver_config config = {};
+ *   config.frame = evserver_frame_terminated;
+ *   config.handler = handle_request;
+ *   server = evserver_create(listenfd, &config);
+ *   evserver_run(server);
+ *   evserver_destroy(server);
+ */
+
+#ifndef _PB_EXAMPLE_EVSERVER_H_
+#define _PB_EXAMPLE_EVSERVER_H_
+
+#include <stddef.h>
+#include <pb.h>
+
+/* Return values of the framing function, besides the length of a frame */
+#define EVSERVER_NEED_MORE 0
+#define EVSERVER_BAD_FRAME ((size_t)-1)
+
+/* Find the first request in the len bytes received so far. Returns its
+ * length, EVSERVER_NEED_MORE or EVSERVER_BAD_FRAME. *scanned is zero for
+ * a new request, and the function may store there how many bytes it has
+ * already checked, to continue from there when more bytes arrive. */
+typedef size_t (*evserver_frame_f)(const uint8_t *buf, size_t len, size_t *scanned);
+
+/* Requests terminated by a zero tag, as decoded by pb_decode(). */
+size_t evserver_frame_terminated(const uint8_t *buf, size_t len, size_t *scanned);
+
+/* Requests prefixed with their length, as decoded by pb_decode_delimited(). */
+size_t evserver_frame_delimited(const uint8_t *buf, size_t len, size_t *scanned);
+
+/* Decode one request and encode the response. Called from the worker
+ * threads, so it must be thread safe. Returning false closes the
+ * connection without sending the response. */
+typedef bool (*evserver_handler_f)(pb_istream_t *request, pb_ostream_t *response, void *arg);
+
+struct evserver_config {
+    evserver_frame_f frame;
+    evserver_handler_f handler;
+    void *arg; /* Passed to the handler */
+
+    unsigned workers;            /* Worker threads, 0 for one per CPU */
+    size_t max_request_size;     /* 0 for 4 kB */
+    size_t max_response_size;    /* 0 for 1 MB */
+    bool close_after_response;   /* For protocols where EOF ends the response */
+};
+
+struct evserver_stats {
+    unsigned long accepted;
+    unsigned long requests;
+    unsigned long errors;        /* Bad or too large frames and failed handlers */
+    unsigned long connections;   /* Currently open */
+};
+
+struct evserver;
+
+/* Set up a server for a listening socket. Returns NULL on errors. */
+struct evserver *evserver_create(int listenfd, const struct evserver_config *config);
+
+/* Serve connections until evserver_stop() is called. Returns false on
+ * errors. */
+bool evserver_run(struct evserver *server);
+
+/* Make evserver_run() return. Can be called from any thread and from
+ * signal handlers. */
+void evserver_stop(struct evserver *server);
+
+/* Close all the connections and free the server. The listening socket is
+ * left open. */
+void evserver_destroy(struct evserver *server);
+
+/* The counters are updated by the thread that runs evserver_run(), so
+ * read them from that thread or after it has returned. */
+void evserver_get_stats(struct evserver *server, struct evserver_stats *stats);
+
+#endif
@@ -32,6 +32,55 @@
 
 #include "fileproto.pb.h"
 #include "common.h"
+#include "pb_stream_tap.h"
+
+/* Time spent waiting for the device in the stream callbacks, printed at
+ * exit. With '-t <prefix>' each call is also logged to <prefix>-read.log
+ * and <prefix>-write.log, and the histograms are written in HdrHistogram
+ * format to <prefix>-read.hgrm and <prefix>-write.hgrm. */
+static pb_stream_tap_t readTap;
+static pb_stream_tap_t writeTap;
+
+static FILE* openTapFile(const char *prefix, const char *suffix) {
+	char name[256];
+	FILE *file;
+
+	snprintf(name, sizeof(name), "%s-%s", prefix, suffix);
+	file = fopen(name, "w");
+	if (!file)
+		perror(name);
+	return file;
+}
+
+static void writeTapHistogram(const char *prefix, const char *suffix,
+		const pb_stream_tap_t *tap) {
+	FILE *file = openTapFile(prefix, suffix);
+	if (file) {
+		/* Microseconds */
+		pb_tap_histogram_export(&tap->blocked, file, 1000.0);
+		fclose(file);
+	}
+}
+
+#ifdef PB_ENABLE_TRACE
+/* Build with 'make TRACE=1' to print the size and decoding time of
+ * each field of the answers at exit. */
+#include "pb_trace_collector.h"
+
+static pb_trace_collector_t traceCollector;
+
+static void initTrace(void) {
+	pb_trace_collector_init(&traceCollector);
+	pb_trace_collector_add(&traceCollector, "GenericAnsver", GenericAnsver_fields);
+	pb_trace_collector_add(&traceCollector, "Summary", Summary_fields);
+	pb_trace_collector_add(&traceCollector, "Settings", Settings_fields);
+	pb_trace_collector_add(&traceCollector, "Control", Control_fields);
+	pb_trace_collector_add(&traceCollector, "T_Coeffs", T_Coeffs_fields);
+	pb_trace_collector_add(&traceCollector, "Value", Value_fields);
+	pb_trace_collector_add(&traceCollector, "Values", Values_fields);
+	pb_trace_collector_add(&traceCollector, "TimeStamp", TimeStamp_fields);
+}
+#endif
 
 #define MAX_RETRYS 3
 
@@ -86,8 +135,9 @@ static bool sendRequest(FILE* f, const pb_field_t fields[], const void *src_stru
 		return false;
 	}
 
-	if (fwrite(output.state - output.bytes_written, 1, output.bytes_written, f)
-			!= output.bytes_written)
+	pb_ostream_t file = pb_ostream_from_file(f);
+	pb_ostream_t tapped = pb_ostream_tap(&writeTap, &file);
+	if (!pb_write(&tapped, buf, output.bytes_written))
 		return false;
 
 	free(buf);
@@ -97,9 +147,13 @@ static bool sendRequest(FILE* f, const pb_field_t fields[], const void *src_stru
 
 static enum enError_Type readAnsver(pb_istream_t* inputStream,
 		const pb_field_t fields[], void *dest_struct) {
-	if (!pb_decode_delimited(inputStream, fields, dest_struct)) {
-		printf("Decode failed: %s\n", PB_GET_ERROR(inputStream));
-		if (!strcmp(PB_GET_ERROR(inputStream), "io error"))
+	pb_istream_t tapped = pb_istream_tap(&readTap, inputStream);
+#ifdef PB_ENABLE_TRACE
+	tapped.trace = &traceCollector.trace;
+#endif
+	if (!pb_decode_delimited(&tapped, fields, dest_struct)) {
+		printf("Decode failed: %s\n", PB_GET_ERROR(&tapped));
+		if (!strcmp(PB_GET_ERROR(&tapped), "io error"))
 			return ERR_IO;
 		return ERR_UNKNOWN;
 	}
@@ -851,17 +905,28 @@ int main(int argc, char **argv) {
 	char *dev = NULL;
 	int i;
 	bool verbose = false;
+	char *tapPrefix = NULL;
 
 	if (argc > 1) {
 		dev = argv[1];
-		if (argc > 2 && !strcmp(argv[2], "-v")) {
-			verbose = true;
+		for (i = 2; i < argc; ++i) {
+			if (!strcmp(argv[i], "-v"))
+				verbose = true;
+			else if (!strcmp(argv[i], "-t") && i + 1 < argc)
+				tapPrefix = argv[++i];
 		}
 	} else {
-		printf("USAGE: %s <file> [-v]\n", argv[0]);
+		printf("USAGE: %s <file> [-v] [-t <prefix>]\n", argv[0]);
 		return 0;
 	}
 
+	pb_stream_tap_init(&readTap);
+	pb_stream_tap_init(&writeTap);
+	if (tapPrefix) {
+		readTap.log = openTapFile(tapPrefix, "read.log");
+		writeTap.log = openTapFile(tapPrefix, "write.log");
+	}
+
 	f = fopen(dev, "w+");
 
 	if (!f) {
@@ -877,12 +942,17 @@ int main(int argc, char **argv) {
 	 tcsetattr(f->_fileno, TCSANOW, &ios);
 	 }
 	 */
+	/* Wake-up byte, which the device reads as an empty message */
+	i = 0;
 	while (fwrite(&i, 1, 1, f) != 1)
 		;
 
 	enum enError_Type err;
 	int retrys = MAX_RETRYS;
 
+#ifdef PB_ENABLE_TRACE
+	initTrace();
+#endif
 	ProfilerStart("tests");
 
 	for (i = 0; i < sizeof(tests) / sizeof(struct test); ++i) {
@@ -925,6 +995,21 @@ int main(int argc, char **argv) {
 
 	__FAIL: ProfilerStop();
 
+#ifdef PB_ENABLE_TRACE
+	pb_trace_collector_print(&traceCollector, stdout);
+#endif
+
+	pb_stream_tap_print(&readTap, "\nread", stdout);
+	pb_stream_tap_print(&writeTap, "write", stdout);
+	if (tapPrefix) {
+		writeTapHistogram(tapPrefix, "read.hgrm", &readTap);
+		writeTapHistogram(tapPrefix, "write.hgrm", &writeTap);
+		if (readTap.log)
+			fclose(readTap.log);
+		if (writeTap.log)
+			fclose(writeTap.log);
+	}
+
 	putchar('\n');
 	/* Close connection */
 	fclose(f);
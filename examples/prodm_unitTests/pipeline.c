@@ -0,0 +1,224 @@
+/* Pipelined requests to the device, see pipeline.h.
+ */
+
+#define _GNU_SOURCE
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <pb_encode.h>
+#include <pb_decode.h>
+
+#include "pipeline.h"
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+void pipeline_init(struct pipeline *p, int fd, unsigned window,
+		unsigned timeout_ms, unsigned max_retries) {
+	memset(p, 0, sizeof(*p));
+	p->fd = fd;
+	p->window = (window < 1) ? 1 :
+			(window > PIPELINE_MAX_WINDOW) ? PIPELINE_MAX_WINDOW : window;
+	p->timeout_ms = timeout_ms;
+	p->max_retries = max_retries;
+}
+
+static bool send_request(struct pipeline *p, struct pipeline_slot *slot) {
+	uint8_t buf[GenericRequest_size + 8];
+	pb_ostream_t output = pb_ostream_from_buffer(buf, sizeof(buf));
+	const uint8_t *pos = buf;
+	size_t count;
+
+	if (!pb_encode_delimited(&output, GenericRequest_fields, &slot->request))
+		return false;
+
+	for (count = output.bytes_written; count;) {
+		ssize_t r = write(p->fd, pos, count);
+		if (r <= 0)
+			return false;
+		pos += r;
+		count -= (size_t) r;
+	}
+
+	slot->last_sent = now_ns();
+	p->sent++;
+	p->bytes_sent += output.bytes_written;
+	return true;
+}
+
+/* Free the slot before calling the callback, which may submit a new
+ * request into it. */
+static void complete(struct pipeline *p, struct pipeline_slot *slot,
+		const GenericAnsver *response, uint64_t now) {
+	struct pipeline_slot done = *slot;
+
+	slot->in_use = false;
+	p->in_flight--;
+	done.done(p, &done.request, response, now - done.first_sent, done.arg);
+}
+
+static void dispatch(struct pipeline *p, const GenericAnsver *response) {
+	unsigned i;
+
+	for (i = 0; i < p->window; i++) {
+		struct pipeline_slot *slot = &p->slots[i];
+		if (slot->in_use && slot->request.ReqId == response->ReqId) {
+			p->completed++;
+			complete(p, slot, response, now_ns());
+			return;
+		}
+	}
+	p->unmatched++;
+}
+
+/* Decode the whole answers at the start of the receive buffer */
+static void parse_answers(struct pipeline *p) {
+	size_t pos = 0;
+
+	while (pos < p->rx_len) {
+		pb_istream_t stream = pb_istream_from_buffer(p->rx + pos,
+				p->rx_len - pos);
+		GenericAnsver response = { };
+		size_t header;
+		uint32_t length;
+
+		if (!pb_decode_varint32(&stream, &length)) {
+			/* Skip a corrupted length, or wait for the rest of it */
+			if (p->rx_len - pos >= 5) {
+				pos++;
+				continue;
+			}
+			break;
+		}
+
+		header = p->rx_len - pos - stream.bytes_left;
+		if (length > sizeof(p->rx) / 2) {
+			pos++;
+			continue;
+		}
+		if (stream.bytes_left < length)
+			break;
+
+		stream.bytes_left = length;
+		if (pb_decode(&stream, GenericAnsver_fields, &response))
+			dispatch(p, &response);
+		else
+			p->unmatched++;
+
+		pos += header + length;
+	}
+
+	memmove(p->rx, p->rx + pos, p->rx_len - pos);
+	p->rx_len -= pos;
+}
+
+static bool check_timeouts(struct pipeline *p) {
+	uint64_t now = now_ns();
+	uint64_t timeout = (uint64_t) p->timeout_ms * 1000000;
+	unsigned i;
+
+	for (i = 0; i < p->window; i++) {
+		struct pipeline_slot *slot = &p->slots[i];
+
+		if (!slot->in_use || now - slot->last_sent < timeout)
+			continue;
+
+		if (slot->retries < p->max_retries) {
+			slot->retries++;
+			p->retried++;
+			if (!send_request(p, slot))
+				return false;
+		} else {
+			p->timed_out++;
+			complete(p, slot, NULL, now);
+		}
+	}
+	return true;
+}
+
+bool pipeline_poll(struct pipeline *p, int wait_ms) {
+	struct pollfd pfd = { p->fd, POLLIN, 0 };
+	uint64_t now = now_ns();
+	unsigned i;
+
+	/* Wake up for the first timeout */
+	for (i = 0; i < p->window; i++) {
+		const struct pipeline_slot *slot = &p->slots[i];
+		uint64_t deadline = slot->last_sent
+				+ (uint64_t) p->timeout_ms * 1000000;
+		int remaining;
+
+		if (!slot->in_use)
+			continue;
+
+		remaining = (deadline > now) ?
+				(int) ((deadline - now + 999999) / 1000000) : 0;
+		if (wait_ms < 0 || remaining < wait_ms)
+			wait_ms = remaining;
+	}
+
+	if (poll(&pfd, 1, wait_ms) < 0)
+		return false;
+
+	if (pfd.revents & POLLIN) {
+		ssize_t r;
+
+		/* Without a whole answer in a full buffer, the data is garbage */
+		if (p->rx_len == sizeof(p->rx))
+			p->rx_len = 0;
+
+		r = read(p->fd, p->rx + p->rx_len, sizeof(p->rx) - p->rx_len);
+		if (r <= 0)
+			return false;
+		p->rx_len += (size_t) r;
+		p->bytes_received += (unsigned long) r;
+		parse_answers(p);
+	} else if (pfd.revents & (POLLERR | POLLHUP)) {
+		return false;
+	}
+
+	return check_timeouts(p);
+}
+
+bool pipeline_submit(struct pipeline *p, const GenericRequest *request,
+		pipeline_done_f done, void *arg) {
+	struct pipeline_slot *slot = NULL;
+	unsigned i;
+
+	while (p->in_flight >= p->window) {
+		if (!pipeline_poll(p, -1))
+			return false;
+	}
+
+	for (i = 0; i < p->window; i++) {
+		if (!p->slots[i].in_use) {
+			slot = &p->slots[i];
+			break;
+		}
+	}
+
+	slot->in_use = true;
+	slot->request = *request;
+	slot->retries = 0;
+	slot->done = done;
+	slot->arg = arg;
+	p->in_flight++;
+
+	if (!send_request(p, slot))
+		return false;
+	slot->first_sent = slot->last_sent;
+	return true;
+}
+
+bool pipeline_drain(struct pipeline *p) {
+	while (p->in_flight > 0) {
+		if (!pipeline_poll(p, -1))
+			return false;
+	}
+	return true;
+}
@@ -0,0 +1,83 @@
+/* Pipelined requests to the device. Up to a window of GenericRequests are
+ * kept in flight over one file descriptor, and the GenericAnsvers are
+ * matched to them by ReqId, so they may arrive in any order. Requests that
+ * are not answered within the timeout are sent again with the same ReqId.
+ *
+ * Example usage:
+ *   struct pipeline p;
+ *   pipeline_init(&p, fd, 8, 500, 3);
+ *   for (i = 0; i < count; i++) {
+ *       fill(&request, i);
+ *       pipeline_submit(&p, &request, done, NULL);
+ *   }
+ *   pipeline_drain(&p);
+ */
+
+#ifndef _PB_EXAMPLE_PIPELINE_H_
+#define _PB_EXAMPLE_PIPELINE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "fileproto.pb.h"
+
+#define PIPELINE_MAX_WINDOW 32
+
+struct pipeline;
+
+/* Called once for each submitted request, with the answer or with NULL
+ * when all the retries timed out. */
+typedef void (*pipeline_done_f)(struct pipeline *p,
+		const GenericRequest *request, const GenericAnsver *response,
+		uint64_t rtt_ns, void *arg);
+
+struct pipeline_slot {
+	bool in_use;
+	GenericRequest request;
+	uint64_t first_sent; /* For the round trip time */
+	uint64_t last_sent; /* For the timeout */
+	unsigned retries;
+	pipeline_done_f done;
+	void *arg;
+};
+
+struct pipeline {
+	int fd;
+	unsigned window;
+	unsigned timeout_ms;
+	unsigned max_retries;
+
+	struct pipeline_slot slots[PIPELINE_MAX_WINDOW];
+	unsigned in_flight;
+
+	/* Received bytes that do not form a whole answer yet */
+	uint8_t rx[2 * (GenericAnsver_size + 8)];
+	size_t rx_len;
+
+	/* Counters */
+	unsigned long sent;
+	unsigned long retried;
+	unsigned long timed_out;
+	unsigned long completed;
+	unsigned long unmatched; /* Answers to unknown ReqIds, e.g. late ones */
+	unsigned long bytes_sent;
+	unsigned long bytes_received;
+};
+
+void pipeline_init(struct pipeline *p, int fd, unsigned window,
+		unsigned timeout_ms, unsigned max_retries);
+
+/* Send a request, first waiting for a free slot if the window is full.
+ * The ReqId must not be used by another request in flight. Returns false
+ * on IO errors. */
+bool pipeline_submit(struct pipeline *p, const GenericRequest *request,
+		pipeline_done_f done, void *arg);
+
+/* Process the answers that arrive within wait_ms, and the timeouts.
+ * Returns false on IO errors. */
+bool pipeline_poll(struct pipeline *p, int wait_ms);
+
+/* Wait until all the requests are answered or have timed out. */
+bool pipeline_drain(struct pipeline *p);
+
+#endif
@@ -0,0 +1,550 @@
+/* Simulator of the device that client.c tests. It serves the
+ * GenericRequest/GenericAnsver protocol on a pseudo-terminal, so that the
+ * tests, the codec and the transport can be run without the hardware:
+ *
+ *   ./simulator &              # prints the terminal name, e.g. /dev/pts/3
+ *   ./client /dev/pts/3 -v
+ *
+ * With -L it also acts as a load generator: it starts the simulator in a
+ * child process, keeps up to -c requests in flight with pipeline.c and
+ * prints the request rate and the round trip times.
+ *
+ *   ./simulator -L -n 10000 -c 4 -b 115200
+ *
+ * Options:
+ *   -b <baud>     Emulate the transfer time of a serial link (8N1)
+ *   -d <usec>     Processing time of each request
+ *   -r            Send every other answer after the next one
+ *   -x <percent>  Drop this share of the answers
+ *   -L            Load generator mode
+ *   -D <device>   Send the load to this device instead of a simulator
+ *   -n <count>    Number of requests to send (default 1000)
+ *   -c <count>    Number of requests in flight (default 1)
+ *   -t <msec>     Timeout before a request is sent again (default 1000)
+ *   -R <count>    Number of times a request is sent again (default 3)
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <pb_encode.h>
+#include <pb_decode.h>
+
+#include "fileproto.pb.h"
+#include "pb_stream_tap.h"
+#include "pipeline.h"
+
+#define USED_PROTOCOL_VERSION 1
+
+/* The requests in flight must fit in the terminal buffers of the pty,
+ * or both sides block in write(). */
+#define MAX_CONCURRENCY PIPELINE_MAX_WINDOW
+
+#define ANSVER_BUFFER_SIZE (GenericAnsver_size + 8)
+
+/* File descriptor with a read-ahead buffer, so that the decoder does
+ * not need one read() per byte. With baud emulation, the two directions
+ * of the line are busy independently, like on a full-duplex UART. */
+struct link {
+	int fd;
+	int timeout_ms; /* -1 waits forever */
+	uint64_t byte_ns; /* Transfer time of a byte, 0 for no emulation */
+	uint64_t rx_start; /* Emulated arrival of the start of buf */
+	uint64_t rx_free; /* Time when the receiving line becomes idle */
+	uint64_t tx_free; /* Time when the sending line becomes idle */
+	uint8_t buf[256];
+	size_t pos;
+	size_t len;
+};
+
+static uint64_t now_ns(clockid_t clock) {
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t ns) {
+	struct timespec ts = { (time_t) (ns / 1000000000), (long) (ns % 1000000000) };
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0)
+		;
+}
+
+static bool link_read(pb_istream_t *stream, uint8_t *buf, size_t count) {
+	struct link *link = (struct link*) stream->state;
+
+	while (count) {
+		size_t n;
+
+		if (link->pos == link->len) {
+			struct pollfd pfd = { link->fd, POLLIN, 0 };
+			ssize_t r;
+
+			if (poll(&pfd, 1, link->timeout_ms) <= 0) {
+				stream->bytes_left = 0;
+				return false;
+			}
+			r = read(link->fd, link->buf, sizeof(link->buf));
+			if (r <= 0) {
+				stream->bytes_left = 0;
+				return false;
+			}
+			link->pos = 0;
+			link->len = (size_t) r;
+
+			/* The bytes were written at once, but arrive one by one */
+			link->rx_start = now_ns(CLOCK_MONOTONIC);
+			if (link->rx_start < link->rx_free)
+				link->rx_start = link->rx_free;
+			link->rx_free = link->rx_start + (uint64_t) r * link->byte_ns;
+		}
+
+		n = link->len - link->pos;
+		if (n > count)
+			n = count;
+		if (buf) {
+			memcpy(buf, link->buf + link->pos, n);
+			buf += n;
+		}
+		link->pos += n;
+		count -= n;
+	}
+	return true;
+}
+
+static pb_istream_t link_istream(struct link *link) {
+	pb_istream_t stream = { &link_read, link, SIZE_MAX };
+	return stream;
+}
+
+/* Wait until the bytes consumed so far have arrived over the emulated line */
+static void link_wait_received(const struct link *link) {
+	if (link->byte_ns)
+		sleep_until(link->rx_start + link->pos * link->byte_ns);
+}
+
+static bool link_send(struct link *link, const uint8_t *buf, size_t count) {
+	if (link->byte_ns) {
+		uint64_t start = now_ns(CLOCK_MONOTONIC);
+		if (start < link->tx_free)
+			start = link->tx_free;
+		link->tx_free = start + count * link->byte_ns;
+		sleep_until(link->tx_free);
+	}
+
+	while (count) {
+		ssize_t r = write(link->fd, buf, count);
+		if (r <= 0)
+			return false;
+		buf += r;
+		count -= (size_t) r;
+	}
+	return true;
+}
+
+static void fillTimeStamp(TimeStamp *ts, uint64_t ns) {
+	ts->tv_sec = (uint32_t) (ns / 1000000000);
+	ts->tv_nsec = ns % 1000000000;
+}
+
+/////////////////////////////////////////////////////////////////
+
+/* State of the simulated device */
+static Control deviceControl;
+static Settings deviceSettings;
+static int64_t clockOffset; /* Device clock - host clock, in ns */
+
+static float simulatedValue(ValueOf valueOf) {
+	/* Slowly varying readings, different for each sensor */
+	double t = (double) (now_ns(CLOCK_MONOTONIC) % 60000000000ULL) / 1e9;
+	return (float) (20.0 + 5.0 * (int) valueOf + t / 60.0);
+}
+
+static void fillSummary(Summary *summary) {
+	strcpy(summary->name, "Productomer");
+	strcpy(summary->version, "simulator");
+	strcpy(summary->manufacturer, "OOO SCTB Elpa");
+	summary->settings = deviceSettings;
+	summary->control = deviceControl;
+
+	if (deviceSettings.has_Clock)
+		fillTimeStamp(&summary->settings.Clock,
+				now_ns(CLOCK_REALTIME) + (uint64_t) clockOffset);
+}
+
+static void mergeSettings(const Settings *s) {
+	if (s->has_Temperature1MesureTime) {
+		deviceSettings.has_Temperature1MesureTime = true;
+		deviceSettings.Temperature1MesureTime = s->Temperature1MesureTime;
+	}
+	if (s->has_Temperature2MesureTime) {
+		deviceSettings.has_Temperature2MesureTime = true;
+		deviceSettings.Temperature2MesureTime = s->Temperature2MesureTime;
+	}
+	if (s->has_CpuSpeed) {
+		deviceSettings.has_CpuSpeed = true;
+		deviceSettings.CpuSpeed = s->CpuSpeed;
+	}
+	if (s->has_CoeffsT1) {
+		deviceSettings.has_CoeffsT1 = true;
+		deviceSettings.CoeffsT1 = s->CoeffsT1;
+	}
+	if (s->has_CoeffsT2) {
+		deviceSettings.has_CoeffsT2 = true;
+		deviceSettings.CoeffsT2 = s->CoeffsT2;
+	}
+	if (s->has_Clock) {
+		uint64_t clock = (uint64_t) s->Clock.tv_sec * 1000000000
+				+ s->Clock.tv_nsec;
+		deviceSettings.has_Clock = true;
+		clockOffset = (int64_t) (clock - now_ns(CLOCK_REALTIME));
+	}
+}
+
+static void processRequest(const GenericRequest *request,
+		GenericAnsver *response) {
+	response->PROTOCOL_VERSION = USED_PROTOCOL_VERSION;
+	response->ReqId = request->ReqId;
+	response->status = GenericAnsver_Status_OK;
+	response->has_timeStamp = true;
+	fillTimeStamp(&response->timeStamp, now_ns(CLOCK_REALTIME));
+
+	if (request->PROTOCOL_VERSION != USED_PROTOCOL_VERSION) {
+		response->Type = GenericAnsver_ResponseType_UNKNOWN;
+		response->status = GenericAnsver_Status_PROTOCOL_ERROR;
+		return;
+	}
+
+	switch (request->Type) {
+	case GenericRequest_RequestType_PING:
+		response->Type = GenericAnsver_ResponseType_PONG;
+		break;
+	case GenericRequest_RequestType_GET_SUMMARY:
+		response->Type = GenericAnsver_ResponseType_SUMMARY;
+		response->has_summary = true;
+		fillSummary(&response->summary);
+		break;
+	case GenericRequest_RequestType_GET_VALUE:
+		response->Type = GenericAnsver_ResponseType_RESULT_VALUE;
+		if (!request->has_getValue) {
+			response->status = GenericAnsver_Status_VALUE_ERROR;
+			break;
+		}
+		response->has_value = true;
+		response->value.valueOf = request->getValue.valueOf;
+		fillTimeStamp(&response->value.timestamp, now_ns(CLOCK_REALTIME));
+		response->value.Value = simulatedValue(request->getValue.valueOf);
+		break;
+	case GenericRequest_RequestType_GET_VALUES:
+		response->Type = GenericAnsver_ResponseType_RESULT_VALUES;
+		response->has_values = true;
+		fillTimeStamp(&response->values.timestamp, now_ns(CLOCK_REALTIME));
+		response->values.Temperature1 = simulatedValue(ValueOf_TEMPERATURE_1);
+		response->values.Temperature2 = simulatedValue(ValueOf_TEMPERATURE_2);
+		response->values.Ft1 = simulatedValue(ValueOf_F_T_1);
+		response->values.Ft2 = simulatedValue(ValueOf_F_T_2);
+		break;
+	case GenericRequest_RequestType_SET_CONTROL:
+		response->Type = GenericAnsver_ResponseType_ACCEPT;
+		if (!request->has_setControl) {
+			response->status = GenericAnsver_Status_VALUE_ERROR;
+			break;
+		}
+		deviceControl = request->setControl;
+		break;
+	case GenericRequest_RequestType_SET_SETTINGS:
+		response->Type = GenericAnsver_ResponseType_ACCEPT;
+		if (!request->has_setSettings) {
+			response->status = GenericAnsver_Status_VALUE_ERROR;
+			break;
+		}
+		mergeSettings(&request->setSettings);
+		break;
+	default:
+		response->Type = GenericAnsver_ResponseType_UNKNOWN;
+		response->status = GenericAnsver_Status_PROTOCOL_ERROR;
+		break;
+	}
+}
+
+struct serverOptions {
+	unsigned baud; /* 0 for no emulation */
+	unsigned delay_us;
+	bool reorder;
+	unsigned drop_percent;
+};
+
+/* Answer the requests until the terminal is closed */
+static void serve(int fd, const struct serverOptions *options) {
+	struct link link = { fd, -1 };
+	pb_istream_t input = link_istream(&link);
+	uint8_t held[ANSVER_BUFFER_SIZE];
+	size_t heldLength = 0;
+	unsigned long answers = 0;
+
+	/* 8N1: a start bit, 8 data bits and a stop bit */
+	if (options->baud)
+		link.byte_ns = 10ULL * 1000000000 / options->baud;
+	srand(1);
+
+	while (true) {
+		GenericRequest request = { };
+		GenericAnsver response = { };
+		uint8_t buf[ANSVER_BUFFER_SIZE];
+		pb_ostream_t output = pb_ostream_from_buffer(buf, sizeof(buf));
+		pb_istream_t frame;
+		uint64_t length;
+
+		/* Send a held answer if the next request does not come soon */
+		link.timeout_ms = heldLength ? 10 : -1;
+		input.bytes_left = SIZE_MAX;
+		if (!pb_decode_varint(&input, &length)) {
+			if (heldLength == 0 || !link_send(&link, held, heldLength))
+				return;
+			heldLength = 0;
+			continue;
+		}
+		link.timeout_ms = -1;
+
+		/* The client wakes the device up with a zero byte */
+		if (length == 0)
+			continue;
+
+		frame = input;
+		frame.bytes_left = (size_t) length;
+		if (!pb_decode_GenericRequest(&frame, &request)) {
+			fprintf(stderr, "Bad request: %s\n", PB_GET_ERROR(&frame));
+			if (frame.bytes_left && !pb_read(&frame, NULL, frame.bytes_left))
+				return;
+			request.PROTOCOL_VERSION = 0;
+		}
+
+		link_wait_received(&link);
+		if (options->delay_us)
+			usleep(options->delay_us);
+
+		processRequest(&request, &response);
+		if (!pb_encode_delimited(&output, GenericAnsver_fields, &response)) {
+			fprintf(stderr, "Encoding failed: %s\n", PB_GET_ERROR(&output));
+			return;
+		}
+
+		if (options->drop_percent
+				&& (unsigned) rand() % 100 < options->drop_percent)
+			continue;
+
+		if (options->reorder && heldLength == 0 && (answers++ & 1) == 0) {
+			memcpy(held, buf, output.bytes_written);
+			heldLength = output.bytes_written;
+			continue;
+		}
+
+		if (!link_send(&link, buf, output.bytes_written))
+			return;
+		if (heldLength) {
+			if (!link_send(&link, held, heldLength))
+				return;
+			heldLength = 0;
+		}
+	}
+}
+
+/* Create a pseudo-terminal in raw mode. The slave side is kept open, so
+ * that the master does not see a hangup between the clients. */
+static int openPty(char *name, size_t size) {
+	struct termios ios;
+	int master, slave;
+
+	master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) {
+		perror("pty");
+		return -1;
+	}
+
+	snprintf(name, size, "%s", ptsname(master));
+	slave = open(name, O_RDWR | O_NOCTTY);
+	if (slave < 0) {
+		perror(name);
+		return -1;
+	}
+
+	tcgetattr(slave, &ios);
+	cfmakeraw(&ios);
+	tcsetattr(slave, TCSANOW, &ios);
+	return master;
+}
+
+/////////////////////////////////////////////////////////////////
+
+static void fillLoadRequest(GenericRequest *request, uint32_t id) {
+	static const GenericRequest_RequestType mix[] = {
+			GenericRequest_RequestType_PING,
+			GenericRequest_RequestType_GET_VALUE,
+			GenericRequest_RequestType_GET_VALUES,
+			GenericRequest_RequestType_GET_SUMMARY };
+
+	request->PROTOCOL_VERSION = USED_PROTOCOL_VERSION;
+	request->ReqId = id;
+	request->Type = mix[id % (sizeof(mix) / sizeof(mix[0]))];
+	request->has_timeStamp = true;
+	fillTimeStamp(&request->timeStamp, now_ns(CLOCK_REALTIME));
+
+	if (request->Type == GenericRequest_RequestType_GET_VALUE) {
+		request->has_getValue = true;
+		request->getValue.valueOf = (ValueOf) (id % 4);
+	}
+}
+
+struct load {
+	pb_tap_histogram_t rtt;
+	unsigned long failed;
+};
+
+static void loadDone(struct pipeline *p, const GenericRequest *request,
+		const GenericAnsver *response, uint64_t rtt_ns, void *arg) {
+	struct load *load = (struct load*) arg;
+
+	if (!response || response->status != GenericAnsver_Status_OK) {
+		load->failed++;
+		return;
+	}
+	pb_tap_histogram_add(&load->rtt, rtt_ns);
+}
+
+/* Send count requests with up to concurrency of them in flight, and
+ * print the request rate and round trip times. */
+static int runLoad(const char *dev, unsigned count, unsigned concurrency,
+		unsigned timeout_ms, unsigned retries) {
+	static struct load load;
+	struct pipeline p;
+	uint64_t start, elapsed;
+	unsigned i;
+	int fd;
+
+	fd = open(dev, O_RDWR | O_NOCTTY);
+	if (fd < 0) {
+		perror(dev);
+		return 1;
+	}
+	pipeline_init(&p, fd, concurrency, timeout_ms, retries);
+
+	start = now_ns(CLOCK_MONOTONIC);
+	for (i = 0; i < count; i++) {
+		GenericRequest request = { };
+
+		fillLoadRequest(&request, i);
+		if (!pipeline_submit(&p, &request, loadDone, &load)) {
+			fprintf(stderr, "Sending request %u failed\n", i);
+			return 1;
+		}
+	}
+	if (!pipeline_drain(&p)) {
+		fprintf(stderr, "Reading the answers failed\n");
+		return 1;
+	}
+	elapsed = now_ns(CLOCK_MONOTONIC) - start;
+
+	printf("%u requests, %u in flight: %.3f s, %.1f requests/s, "
+			"%lu bytes sent, %lu bytes received\n", count, concurrency,
+			(double) elapsed / 1e9, count / ((double) elapsed / 1e9),
+			p.bytes_sent, p.bytes_received);
+	printf("round trip: p50 %.1f us p99 %.1f us max %.1f us\n",
+			(double) pb_tap_histogram_percentile(&load.rtt, 50) / 1e3,
+			(double) pb_tap_histogram_percentile(&load.rtt, 99) / 1e3,
+			(double) load.rtt.max / 1e3);
+	printf("%lu retried, %lu timed out, %lu failed, %lu unmatched answers\n",
+			p.retried, p.timed_out, load.failed, p.unmatched);
+
+	close(fd);
+	return (load.failed == 0) ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
+	struct serverOptions options = { 0, 0, false, 0 };
+	char name[64];
+	char *dev = NULL;
+	bool load = false;
+	unsigned count = 1000, concurrency = 1, timeout_ms = 1000, retries = 3;
+	int master, opt, status;
+	pid_t server;
+
+	while ((opt = getopt(argc, argv, "b:d:rx:LD:n:c:t:R:")) != -1) {
+		switch (opt) {
+		case 'b':
+			options.baud = (unsigned) atoi(optarg);
+			break;
+		case 'd':
+			options.delay_us = (unsigned) atoi(optarg);
+			break;
+		case 'r':
+			options.reorder = true;
+			break;
+		case 'x':
+			options.drop_percent = (unsigned) atoi(optarg);
+			break;
+		case 'L':
+			load = true;
+			break;
+		case 'D':
+			dev = optarg;
+			load = true;
+			break;
+		case 'n':
+			count = (unsigned) atoi(optarg);
+			break;
+		case 'c':
+			concurrency = (unsigned) atoi(optarg);
+			break;
+		case 't':
+			timeout_ms = (unsigned) atoi(optarg);
+			break;
+		case 'R':
+			retries = (unsigned) atoi(optarg);
+			break;
+		default:
+			printf("USAGE: %s [-b baud] [-d usec] [-r] [-x percent] [-L [-D device] "
+					"[-n count] [-c concurrency] [-t msec] [-R retries]]\n",
+					argv[0]);
+			return 1;
+		}
+	}
+
+	if (concurrency < 1 || concurrency > MAX_CONCURRENCY) {
+		printf("Concurrency must be between 1 and %d\n", MAX_CONCURRENCY);
+		return 1;
+	}
+
+	if (load && dev)
+		return runLoad(dev, count, concurrency, timeout_ms, retries);
+
+	master = openPty(name, sizeof(name));
+	if (master < 0)
+		return 1;
+
+	if (!load) {
+		printf("%s\n", name);
+		fflush(stdout);
+		serve(master, &options);
+		return 0;
+	}
+
+	server = fork();
+	if (server == 0) {
+		serve(master, &options);
+		_exit(0);
+	}
+
+	status = runLoad(name, count, concurrency, timeout_ms, retries);
+	kill(server, SIGTERM);
+	waitpid(server, NULL, 0);
+	return status;
+}
@@ -8,52 +8,6 @@
 #include <pb_decode.h>
 #include "unionproto.pb.h"
 
-/* This function reads manually the first tag from the stream and finds the
- * corresponding message type. It doesn't yet decode the actual message.
- *
- * Returns a pointer to the MsgType_fields array, as an identifier for the
- * message type. Returns null if the tag is of unknown type or an error occurs.
- */
-const pb_field_t* decode_unionmessage_type(pb_istream_t *stream)
-{
-    pb_wire_type_t wire_type;
-    uint32_t tag;
-    bool eof;
-
-    while (pb_decode_tag(stream, &wire_type, &tag, &eof))
-    {
-        if (wire_type == PB_WT_STRING)
-        {
-            const pb_field_t *field;
-            for (field = UnionMessage_fields; field->tag != 0; field++)
-            {
-                if (field->tag == tag && (field->type & PB_LTYPE_SUBMESSAGE))
-                {
-                    /* Found our field. */
-                    return field->ptr;
-                }
-            }
-        }
-        
-        /* Wasn't our field.. */
-        pb_skip_field(stream, wire_type);
-    }
-    
-    return NULL;
-}
-
-bool decode_unionmessage_contents(pb_istream_t *stream, const pb_field_t fields[], void *dest_struct)
-{
-    pb_istream_t substream;
-    bool status;
-    if (!pb_make_string_substream(stream, &substream))
-        return false;
-    
-    status = pb_decode(&substream, fields, dest_struct);
-    pb_close_string_substream(stream, &substream);
-    return status;
-}
-
 int main()
 {
     /* Read the data into buffer */
@@ -61,36 +15,33 @@ int main()
     size_t count = fread(buffer, 1, sizeof(buffer), stdin);
     pb_istream_t stream = pb_istream_from_buffer(buffer, count);
     
-    const pb_field_t *type = decode_unionmessage_type(&stream);
-    bool status = false;
+    /* The union has room for the largest of the message types. The msgid
+     * in front of the message selects the type from the generated table. */
+    UNIONPROTO_msgid_union msg;
+    uint32_t msgid;
     
-    if (type == MsgType1_fields)
-    {
-        MsgType1 msg = {};
-        status = decode_unionmessage_contents(&stream, MsgType1_fields, &msg);
-        printf("Got MsgType1: %d\n", msg.value);
-    }
-    else if (type == MsgType2_fields)
+    if (!pb_decode_any(&stream, &UNIONPROTO_msgid_table, &msgid, &msg))
     {
-        MsgType2 msg = {};
-        status = decode_unionmessage_contents(&stream, MsgType2_fields, &msg);
-        printf("Got MsgType2: %s\n", msg.value ? "true" : "false");
-    }
-    else if (type == MsgType3_fields)
-    {
-        MsgType3 msg = {};
-        status = decode_unionmessage_contents(&stream, MsgType3_fields, &msg);
-        printf("Got MsgType3: %d %d\n", msg.value1, msg.value2);    
+        printf("Decode failed: %s\n", PB_GET_ERROR(&stream));
+        return 1;
     }
     
-    if (!status)
+    switch (msgid)
     {
-        printf("Decode failed: %s\n", PB_GET_ERROR(&stream));
-        return 1;
+        case MsgType1_msgid:
+            printf("Got MsgType1: %d\n", msg.MsgType1_msg.value);
+            break;
+        
+        case MsgType2_msgid:
+            printf("Got MsgType2: %s\n", msg.MsgType2_msg.value ? "true" : "false");
+            break;
+        
+        case MsgType3_msgid:
+            printf("Got MsgType3: %d %d\n", msg.MsgType3_msg.value1, msg.MsgType3_msg.value2);
+            break;
     }
     
     return 0;
 }
 
 
-
@@ -0,0 +1,254 @@
+/* pb_rpc.c: Calls to the methods of the services defined in .proto files.
+ * See pb_rpc.h for usage.
+ */
+
+#include <string.h>
+#include "pb_rpc.h"
+
+const pb_rpc_method_t *pb_rpc_find_method(const pb_rpc_service_t *service, uint32_t method_id)
+{
+    const pb_rpc_method_t *method;
+
+    if (method_id == 0 || method_id > service->method_count)
+        return NULL;
+
+    /* Streaming methods are skipped by the generator, and have no fields */
+    method = &service->methods[method_id - 1];
+    return (method->request_fields != NULL) ? method : NULL;
+}
+
+/* Each request and response message is decoded from a stream of its own,
+ * which reads through the input stream. The input then stays at a known
+ * position even if the decoding fails half way, for example inside a
+ * submessage, and the rest of the message can be skipped. */
+#ifndef PB_BUFFER_ONLY
+static bool read_frame(pb_istream_t *stream, uint8_t *buf, size_t count)
+{
+    pb_istream_t *input = (pb_istream_t*)stream->state;
+    return pb_read(input, buf, count);
+}
+#endif
+
+/* Read the length of a message and set up a stream for its contents.
+ * The input is at *end bytes_left when the whole message has been read. */
+static bool open_frame(pb_istream_t *input, pb_istream_t *frame, size_t *end)
+{
+    uint32_t size;
+    
+    if (!pb_decode_varint32(input, &size))
+        return false;
+    
+    if (input->bytes_left < size)
+        PB_RETURN_ERROR(input, "parent stream too short");
+    
+    /* With PB_BUFFER_ONLY, the frame reads from a copy of the input
+     * position and the input is advanced by close_frame(). */
+    *frame = *input;
+    frame->bytes_left = size;
+#ifndef PB_BUFFER_ONLY
+    frame->callback = &read_frame;
+    frame->state = input;
+#endif
+#ifndef PB_NO_ERRMSG
+    frame->errmsg = NULL;
+#endif
+    *end = input->bytes_left - size;
+    return true;
+}
+
+/* Skip the rest of a message, so that the next one can be read */
+static bool close_frame(pb_istream_t *input, size_t end)
+{
+    return pb_read(input, NULL, input->bytes_left - end);
+}
+
+/**************************************
+ * Server                             *
+ **************************************/
+
+bool pb_rpc_serve(const pb_rpc_server_t *server, pb_istream_t *input, pb_ostream_t *output)
+{
+    const pb_rpc_method_t *method;
+    pb_istream_t frame;
+    pb_rpc_status_t status;
+    uint32_t method_id, call_id;
+    size_t end;
+
+    if (!pb_decode_varint32(input, &method_id) ||
+        !pb_decode_varint32(input, &call_id) ||
+        !open_frame(input, &frame, &end))
+    {
+        return false;
+    }
+
+    method = pb_rpc_find_method(server->service, method_id);
+    if (method == NULL)
+    {
+        status = PB_RPC_UNKNOWN_METHOD;
+    }
+    else if (!pb_decode(&frame, method->request_fields, server->request))
+    {
+        status = PB_RPC_BAD_REQUEST;
+    }
+    else
+    {
+        memset(server->response, 0, method->response_size);
+        status = method->invoke(server->handlers, server->request, server->response, server->arg);
+    }
+
+    if (!close_frame(input, end))
+        return false;
+
+    if (!pb_encode_varint(output, call_id) ||
+        !pb_encode_varint(output, (uint64_t)status))
+    {
+        return false;
+    }
+
+    if (status == PB_RPC_OK)
+    {
+        if (!pb_encode_submessage(output, method->response_fields, server->response))
+            return false;
+    }
+    else
+    {
+        if (!pb_encode_varint(output, 0))
+            return false;
+    }
+
+#ifdef PB_ENABLE_MALLOC
+    if (method != NULL)
+    {
+        pb_release(method->request_fields, server->request);
+        if (status == PB_RPC_OK)
+            pb_release(method->response_fields, server->response);
+    }
+#endif
+
+    return true;
+}
+
+/**************************************
+ * Client                             *
+ **************************************/
+
+void pb_rpc_client_init(pb_rpc_client_t *client)
+{
+    client->next_call_id = 1;
+    client->pending = NULL;
+}
+
+bool pb_rpc_start(pb_rpc_client_t *client, pb_ostream_t *output, pb_rpc_call_t *call,
+                  const pb_rpc_method_t *method, const void *request, void *response)
+{
+    call->call_id = client->next_call_id++;
+    call->method = method;
+    call->response = response;
+    call->done = false;
+    call->status = PB_RPC_OK;
+
+    if (!pb_encode_varint(output, method->id) ||
+        !pb_encode_varint(output, call->call_id) ||
+        !pb_encode_submessage(output, method->request_fields, request))
+    {
+        return false;
+    }
+
+    call->next = client->pending;
+    client->pending = call;
+    return true;
+}
+
+/* Remove the call from the pending calls, and return it */
+static pb_rpc_call_t *take_pending(pb_rpc_client_t *client, uint32_t call_id)
+{
+    pb_rpc_call_t **prev = &client->pending;
+
+    while (*prev != NULL)
+    {
+        pb_rpc_call_t *call = *prev;
+        if (call->call_id == call_id)
+        {
+            *prev = call->next;
+            call->next = NULL;
+            return call;
+        }
+        prev = &call->next;
+    }
+
+    return NULL;
+}
+
+bool pb_rpc_receive(pb_rpc_client_t *client, pb_istream_t *input)
+{
+    pb_rpc_call_t *call;
+    pb_istream_t frame;
+    uint32_t call_id, status;
+    size_t end;
+    bool stream_ok;
+
+    if (!pb_decode_varint32(input, &call_id) ||
+        !pb_decode_varint32(input, &status) ||
+        !open_frame(input, &frame, &end))
+    {
+        return false;
+    }
+
+    call = take_pending(client, call_id);
+    if (call != NULL)
+    {
+        call->status = (pb_rpc_status_t)status;
+        if (status == PB_RPC_OK &&
+            !pb_decode(&frame, call->method->response_fields, call->response))
+        {
+            call->status = PB_RPC_BAD_RESPONSE;
+        }
+    }
+
+    stream_ok = close_frame(input, end);
+
+    if (call != NULL)
+    {
+        /* The call got only part of its response if the stream failed */
+        if (!stream_ok)
+            call->status = PB_RPC_STREAM_ERROR;
+
+        call->done = true;
+        if (call->callback != NULL)
+            call->callback(call);
+    }
+
+    return stream_ok;
+}
+
+pb_rpc_status_t pb_rpc_wait(pb_rpc_client_t *client, pb_istream_t *input, pb_rpc_call_t *call)
+{
+    while (!call->done)
+    {
+        if (!pb_rpc_receive(client, input) && !call->done)
+        {
+            pb_rpc_cancel(client, call);
+            call->done = true;
+            call->status = PB_RPC_STREAM_ERROR;
+        }
+    }
+
+    return call->status;
+}
+
+pb_rpc_status_t pb_rpc_call(pb_rpc_client_t *client, pb_ostream_t *output, pb_istream_t *input,
+                            const pb_rpc_method_t *method, const void *request, void *response)
+{
+    pb_rpc_call_t call;
+
+    memset(&call, 0, sizeof(call));
+    if (!pb_rpc_start(client, output, &call, method, request, response))
+        return PB_RPC_STREAM_ERROR;
+
+    return pb_rpc_wait(client, input, &call);
+}
+
+void pb_rpc_cancel(pb_rpc_client_t *client, pb_rpc_call_t *call)
+{
+    take_pending(client, call->call_id);
+}
@@ -0,0 +1,178 @@
+/* pb_rpc.h: Calls to the methods of the services defined in .proto files.
+ * When PB_RPC is defined, the generator creates for each service:
+ *
+ *  - ServiceName_MethodName_methodid: the id of each method, numbered from 1
+ *    in the order of the .proto file.
+ *  - ServiceName_service: the table of the methods, with their request and
+ *    response types, for pb_rpc_serve().
+ *  - ServiceName_handlers_t: a structure of the handler functions that the
+ *    server implements, one for each method.
+ *  - ServiceName_request_union and ServiceName_response_union: storage for
+ *    the requests and the responses of any method of the service.
+ *  - ServiceName_MethodName_start() and ServiceName_MethodName_call():
+ *    typed client functions for each method.
+ *
+ * The calls are sent over any pair of streams. Each request carries a call
+ * id chosen by the client, and the response carries the same id back, so
+ * many calls can be in flight at the same time and the server may answer
+ * them in any order. On the wire, a request is:
+ *
+ *    varint method id, varint call id, varint length, request message
+ *
+ * and a response is:
+ *
+ *    varint call id, varint status, varint length, response message
+ *
+ * where the response message is empty unless the status is PB_RPC_OK.
+ *
+ * Example usage on the server:
+ *    static const MyService_handlers_t handlers = {&handle_get, &handle_set};
+ *    static MyService_request_union request;
+ *    static MyService_response_union response;
+ *    static const pb_rpc_server_t server = {&MyService_service, &handlers, NULL,
+ *                                           &request, &response};
+ *
+ *    while (pb_rpc_serve(&server, &input, &output))
+ *        flush(&output);
+ *
+ * and on the client:
+ *    pb_rpc_client_t client;
+ *    pb_rpc_client_init(&client);
+ *    status = MyService_Get_call(&client, &output, &input, &request, &response);
+ */
+
+#ifndef PB_RPC_H_INCLUDED
+#define PB_RPC_H_INCLUDED
+
+#include <pb_encode.h>
+#include <pb_decode.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    PB_RPC_OK = 0,
+    PB_RPC_UNKNOWN_METHOD = 1,  /* Unknown method id, or no handler for it */
+    PB_RPC_BAD_REQUEST = 2,     /* The server could not decode the request */
+    PB_RPC_FAILED = 3,          /* The handler returned false */
+    PB_RPC_BAD_RESPONSE = 4,    /* The client could not decode the response */
+    PB_RPC_STREAM_ERROR = 5     /* The client could not write or read the stream */
+} pb_rpc_status_t;
+
+/* Calls the handler of a method from the handlers structure of the
+ * service. Generated for each method. */
+typedef pb_rpc_status_t (*pb_rpc_invoke_t)(const void *handlers, const void *request,
+                                           void *response, void *arg);
+
+typedef struct pb_rpc_method_s pb_rpc_method_t;
+struct pb_rpc_method_s {
+    uint32_t id;
+    const char *name;
+    const pb_field_t *request_fields;
+    size_t request_size;
+    const pb_field_t *response_fields;
+    size_t response_size;
+    pb_rpc_invoke_t invoke;
+};
+
+typedef struct pb_rpc_service_s pb_rpc_service_t;
+struct pb_rpc_service_s {
+    const char *name;
+    uint32_t method_count;
+    const pb_rpc_method_t *methods; /* Method id n is at index n - 1. The
+                                     * methods that were skipped have no
+                                     * fields. */
+};
+
+/* Returns the method with the id, or NULL if there is none. */
+const pb_rpc_method_t *pb_rpc_find_method(const pb_rpc_service_t *service, uint32_t method_id);
+
+/**************************************
+ * Server                             *
+ **************************************/
+
+typedef struct {
+    const pb_rpc_service_t *service;
+    const void *handlers;   /* Usually a ServiceName_handlers_t */
+    void *arg;              /* Passed to the handlers */
+    void *request;          /* Usually a ServiceName_request_union */
+    void *response;         /* Usually a ServiceName_response_union */
+} pb_rpc_server_t;
+
+/* Read one request from the input stream, call the handler of the method
+ * and write the response to the output stream. The response structure is
+ * cleared with zeros before the handler is called. Errors in the request
+ * and in the handler are reported to the client in the status of the
+ * response. Returns false on stream errors, with the error message set to
+ * the stream that failed. */
+bool pb_rpc_serve(const pb_rpc_server_t *server, pb_istream_t *input, pb_ostream_t *output);
+
+/**************************************
+ * Client                             *
+ **************************************/
+
+typedef struct pb_rpc_call_s pb_rpc_call_t;
+
+/* Called when the response to a call has been received. */
+typedef void (*pb_rpc_callback_t)(pb_rpc_call_t *call);
+
+struct pb_rpc_call_s {
+    /* Set by the user before the call is started, or left NULL */
+    pb_rpc_callback_t callback;
+    void *arg;
+
+    /* Set by pb_rpc_start() */
+    uint32_t call_id;
+    const pb_rpc_method_t *method;
+    void *response;
+
+    /* Set when the response has been received, or when the input stream
+     * failed while reading it */
+    bool done;
+    pb_rpc_status_t status;
+
+    pb_rpc_call_t *next;
+};
+
+typedef struct {
+    uint32_t next_call_id;
+    pb_rpc_call_t *pending; /* Calls waiting for a response */
+} pb_rpc_client_t;
+
+void pb_rpc_client_init(pb_rpc_client_t *client);
+
+/* Write a request to the output stream and add the call to the pending
+ * calls of the client. The call and the response structure must stay valid
+ * until the response has been received. The generated functions
+ * ServiceName_MethodName_start() call this with the right method.
+ * Returns false on stream errors, and then the call is not pending. */
+bool pb_rpc_start(pb_rpc_client_t *client, pb_ostream_t *output, pb_rpc_call_t *call,
+                  const pb_rpc_method_t *method, const void *request, void *response);
+
+/* Read one response from the input stream and complete the pending call
+ * that has the same call id: decode the response, set the status and call
+ * the callback. A response with an unknown call id, such as a late response
+ * to a cancelled call, is skipped. Returns false on stream errors. */
+bool pb_rpc_receive(pb_rpc_client_t *client, pb_istream_t *input);
+
+/* Receive responses until the call is done, and return its status. The
+ * responses to the other pending calls are completed along the way. If the
+ * input stream fails, the call is cancelled and PB_RPC_STREAM_ERROR is
+ * returned. */
+pb_rpc_status_t pb_rpc_wait(pb_rpc_client_t *client, pb_istream_t *input, pb_rpc_call_t *call);
+
+/* Start a call and wait for its response. The generated functions
+ * ServiceName_MethodName_call() call this with the right method. */
+pb_rpc_status_t pb_rpc_call(pb_rpc_client_t *client, pb_ostream_t *output, pb_istream_t *input,
+                            const pb_rpc_method_t *method, const void *request, void *response);
+
+/* Forget a pending call, for example after a timeout. A late response to
+ * it will be skipped. */
+void pb_rpc_cancel(pb_rpc_client_t *client, pb_rpc_call_t *call);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif
@@ -0,0 +1,232 @@
+/* pb_stream_tap.c: Wrapper that measures the IO callbacks of another stream.
+ * See pb_stream_tap.h for usage.
+ */
+
+#ifndef PB_TAP_CLOCK
+#define PB_TAP_POSIX_CLOCK
+#define _POSIX_C_SOURCE 199309L
+#include <time.h>
+#endif
+
+#include <string.h>
+#include "pb_stream_tap.h"
+
+#ifdef PB_TAP_POSIX_CLOCK
+uint64_t pb_tap_clock_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+#endif
+
+static unsigned bucket_index(uint64_t value)
+{
+    unsigned shift = 0;
+
+    if (value < PB_TAP_SUB_BUCKETS)
+        return (unsigned)value;
+
+    /* Keep the highest PB_TAP_SUB_BUCKET_BITS + 1 bits of the value */
+    while ((value >> shift) >= 2 * PB_TAP_SUB_BUCKETS)
+        shift++;
+
+    return (shift + 1) * PB_TAP_SUB_BUCKETS +
+           (unsigned)(value >> shift) - PB_TAP_SUB_BUCKETS;
+}
+
+/* Largest value that falls into the bucket */
+static uint64_t bucket_limit(unsigned index)
+{
+    unsigned shift;
+    uint64_t first;
+
+    if (index < PB_TAP_SUB_BUCKETS)
+        return index;
+
+    shift = index / PB_TAP_SUB_BUCKETS - 1;
+    first = (uint64_t)(index % PB_TAP_SUB_BUCKETS + PB_TAP_SUB_BUCKETS) << shift;
+    return first + (((uint64_t)1 << shift) - 1);
+}
+
+void pb_tap_histogram_add(pb_tap_histogram_t *histogram, uint64_t value)
+{
+    if (histogram->count == 0 || value < histogram->min)
+        histogram->min = value;
+    if (value > histogram->max)
+        histogram->max = value;
+
+    histogram->count++;
+    histogram->sum += value;
+    histogram->buckets[bucket_index(value)]++;
+}
+
+uint64_t pb_tap_histogram_percentile(const pb_tap_histogram_t *histogram, double percent)
+{
+    double needed = (double)histogram->count * percent / 100.0;
+    unsigned long seen = 0;
+    unsigned i;
+
+    if (histogram->count == 0)
+        return 0;
+
+    for (i = 0; i < PB_TAP_BUCKETS; i++)
+    {
+        seen += histogram->buckets[i];
+        if (seen > 0 && seen >= needed)
+        {
+            uint64_t limit = bucket_limit(i);
+            return (limit < histogram->max) ? limit : histogram->max;
+        }
+    }
+
+    return histogram->max;
+}
+
+void pb_tap_histogram_export(const pb_tap_histogram_t *histogram, FILE *file, double scale)
+{
+    unsigned long seen = 0;
+    unsigned i;
+
+    fprintf(file, "%12s %14s %10s %14s\n\n", "Value", "Percentile", "TotalCount", "1/(1-Percentile)");
+
+    for (i = 0; i < PB_TAP_BUCKETS && seen < histogram->count; i++)
+    {
+        uint64_t limit;
+        double fraction;
+
+        if (histogram->buckets[i] == 0)
+            continue;
+
+        seen += histogram->buckets[i];
+        limit = bucket_limit(i);
+        if (limit > histogram->max)
+            limit = histogram->max;
+
+        fraction = (double)seen / (double)histogram->count;
+        if (seen < histogram->count)
+            fprintf(file, "%12.3f %2.12f %10lu %14.2f\n", (double)limit / scale,
+                    fraction, seen, 1.0 / (1.0 - fraction));
+        else
+            fprintf(file, "%12.3f %2.12f %10lu\n", (double)limit / scale,
+                    fraction, seen);
+    }
+
+    fprintf(file, "#[Mean    = %12.3f, Min           = %12.3f]\n",
+            histogram->count ? (double)histogram->sum / (double)histogram->count / scale : 0.0,
+            (double)histogram->min / scale);
+    fprintf(file, "#[Max     = %12.3f, Total count   = %12lu]\n",
+            (double)histogram->max / scale, histogram->count);
+    fprintf(file, "#[Buckets = %12d, SubBuckets    = %12d]\n",
+            PB_TAP_BUCKETS, PB_TAP_SUB_BUCKETS);
+}
+
+static void record_call(pb_stream_tap_t *tap, uint64_t start, size_t count, bool status)
+{
+    uint64_t elapsed = PB_TAP_CLOCK() - start;
+
+    pb_tap_histogram_add(&tap->bytes, count);
+    pb_tap_histogram_add(&tap->blocked, elapsed);
+    if (!status)
+        tap->failures++;
+
+    if (tap->log != NULL)
+    {
+        fprintf(tap->log, "%lu;%lu;%lu;%d\n", (unsigned long)start,
+                (unsigned long)count, (unsigned long)elapsed, status ? 1 : 0);
+    }
+}
+
+static bool tap_read(pb_istream_t *stream, uint8_t *buf, size_t count)
+{
+    pb_stream_tap_t *tap = (pb_stream_tap_t*)stream->state;
+    pb_istream_t *inner = tap->istream;
+    uint64_t start;
+    bool status;
+
+    /* The callback may set bytes_left to signal the end of the stream */
+    inner->bytes_left = stream->bytes_left;
+
+    start = PB_TAP_CLOCK();
+    status = inner->callback(inner, buf, count);
+    record_call(tap, start, count, status);
+
+    stream->bytes_left = inner->bytes_left;
+#ifndef PB_NO_ERRMSG
+    if (!status && inner->errmsg != NULL)
+        stream->errmsg = inner->errmsg;
+#endif
+
+    return status;
+}
+
+static bool tap_write(pb_ostream_t *stream, const uint8_t *buf, size_t count)
+{
+    pb_stream_tap_t *tap = (pb_stream_tap_t*)stream->state;
+    pb_ostream_t *inner = tap->ostream;
+    uint64_t start;
+    bool status;
+
+    inner->max_size = stream->max_size;
+    inner->bytes_written = stream->bytes_written;
+
+    start = PB_TAP_CLOCK();
+    status = inner->callback(inner, buf, count);
+    record_call(tap, start, count, status);
+
+#ifndef PB_NO_ERRMSG
+    if (!status && inner->errmsg != NULL)
+        stream->errmsg = inner->errmsg;
+#endif
+
+    return status;
+}
+
+void pb_stream_tap_init(pb_stream_tap_t *tap)
+{
+    memset(tap, 0, sizeof(*tap));
+}
+
+pb_istream_t pb_istream_tap(pb_stream_tap_t *tap, pb_istream_t *inner)
+{
+    pb_istream_t stream = *inner;
+    tap->istream = inner;
+    stream.callback = &tap_read;
+    stream.state = tap;
+    return stream;
+}
+
+pb_ostream_t pb_ostream_tap(pb_stream_tap_t *tap, pb_ostream_t *inner)
+{
+    pb_ostream_t stream = *inner;
+    tap->ostream = inner;
+    stream.callback = &tap_write;
+    stream.state = tap;
+    return stream;
+}
+
+void pb_stream_tap_print(const pb_stream_tap_t *tap, const char *name, FILE *file)
+{
+    const pb_tap_histogram_t *blocked = &tap->blocked;
+
+    fprintf(file, "%s: %lu calls, %lu bytes", name, tap->bytes.count,
+            (unsigned long)tap->bytes.sum);
+
+    if (tap->bytes.count > 0)
+    {
+        fprintf(file, " | bytes p50 %lu max %lu",
+                (unsigned long)pb_tap_histogram_percentile(&tap->bytes, 50),
+                (unsigned long)tap->bytes.max);
+        fprintf(file, " | blocked %.3f ms, p50 %.1f us p99 %.1f us p99.9 %.1f us max %.1f us",
+                (double)blocked->sum / 1e6,
+                (double)pb_tap_histogram_percentile(blocked, 50) / 1e3,
+                (double)pb_tap_histogram_percentile(blocked, 99) / 1e3,
+                (double)pb_tap_histogram_percentile(blocked, 99.9) / 1e3,
+                (double)blocked->max / 1e3);
+    }
+
+    if (tap->failures > 0)
+        fprintf(file, " | %lu failed", tap->failures);
+
+    fprintf(file, "\n");
+}
@@ -0,0 +1,100 @@
+/* pb_stream_tap.h: Wrapper that measures the IO callbacks of another stream.
+ * Each call of the wrapped callback is timed, and the number of bytes and the
+ * time spent in the call are counted in log-linear histograms, in the style
+ * of HdrHistogram. This shows how much of the decoding or encoding time is
+ * spent waiting for the link, and how the link delivers the data.
+ *
+ * Example usage:
+ *    static pb_stream_tap_t tap;
+ *    pb_istream_t file = pb_istream_from_file(f);
+ *    pb_istream_t stream;
+ *
+ *    pb_stream_tap_init(&tap);
+ *    stream = pb_istream_tap(&tap, &file);
+ *    pb_decode(&stream, MyMessage_fields, &msg);
+ *    pb_stream_tap_print(&tap, "input", stdout);
+ */
+
+#ifndef PB_STREAM_TAP_H_INCLUDED
+#define PB_STREAM_TAP_H_INCLUDED
+
+#include <stdio.h>
+#include <pb_encode.h>
+#include <pb_decode.h>
+
+#ifdef PB_BUFFER_ONLY
+#error The stream tap requires callback streams.
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Clock used to time the callbacks, in nanoseconds. Defaults to
+ * pb_tap_clock_ns(), which uses the POSIX monotonic clock. */
+#ifndef PB_TAP_CLOCK
+#define PB_TAP_CLOCK() pb_tap_clock_ns()
+uint64_t pb_tap_clock_ns(void);
+#endif
+
+/* Values below PB_TAP_SUB_BUCKETS are counted exactly, and each larger
+ * power of two is split into PB_TAP_SUB_BUCKETS buckets. This keeps the
+ * error of the reported values below 1/PB_TAP_SUB_BUCKETS over the whole
+ * range of uint64_t. */
+#define PB_TAP_SUB_BUCKET_BITS 4
+#define PB_TAP_SUB_BUCKETS (1 << PB_TAP_SUB_BUCKET_BITS)
+#define PB_TAP_BUCKETS ((64 - PB_TAP_SUB_BUCKET_BITS + 1) * PB_TAP_SUB_BUCKETS)
+
+typedef struct {
+    unsigned long count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    unsigned long buckets[PB_TAP_BUCKETS];
+} pb_tap_histogram_t;
+
+typedef struct {
+    pb_tap_histogram_t bytes;   /* Bytes requested in each call */
+    pb_tap_histogram_t blocked; /* Time spent in each call, see PB_TAP_CLOCK() */
+    unsigned long failures;     /* Calls that returned false */
+
+    /* If not NULL, one line is written for each call: the start time,
+     * the number of bytes, the time spent and the result, separated by
+     * semicolons. */
+    FILE *log;
+
+    /* The streams that are currently wrapped */
+    pb_istream_t *istream;
+    pb_ostream_t *ostream;
+} pb_stream_tap_t;
+
+/* Clear the histograms. */
+void pb_stream_tap_init(pb_stream_tap_t *tap);
+
+/* Create a stream that passes the calls to the callback of inner and
+ * measures them. The returned stream starts with the same state as inner,
+ * and inner must stay valid as long as it is used. The tap can be used for
+ * one input and one output stream at a time, and keeps collecting data when
+ * it is used for new streams. */
+pb_istream_t pb_istream_tap(pb_stream_tap_t *tap, pb_istream_t *inner);
+pb_ostream_t pb_ostream_tap(pb_stream_tap_t *tap, pb_ostream_t *inner);
+
+void pb_tap_histogram_add(pb_tap_histogram_t *histogram, uint64_t value);
+
+/* Value below which the given percentage of the samples fall, rounded up
+ * to the end of the histogram bucket. */
+uint64_t pb_tap_histogram_percentile(const pb_tap_histogram_t *histogram, double percent);
+
+/* Write the percentile distribution in the format of HdrHistogram's
+ * outputPercentileDistribution(), which the HdrHistogram plotter reads.
+ * The values are divided by scale, e.g. 1000.0 for microseconds. */
+void pb_tap_histogram_export(const pb_tap_histogram_t *histogram, FILE *file, double scale);
+
+/* Write a one line summary of the calls. */
+void pb_stream_tap_print(const pb_stream_tap_t *tap, const char *name, FILE *file);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif
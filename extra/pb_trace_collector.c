@@ -0,0 +1,191 @@
+/* pb_trace_collector.c: Reference collector for the PB_ENABLE_TRACE hook.
+ * See pb_trace_collector.h for usage.
+ */
+
+#include <string.h>
+#include <pb_common.h>
+#include "pb_trace_collector.h"
+
+static void histogram_add(pb_histogram_t *histogram, uint64_t value)
+{
+    unsigned bucket = 0;
+    uint64_t rest = value;
+
+    while (rest != 0 && bucket < PB_HISTOGRAM_BUCKETS - 1)
+    {
+        rest >>= 1;
+        bucket++;
+    }
+
+    histogram->count++;
+    histogram->sum += value;
+    if (value > histogram->max)
+        histogram->max = value;
+    histogram->buckets[bucket]++;
+}
+
+uint64_t pb_histogram_percentile(const pb_histogram_t *histogram, unsigned percent)
+{
+    unsigned long needed = (unsigned long)((histogram->count * (uint64_t)percent + 99) / 100);
+    unsigned long seen = 0;
+    unsigned bucket;
+
+    if (histogram->count == 0)
+        return 0;
+
+    for (bucket = 0; bucket < PB_HISTOGRAM_BUCKETS - 1; bucket++)
+    {
+        seen += histogram->buckets[bucket];
+        if (seen >= needed && seen > 0)
+        {
+            uint64_t limit = (bucket == 0) ? 0 : ((uint64_t)1 << bucket) - 1;
+            return (limit < histogram->max) ? limit : histogram->max;
+        }
+    }
+
+    return histogram->max;
+}
+
+/* Find the statistics of a field of a registered message. The field
+ * descriptor in the event may be a temporary copy, so the message is
+ * found by its fields array and the field by its tag. */
+static pb_trace_field_stats_t *find_field(pb_trace_collector_t *collector,
+                                          const pb_trace_event_t *event)
+{
+    pb_size_t i, j;
+
+    for (i = 0; i < collector->message_count; i++)
+    {
+        pb_trace_message_stats_t *message = &collector->messages[i];
+        if (message->fields != event->fields)
+            continue;
+
+        for (j = 0; j < message->field_count; j++)
+        {
+            if (message->tags[j] == event->tag)
+                return &message->field_stats[j];
+        }
+    }
+
+    return NULL;
+}
+
+void pb_trace_collector_record(pb_trace_collector_t *collector, const pb_field_t fields[],
+                               size_t size, pb_trace_time_t elapsed)
+{
+    pb_size_t i;
+
+    for (i = 0; i < collector->message_count; i++)
+    {
+        if (collector->messages[i].fields == fields)
+        {
+            histogram_add(&collector->messages[i].time, elapsed);
+            histogram_add(&collector->messages[i].size, size);
+            return;
+        }
+    }
+}
+
+static void collector_hook(const pb_trace_event_t *event, void *arg)
+{
+    pb_trace_collector_t *collector = (pb_trace_collector_t*)arg;
+    pb_trace_field_stats_t *stats = find_field(collector, event);
+
+    if (stats == NULL)
+    {
+        collector->other_fields++;
+        return;
+    }
+
+    histogram_add(&stats->time, event->elapsed);
+    histogram_add(&stats->size, event->size);
+
+    /* An array field reports all its entries at once when encoding, so
+     * only single submessages are counted as whole messages. */
+    if (PB_LTYPE(event->field->type) == PB_LTYPE_SUBMESSAGE &&
+        PB_HTYPE(event->field->type) != PB_HTYPE_REPEATED)
+    {
+        pb_trace_collector_record(collector, (const pb_field_t*)event->field->ptr,
+                                  event->size, event->elapsed);
+    }
+}
+
+void pb_trace_collector_init(pb_trace_collector_t *collector)
+{
+    memset(collector, 0, sizeof(*collector));
+    collector->trace.hook = &collector_hook;
+    collector->trace.arg = collector;
+}
+
+bool pb_trace_collector_add(pb_trace_collector_t *collector, const char *name,
+                            const pb_field_t fields[])
+{
+    pb_trace_message_stats_t *message;
+    pb_field_iter_t iter;
+
+    if (collector->message_count >= PB_TRACE_MAX_MESSAGES)
+        return false;
+
+    message = &collector->messages[collector->message_count];
+    message->name = name;
+    message->fields = fields;
+    message->field_count = 0;
+
+    /* The iterator also handles compact field tables. It needs some
+     * structure pointer, but the field data is not accessed. */
+    if (pb_field_iter_begin(&iter, fields, collector))
+    {
+        do {
+            if (message->field_count >= PB_TRACE_MAX_FIELDS)
+                return false;
+            message->tags[message->field_count++] = iter.pos->tag;
+        } while (pb_field_iter_next(&iter));
+    }
+
+    collector->message_count++;
+    return true;
+}
+
+static void print_histogram(FILE *file, const char *label, const pb_histogram_t *histogram)
+{
+    fprintf(file, " %s mean %lu p50 %lu p99 %lu max %lu", label,
+            (unsigned long)(histogram->sum / histogram->count),
+            (unsigned long)pb_histogram_percentile(histogram, 50),
+            (unsigned long)pb_histogram_percentile(histogram, 99),
+            (unsigned long)histogram->max);
+}
+
+void pb_trace_collector_print(const pb_trace_collector_t *collector, FILE *file)
+{
+    pb_size_t i, j;
+
+    for (i = 0; i < collector->message_count; i++)
+    {
+        const pb_trace_message_stats_t *message = &collector->messages[i];
+
+        fprintf(file, "%s: %lu messages", message->name, message->time.count);
+        if (message->time.count > 0)
+        {
+            print_histogram(file, "| bytes", &message->size);
+            print_histogram(file, "| time", &message->time);
+        }
+        fprintf(file, "\n");
+
+        for (j = 0; j < message->field_count; j++)
+        {
+            const pb_trace_field_stats_t *stats = &message->field_stats[j];
+
+            if (stats->time.count == 0)
+                continue;
+
+            fprintf(file, "  field %lu: %lu samples",
+                    (unsigned long)message->tags[j], stats->time.count);
+            print_histogram(file, "| bytes", &stats->size);
+            print_histogram(file, "| time", &stats->time);
+            fprintf(file, "\n");
+        }
+    }
+
+    if (collector->other_fields > 0)
+        fprintf(file, "other fields: %lu samples\n", collector->other_fields);
+}
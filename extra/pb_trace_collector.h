@@ -0,0 +1,101 @@
+/* pb_trace_collector.h: Reference collector for the PB_ENABLE_TRACE hook.
+ * Builds histograms of the encoded size and the decoding or encoding time
+ * of each field of the registered message types. Compile pb_trace_collector.c
+ * and the nanopb core with PB_ENABLE_TRACE defined.
+ *
+ * Example usage:
+ *    static pb_trace_collector_t collector;
+ *    pb_istream_t stream = pb_istream_from_buffer(buffer, count);
+ *
+ *    pb_trace_collector_init(&collector);
+ *    pb_trace_collector_add(&collector, "MyMessage", MyMessage_fields);
+ *    stream.trace = &collector.trace;
+ *    pb_decode(&stream, MyMessage_fields, &msg);
+ *    pb_trace_collector_print(&collector, stdout);
+ */
+
+#ifndef PB_TRACE_COLLECTOR_H_INCLUDED
+#define PB_TRACE_COLLECTOR_H_INCLUDED
+
+#include <stdio.h>
+#include <pb.h>
+
+#ifndef PB_ENABLE_TRACE
+#error The trace collector requires PB_ENABLE_TRACE.
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Maximum number of message types and fields per message type */
+#ifndef PB_TRACE_MAX_MESSAGES
+#define PB_TRACE_MAX_MESSAGES 16
+#endif
+#ifndef PB_TRACE_MAX_FIELDS
+#define PB_TRACE_MAX_FIELDS 32
+#endif
+
+/* Bucket 0 counts zero values, bucket i values from 2^(i-1) to 2^i - 1.
+ * The last bucket also counts all larger values. */
+#define PB_HISTOGRAM_BUCKETS 40
+
+typedef struct {
+    unsigned long count;
+    uint64_t sum;
+    uint64_t max;
+    unsigned long buckets[PB_HISTOGRAM_BUCKETS];
+} pb_histogram_t;
+
+typedef struct {
+    pb_histogram_t time;
+    pb_histogram_t size;
+} pb_trace_field_stats_t;
+
+typedef struct {
+    const char *name;
+    const pb_field_t *fields;
+    pb_size_t field_count;
+    uint32_t tags[PB_TRACE_MAX_FIELDS];
+
+    /* Whole messages, from the non-repeated submessage fields that
+     * contain this message and from pb_trace_collector_record(). */
+    pb_histogram_t time;
+    pb_histogram_t size;
+
+    /* Indexed by the position of the field in the message, as in tags */
+    pb_trace_field_stats_t field_stats[PB_TRACE_MAX_FIELDS];
+} pb_trace_message_stats_t;
+
+typedef struct {
+    pb_trace_t trace; /* Assign &collector.trace to stream.trace */
+    pb_size_t message_count;
+    pb_trace_message_stats_t messages[PB_TRACE_MAX_MESSAGES];
+    unsigned long other_fields; /* Events for fields of unregistered messages */
+} pb_trace_collector_t;
+
+/* Clear all the collected data and registered messages. */
+void pb_trace_collector_init(pb_trace_collector_t *collector);
+
+/* Register a message type. Returns false if the collector is full or the
+ * message has more than PB_TRACE_MAX_FIELDS fields. */
+bool pb_trace_collector_add(pb_trace_collector_t *collector, const char *name,
+                            const pb_field_t fields[]);
+
+/* Add a sample of a whole message, for example the time measured with
+ * PB_TRACE_CLOCK() around a top-level pb_decode() call. */
+void pb_trace_collector_record(pb_trace_collector_t *collector, const pb_field_t fields[],
+                               size_t size, pb_trace_time_t elapsed);
+
+/* Value below which the given percentage of the samples fall, rounded up
+ * to the end of the histogram bucket. */
+uint64_t pb_histogram_percentile(const pb_histogram_t *histogram, unsigned percent);
+
+/* Write a summary of the histograms as text. */
+void pb_trace_collector_print(const pb_trace_collector_t *collector, FILE *file);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif
@@ -67,6 +67,22 @@ datatypes = {
 }
 
 # Integer size overrides (from .proto settings)
+# Alignment requirement of the C types, used for ordering struct members.
+# Sizes that depend on the platform or compile options are estimated.
+alignments = {
+    'bool': 1, 'char': 1, 'int8_t': 1, 'uint8_t': 1,
+    'int16_t': 2, 'uint16_t': 2,
+    'int32_t': 4, 'uint32_t': 4, 'float': 4,
+    'int64_t': 8, 'uint64_t': 8, 'double': 8,
+}
+pointer_alignment = 8
+size_t_alignment = 2 # pb_size_t
+
+def signed_limit_check(expr):
+    '''Return C expression that is below 2**n when expr fits in a signed n
+    bit value, for use in the pb_field_t size checks.'''
+    return '((%s) < 0 ? -2*(%s) - 1 : 2*(%s))' % (expr, expr, expr)
+
 intsizes = {
     nanopb_pb2.IS_8:     'int8_t',
     nanopb_pb2.IS_16:    'int16_t',
@@ -121,6 +137,41 @@ assert varint_max_size(0) == 1
 assert varint_max_size(127) == 1
 assert varint_max_size(128) == 2
 
+def varint_bytes(value):
+    '''Returns a non-negative value encoded as a varint, as a list of bytes.'''
+    result = []
+    while True:
+        byte = value & 0x7F
+        value >>= 7
+        if value:
+            byte |= 0x80
+        result.append(byte)
+        if not value:
+            return result
+
+assert varint_bytes(0) == [0]
+assert varint_bytes(300) == [0xac, 0x02]
+
+def encoded_tag_literal(tag, wire_type):
+    '''Returns the tag of a field encoded as a varint, in the form of a C
+    string literal, and the number of bytes in it.'''
+    encoded = varint_bytes((tag << 3) | wire_type)
+    return '"%s"' % ''.join('\\x%02x' % byte for byte in encoded), len(encoded)
+
+assert encoded_tag_literal(1, 0) == ('"\\x08"', 1)
+assert encoded_tag_literal(16, 2) == ('"\\x82\\x01"', 2)
+
+# Wire types used by the specialized encoding and decoding functions
+wiretypes = {
+    'BOOL': 'PB_WT_VARINT', 'INT32': 'PB_WT_VARINT', 'INT64': 'PB_WT_VARINT',
+    'UINT32': 'PB_WT_VARINT', 'UINT64': 'PB_WT_VARINT', 'SINT32': 'PB_WT_VARINT',
+    'SINT64': 'PB_WT_VARINT', 'ENUM': 'PB_WT_VARINT', 'UENUM': 'PB_WT_VARINT',
+    'FIXED32': 'PB_WT_32BIT', 'SFIXED32': 'PB_WT_32BIT', 'FLOAT': 'PB_WT_32BIT',
+    'FIXED64': 'PB_WT_64BIT', 'SFIXED64': 'PB_WT_64BIT', 'DOUBLE': 'PB_WT_64BIT',
+    'STRING': 'PB_WT_STRING', 'BYTES': 'PB_WT_STRING', 'MESSAGE': 'PB_WT_STRING',
+}
+wiretype_values = {'PB_WT_VARINT': 0, 'PB_WT_64BIT': 1, 'PB_WT_STRING': 2, 'PB_WT_32BIT': 5}
+
 class EncodedSize:
     '''Class used to represent the encoded size of a field or a message.
     Consists of a combination of symbolic sizes and integer sizes.'''
@@ -224,6 +275,19 @@ class FieldMaxSize:
         self.checks.extend(extend.checks)
 
 class Field:
+    # Bit number in has_fields, if the message uses a presence bitmap
+    presence_bit = None
+
+    # Bit number in dirty_fields, if the message has dirty tracking
+    dirty_bit = None
+
+    # True if the message has its members ordered by alignment
+    reordered = False
+
+    # Struct-of-arrays field, and its submessage type as set by Message.resolve_soa()
+    soa = False
+    soa_message = None
+
     def __init__(self, struct_name, desc, field_options):
         '''desc is FieldDescriptorProto'''
         self.tag = desc.number
@@ -326,6 +390,13 @@ class Field:
         else:
             raise NotImplementedError(desc.type)
 
+        self.soa = field_options.soa
+        if self.soa:
+            if self.pbtype != 'MESSAGE' or self.rules != 'REPEATED' or self.allocation != 'STATIC':
+                raise Exception("Field %s has the soa option, but it is not a static "
+                                "repeated submessage field." % self.name)
+            self.soa_ctype = self.struct_name + self.name + 't'
+
     def __lt__(self, other):
         return self.tag < other.tag
 
@@ -345,8 +416,11 @@ class Field:
                 result += '    %s *%s;' % (self.ctype, self.name)
         elif self.allocation == 'CALLBACK':
             result += '    pb_callback_t %s;' % self.name
+        elif self.soa:
+            result += '    pb_size_t ' + self.name + '_count;\n'
+            result += '    %s %s;' % (self.soa_ctype, self.name)
         else:
-            if self.rules == 'OPTIONAL' and self.allocation == 'STATIC':
+            if self.rules == 'OPTIONAL' and self.presence_bit is None:
                 result += '    bool has_' + self.name + ';\n'
             elif self.rules == 'REPEATED' and self.allocation == 'STATIC':
                 result += '    pb_size_t ' + self.name + '_count;\n'
@@ -357,10 +431,36 @@ class Field:
         '''Return definitions for any special types this field might need.'''
         if self.pbtype == 'BYTES' and self.allocation == 'STATIC':
             result = 'typedef PB_BYTES_ARRAY_T(%d) %s;\n' % (self.max_size, self.ctype)
+        elif self.soa:
+            result = 'typedef struct _%s {\n' % self.soa_ctype
+            for f in self.soa_message.ordered_fields:
+                aux = f.aux_member()
+                if aux is not None:
+                    auxtype = 'bool' if aux.startswith('has_') else 'pb_size_t'
+                    result += '    %s %s[%d];\n' % (auxtype, aux, self.max_count)
+                result += '    %s %s[%d]%s;\n' % (f.ctype, f.name, self.max_count, f.array_decl)
+            result += '} %s;\n' % self.soa_ctype
         else:
             result = ''
         return result
 
+    def soa_definition(self):
+        '''Return the column table of a struct-of-arrays field.'''
+        columns = []
+        for f in self.soa_message.ordered_fields:
+            data = 'offsetof(%s, %s)' % (self.soa_ctype, f.name)
+            aux = f.aux_member()
+            if aux is None:
+                columns.append('    {%s, 0}' % data)
+            else:
+                columns.append('    {%s, offsetof(%s, %s)}' % (data, self.soa_ctype, aux))
+
+        name = '%s_%s' % (self.struct_name, self.name)
+        result = 'static const pb_soa_column_t %s_columns[%d] = {\n' % (name, len(columns))
+        result += ',\n'.join(columns) + '\n};\n'
+        result += 'static const pb_soa_t %s_soa = {%s_fields, %s_columns};\n' % (name, self.submsgname, name)
+        return result
+
     def get_dependencies(self):
         '''Get list of type names used by this field.'''
         if self.allocation == 'STATIC':
@@ -412,12 +512,24 @@ class Field:
             return inner_init
 
         outer_init = None
-        if self.allocation == 'STATIC':
+        if self.soa:
+            columns = []
+            for f in self.soa_message.ordered_fields:
+                aux = f.aux_member()
+                if aux is not None:
+                    aux_init = 'false' if aux.startswith('has_') else '0'
+                    columns.append('{' + ', '.join([aux_init] * self.max_count) + '}')
+                entry = f.get_initializer(null_init, True)
+                if f.rules == 'REPEATED':
+                    entry = '{' + ', '.join([entry] * f.max_count) + '}'
+                columns.append('{' + ', '.join([entry] * self.max_count) + '}')
+            outer_init = '0, {' + ', '.join(columns) + '}'
+        elif self.allocation == 'STATIC':
             if self.rules == 'REPEATED':
                 outer_init = '0, {'
                 outer_init += ', '.join([inner_init] * self.max_count)
                 outer_init += '}'
-            elif self.rules == 'OPTIONAL':
+            elif self.rules == 'OPTIONAL' and self.presence_bit is None:
                 outer_init = 'false, ' + inner_init
             else:
                 outer_init = inner_init
@@ -459,7 +571,63 @@ class Field:
     def tags(self):
         '''Return the #define for the tag number of this field.'''
         identifier = '%s_%s_tag' % (self.struct_name, self.name)
-        return '#define %-40s %d\n' % (identifier, self.tag)
+        result = '#define %-40s %d\n' % (identifier, self.tag)
+        if self.presence_bit is not None:
+            identifier = '%s_%s_presence_bit' % (self.struct_name, self.name)
+            result += '#define %-40s %d\n' % (identifier, self.presence_bit)
+        if self.dirty_bit is not None:
+            identifier = '%s_%s_dirty_bit' % (self.struct_name, self.name)
+            result += '#define %-40s %d\n' % (identifier, self.dirty_bit)
+        if self.soa:
+            identifier = '%s_%s_max_count' % (self.struct_name, self.name)
+            result += '#define %-40s %d\n' % (identifier, self.max_count)
+        return result
+
+    def presence_check(self, struct):
+        '''Return C expression that tells if this optional field is present.'''
+        if self.presence_bit is None:
+            return '%s->has_%s' % (struct, self.name)
+        else:
+            return '(%s->has_fields & ((pb_presence_t)1 << %s_%s_presence_bit))' % (struct, self.struct_name, self.name)
+
+    def presence_set(self, struct):
+        '''Return C statement that marks this optional field as present.'''
+        if self.presence_bit is None:
+            return '%s->has_%s = true;' % (struct, self.name)
+        else:
+            return '%s->has_fields |= (pb_presence_t)1 << %s_%s_presence_bit;' % (struct, self.struct_name, self.name)
+
+    def setter(self):
+        '''Return the #define of a setter macro that also invalidates the
+        encode cache of the message, or None for fields that are not
+        single scalar values.'''
+        if (self.allocation != 'STATIC' or self.rules not in ('REQUIRED', 'OPTIONAL')
+            or self.pbtype in ('STRING', 'BYTES', 'MESSAGE')):
+            return None
+
+        parts = ['(msg)->%s = (value)' % self.name]
+        if self.rules == 'OPTIONAL':
+            parts.append(self.presence_set('(msg)').rstrip(';'))
+        if self.dirty_bit is not None:
+            parts.append(self.dirty_set('(msg)'))
+        parts.append('pb_invalidate_cache(&(msg)->encode_cache)')
+        identifier = '%s_set_%s(msg, value)' % (self.struct_name, self.name)
+        return '#define %-40s (%s)\n' % (identifier, ', '.join(parts))
+
+    def dirty_set(self, struct):
+        '''Return C expression that marks this field as changed.'''
+        return '%s->dirty_fields |= (pb_dirty_t)1 << %s_%s_dirty_bit' % (struct, self.struct_name, self.name)
+
+    def toucher(self):
+        '''Return the #define of a macro that marks the field as changed
+        after it has been modified in place, for fields of messages with
+        dirty tracking that have no setter.'''
+        if self.dirty_bit is None or self.setter() is not None:
+            return None
+
+        parts = [self.dirty_set('(msg)'), 'pb_invalidate_cache(&(msg)->encode_cache)']
+        identifier = '%s_touch_%s(msg)' % (self.struct_name, self.name)
+        return '#define %-40s (%s)\n' % (identifier, ', '.join(parts))
 
     def pb_field_t(self, prev_field_name):
         '''Return the pb_field_t initializer to use in the constant array.
@@ -475,15 +643,25 @@ class Field:
             result = '    PB_FIELD('
 
         result += '%3d, ' % self.tag
-        result += '%-8s, ' % self.pbtype
-        result += '%s, ' % self.rules
+        if self.soa:
+            result += '%-8s, SOA, ' % 'SOA'
+        else:
+            result += '%-8s, ' % self.pbtype
+            result += '%s, ' % (self.rules if self.presence_bit is None else 'OPTBIT')
         result += '%-8s, ' % self.allocation
-        result += '%s, ' % ("FIRST" if not prev_field_name else "OTHER")
+        if not prev_field_name:
+            result += 'FIRST, '
+        elif self.reordered:
+            result += 'ANY, '
+        else:
+            result += 'OTHER, '
         result += '%s, ' % self.struct_name
         result += '%s, ' % self.name
         result += '%s, ' % (prev_field_name or self.name)
 
-        if self.pbtype == 'MESSAGE':
+        if self.soa:
+            result += '&%s_%s_soa)' % (self.struct_name, self.name)
+        elif self.pbtype == 'MESSAGE':
             result += '&%s_fields)' % self.submsgname
         elif self.default is None:
             result += '0)'
@@ -499,12 +677,47 @@ class Field:
     def get_last_field_name(self):
         return self.name
 
+    def member_name(self):
+        '''Name of the field data member, for use in offsetof().'''
+        if self.rules == 'ONEOF' and not self.anonymous:
+            return self.union_name + '.' + self.name
+        else:
+            return self.name
+
+    def aux_member(self):
+        '''Return the name of the has_ or _count member that precedes the
+        field data in the structure, or None.'''
+        if self.rules == 'OPTIONAL' and self.allocation == 'STATIC' and self.presence_bit is None:
+            return 'has_' + self.name
+        elif self.rules == 'REPEATED' and self.allocation in ('STATIC', 'POINTER'):
+            return self.name + '_count'
+        else:
+            return None
+
+    def alignment(self, dependencies):
+        '''Estimate the alignment requirement of the field data.'''
+        if self.allocation != 'STATIC':
+            return pointer_alignment
+        elif self.pbtype == 'MESSAGE':
+            submsg = dependencies.get(str(self.submsgname))
+            if submsg is None:
+                return pointer_alignment
+            return submsg.alignment(dependencies)
+        elif self.pbtype in ('ENUM', 'UENUM'):
+            return 4
+        elif self.pbtype in ('BYTES', 'UNKNOWN'):
+            return size_t_alignment
+        else:
+            return alignments.get(str(self.ctype), pointer_alignment)
+
     def largest_field_value(self):
         '''Determine if this field needs 16bit or 32bit pb_field_t structure to compile properly.
         Returns numeric value or a C-expression for assert.'''
         check = []
         if self.pbtype == 'MESSAGE':
-            if self.rules == 'REPEATED' and self.allocation == 'STATIC':
+            if self.soa:
+                check.append('pb_membersize(%s, %s)' % (self.struct_name, self.name))
+            elif self.rules == 'REPEATED' and self.allocation == 'STATIC':
                 check.append('pb_membersize(%s, %s[0])' % (self.struct_name, self.name))
             elif self.rules == 'ONEOF':
                 if self.anonymous:
@@ -571,6 +784,203 @@ class Field:
 
         return encsize
 
+    def specialized_encoder(self, specialized):
+        '''Return C code that encodes this field directly from the struct.
+        specialized is the set of message names that have their own
+        encoding functions.'''
+        tagstr, tagsize = encoded_tag_literal(self.tag, wiretype_values[wiretypes[self.pbtype]])
+        member = 'src->%s' % self.name
+        writetag = 'pb_write(stream, (const uint8_t*)%s, %d)' % (tagstr, tagsize)
+        indent = '    '
+        result = ''
+
+        if self.rules == 'OPTIONAL':
+            result += '    if (%s)\n' % self.presence_check('src')
+            result += '    {\n'
+            indent = '        '
+
+        if self.pbtype in ['BOOL', 'UINT32', 'UINT64', 'UENUM']:
+            value = 'pb_encode_varint(stream, (uint64_t)%s)' % member
+        elif self.pbtype in ['INT32', 'INT64', 'ENUM']:
+            value = 'pb_encode_varint(stream, (uint64_t)(int64_t)%s)' % member
+        elif self.pbtype in ['SINT32', 'SINT64']:
+            value = 'pb_encode_svarint(stream, (int64_t)%s)' % member
+        elif self.pbtype in ['FIXED32', 'SFIXED32', 'FLOAT']:
+            value = 'pb_encode_fixed32(stream, &%s)' % member
+        elif self.pbtype in ['FIXED64', 'SFIXED64', 'DOUBLE']:
+            value = 'pb_encode_fixed64(stream, &%s)' % member
+        elif self.pbtype == 'BYTES':
+            result += indent + 'if (%s.size > sizeof(%s.bytes))\n' % (member, member)
+            result += indent + '    PB_RETURN_ERROR(stream, "bytes size exceeded");\n'
+            value = 'pb_encode_string(stream, %s.bytes, %s.size)' % (member, member)
+        elif self.pbtype == 'STRING':
+            block = 'size_t size = 0;\n'
+            block += 'while (size < sizeof(%s) && %s[size] != \'\\0\')\n' % (member, member)
+            block += '    size++;\n'
+            block += 'if (!%s ||\n' % writetag
+            block += '    !pb_encode_string(stream, (const uint8_t*)%s, size))\n' % member
+            block += '    return false;\n'
+            value = None
+        elif self.pbtype == 'MESSAGE' and str(self.submsgname) in specialized:
+            # The size of a static submessage does not depend on the stream,
+            # so it can be computed beforehand and written directly.
+            func = 'pb_encode_%s' % self.submsgname
+            block = 'pb_ostream_t sizestream = PB_OSTREAM_SIZING;\n'
+            block += 'if (!%s(&sizestream, &%s) ||\n' % (func, member)
+            block += '    !%s ||\n' % writetag
+            block += '    !pb_encode_varint(stream, (uint64_t)sizestream.bytes_written) ||\n'
+            block += '    !%s(stream, &%s))\n' % (func, member)
+            block += '    return false;\n'
+            value = None
+        elif self.pbtype == 'MESSAGE':
+            value = 'pb_encode_submessage(stream, %s_fields, &%s)' % (self.submsgname, member)
+        else:
+            raise NotImplementedError(self.pbtype)
+
+        if value is not None:
+            result += indent + 'if (!%s ||\n' % writetag
+            result += indent + '    !%s)\n' % value
+            result += indent + '    return false;\n'
+        elif self.rules == 'OPTIONAL':
+            # Variables can be declared directly in the if block
+            result += ''.join(indent + line + '\n' for line in block.splitlines())
+        else:
+            result += '    {\n'
+            result += ''.join('        ' + line + '\n' for line in block.splitlines())
+            result += '    }\n'
+
+        if self.rules == 'OPTIONAL':
+            result += '    }\n'
+
+        return result
+
+    def encoded_template(self, dependencies, member):
+        '''Return the encoded form of a required fixed-width field as a list
+        of bytes, with the value left as zero. Also returns a list of
+        (offset, pbtype, member) tuples that tell where the values have to
+        be stored. Submessages must have a fixed encoded size.'''
+        encoded = varint_bytes((self.tag << 3) | wiretype_values[wiretypes[self.pbtype]])
+
+        if self.pbtype == 'MESSAGE':
+            submsg = dependencies[str(self.submsgname)]
+            subencoded, substores = submsg.encoded_template(dependencies, member + '.')
+            encoded += varint_bytes(len(subencoded))
+            stores = [(offset + len(encoded), pbtype, name) for offset, pbtype, name in substores]
+            encoded += subencoded
+        else:
+            stores = [(len(encoded), self.pbtype, member)]
+            encoded += [0] * (self.enc_size if self.pbtype != 'BOOL' else 1)
+
+        return encoded, stores
+
+    def specialized_decoder(self, specialized):
+        '''Return the C code for the switch case that decodes this field
+        directly into the struct.'''
+        member = 'dest->%s' % self.name
+        indent = '                '
+        result = '            case %d: /* %s */\n' % (self.tag, self.name)
+        result += indent + 'if (wire_type != %s)\n' % wiretypes[self.pbtype]
+        result += indent + '    PB_RETURN_ERROR(stream, "wrong wire type");\n'
+
+        # Values that do not fit in the field are rejected like in
+        # pb_dec_varint(), pb_dec_uvarint() and pb_dec_svarint().
+        range_error = indent + '        PB_RETURN_ERROR(stream, "integer too large");\n'
+        if self.pbtype == 'BOOL':
+            result += indent + '{\n'
+            result += indent + '    uint64_t value;\n'
+            result += indent + '    if (!pb_decode_varint(stream, &value))\n'
+            result += indent + '        return false;\n'
+            result += indent + '    %s = (value != 0);\n' % member
+            result += indent + '}\n'
+        elif self.pbtype in ['UINT32', 'UINT64', 'UENUM']:
+            result += indent + '{\n'
+            result += indent + '    uint64_t value;\n'
+            result += indent + '    if (!pb_decode_varint(stream, &value))\n'
+            result += indent + '        return false;\n'
+            result += indent + '    %s = (%s)value;\n' % (member, self.ctype)
+            if self.ctype != 'uint64_t':
+                result += indent + '    if ((uint64_t)%s != value)\n' % member
+                result += range_error
+            result += indent + '}\n'
+        elif self.pbtype in ['INT32', 'INT64', 'ENUM']:
+            # Negative values of 32-bit fields may have been encoded as
+            # 32 bits only, see pb_dec_varint().
+            if self.ctype == 'int64_t':
+                conversion = '(int64_t)value'
+            else:
+                conversion = '(int32_t)value'
+            result += indent + '{\n'
+            result += indent + '    uint64_t value;\n'
+            result += indent + '    int64_t svalue;\n'
+            result += indent + '    if (!pb_decode_varint(stream, &value))\n'
+            result += indent + '        return false;\n'
+            result += indent + '    svalue = %s;\n' % conversion
+            result += indent + '    %s = (%s)svalue;\n' % (member, self.ctype)
+            if self.ctype not in ['int64_t', 'int32_t']:
+                result += indent + '    if ((int64_t)%s != svalue)\n' % member
+                result += range_error
+            result += indent + '}\n'
+        elif self.pbtype in ['SINT32', 'SINT64']:
+            result += indent + '{\n'
+            result += indent + '    int64_t value;\n'
+            result += indent + '    if (!pb_decode_svarint(stream, &value))\n'
+            result += indent + '        return false;\n'
+            result += indent + '    %s = (%s)value;\n' % (member, self.ctype)
+            if self.ctype != 'int64_t':
+                result += indent + '    if ((int64_t)%s != value)\n' % member
+                result += range_error
+            result += indent + '}\n'
+        elif self.pbtype in ['FIXED32', 'SFIXED32', 'FLOAT']:
+            result += indent + 'if (!pb_decode_fixed32(stream, &%s))\n' % member
+            result += indent + '    return false;\n'
+        elif self.pbtype in ['FIXED64', 'SFIXED64', 'DOUBLE']:
+            result += indent + 'if (!pb_decode_fixed64(stream, &%s))\n' % member
+            result += indent + '    return false;\n'
+        elif self.pbtype in ['STRING', 'BYTES']:
+            if self.pbtype == 'STRING':
+                data = member
+                check = 'size >= sizeof(%s)' % member
+                error = 'string overflow'
+            else:
+                data = member + '.bytes'
+                check = 'size > sizeof(%s.bytes)' % member
+                error = 'bytes overflow'
+            result += indent + '{\n'
+            result += indent + '    uint64_t size;\n'
+            result += indent + '    if (!pb_decode_varint(stream, &size))\n'
+            result += indent + '        return false;\n'
+            result += indent + '    if (%s)\n' % check
+            result += indent + '        PB_RETURN_ERROR(stream, "%s");\n' % error
+            if self.pbtype == 'STRING':
+                result += indent + '    %s[size] = \'\\0\';\n' % member
+            else:
+                result += indent + '    %s.size = (pb_size_t)size;\n' % member
+            result += indent + '    if (!pb_read(stream, (uint8_t*)%s, (size_t)size))\n' % data
+            result += indent + '        return false;\n'
+            result += indent + '}\n'
+        elif self.pbtype == 'MESSAGE':
+            if str(self.submsgname) in specialized:
+                call = 'pb_decode_noinit_%s(&substream, &%s)' % (self.submsgname, member)
+            else:
+                call = 'pb_decode_noinit(&substream, %s_fields, &%s)' % (self.submsgname, member)
+            result += indent + '{\n'
+            result += indent + '    pb_istream_t substream;\n'
+            result += indent + '    bool status;\n'
+            result += indent + '    if (!pb_make_string_substream(stream, &substream))\n'
+            result += indent + '        return false;\n'
+            result += indent + '    status = %s;\n' % call
+            result += indent + '    pb_close_string_substream(stream, &substream);\n'
+            result += indent + '    if (!status)\n'
+            result += indent + '        return false;\n'
+            result += indent + '}\n'
+        else:
+            raise NotImplementedError(self.pbtype)
+
+        if self.rules == 'OPTIONAL':
+            result += indent + self.presence_set('dest') + '\n'
+
+        return result
+
 
 class ExtensionRange(Field):
     def __init__(self, struct_name, range_start, field_options):
@@ -606,6 +1016,41 @@ class ExtensionRange(Field):
         # way the value remains useful if extensions are not used.
         return EncodedSize(0)
 
+class UnknownFields(Field):
+    def __init__(self, struct_name, tag, max_size):
+        '''Implements a special bytes array field that stores the raw data
+        of any fields that the decoder does not recognize. The encoder writes
+        them back out as is. The tag is not used for matching, but it decides
+        the position of the field in the structure.
+        '''
+        self.tag = tag
+        self.struct_name = struct_name
+        self.name = 'unknown_fields'
+        self.pbtype = 'UNKNOWN'
+        self.rules = 'RAW'
+        self.allocation = 'STATIC'
+        self.ctype = self.struct_name + self.name + 't'
+        self.array_decl = ''
+        self.default = None
+        self.max_size = max_size
+        self.max_count = None
+
+    def __str__(self):
+        return '    %s %s;' % (self.ctype, self.name)
+
+    def types(self):
+        return 'typedef PB_BYTES_ARRAY_T(%d) %s;\n' % (self.max_size, self.ctype)
+
+    def get_initializer(self, null_init, inner_init_only = False):
+        return '{0, {0}}'
+
+    def tags(self):
+        return ''
+
+    def encoded_size(self, dependencies):
+        # The stored fields are written out as is, including their tags.
+        return EncodedSize(self.max_size)
+
 class ExtensionField(Field):
     def __init__(self, struct_name, desc, field_options):
         self.fullname = struct_name + desc.name
@@ -723,6 +1168,12 @@ class OneOf(Field):
         else:
             return self.name + '.' + self.fields[-1].name
 
+    def aux_member(self):
+        return 'which_' + self.name
+
+    def alignment(self, dependencies):
+        return max([1] + [f.alignment(dependencies) for f in self.fields])
+
     def largest_field_value(self):
         largest = FieldMaxSize()
         for f in self.fields:
@@ -792,10 +1243,57 @@ class Message:
             if field_options.type != nanopb_pb2.FT_IGNORE:
                 self.fields.append(ExtensionRange(self.name, range_start, field_options))
 
+        if message_options.unknown_fields_size > 0:
+            # Place the buffer after the last regular field
+            tags = [f.tag for f in self.fields if not isinstance(f, OneOf)]
+            for oneof in self.oneofs.values():
+                tags += [f.tag for f in oneof.fields]
+            last_tag = max(tags) if tags else 1
+            self.fields.append(UnknownFields(self.name, last_tag, message_options.unknown_fields_size))
+
         self.packed = message_options.packed_struct
+        self.specialize = message_options.specialize
+        self.default_image = message_options.default_image
+        self.dirty_tracking = message_options.dirty_tracking
+        self.encode_cache = message_options.encode_cache or self.dirty_tracking
         self.ordered_fields = self.fields[:]
         self.ordered_fields.sort()
 
+        # Number the dirty bits in the order of the field array entries
+        if self.dirty_tracking:
+            entries = []
+            for field in self.ordered_fields:
+                if isinstance(field, OneOf):
+                    entries += field.fields
+                else:
+                    entries.append(field)
+            if len(entries) > 32:
+                raise Exception("Message %s has %d fields, but the dirty "
+                                "bitmap can hold only 32." % (self.name, len(entries)))
+            for i, field in enumerate(entries):
+                if not isinstance(field, (ExtensionRange, UnknownFields)):
+                    field.dirty_bit = i
+
+        # Number the presence bits in the same order as the fields
+        self.presence_bitmap = False
+        if message_options.presence_bitmap:
+            optional = [f for f in self.ordered_fields
+                        if f.rules == 'OPTIONAL' and f.allocation == 'STATIC']
+            if len(optional) > 32:
+                raise Exception("Message %s has %d optional fields, but the "
+                                "presence bitmap can hold only 32." % (self.name, len(optional)))
+            for i, field in enumerate(optional):
+                field.presence_bit = i
+            self.presence_bitmap = bool(optional)
+
+        self.reorder = message_options.reorder_for_size
+        if self.reorder:
+            for field in self.fields:
+                field.reordered = True
+                if isinstance(field, OneOf):
+                    for f in field.fields:
+                        f.reordered = True
+
     def get_dependencies(self):
         '''Get list of type names that this structure refers to.'''
         deps = []
@@ -803,6 +1301,61 @@ class Message:
             deps += f.get_dependencies()
         return deps
 
+    def alignment(self, dependencies):
+        '''Estimate the alignment requirement of the structure.'''
+        result = 4 if self.presence_bitmap else 1
+        for field in self.fields:
+            result = max(result, field.alignment(dependencies))
+            if field.aux_member() is not None:
+                result = max(result, size_t_alignment)
+        return result
+
+    def struct_members(self, dependencies = {}):
+        '''Return the members of a reordered structure in the order they
+        are declared, as (field, is_aux) tuples. The field data is sorted
+        by alignment and the has_, _count and which_ members are placed
+        after all the data.'''
+        data = [(field, False) for field in self.ordered_fields]
+        data.sort(key = lambda m: -m[0].alignment(dependencies))
+        aux = [(field, True) for field in self.ordered_fields
+               if field.aux_member() is not None]
+        aux.sort(key = lambda m: 0 if m[0].aux_member().startswith('has_') else -1)
+        return data + aux
+
+    def resolve_soa(self, dependencies):
+        '''Find the submessage types of struct-of-arrays fields, which
+        determine the columns.'''
+        for field in self.fields:
+            if not field.soa:
+                continue
+
+            submsg = dependencies.get(str(field.submsgname))
+            if submsg is None:
+                raise Exception("Field %s.%s has the soa option, but the message type %s "
+                                "is not available." % (self.name, field.name, field.submsgname))
+            if submsg.presence_bitmap:
+                raise Exception("Field %s.%s has the soa option, but %s uses a presence "
+                                "bitmap." % (self.name, field.name, submsg.name))
+            for f in submsg.fields:
+                if (isinstance(f, (OneOf, ExtensionRange, UnknownFields))
+                    or f.allocation != 'STATIC' or f.soa):
+                    raise Exception("Field %s.%s has the soa option, but %s.%s is not a "
+                                    "plain static field." % (self.name, field.name, submsg.name, f.name))
+            field.soa_message = submsg
+
+    def soa_definitions(self):
+        return ''.join([f.soa_definition() for f in self.fields if f.soa])
+
+    def set_member_order(self, dependencies):
+        '''Fix the order of the struct members, which may depend on the
+        alignment of submessages in other files.'''
+        self.members = self.struct_members(dependencies)
+
+    def get_members(self):
+        if not hasattr(self, 'members'):
+            self.members = self.struct_members()
+        return self.members
+
     def __str__(self):
         result = 'typedef struct _%s {\n' % self.name
 
@@ -811,7 +1364,29 @@ class Message:
             # Therefore add a dummy field if an empty message occurs.
             result += '    uint8_t dummy_field;'
 
-        result += '\n'.join([str(f) for f in self.ordered_fields])
+        if self.presence_bitmap:
+            # Must be the first member, the library finds it at the
+            # start of the structure.
+            result += '    pb_presence_t has_fields;\n'
+
+        if self.reorder:
+            members = []
+            for field, is_aux in self.get_members():
+                decl = str(field)
+                if field.aux_member() is not None:
+                    aux_decl, decl = decl.split('\n', 1)
+                    if is_aux:
+                        decl = aux_decl
+                members.append(decl)
+            result += '\n'.join(members)
+        else:
+            result += '\n'.join([str(f) for f in self.ordered_fields])
+
+        if self.dirty_tracking:
+            result += '\n    pb_dirty_t dirty_fields;'
+        if self.encode_cache:
+            # Not described in the field list, so it must come last.
+            result += '\n    pb_encode_cache_t encode_cache;'
         result += '\n}'
 
         if self.packed:
@@ -828,13 +1403,40 @@ class Message:
     def types(self):
         return ''.join([f.types() for f in self.fields])
 
-    def get_initializer(self, null_init):
-        if not self.ordered_fields:
-            return '{0}'
+    def setters(self):
+        '''Return the setter macros of a message with the encode_cache
+        option.'''
+        result = ''
+        for field in self.ordered_fields:
+            if isinstance(field, OneOf):
+                for f in field.fields:
+                    result += f.toucher() or ''
+            elif not isinstance(field, (ExtensionRange, UnknownFields)):
+                result += field.setter() or ''
+                result += field.toucher() or ''
+        return result
 
+    def get_initializer(self, null_init):
         parts = []
-        for field in self.ordered_fields:
-            parts.append(field.get_initializer(null_init))
+        if not self.ordered_fields:
+            parts.append('0')
+        if self.presence_bitmap:
+            parts.append('0')
+        if self.reorder:
+            for field, is_aux in self.get_members():
+                init = field.get_initializer(null_init)
+                if field.aux_member() is not None:
+                    aux_init, init = init.split(', ', 1)
+                    if is_aux:
+                        init = aux_init
+                parts.append(init)
+        else:
+            for field in self.ordered_fields:
+                parts.append(field.get_initializer(null_init))
+        if self.dirty_tracking:
+            parts.append('0')
+        if self.encode_cache:
+            parts.append('PB_ENCODE_CACHE_INIT')
         return '{' + ', '.join(parts) + '}'
 
     def default_decl(self, declaration_only = False):
@@ -864,19 +1466,171 @@ class Message:
         return count
 
     def fields_declaration(self):
-        result = 'extern const pb_field_t %s_fields[%d];' % (self.name, self.count_all_fields() + 1)
-        return result
+        count = self.count_all_fields() + 1
+        if self.can_compact():
+            size = 'PB_COMPACT_ARRAY_SIZE(%d)' % count
+        else:
+            size = str(count)
+        return 'extern const pb_field_t %s_fields[%s];' % (self.name, size)
+
+    def can_compact(self):
+        '''Returns True if all the values in the field descriptors are known
+        to fit in 8 bits, so that a pb_field_compact_t table can be used when
+        the library is compiled with wider pb_field_t. Sizes that are only
+        known to the C compiler, such as those of submessages, and the offsets
+        in reordered messages are not checked, so such messages are left out.
+        '''
+        if self.reorder or not self.fields:
+            return False
+
+        worst = 0
+        for field in self.fields:
+            if isinstance(field, OneOf):
+                members = field.fields
+            else:
+                members = [field]
+
+            for f in members:
+                largest = f.largest_field_value()
+                if largest.checks:
+                    return False
+                worst = max(worst, largest.worst)
+
+        # Bytes fields also store the length in the data area.
+        return worst + 8 < 256
+
+    def offset_limits(self):
+        '''In reordered messages, the data_offset and size_offset values are
+        not limited by the field sizes alone. Return the checks that they
+        fit in the signed range of pb_field_t.'''
+        checks = []
+        if self.reorder:
+            prev = None
+            for field in self.ordered_fields:
+                if isinstance(field, OneOf):
+                    members = field.fields
+                else:
+                    members = [field]
+
+                for f in members:
+                    member = f.member_name()
+                    if prev is None:
+                        checks.append('offsetof(%s, %s)' % (self.name, member))
+                    else:
+                        delta = '(int)offsetof(%s, %s) - (int)offsetof(%s, %s) - (int)pb_membersize(%s, %s)' % (
+                            self.name, member, self.name, prev, self.name, prev)
+                        checks.append(signed_limit_check(delta))
+
+                    aux = field.aux_member()
+                    if aux is not None:
+                        checks.append(signed_limit_check('pb_delta(%s, %s, %s)' % (self.name, aux, member)))
+
+                prev = field.get_last_field_name()
+
+        return FieldMaxSize(0, checks, str(self.name))
+
+    def has_callbacks(self, dependencies):
+        '''Returns True if the message, or any statically allocated
+        submessage in it, contains callback or extension fields. These
+        must not be overwritten when the structure is initialized.
+        The same applies to the encode cache. Also returns True if a
+        submessage type cannot be found.'''
+        if self.encode_cache:
+            return True
+
+        fields = []
+        for field in self.fields:
+            if isinstance(field, OneOf):
+                fields += field.fields
+            else:
+                fields.append(field)
+
+        for field in fields:
+            if field.allocation == 'CALLBACK' or isinstance(field, ExtensionRange):
+                return True
+            if field.allocation == 'STATIC' and field.pbtype == 'MESSAGE':
+                submsg = dependencies.get(str(field.submsgname))
+                if submsg is None or submsg.has_callbacks(dependencies):
+                    return True
+        return False
+
+    def has_default_image(self, dependencies):
+        '''Returns True if the message has the default_image option and
+        the structure can be initialized by copying it.'''
+        return self.default_image and not self.has_callbacks(dependencies)
+
+    def default_struct_definition(self, dependencies):
+        '''Return the definition of the structure with the default values,
+        shared by the default image and the specialized decoder, or None if
+        neither needs it.'''
+        if not self.has_default_image(dependencies) and not (self.specialize and self.can_specialize()):
+            return None
+
+        return 'static const %s %s_default_struct = %s_init_default;\n' % (self.name, self.name, self.name)
+
+    def default_image_definition(self, dependencies):
+        '''Return the definition of the default image used to initialize
+        the structure, or None if the fields have to be initialized one by
+        one.'''
+        if not self.has_default_image(dependencies):
+            return None
+
+        return 'static const pb_default_image_t %s_default_image = {&%s_default_struct, sizeof(%s)};\n' % (self.name, self.name, self.name)
 
-    def fields_definition(self):
-        result = 'const pb_field_t %s_fields[%d] = {\n' % (self.name, self.count_all_fields() + 1)
+    def cache_info_definition(self):
+        '''Return the definition of the pb_cache_info_t referenced from the
+        message information, or None if the message does not have an
+        encode cache.'''
+        if not self.encode_cache:
+            return None
+
+        if self.dirty_tracking:
+            dirty = 'offsetof(%s, dirty_fields)' % self.name
+        else:
+            dirty = 'PB_NO_DIRTY_FIELDS'
+
+        return 'static const pb_cache_info_t %s_cache_info = {offsetof(%s, encode_cache), %s};\n' % (self.name, self.name, dirty)
+
+    def message_info_definition(self, dependencies):
+        '''Return the definition of the pb_message_info_t referenced from
+        the terminator of the field array, or None if the message has no
+        default image, fixed size or encode cache.'''
+        has_image = (self.default_image_definition(dependencies) is not None)
+        fixed_size = self.fixed_encoded_size(dependencies)
+        if not has_image and fixed_size is None and not self.encode_cache:
+            return None
 
+        image = '&%s_default_image' % self.name if has_image else 'NULL'
+        cache_info = '&%s_cache_info' % self.name if self.encode_cache else 'NULL'
+        return 'static const pb_message_info_t %s_info = {%s, %s, %d};\n' % (
+            self.name, image, cache_info, fixed_size or 0)
+
+    def fields_definition(self, dependencies = {}):
+        entries = ''
         prev = None
         for field in self.ordered_fields:
-            result += field.pb_field_t(prev)
-            result += ',\n'
+            entries += field.pb_field_t(prev)
+            entries += ',\n'
             prev = field.get_last_field_name()
 
-        result += '    PB_LAST_FIELD\n};'
+        if self.message_info_definition(dependencies) is not None:
+            last = '    PB_LAST_FIELD_WITH_INFO(%s_info)\n' % self.name
+        else:
+            last = '    PB_LAST_FIELD\n'
+
+        count = self.count_all_fields() + 1
+        result = 'const pb_field_t %s_fields[%d] = {\n' % (self.name, count)
+        result += entries + last + '};'
+
+        if self.can_compact():
+            compact = '#ifdef PB_COMPACT_FIELDS\n'
+            compact += 'static const pb_field_compact_t %s_compact_fields[%d] = {\n' % (self.name, count)
+            compact += entries + '    PB_LAST_FIELD\n};\n\n'
+            compact += 'const pb_field_t %s_fields[2] = {\n' % self.name
+            compact += '    PB_COMPACT_TABLE(%s_compact_fields),\n' % self.name
+            compact += last + '};\n#else\n'
+            result = compact + result + '\n#endif'
+
         return result
 
     def encoded_size(self, dependencies):
@@ -892,11 +1646,290 @@ class Message:
 
         return size
 
+    def fixed_encoded_size(self, dependencies):
+        '''Return the encoded size of the message as an integer if it does
+        not depend on the data, i.e. all fields are required and have a
+        fixed-width encoding. Otherwise returns None.
+        '''
+        if not self.fields:
+            return None
+
+        for field in self.fields:
+            if isinstance(field, (OneOf, ExtensionRange, UnknownFields)):
+                return None
+            if field.rules != 'REQUIRED' or field.allocation != 'STATIC':
+                return None
+            if field.pbtype == 'MESSAGE':
+                submsg = dependencies.get(str(field.submsgname))
+                if submsg is None or submsg.fixed_encoded_size(dependencies) is None:
+                    return None
+            elif field.pbtype not in ('BOOL', 'FIXED32', 'SFIXED32', 'FLOAT',
+                                      'FIXED64', 'SFIXED64', 'DOUBLE'):
+                return None
+
+        size = self.encoded_size(dependencies)
+        if size is None or size.symbols:
+            return None
+        return size.value
+
+    def can_specialize(self):
+        '''Returns True if straight-line encoding and decoding functions can
+        be generated for this message. Other messages with the specialize
+        option get functions that call the generic pb_encode() and pb_decode().
+        '''
+        if self.count_required_fields() > 32:
+            return False
+
+        for field in self.fields:
+            if isinstance(field, (OneOf, ExtensionRange, UnknownFields)):
+                return False
+            if field.allocation != 'STATIC' or field.rules == 'REPEATED':
+                return False
+
+        return True
+
+    def encoded_template(self, dependencies, prefix):
+        '''Return the encoded form of a message that has a fixed encoded
+        size, see Field.encoded_template().'''
+        encoded = []
+        stores = []
+        for field in self.ordered_fields:
+            fencoded, fstores = field.encoded_template(dependencies, prefix + field.name)
+            stores += [(offset + len(encoded), pbtype, name) for offset, pbtype, name in fstores]
+            encoded += fencoded
+        return encoded, stores
+
+    def template_encoder(self, dependencies):
+        '''Return the body of an encoding function that copies the encoded
+        form of the message with the tags and lengths already filled in,
+        and then stores the field values in it.'''
+        encoded, stores = self.encoded_template(dependencies, 'src->')
+        size = len(encoded)
+
+        result = '    /* Encoded message with all values set to zero */\n'
+        result += '    static const uint8_t encoded[%d] = {' % size
+        for i, byte in enumerate(encoded):
+            if i % 12 == 0:
+                result += '\n        '
+            else:
+                result += ' '
+            result += '0x%02x' % byte
+            if i != size - 1:
+                result += ','
+        result += '\n    };\n'
+        result += '    uint8_t buffer[%d];\n' % size
+        result += '    \n'
+        result += '    if (stream->callback == NULL)\n'
+        result += '        return pb_write(stream, NULL, %d); /* Just sizing */\n' % size
+        result += '    \n'
+        result += '    memcpy(buffer, encoded, %d);\n' % size
+        for offset, pbtype, member in stores:
+            if pbtype == 'BOOL':
+                result += '    buffer[%d] = (uint8_t)(%s ? 1 : 0);\n' % (offset, member)
+            elif pbtype in ('FIXED32', 'SFIXED32', 'FLOAT'):
+                result += '    pb_store_fixed32(&buffer[%d], &%s);\n' % (offset, member)
+            else:
+                result += '    pb_store_fixed64(&buffer[%d], &%s);\n' % (offset, member)
+        result += '    return pb_write(stream, buffer, %d);\n' % size
+        return result
+
+    def specialized_declaration(self):
+        result = 'bool pb_encode_%s(pb_ostream_t *stream, const %s *src);\n' % (self.name, self.name)
+        result += 'bool pb_decode_%s(pb_istream_t *stream, %s *dest);\n' % (self.name, self.name)
+        result += 'bool pb_decode_noinit_%s(pb_istream_t *stream, %s *dest);\n' % (self.name, self.name)
+        return result
+
+    def specialized_definition(self, specialized, dependencies):
+        '''Return the definitions of the encoding and decoding functions.
+        specialized is the set of message names in this file that have
+        their own functions. Messages with a fixed encoded size are encoded
+        from a template.'''
+        name = self.name
+        result = 'bool pb_encode_%s(pb_ostream_t *stream, const %s *src)\n{\n' % (name, name)
+        if self.can_specialize() and self.fixed_encoded_size(dependencies) is not None:
+            result += self.template_encoder(dependencies)
+        elif self.can_specialize():
+            for field in self.ordered_fields:
+                result += field.specialized_encoder(specialized)
+            result += '    return true;\n'
+        else:
+            result += '    return pb_encode(stream, %s_fields, src);\n' % name
+        result += '}\n\n'
+
+        result += 'bool pb_decode_%s(pb_istream_t *stream, %s *dest)\n{\n' % (name, name)
+        if self.can_specialize():
+            result += '    *dest = %s_default_struct;\n' % name
+            result += '    return pb_decode_noinit_%s(stream, dest);\n' % name
+        else:
+            result += '    return pb_decode(stream, %s_fields, dest);\n' % name
+        result += '}\n\n'
+
+        result += 'bool pb_decode_noinit_%s(pb_istream_t *stream, %s *dest)\n{\n' % (name, name)
+        if not self.can_specialize():
+            result += '    return pb_decode_noinit(stream, %s_fields, dest);\n' % name
+            result += '}\n'
+            return result
+
+        required = [f for f in self.ordered_fields if f.rules == 'REQUIRED']
+        if required:
+            result += '    uint32_t fields_seen = 0;\n'
+            result += '    \n'
+        result += '    while (stream->bytes_left)\n'
+        result += '    {\n'
+        result += '        uint32_t tag;\n'
+        result += '        pb_wire_type_t wire_type;\n'
+        result += '        bool eof;\n'
+        result += '        \n'
+        result += '        if (!pb_decode_tag(stream, &wire_type, &tag, &eof))\n'
+        result += '        {\n'
+        result += '            if (eof)\n'
+        result += '                break;\n'
+        result += '            return false;\n'
+        result += '        }\n'
+        result += '        \n'
+        result += '        switch (tag)\n'
+        result += '        {\n'
+        for field in self.ordered_fields:
+            result += field.specialized_decoder(specialized)
+            if field.rules == 'REQUIRED':
+                result += '                fields_seen |= 0x%xU;\n' % (1 << required.index(field))
+            result += '                break;\n'
+            result += '            \n'
+        result += '            default:\n'
+        result += '                if (!pb_skip_field(stream, wire_type))\n'
+        result += '                    return false;\n'
+        result += '                break;\n'
+        result += '        }\n'
+        result += '    }\n'
+        result += '    \n'
+        if required:
+            result += '    if (fields_seen != 0x%xU)\n' % ((1 << len(required)) - 1)
+            result += '        PB_RETURN_ERROR(stream, "missing required field");\n'
+            result += '    \n'
+        result += '    return true;\n'
+        result += '}\n'
+        return result
+
 
 # ---------------------------------------------------------------------------
 #                    Processing of entire .proto files
 # ---------------------------------------------------------------------------
 
+class Service:
+    def __init__(self, names, desc):
+        '''desc is ServiceDescriptorProto'''
+        self.name = names + desc.name
+        self.fullname = '.'.join(self.name.parts)
+        self.method_count = len(desc.method)
+        self.methods = []
+        self.skipped = {}
+        self.valid = None
+
+        # The method ids follow the order in the .proto file, also when
+        # some of the methods are skipped.
+        for i, method in enumerate(desc.method):
+            if method.client_streaming or method.server_streaming:
+                sys.stderr.write('Warning: streaming method %s.%s is not supported, '
+                                 'skipping it.\n' % (self.name, method.name))
+                self.skipped[i + 1] = method.name
+                continue
+
+            self.methods.append((i + 1, method.name,
+                                 names_from_type_name(method.input_type),
+                                 names_from_type_name(method.output_type)))
+
+    def check_types(self, dependencies):
+        '''Check that the request and response types have been generated.'''
+        if self.valid is None:
+            self.valid = len(self.methods) > 0
+            for methodid, method, request, response in self.methods:
+                for msgname in (request, response):
+                    if self.valid and str(msgname) not in dependencies:
+                        sys.stderr.write('Warning: message %s of method %s.%s is not generated, '
+                                         'skipping service %s.\n' % (msgname, self.name, method, self.name))
+                        self.valid = False
+        return self.valid
+
+    def declarations(self):
+        '''Method ids, storage, handlers and client functions, see pb_rpc.h'''
+        result = '/* Service %s, see pb_rpc.h */\n' % self.name
+        for methodid, method, request, response in self.methods:
+            result += '#define %-40s %d\n' % ('%s_%s_methodid' % (self.name, method), methodid)
+        result += '\n'
+
+        result += 'typedef union {\n'
+        for methodid, method, request, response in self.methods:
+            result += '    %s %s;\n' % (request, method)
+        result += '} %s_request_union;\n\n' % self.name
+
+        result += 'typedef union {\n'
+        for methodid, method, request, response in self.methods:
+            result += '    %s %s;\n' % (response, method)
+        result += '} %s_response_union;\n\n' % self.name
+
+        result += 'typedef struct {\n'
+        for methodid, method, request, response in self.methods:
+            result += '    bool (*%s)(const %s *request, %s *response, void *arg);\n' % (
+                method, request, response)
+        result += '} %s_handlers_t;\n\n' % self.name
+
+        result += 'extern const pb_rpc_service_t %s_service;\n\n' % self.name
+
+        for methodid, method, request, response in self.methods:
+            prefix = '%s_%s' % (self.name, method)
+            result += 'bool %s_start(pb_rpc_client_t *client, pb_ostream_t *output, pb_rpc_call_t *call,\n' % prefix
+            result += '        const %s *request, %s *response);\n' % (request, response)
+            result += 'pb_rpc_status_t %s_call(pb_rpc_client_t *client, pb_ostream_t *output, pb_istream_t *input,\n' % prefix
+            result += '        const %s *request, %s *response);\n' % (request, response)
+        result += '\n'
+        return result
+
+    def definitions(self):
+        '''Dispatch table and client functions, see pb_rpc.h'''
+        result = ''
+        for methodid, method, request, response in self.methods:
+            result += 'static pb_rpc_status_t %s_%s_invoke(const void *handlers, const void *request,\n' % (self.name, method)
+            result += '        void *response, void *arg)\n'
+            result += '{\n'
+            result += '    const %s_handlers_t *h = (const %s_handlers_t*)handlers;\n' % (self.name, self.name)
+            result += '    if (h->%s == NULL)\n' % method
+            result += '        return PB_RPC_UNKNOWN_METHOD;\n'
+            result += '    return h->%s((const %s*)request, (%s*)response, arg) ? PB_RPC_OK : PB_RPC_FAILED;\n' % (
+                method, request, response)
+            result += '}\n\n'
+
+        # Indexed by method id - 1, with empty entries for skipped methods
+        entries = {}
+        for methodid, method, request, response in self.methods:
+            entries[methodid] = '{%d, "%s", %s_fields, sizeof(%s), %s_fields, sizeof(%s), &%s_%s_invoke}' % (
+                methodid, method, request, request, response, response, self.name, method)
+        for methodid, method in self.skipped.items():
+            entries[methodid] = '{%d, "%s", NULL, 0, NULL, 0, NULL}' % (methodid, method)
+
+        result += 'static const pb_rpc_method_t %s_methods[%d] = {\n' % (self.name, self.method_count)
+        for methodid in range(1, self.method_count + 1):
+            result += '    %s,\n' % entries[methodid]
+        result += '};\n'
+        result += 'const pb_rpc_service_t %s_service = {"%s", %d, %s_methods};\n\n' % (
+            self.name, self.fullname, self.method_count, self.name)
+
+        for methodid, method, request, response in self.methods:
+            prefix = '%s_%s' % (self.name, method)
+            result += 'bool %s_start(pb_rpc_client_t *client, pb_ostream_t *output, pb_rpc_call_t *call,\n' % prefix
+            result += '        const %s *request, %s *response)\n' % (request, response)
+            result += '{\n'
+            result += '    return pb_rpc_start(client, output, call, &%s_methods[%d], request, response);\n' % (
+                self.name, methodid - 1)
+            result += '}\n\n'
+            result += 'pb_rpc_status_t %s_call(pb_rpc_client_t *client, pb_ostream_t *output, pb_istream_t *input,\n' % prefix
+            result += '        const %s *request, %s *response)\n' % (request, response)
+            result += '{\n'
+            result += '    return pb_rpc_call(client, output, input, &%s_methods[%d], request, response);\n' % (
+                self.name, methodid - 1)
+            result += '}\n\n'
+        return result
+
+
 def iterate_messages(desc, names = Names()):
     '''Recursively find all messages. For each, yield name, DescriptorProto.'''
     if hasattr(desc, 'message_type'):
@@ -979,6 +2012,7 @@ class ProtoFile:
         self.enums = []
         self.messages = []
         self.extensions = []
+        self.services = []
 
         if self.fdesc.package:
             base_name = Names(self.fdesc.package.split('.'))
@@ -1005,6 +2039,9 @@ class ProtoFile:
             if field_options.type != nanopb_pb2.FT_IGNORE:
                 self.extensions.append(ExtensionField(names, extension, field_options))
 
+        for service in self.fdesc.service:
+            self.services.append(Service(base_name, service))
+
     def add_dependency(self, other):
         for enum in other.enums:
             self.dependencies[str(enum.names)] = enum
@@ -1055,6 +2092,15 @@ class ProtoFile:
             yield options.genformat % (noext + options.extension + '.h')
             yield '\n'
 
+        services = [s for s in self.services if s.check_types(self.dependencies)]
+        if services:
+            yield '#ifdef PB_RPC\n'
+            try:
+                yield options.libformat % ('pb_rpc.h')
+            except TypeError:
+                pass # Custom library header, assume it includes everything
+            yield '#endif\n\n'
+
         yield '#if PB_PROTO_HEADER_VERSION != 30\n'
         yield '#error Regenerate this file with the current version of nanopb generator.\n'
         yield '#endif\n'
@@ -1071,6 +2117,10 @@ class ProtoFile:
 
         if self.messages:
             yield '/* Struct definitions */\n'
+            for msg in self.messages:
+                msg.resolve_soa(self.dependencies)
+                if msg.reorder:
+                    msg.set_member_order(self.dependencies)
             for msg in sort_dependencies(self.messages):
                 yield msg.types()
                 yield str(msg) + '\n\n'
@@ -1104,11 +2154,36 @@ class ProtoFile:
                 yield extension.tags()
             yield '\n'
 
+            cached = [msg for msg in self.messages if msg.encode_cache]
+            if cached:
+                yield '/* Setters that invalidate the encode cache */\n'
+                for msg in cached:
+                    yield msg.setters()
+                yield '\n'
+
             yield '/* Struct field encoding specification for nanopb */\n'
             for msg in self.messages:
                 yield msg.fields_declaration() + '\n'
             yield '\n'
 
+            specialized = [msg for msg in self.messages if msg.specialize]
+            if specialized:
+                yield '/* Specialized encoding and decoding functions */\n'
+                for msg in specialized:
+                    yield msg.specialized_declaration()
+                yield '\n'
+
+            msgid_msgs = [msg for msg in self.messages if hasattr(msg, 'msgid')]
+            if msgid_msgs:
+                symbol = make_identifier(headername.split('.')[0])
+                yield '/* Messages with the msgid option, for pb_decode_any() and pb_encode_any() */\n'
+                yield 'typedef union {\n'
+                for msg in msgid_msgs:
+                    yield '    %s %s_msg;\n' % (msg.name, msg.name)
+                yield '} %s_msgid_union;\n' % symbol
+                yield 'extern const pb_msgid_table_t %s_msgid_table;\n' % symbol
+                yield '\n'
+
             yield '/* Maximum encoded size of messages (where known) */\n'
             for msg in self.messages:
                 msize = msg.encoded_size(self.dependencies)
@@ -1117,6 +2192,14 @@ class ProtoFile:
                     yield '#define %-40s %s\n' % (identifier, msize)
             yield '\n'
 
+            yield '/* Exact encoded size of messages that always encode to the same length */\n'
+            for msg in self.messages:
+                fixed_size = msg.fixed_encoded_size(self.dependencies)
+                if fixed_size is not None:
+                    identifier = '%s_fixed_size' % msg.name
+                    yield '#define %-40s %d\n' % (identifier, fixed_size)
+            yield '\n'
+
             yield '/* Message IDs (where set with "msgid" option) */\n'
 
             yield '#ifdef PB_MSGID\n'
@@ -1144,6 +2227,12 @@ class ProtoFile:
 
             yield '#endif\n\n'
 
+        if services:
+            yield '#ifdef PB_RPC\n'
+            for service in services:
+                yield service.declarations()
+            yield '#endif\n\n'
+
         yield '#ifdef __cplusplus\n'
         yield '} /* extern "C" */\n'
         yield '#endif\n'
@@ -1151,6 +2240,36 @@ class ProtoFile:
         # End of header
         yield '\n#endif\n'
 
+    def msgid_table_definition(self, headername, msgid_msgs):
+        '''Generate the table of the messages that have the msgid option,
+        indexed by msgid - first, for pb_decode_any().'''
+        symbol = make_identifier(headername.split('.')[0])
+        by_id = {}
+        for msg in msgid_msgs:
+            if msg.msgid in by_id:
+                raise Exception("Messages %s and %s have the same msgid %d" %
+                                (by_id[msg.msgid].name, msg.name, msg.msgid))
+            by_id[msg.msgid] = msg
+
+        first = min(by_id)
+        count = max(by_id) - first + 1
+        if count > 64 and count > 8 * len(by_id):
+            sys.stderr.write('Warning: the msgids of %s are sparse, the dispatch table '
+                             'has %d entries for %d messages.\n' % (headername, count, len(by_id)))
+
+        result = '/* Message types by msgid, see pb_decode_any() */\n'
+        result += 'static const pb_msgid_entry_t %s_msgid_entries[%d] = {\n' % (symbol, count)
+        for msgid in range(first, first + count):
+            if msgid in by_id:
+                name = by_id[msgid].name
+                result += '    {%s_fields, sizeof(%s)}, /* %d */\n' % (name, name, msgid)
+            else:
+                result += '    {NULL, 0}, /* %d */\n' % msgid
+        result += '};\n'
+        result += 'const pb_msgid_table_t %s_msgid_table = {%d, %d, %s_msgid_entries};\n\n' % (
+            symbol, first, count, symbol)
+        return result
+
     def generate_source(self, headername, options):
         '''Generate content for a source file.'''
 
@@ -1167,17 +2286,67 @@ class ProtoFile:
         yield '#endif\n'
         yield '\n'
 
+        if any(f.soa for msg in self.messages for f in msg.fields):
+            yield '#ifndef PB_ENABLE_SOA\n'
+            yield '#error Fields with the soa option require PB_ENABLE_SOA to be defined.\n'
+            yield '#endif\n'
+            yield '\n'
+
+        if any(isinstance(f, UnknownFields) for msg in self.messages for f in msg.fields):
+            yield '#ifndef PB_ENABLE_UNKNOWN_FIELDS\n'
+            yield '#error The unknown_fields_size option requires PB_ENABLE_UNKNOWN_FIELDS to be defined.\n'
+            yield '#endif\n'
+            yield '\n'
+
         for msg in self.messages:
             yield msg.default_decl(False)
 
         yield '\n\n'
 
         for msg in self.messages:
-            yield msg.fields_definition() + '\n\n'
+            msg.resolve_soa(self.dependencies)
+            yield msg.soa_definitions()
+            default_struct = msg.default_struct_definition(self.dependencies)
+            if default_struct is not None:
+                yield default_struct
+            image = msg.default_image_definition(self.dependencies)
+            if image is not None:
+                yield image
+            cache_info = msg.cache_info_definition()
+            if cache_info is not None:
+                yield cache_info
+            message_info = msg.message_info_definition(self.dependencies)
+            if message_info is not None:
+                yield message_info
+            yield msg.fields_definition(self.dependencies) + '\n\n'
 
         for ext in self.extensions:
             yield ext.extension_def() + '\n'
 
+        msgid_msgs = [msg for msg in self.messages if hasattr(msg, 'msgid')]
+        if msgid_msgs:
+            yield self.msgid_table_definition(headername, msgid_msgs)
+
+        services = [s for s in self.services if s.check_types(self.dependencies)]
+        if services:
+            yield '#ifdef PB_RPC\n'
+            for service in services:
+                yield service.definitions()
+            yield '#endif\n\n'
+
+        specialized = [msg for msg in self.messages if msg.specialize]
+        if specialized:
+            yield '\n'
+            try:
+                yield options.libformat % ('pb_encode.h')
+                yield options.libformat % ('pb_decode.h')
+            except TypeError:
+                pass # Custom library header, assume it includes everything
+            yield '\n'
+            names = set(str(msg.name) for msg in specialized)
+            for msg in specialized:
+                yield msg.specialized_definition(names, self.dependencies) + '\n'
+
         # Add checks for numeric limits
         if self.messages:
             largest_msg = max(self.messages, key = lambda m: m.count_required_fields())
@@ -1195,6 +2364,7 @@ class ProtoFile:
             checks_msgnames.append(msg.name)
             for field in msg.fields:
                 max_field.extend(field.largest_field_value())
+            max_field.extend(msg.offset_limits())
 
         worst = max_field.worst
         worst_field = max_field.worst_field
@@ -13,6 +13,13 @@
 /* Enable support for dynamically allocated fields */
 /* #define PB_ENABLE_MALLOC 1 */
 
+/* Enable support for fields generated with the soa option. */
+/* #define PB_ENABLE_SOA 1 */
+
+/* Enable storing unknown fields in messages generated with the
+ * unknown_fields_size option. */
+/* #define PB_ENABLE_UNKNOWN_FIELDS 1 */
+
 /* Define this if your CPU architecture is big endian, i.e. it
  * stores the most-significant byte first. */
 /* #define __BIG_ENDIAN__ 1 */
@@ -37,6 +44,13 @@
 /* Disable support for custom streams (support only memory buffers). */
 /* #define PB_BUFFER_ONLY 1 */
 
+/* Count the work done by each stream, see pb_stats_t. */
+/* #define PB_ENABLE_STATS 1 */
+
+/* Call a hook around each field that is decoded or encoded, see
+ * pb_trace_t. Also enables PB_ENABLE_STATS. */
+/* #define PB_ENABLE_TRACE 1 */
+
 /* Switch back to the old-style callback function signature.
  * This was the default until nanopb-0.2.1. */
 /* #define PB_OLD_CALLBACK_STYLE */
@@ -174,8 +188,19 @@ typedef uint8_t pb_type_t;
  * The field contains a pointer to pb_extension_t */
 #define PB_LTYPE_EXTENSION 0x08
 
+/* Unknown fields pseudo-field
+ * The field is a PB_BYTES_ARRAY_T that stores the raw wire format of
+ * any fields the decoder did not recognize, so that they can be
+ * written back out by the encoder. */
+#define PB_LTYPE_UNKNOWN 0x09
+
+/* Repeated submessage stored as a structure of arrays
+ * Each field of the submessage type has an array of its own, as
+ * generated with the soa option. The ptr points to a pb_soa_t. */
+#define PB_LTYPE_SUBMSG_SOA 0x0A
+
 /* Number of declared LTYPES */
-#define PB_LTYPES_COUNT 9
+#define PB_LTYPES_COUNT 11
 #define PB_LTYPE_MASK 0x0F
 
 /**** Field repetition rules ****/
@@ -227,7 +252,7 @@ typedef struct pb_field_s pb_field_t;
 struct pb_field_s {
     pb_size_t tag;
     pb_type_t type;
-    pb_size_t data_offset; /* Offset of field data, relative to previous field. */
+    pb_size_t data_offset; /* Offset of field data, relative to previous field. Signed. */
     pb_ssize_t size_offset; /* Offset of array size or has-boolean, relative to data */
     pb_size_t data_size; /* Data size in bytes for a single item */
     pb_size_t array_size; /* Maximum number of entries in array */
@@ -239,6 +264,34 @@ struct pb_field_s {
 } pb_packed;
 PB_PACKED_STRUCT_END
 
+/* When pb_field_t is wider than 8 bits, the generator also emits the field
+ * array of each message whose descriptor values all fit in 8 bits as a
+ * table of pb_field_compact_t. The pb_field_t array of such a message then
+ * contains a single PB_COMPACT_TABLE() entry pointing to the compact table,
+ * followed by the terminator. The field iterator expands the compact
+ * entries one at a time, but code that walks the pb_field_t array directly
+ * or expects iter->pos to point into it does not work with such messages.
+ * Therefore the compact tables are only used when PB_ENABLE_COMPACT_FIELDS
+ * is defined. There is no per-table choice of width: a message uses either
+ * the 8-bit table or the normal pb_field_t table of the build.
+ */
+#if (defined(PB_FIELD_16BIT) || defined(PB_FIELD_32BIT)) && defined(PB_ENABLE_COMPACT_FIELDS)
+#define PB_COMPACT_FIELDS 1
+
+PB_PACKED_STRUCT_START
+typedef struct pb_field_compact_s pb_field_compact_t;
+struct pb_field_compact_s {
+    uint8_t tag;
+    pb_type_t type;
+    uint8_t data_offset;
+    int8_t size_offset;
+    uint8_t data_size;
+    uint8_t array_size;
+    const void *ptr;
+} pb_packed;
+PB_PACKED_STRUCT_END
+#endif
+
 /* Make sure that the standard integer types are of the expected sizes.
  * All kinds of things may break otherwise.. atleast all fixed* types.
  *
@@ -364,6 +417,181 @@ struct pb_extension_s {
     bool found;
 };
 
+/* Table of extensions sorted by tag number, for messages that have many
+ * extensions registered. Instead of walking a linked list for every
+ * unknown field, the decoder looks the tag up in the table: by indexing
+ * with tag - first_tag when the tags are consecutive, and otherwise with
+ * a binary search. Use pb_extension_registry_init() to set it up, and
+ * then point the extensions field of the message to &registry.node.
+ */
+typedef struct pb_extension_registry_s pb_extension_registry_t;
+struct pb_extension_registry_s {
+    /* List node that marks the registry. The next pointer can be used
+     * to chain further extensions with custom handlers after the table. */
+    pb_extension_t node;
+    
+    /* Array of extensions, sorted by pb_extension_registry_init().
+     * The next pointers of the entries are not used. */
+    pb_extension_t **entries;
+    pb_size_t count;
+    
+    /* Smallest and largest registered tag. Tags outside of the range
+     * are rejected without looking at the entries. */
+    uint32_t first_tag;
+    uint32_t last_tag;
+};
+
+/* Table of the message types that have the msgid option, indexed by
+ * msgid - first. The generator creates one for each .proto file, along
+ * with a union of the message structures. Ids in the range that are not
+ * used have NULL fields. See pb_decode_any() in pb_decode.h.
+ */
+typedef struct pb_msgid_entry_s pb_msgid_entry_t;
+struct pb_msgid_entry_s {
+    const pb_field_t *fields;
+    size_t size; /* sizeof() the message structure */
+};
+
+typedef struct pb_msgid_table_s pb_msgid_table_t;
+struct pb_msgid_table_s {
+    uint32_t first;
+    uint32_t count;
+    const pb_msgid_entry_t *entries;
+};
+
+/* Cache for the encoded form of a message. Messages generated with the
+ * encode_cache option have one as the last member of the structure.
+ * The user provides the buffer, or leaves it NULL to cache only the
+ * encoded size. See pb_encode_cached() in pb_encode.h.
+ */
+typedef struct pb_encode_cache_s pb_encode_cache_t;
+struct pb_encode_cache_s {
+    uint8_t *buffer;
+    size_t max_size;
+    
+    /* Encoded size of the message, and the contents of buffer if it
+     * is not NULL. Only meaningful when valid is true. */
+    size_t size;
+    bool valid;
+};
+
+#define PB_ENCODE_CACHE_INIT {NULL, 0, 0, false}
+
+/* Mark the cached encoding out of date. The generated setters do this,
+ * other changes to the structure must be followed by a call to this. */
+#define pb_invalidate_cache(cache) ((void)((cache)->valid = false))
+
+/* Messages generated with the dirty_tracking option have a bitmap with a
+ * bit for each entry of the field array, set by the generated setters.
+ * The location of the bitmap and of the encode cache is described by a
+ * pb_cache_info_t referenced from the pb_message_info_t of the message.
+ * Messages with only the encode_cache option have PB_NO_DIRTY_FIELDS as
+ * the dirty_offset. See pb_encode_incremental() in pb_encode.h. */
+typedef uint32_t pb_dirty_t;
+typedef struct pb_cache_info_s pb_cache_info_t;
+struct pb_cache_info_s {
+    size_t cache_offset;
+    size_t dirty_offset;
+};
+#define PB_NO_DIRTY_FIELDS ((size_t)-1)
+
+/* Messages generated with the presence_bitmap option store the presence
+ * of their optional static fields as bits of a uint32_t word, which is
+ * always the first member of the structure. */
+typedef uint32_t pb_presence_t;
+#define PB_HAS_PRESENCE_BIT(field) (PB_HTYPE((field)->type) == PB_HTYPE_OPTIONAL && \
+                                    (field)->array_size != 0)
+#define PB_PRESENCE_MASK(field) ((pb_presence_t)1 << ((field)->array_size - 1))
+
+/* Initial contents of a message structure, with all fields set to their
+ * default values. For messages with the default_image option, the generator
+ * references this from the pb_message_info_t of the message, so that the
+ * decoder can initialize the structure with a single memcpy(). It is not
+ * generated for messages that contain callback or extension fields, as
+ * those must not be overwritten. */
+typedef struct pb_default_image_s pb_default_image_t;
+struct pb_default_image_s {
+    const void *data;
+    size_t size;
+};
+
+/* Information about a message type as a whole. The generator places a
+ * pointer to this in the terminator of the field array, see
+ * PB_LAST_FIELD_WITH_INFO(), and pb_compile_plan() copies it to the plan,
+ * so that the plan functions find it without walking through the fields.
+ * Field arrays that end with PB_LAST_FIELD, such as hand-written ones,
+ * have no information. */
+typedef struct pb_message_info_s pb_message_info_t;
+struct pb_message_info_s {
+    const pb_default_image_t *default_image; /* NULL if the fields are initialized one by one */
+    const pb_cache_info_t *cache_info;       /* NULL if the message has no encode cache */
+    size_t fixed_size; /* Encoded size if it does not depend on the data, otherwise 0 */
+};
+
+/* Location of the arrays that store one field of the submessage type in
+ * a struct-of-arrays field. The offsets are from the start of the column
+ * structure. The size_offset locates the array of has_ or _count members,
+ * and is not used for required fields. */
+typedef struct pb_soa_column_s pb_soa_column_t;
+struct pb_soa_column_s {
+    size_t data_offset;
+    size_t size_offset;
+};
+
+/* Layout of a PB_LTYPE_SUBMSG_SOA field, generated with the soa option.
+ * Encoding and decoding these fields requires PB_ENABLE_SOA. */
+typedef struct pb_soa_s pb_soa_t;
+struct pb_soa_s {
+    const pb_field_t *fields;        /* Fields of the submessage type */
+    const pb_soa_column_t *columns;  /* One entry per field, in the same order */
+};
+
+/* Precomputed information about a single field, filled in by
+ * pb_compile_plan(). The tag is stored in its encoded form, with the
+ * wire type that the encoder uses for the field. */
+typedef struct pb_plan_field_s pb_plan_field_t;
+struct pb_plan_field_s {
+    const pb_field_t *field;
+#ifdef PB_COMPACT_FIELDS
+    pb_field_t expanded;       /* Storage for field, if it is from a compact table */
+#endif
+    size_t data_offset;        /* Offset of the field from the start of the structure */
+    pb_size_t required_index;  /* Index among the required fields */
+    uint8_t tag_size;
+    uint8_t tag_bytes[5];
+};
+
+/* Field information of a message type in a form that can be accessed
+ * without walking the pb_field_t array. The same plan can be used for
+ * any number of messages of the type, with pb_encode_with_plan() and
+ * pb_decode_with_plan(). */
+typedef struct pb_plan_s pb_plan_t;
+struct pb_plan_s {
+    const pb_field_t *fields;
+    pb_plan_field_t *entries;
+    pb_size_t field_count;
+    pb_size_t required_count;
+    
+    /* Index of the extension and unknown fields placeholders,
+     * or field_count if the message has none. */
+    pb_size_t extension_index;
+    pb_size_t unknown_index;
+    
+    /* Information from the end of the field array, or NULL. */
+    const pb_message_info_t *info;
+    
+    uint8_t flags; /* PB_PLAN_HAS_xxx */
+};
+
+#define PB_PLAN_HAS_POINTERS    0x01
+#define PB_PLAN_HAS_CALLBACKS   0x02
+#define PB_PLAN_HAS_EXTENSIONS  0x04
+#define PB_PLAN_HAS_UNKNOWN     0x08
+
+/* All fields are optional with a presence bit, and the bit numbers follow
+ * the order of the entries. */
+#define PB_PLAN_PRESENCE_ONLY   0x10
+
 /* Memory allocation functions to use. You can define pb_realloc and
  * pb_free to custom functions if you want. */
 #ifdef PB_ENABLE_MALLOC
@@ -387,12 +615,32 @@ struct pb_extension_s {
 #define pb_delta(st, m1, m2) ((int)offsetof(st, m1) - (int)offsetof(st, m2))
 /* Marks the end of the field list */
 #define PB_LAST_FIELD {0,(pb_type_t) 0,0,0,0,0,0}
+/* End of the field list, with a pointer to a pb_message_info_t. It uses
+ * a type value that cannot occur in normal field definitions. */
+#define PB_LTYPE_MESSAGE_INFO 0x0D
+#define PB_LAST_FIELD_WITH_INFO(info) {0,(pb_type_t) PB_LTYPE_MESSAGE_INFO,0,0,0,0,&info}
+/* Entry that refers to a pb_field_compact_t table. It uses a type value
+ * that cannot occur in normal field definitions. */
+#define PB_LTYPE_COMPACT_TABLE 0x0F
+#define PB_COMPACT_TABLE(table) {1,(pb_type_t) PB_LTYPE_COMPACT_TABLE,0,0,0,0,table}
+/* Number of entries in the pb_field_t array of a message that has a
+ * compact table, n being the number of entries without it. */
+#ifdef PB_COMPACT_FIELDS
+#define PB_COMPACT_ARRAY_SIZE(n) 2
+#else
+#define PB_COMPACT_ARRAY_SIZE(n) (n)
+#endif
 
 /* Macros for filling in the data_offset field */
 /* data_offset for first field in a message */
 #define PB_DATAOFFSET_FIRST(st, m1, m2) (offsetof(st, m1))
 /* data_offset for subsequent fields */
 #define PB_DATAOFFSET_OTHER(st, m1, m2) (offsetof(st, m1) - offsetof(st, m2) - pb_membersize(st, m2))
+/* data_offset for fields that may be located before the previous field,
+ * as generated with the reorder_for_size option. The iterator treats
+ * data_offset as a signed value, so a negative delta is stored in two's
+ * complement form. */
+#define PB_DATAOFFSET_ANY(st, m1, m2) ((pb_size_t)(pb_ssize_t)((int)offsetof(st, m1) - (int)offsetof(st, m2) - (int)pb_membersize(st, m2)))
 /* Choose first/other based on m1 == m2 (deprecated, remains for backwards compatibility) */
 #define PB_DATAOFFSET_CHOOSE(st, m1, m2) (int)(offsetof(st, m1) == offsetof(st, m2) \
                                   ? PB_DATAOFFSET_FIRST(st, m1, m2) \
@@ -413,6 +661,14 @@ struct pb_extension_s {
     pb_delta(st, has_ ## m, m), \
     pb_membersize(st, m), 0, ptr}
 
+/* With the presence_bitmap option, optional fields have no has_ variable.
+ * Instead array_size stores the number of the field's bit in has_fields,
+ * plus one. The bit numbers are defined by the generator. */
+#define PB_OPTBIT_STATIC(tag, st, m, fd, ltype, ptr) \
+    {tag, PB_ATYPE_STATIC | PB_HTYPE_OPTIONAL | ltype, \
+    fd, 0, pb_membersize(st, m), \
+    st ## _ ## m ## _presence_bit + 1, ptr}
+
 /* Repeated fields have a _count field and also the maximum number of entries. */
 #define PB_REPEATED_STATIC(tag, st, m, fd, ltype, ptr) \
     {tag, PB_ATYPE_STATIC | PB_HTYPE_REPEATED | ltype, \
@@ -421,6 +677,15 @@ struct pb_extension_s {
     pb_membersize(st, m[0]), \
     pb_arraysize(st, m), ptr}
 
+/* Struct-of-arrays fields have a _count field and a structure with the
+ * columns. The maximum number of entries comes from a generated #define. */
+#define PB_SOA_STATIC(tag, st, m, fd, ltype, ptr) \
+    {tag, PB_ATYPE_STATIC | PB_HTYPE_REPEATED | ltype, \
+    fd, \
+    pb_delta(st, m ## _count, m), \
+    pb_membersize(st, m), \
+    st ## _ ## m ## _max_count, ptr}
+
 /* Allocated fields carry the size of the actual data, not the pointer */
 #define PB_REQUIRED_POINTER(tag, st, m, fd, ltype, ptr) \
     {tag, PB_ATYPE_POINTER | PB_HTYPE_REQUIRED | ltype, \
@@ -463,6 +728,12 @@ struct pb_extension_s {
 #define PB_OPTEXT_CALLBACK(tag, st, m, fd, ltype, ptr) \
     PB_OPTIONAL_CALLBACK(tag, st, m, fd, ltype, ptr)
 
+/* The unknown fields buffer has neither has_ field nor count, the size
+ * is stored inside the bytes array itself. */
+#define PB_RAW_STATIC(tag, st, m, fd, ltype, ptr) \
+    {tag, PB_ATYPE_STATIC | PB_HTYPE_OPTIONAL | ltype, \
+    fd, 0, pb_membersize(st, m), 0, ptr}
+
 /* The mapping from protobuf types to LTYPEs is done using these macros. */
 #define PB_LTYPE_MAP_BOOL       PB_LTYPE_VARINT
 #define PB_LTYPE_MAP_BYTES      PB_LTYPE_BYTES
@@ -483,16 +754,20 @@ struct pb_extension_s {
 #define PB_LTYPE_MAP_UINT32     PB_LTYPE_UVARINT
 #define PB_LTYPE_MAP_UINT64     PB_LTYPE_UVARINT
 #define PB_LTYPE_MAP_EXTENSION  PB_LTYPE_EXTENSION
+#define PB_LTYPE_MAP_UNKNOWN    PB_LTYPE_UNKNOWN
+#define PB_LTYPE_MAP_SOA        PB_LTYPE_SUBMSG_SOA
 
 /* This is the actual macro used in field descriptions.
  * It takes these arguments:
  * - Field tag number
  * - Field type:   BOOL, BYTES, DOUBLE, ENUM, UENUM, FIXED32, FIXED64,
  *                 FLOAT, INT32, INT64, MESSAGE, SFIXED32, SFIXED64
- *                 SINT32, SINT64, STRING, UINT32, UINT64 or EXTENSION
- * - Field rules:  REQUIRED, OPTIONAL or REPEATED
+ *                 SINT32, SINT64, STRING, UINT32, UINT64, EXTENSION
+ *                 UNKNOWN or SOA
+ * - Field rules:  REQUIRED, OPTIONAL, OPTBIT, REPEATED, OPTEXT, RAW or SOA
  * - Allocation:   STATIC or CALLBACK
- * - Placement: FIRST or OTHER, depending on if this is the first field in structure.
+ * - Placement: FIRST or OTHER, depending on if this is the first field in structure,
+ *              or ANY if the field may come before the previous field.
  * - Message name
  * - Field name
  * - Previous field name (or field name again for first field)
@@ -537,6 +812,91 @@ struct pb_extension_s {
         PB_DATAOFFSET_ ## placement(message, field, prevfield), \
         PB_LTYPE_MAP_ ## type, ptr)
 
+#if defined(PB_ENABLE_TRACE) && !defined(PB_ENABLE_STATS)
+#define PB_ENABLE_STATS 1
+#endif
+
+#ifdef PB_ENABLE_STATS
+/* Counters of the work done by a stream, available in stream->stats
+ * when PB_ENABLE_STATS is defined. The counters are cumulative over all
+ * the messages read from or written to the stream. The work done in
+ * substreams, including the size calculation pass for submessages, is
+ * added to the stream that the substream was created from.
+ */
+typedef struct pb_stats_s pb_stats_t;
+struct pb_stats_s {
+    size_t bytes;           /* Bytes read from or written to the stream */
+    size_t callbacks;       /* Calls to a custom stream callback */
+    size_t fields;          /* Fields decoded or encoded */
+    size_t skipped_fields;  /* Fields skipped by pb_skip_field() */
+    size_t substreams;      /* Substreams created */
+    size_t allocs;          /* New allocations for pointer fields */
+    size_t reallocs;        /* Reallocations to grow pointer fields */
+    size_t bytes_allocated; /* Total size passed to pb_realloc() */
+    size_t depth;           /* Current submessage nesting depth */
+    size_t max_depth;       /* Maximum submessage nesting depth */
+};
+
+/* Used internally to update the counters. A substream starts with the
+ * counters of its parent, which takes them back when the substream is
+ * closed. PB_STATS_NEST() marks the substream of a submessage. */
+#define PB_STATS_ADD(stream, counter, value) ((stream)->stats.counter += (size_t)(value))
+#ifdef PB_ENABLE_TRACE
+#define PB_STATS_OPEN(stream, substream) ((substream)->stats = (stream)->stats, \
+    (substream)->stats.substreams++, (substream)->trace = (stream)->trace)
+#else
+#define PB_STATS_OPEN(stream, substream) \
+    ((substream)->stats = (stream)->stats, (substream)->stats.substreams++)
+#endif
+#define PB_STATS_CLOSE(stream, substream) \
+    ((substream)->stats.depth = (stream)->stats.depth, (stream)->stats = (substream)->stats)
+#define PB_STATS_NEST(substream) ((substream)->stats.depth++, \
+    (substream)->stats.max_depth += (size_t)((substream)->stats.depth > (substream)->stats.max_depth))
+#else
+#define PB_STATS_ADD(stream, counter, value) ((void)0)
+#define PB_STATS_OPEN(stream, substream) ((void)0)
+#define PB_STATS_CLOSE(stream, substream) ((void)0)
+#define PB_STATS_NEST(substream) ((void)0)
+#endif
+
+#ifdef PB_ENABLE_TRACE
+/* Source of the elapsed time in pb_trace_event_t. The default is the
+ * time stamp counter on x86, other platforms must define it. */
+#ifndef PB_TRACE_CLOCK
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define PB_TRACE_CLOCK() ((pb_trace_time_t)__builtin_ia32_rdtsc())
+#else
+#error Define PB_TRACE_CLOCK() to return a cycle count or other time stamp.
+#endif
+#endif
+
+typedef uint64_t pb_trace_time_t;
+
+/* Information about one field, passed to the hook in pb_trace_t after the
+ * field has been decoded or encoded. When encoding, one event covers all
+ * the entries of an array, and fields that produced no output are not
+ * reported. The time of a submessage field includes its own fields.
+ * The field descriptor may be a temporary copy, for example when the
+ * message uses a compact table, so identify the field by fields and tag. */
+typedef struct pb_trace_event_s pb_trace_event_t;
+struct pb_trace_event_s {
+    const pb_field_t *field;  /* Field descriptor, valid only during the hook */
+    const pb_field_t *fields; /* Fields array of the message, or the descriptor of an extension */
+    uint32_t tag;             /* Field number */
+    size_t offset;            /* Offset of the first tag from the start of the stream */
+    size_t size;              /* Encoded size including the tags */
+    pb_trace_time_t elapsed;  /* Difference of PB_TRACE_CLOCK() around the field */
+};
+
+/* Set stream->trace to point to this structure to enable the tracing.
+ * NULL disables it, which is the default. */
+typedef struct pb_trace_s pb_trace_t;
+struct pb_trace_s {
+    void (*hook)(const pb_trace_event_t *event, void *arg);
+    void *arg;
+};
+#endif
+
 /* These macros are used for giving out error messages.
  * They are mostly a debugging aid; the main error information
  * is the true/false return value from functions.
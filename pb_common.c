@@ -5,10 +5,47 @@
 
 #include "pb_common.h"
 
+#ifdef PB_COMPACT_FIELDS
+/* Fill in iter->expanded from the current compact table entry. */
+static void expand_compact_field(pb_field_iter_t *iter)
+{
+    const pb_field_compact_t *entry = iter->compact;
+    iter->expanded.tag = entry->tag;
+    iter->expanded.type = entry->type;
+    iter->expanded.data_offset = entry->data_offset;
+    iter->expanded.size_offset = entry->size_offset;
+    iter->expanded.data_size = entry->data_size;
+    iter->expanded.array_size = entry->array_size;
+    iter->expanded.ptr = entry->ptr;
+    iter->pos = &iter->expanded;
+}
+#endif
+
+const pb_message_info_t *pb_get_message_info(const pb_field_t fields[])
+{
+    /* The terminator is not at fields[count] if the message has a compact table */
+    const pb_field_t *last = fields;
+    while (last->tag != 0)
+        last++;
+    
+    if (last->type != PB_LTYPE_MESSAGE_INFO)
+        return NULL;
+    
+    return (const pb_message_info_t*)last->ptr;
+}
+
 bool pb_field_iter_begin(pb_field_iter_t *iter, const pb_field_t *fields, void *dest_struct)
 {
     iter->start = fields;
     iter->pos = fields;
+#ifdef PB_COMPACT_FIELDS
+    iter->compact = NULL;
+    if (fields->tag != 0 && fields->type == PB_LTYPE_COMPACT_TABLE)
+    {
+        iter->compact = (const pb_field_compact_t*)fields->ptr;
+        expand_compact_field(iter);
+    }
+#endif
     iter->required_field_index = 0;
     iter->dest_struct = dest_struct;
     iter->pData = (char*)dest_struct + iter->pos->data_offset;
@@ -20,6 +57,9 @@ bool pb_field_iter_begin(pb_field_iter_t *iter, const pb_field_t *fields, void *
 bool pb_field_iter_next(pb_field_iter_t *iter)
 {
     const pb_field_t *prev_field = iter->pos;
+#ifdef PB_COMPACT_FIELDS
+    pb_field_t prev_expanded;
+#endif
 
     if (prev_field->tag == 0)
     {
@@ -28,7 +68,20 @@ bool pb_field_iter_next(pb_field_iter_t *iter)
         return false;
     }
     
-    iter->pos++;
+#ifdef PB_COMPACT_FIELDS
+    if (iter->compact)
+    {
+        /* The expanded entry is reused for the next field */
+        prev_expanded = iter->expanded;
+        prev_field = &prev_expanded;
+        iter->compact++;
+        expand_compact_field(iter);
+    }
+    else
+#endif
+    {
+        iter->pos++;
+    }
     
     if (iter->pos->tag == 0)
     {
@@ -46,14 +99,16 @@ bool pb_field_iter_next(pb_field_iter_t *iter)
         {
             /* Don't advance pointers inside unions */
             prev_size = 0;
-            iter->pData = (char*)iter->pData - prev_field->data_offset;
+            iter->pData = (char*)iter->pData - (pb_ssize_t)prev_field->data_offset;
         }
         else if (PB_ATYPE(prev_field->type) == PB_ATYPE_STATIC &&
                  PB_HTYPE(prev_field->type) == PB_HTYPE_REPEATED)
         {
             /* In static arrays, the data_size tells the size of a single entry and
-             * array_size is the number of entries */
-            prev_size *= prev_field->array_size;
+             * array_size is the number of entries. Struct-of-arrays fields
+             * store the size of the whole column structure. */
+            if (PB_LTYPE(prev_field->type) != PB_LTYPE_SUBMSG_SOA)
+                prev_size *= prev_field->array_size;
         }
         else if (PB_ATYPE(prev_field->type) == PB_ATYPE_POINTER)
         {
@@ -69,29 +124,304 @@ bool pb_field_iter_next(pb_field_iter_t *iter)
             iter->required_field_index++;
         }
     
-        iter->pData = (char*)iter->pData + prev_size + iter->pos->data_offset;
+        /* The offset is negative if the fields are not in the same order
+         * in the structure as in the field array. */
+        iter->pData = (char*)iter->pData + prev_size + (pb_ssize_t)iter->pos->data_offset;
         iter->pSize = (char*)iter->pData + iter->pos->size_offset;
         return true;
     }
 }
 
+void pb_field_iter_copy(pb_field_iter_t *dest, const pb_field_iter_t *src)
+{
+    *dest = *src;
+#ifdef PB_COMPACT_FIELDS
+    if (src->compact)
+        dest->pos = &dest->expanded;
+#endif
+}
+
 bool pb_field_iter_find(pb_field_iter_t *iter, uint32_t tag)
 {
-    const pb_field_t *start = iter->pos;
+    const void *start = PB_ITER_ENTRY(iter);
+    
+    /* A zero tag would match the terminator of an empty message type,
+     * which may carry PB_LTYPE_MESSAGE_INFO instead of a field type. */
+    if (tag == 0)
+        return false;
     
     do {
         if (iter->pos->tag == tag &&
-            PB_LTYPE(iter->pos->type) != PB_LTYPE_EXTENSION)
+            PB_LTYPE(iter->pos->type) != PB_LTYPE_EXTENSION &&
+            PB_LTYPE(iter->pos->type) != PB_LTYPE_UNKNOWN)
         {
             /* Found the wanted field */
             return true;
         }
         
         (void)pb_field_iter_next(iter);
-    } while (iter->pos != start);
+    } while (PB_ITER_ENTRY(iter) != start);
     
     /* Searched all the way back to start, and found nothing. */
     return false;
 }
 
 
+
+const pb_extension_type_t pb_extension_registry_type = {NULL, NULL, NULL};
+
+static uint32_t extension_tag(const pb_extension_t *extension)
+{
+    const pb_field_t *field = (const pb_field_t*)extension->type->arg;
+    return field->tag;
+}
+
+bool pb_extension_registry_init(pb_extension_registry_t *registry,
+                                pb_extension_t *entries[], pb_size_t count)
+{
+    pb_size_t i, j;
+    
+    registry->node.type = &pb_extension_registry_type;
+    registry->node.dest = registry;
+    registry->node.next = NULL;
+    registry->node.found = false;
+    registry->entries = entries;
+    registry->count = count;
+    registry->first_tag = 1;
+    registry->last_tag = 0;
+    
+    for (i = 0; i < count; i++)
+    {
+        if (entries[i] == NULL || entries[i]->type == NULL ||
+            entries[i]->type->arg == NULL)
+        {
+            return false;
+        }
+    }
+    
+    /* Insertion sort, the registry is normally set up only once. */
+    for (i = 1; i < count; i++)
+    {
+        pb_extension_t *entry = entries[i];
+        uint32_t tag = extension_tag(entry);
+        
+        for (j = i; j > 0 && extension_tag(entries[j - 1]) > tag; j--)
+        {
+            entries[j] = entries[j - 1];
+        }
+        entries[j] = entry;
+    }
+    
+    for (i = 1; i < count; i++)
+    {
+        if (extension_tag(entries[i - 1]) == extension_tag(entries[i]))
+            return false;
+    }
+    
+    if (count > 0)
+    {
+        registry->first_tag = extension_tag(entries[0]);
+        registry->last_tag = extension_tag(entries[count - 1]);
+    }
+    
+    return true;
+}
+
+pb_extension_t *pb_extension_registry_find(const pb_extension_registry_t *registry, uint32_t tag)
+{
+    pb_size_t low = 0;
+    pb_size_t high = registry->count;
+    
+    if (tag < registry->first_tag || tag > registry->last_tag)
+        return NULL;
+    
+    /* The tags are unique, so without gaps the entry is at tag - first_tag */
+    if (registry->last_tag - registry->first_tag == (uint32_t)(registry->count - 1))
+        return registry->entries[tag - registry->first_tag];
+    
+    while (low < high)
+    {
+        pb_size_t mid = (pb_size_t)(low + (high - low) / 2);
+        uint32_t mid_tag = extension_tag(registry->entries[mid]);
+        
+        if (mid_tag == tag)
+            return registry->entries[mid];
+        else if (mid_tag < tag)
+            low = (pb_size_t)(mid + 1);
+        else
+            high = mid;
+    }
+    
+    return NULL;
+}
+
+const pb_msgid_entry_t *pb_msgid_lookup(const pb_msgid_table_t *table, uint32_t msgid)
+{
+    const pb_msgid_entry_t *entry;
+    
+    if (msgid < table->first || msgid - table->first >= table->count)
+        return NULL;
+    
+    entry = &table->entries[msgid - table->first];
+    return (entry->fields != NULL) ? entry : NULL;
+}
+
+/* Wire type that the encoder uses for the field, or -1 for placeholders
+ * that are not encoded with a tag of their own. */
+static int plan_wire_type(const pb_field_t *field)
+{
+    switch (PB_LTYPE(field->type))
+    {
+        case PB_LTYPE_VARINT:
+        case PB_LTYPE_UVARINT:
+        case PB_LTYPE_SVARINT:
+            if (PB_HTYPE(field->type) == PB_HTYPE_REPEATED)
+                return PB_WT_STRING; /* Packed array */
+            return PB_WT_VARINT;
+        
+        case PB_LTYPE_FIXED32:
+            if (PB_HTYPE(field->type) == PB_HTYPE_REPEATED)
+                return PB_WT_STRING;
+            return PB_WT_32BIT;
+        
+        case PB_LTYPE_FIXED64:
+            if (PB_HTYPE(field->type) == PB_HTYPE_REPEATED)
+                return PB_WT_STRING;
+            return PB_WT_64BIT;
+        
+        case PB_LTYPE_BYTES:
+        case PB_LTYPE_STRING:
+        case PB_LTYPE_SUBMESSAGE:
+        case PB_LTYPE_SUBMSG_SOA:
+            return PB_WT_STRING;
+        
+        default:
+            return -1;
+    }
+}
+
+bool pb_compile_plan(pb_plan_t *plan, const pb_field_t fields[],
+                     pb_plan_field_t entries[], pb_size_t max_entries)
+{
+    pb_field_iter_t iter;
+    pb_size_t count = 0;
+    pb_size_t extension_index = max_entries;
+    pb_size_t unknown_index = max_entries;
+    bool presence_only = true;
+    
+    plan->fields = fields;
+    plan->entries = entries;
+    plan->required_count = 0;
+    plan->flags = 0;
+    
+    /* The iterator is only used for computing offsets, the plan structure
+     * just serves as a base address. */
+    if (pb_field_iter_begin(&iter, fields, plan))
+    {
+        do {
+            pb_plan_field_t *entry;
+            const pb_field_t *field = iter.pos;
+            int wire_type;
+            
+            if (count >= max_entries)
+                return false;
+            
+            entry = &entries[count];
+            entry->field = field;
+#ifdef PB_COMPACT_FIELDS
+            if (iter.compact)
+            {
+                entry->expanded = *field;
+                entry->field = &entry->expanded;
+            }
+#endif
+            entry->data_offset = (size_t)((char*)iter.pData - (char*)plan);
+            entry->required_index = (pb_size_t)iter.required_field_index;
+            entry->tag_size = 0;
+            
+            if (PB_HTYPE(field->type) == PB_HTYPE_REQUIRED)
+                plan->required_count++;
+            
+            if (!PB_HAS_PRESENCE_BIT(field) || field->array_size != count + 1)
+                presence_only = false;
+            
+            wire_type = plan_wire_type(field);
+            if (wire_type >= 0 && PB_ATYPE(field->type) == PB_ATYPE_POINTER)
+                plan->flags |= PB_PLAN_HAS_POINTERS;
+            else if (wire_type >= 0 && PB_ATYPE(field->type) == PB_ATYPE_CALLBACK)
+                plan->flags |= PB_PLAN_HAS_CALLBACKS;
+            
+            if (PB_LTYPE(field->type) == PB_LTYPE_EXTENSION)
+            {
+                plan->flags |= PB_PLAN_HAS_EXTENSIONS;
+                extension_index = count;
+            }
+            else if (PB_LTYPE(field->type) == PB_LTYPE_UNKNOWN)
+            {
+                plan->flags |= PB_PLAN_HAS_UNKNOWN;
+                unknown_index = count;
+            }
+            else if (wire_type < 0)
+            {
+                return false;
+            }
+            else
+            {
+                /* Encode the tag as a varint */
+                uint32_t tag = ((uint32_t)field->tag << 3) | (uint32_t)wire_type;
+                do {
+                    entry->tag_bytes[entry->tag_size++] = (uint8_t)((tag & 0x7F) | 0x80);
+                    tag >>= 7;
+                } while (tag);
+                entry->tag_bytes[entry->tag_size - 1] &= 0x7F;
+            }
+            
+            count++;
+        } while (pb_field_iter_next(&iter));
+    }
+    
+    plan->field_count = count;
+    
+    if (presence_only && count > 0)
+        plan->flags |= PB_PLAN_PRESENCE_ONLY;
+    
+    plan->info = pb_get_message_info(fields);
+    plan->extension_index = (extension_index < count) ? extension_index : count;
+    plan->unknown_index = (unknown_index < count) ? unknown_index : count;
+    return true;
+}
+
+void pb_plan_iter(pb_field_iter_t *iter, const pb_plan_t *plan, pb_size_t index, void *dest_struct)
+{
+    const pb_plan_field_t *entry = &plan->entries[index];
+    iter->start = plan->fields;
+    iter->pos = entry->field;
+    iter->required_field_index = entry->required_index;
+    iter->dest_struct = dest_struct;
+    iter->pData = (char*)dest_struct + entry->data_offset;
+    iter->pSize = (char*)iter->pData + entry->field->size_offset;
+#ifdef PB_COMPACT_FIELDS
+    iter->compact = NULL;
+#endif
+}
+
+#ifdef PB_ENABLE_SOA
+void pb_soa_iter(pb_field_iter_t *iter, const pb_soa_column_t *column, void *columns, pb_size_t index)
+{
+    const pb_field_t *field = iter->pos;
+    size_t data_size = field->data_size;
+    
+    if (PB_HTYPE(field->type) == PB_HTYPE_REPEATED)
+        data_size *= field->array_size;
+    
+    iter->dest_struct = columns;
+    iter->pData = (char*)columns + column->data_offset + data_size * index;
+    
+    if (PB_HTYPE(field->type) == PB_HTYPE_OPTIONAL)
+        iter->pSize = (char*)columns + column->size_offset + sizeof(bool) * index;
+    else if (PB_HTYPE(field->type) == PB_HTYPE_REPEATED)
+        iter->pSize = (char*)columns + column->size_offset + sizeof(pb_size_t) * index;
+    else
+        iter->pSize = iter->pData;
+}
+#endif
@@ -19,9 +19,21 @@ struct pb_field_iter_s {
     void *dest_struct;             /* Pointer to start of the structure */
     void *pData;                   /* Pointer to current field value */
     void *pSize;                   /* Pointer to count/has field */
+#ifdef PB_COMPACT_FIELDS
+    const pb_field_compact_t *compact; /* Current entry of a compact table, or NULL */
+    pb_field_t expanded;           /* The compact entry, pos points here */
+#endif
 };
 typedef struct pb_field_iter_s pb_field_iter_t;
 
+/* Identifies the current entry of the iterator. Unlike iter->pos, this
+ * differs between the entries of a compact table. */
+#ifdef PB_COMPACT_FIELDS
+#define PB_ITER_ENTRY(iter) ((iter)->compact ? (const void*)(iter)->compact : (const void*)(iter)->pos)
+#else
+#define PB_ITER_ENTRY(iter) ((const void*)(iter)->pos)
+#endif
+
 /* Initialize the field iterator structure to beginning.
  * Returns false if the message type is empty. */
 bool pb_field_iter_begin(pb_field_iter_t *iter, const pb_field_t *fields, void *dest_struct);
@@ -30,10 +42,58 @@ bool pb_field_iter_begin(pb_field_iter_t *iter, const pb_field_t *fields, void *
  * Returns false when the iterator wraps back to the first field. */
 bool pb_field_iter_next(pb_field_iter_t *iter);
 
+/* Copy an iterator. Plain structure assignment does not work for iterators
+ * over compact tables, as pos points inside the iterator itself. */
+void pb_field_iter_copy(pb_field_iter_t *dest, const pb_field_iter_t *src);
+
 /* Advance the iterator until it points at a field with the given tag.
  * Returns false if no such field exists. */
 bool pb_field_iter_find(pb_field_iter_t *iter, uint32_t tag);
 
+/* Find the pb_message_info_t from the terminator of a field list, see
+ * PB_LAST_FIELD_WITH_INFO(). This walks through the fields, so the plan
+ * functions use the copy in pb_plan_t instead.
+ * Returns NULL if the field list has no information. */
+const pb_message_info_t *pb_get_message_info(const pb_field_t fields[]);
+
+/* Marker type for the list node of a pb_extension_registry_t. */
+extern const pb_extension_type_t pb_extension_registry_type;
+
+/* Sort the entries by tag and initialize the registry structure.
+ * All entries must use types that have a pb_field_t in the arg field,
+ * which is the case for the extension types created by the generator.
+ * Returns false if an entry is invalid or a tag occurs twice. */
+bool pb_extension_registry_init(pb_extension_registry_t *registry,
+                                pb_extension_t *entries[], pb_size_t count);
+
+/* Find the extension with the given tag using binary search.
+ * Returns NULL if the tag is not in the registry. */
+pb_extension_t *pb_extension_registry_find(const pb_extension_registry_t *registry, uint32_t tag);
+
+/* Find the message type with the given msgid in a generated table.
+ * Returns NULL if the table has no message type with the id. */
+const pb_msgid_entry_t *pb_msgid_lookup(const pb_msgid_table_t *table, uint32_t msgid);
+
+/* Precompute the field offsets, required field indexes and encoded tags of
+ * a message type. The entries array must have room for all the fields.
+ * sizeof(MyMessage_fields) / sizeof(pb_field_t) is enough, unless the
+ * message uses a compact table.
+ * Returns false if the array is too small or a field has an invalid type. */
+bool pb_compile_plan(pb_plan_t *plan, const pb_field_t fields[],
+                     pb_plan_field_t entries[], pb_size_t max_entries);
+
+/* Initialize an iterator to point at a field of the plan. Functions taking
+ * an iterator can then process the field, but the iterator must not be
+ * advanced with pb_field_iter_next(). */
+void pb_plan_iter(pb_field_iter_t *iter, const pb_plan_t *plan, pb_size_t index, void *dest_struct);
+
+#ifdef PB_ENABLE_SOA
+/* Point an iterator at one entry of a struct-of-arrays field. The iterator
+ * must be positioned at the field of the submessage type that the column
+ * stores. It must not be advanced afterwards. */
+void pb_soa_iter(pb_field_iter_t *iter, const pb_soa_column_t *column, void *columns, pb_size_t index);
+#endif
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
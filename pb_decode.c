@@ -24,17 +24,36 @@
 typedef bool (*pb_decoder_t)(pb_istream_t *stream, const pb_field_t *field, void *dest) checkreturn;
 
 static bool checkreturn buf_read(pb_istream_t *stream, uint8_t *buf, size_t count);
-static bool checkreturn pb_decode_varint32(pb_istream_t *stream, uint32_t *dest);
 static bool checkreturn read_raw_value(pb_istream_t *stream, pb_wire_type_t wire_type, uint8_t *buf, size_t *size);
 static bool checkreturn decode_static_field(pb_istream_t *stream, pb_wire_type_t wire_type, pb_field_iter_t *iter);
+#ifdef PB_ENABLE_SOA
+static bool checkreturn decode_soa_field(pb_istream_t *stream, pb_field_iter_t *iter);
+static bool checkreturn find_soa_column(pb_field_iter_t *iter, pb_size_t *column, uint32_t tag);
+#endif
 static bool checkreturn decode_callback_field(pb_istream_t *stream, pb_wire_type_t wire_type, pb_field_iter_t *iter);
 static bool checkreturn decode_field(pb_istream_t *stream, pb_wire_type_t wire_type, pb_field_iter_t *iter);
+static bool checkreturn decode_field_by_atype(pb_istream_t *stream, pb_wire_type_t wire_type, pb_field_iter_t *iter);
+#ifdef PB_ENABLE_TRACE
+static bool checkreturn trace_decode_field(pb_istream_t *stream, pb_wire_type_t wire_type, pb_field_iter_t *iter);
+#endif
 static void iter_from_extension(pb_field_iter_t *iter, pb_extension_t *extension);
 static bool checkreturn default_extension_decoder(pb_istream_t *stream, pb_extension_t *extension, uint32_t tag, pb_wire_type_t wire_type);
 static bool checkreturn decode_extension(pb_istream_t *stream, uint32_t tag, pb_wire_type_t wire_type, pb_field_iter_t *iter);
 static bool checkreturn find_extension_field(pb_field_iter_t *iter);
+#ifdef PB_ENABLE_UNKNOWN_FIELDS
+static bool checkreturn find_unknown_fields_field(pb_field_iter_t *iter);
+static bool checkreturn append_unknown_varint(pb_istream_t *stream, uint8_t *buf, size_t *size, size_t max_size, uint32_t value);
+static bool checkreturn store_unknown_field(pb_istream_t *stream, uint32_t tag, pb_wire_type_t wire_type, pb_field_iter_t *iter);
+#endif
 static void pb_field_set_to_default(pb_field_iter_t *iter);
 static void pb_message_set_to_defaults(const pb_field_t fields[], void *dest_struct);
+static bool checkreturn check_required_fields(pb_istream_t *stream, const uint8_t *fields_seen, unsigned req_field_count);
+static bool checkreturn find_plan_field(const pb_plan_t *plan, pb_size_t *index, uint32_t tag);
+static void invalidate_encode_cache(const pb_message_info_t *info, void *dest_struct);
+static bool checkreturn decode_message(pb_istream_t *stream, const pb_field_t fields[], void *dest_struct, bool delta);
+static bool submessage_is_present(const pb_field_iter_t *iter);
+static bool checkreturn decode_delta_field(pb_istream_t *stream, pb_wire_type_t wire_type, pb_field_iter_t *iter, bool first_entry);
+static bool checkreturn patch_fixed(pb_istream_t *stream, const pb_field_t fields[], const uint32_t tag_path[], const void *value, bool *found);
 static bool checkreturn pb_dec_varint(pb_istream_t *stream, const pb_field_t *field, void *dest);
 static bool checkreturn pb_dec_uvarint(pb_istream_t *stream, const pb_field_t *field, void *dest);
 static bool checkreturn pb_dec_svarint(pb_istream_t *stream, const pb_field_t *field, void *dest);
@@ -65,7 +84,9 @@ static const pb_decoder_t PB_DECODERS[PB_LTYPES_COUNT] = {
     &pb_dec_bytes,
     &pb_dec_string,
     &pb_dec_submessage,
-    NULL /* extensions */
+    NULL, /* extensions */
+    NULL, /* unknown fields */
+    NULL /* struct-of-arrays submessages */
 };
 
 /*******************************
@@ -111,12 +132,14 @@ bool checkreturn pb_read(pb_istream_t *stream, uint8_t *buf, size_t count)
 #ifndef PB_BUFFER_ONLY
     if (!stream->callback(stream, buf, count))
         PB_RETURN_ERROR(stream, "io error");
+    PB_STATS_ADD(stream, callbacks, stream->callback != buf_read);
 #else
     if (!buf_read(stream, buf, count))
         return false;
 #endif
     
     stream->bytes_left -= count;
+    PB_STATS_ADD(stream, bytes, count);
     return true;
 }
 
@@ -130,12 +153,14 @@ static bool checkreturn pb_readbyte(pb_istream_t *stream, uint8_t *buf)
 #ifndef PB_BUFFER_ONLY
     if (!stream->callback(stream, buf, 1))
         PB_RETURN_ERROR(stream, "io error");
+    PB_STATS_ADD(stream, callbacks, stream->callback != buf_read);
 #else
     *buf = *(const uint8_t*)stream->state;
     stream->state = (uint8_t*)stream->state + 1;
 #endif
 
     stream->bytes_left--;
+    PB_STATS_ADD(stream, bytes, 1);
     
     return true;    
 }
@@ -160,6 +185,12 @@ pb_istream_t pb_istream_from_buffer(const uint8_t *buf, size_t bufsize)
     stream.bytes_left = bufsize;
 #ifndef PB_NO_ERRMSG
     stream.errmsg = NULL;
+#endif
+#ifdef PB_ENABLE_STATS
+    memset(&stream.stats, 0, sizeof(stream.stats));
+#endif
+#ifdef PB_ENABLE_TRACE
+    stream.trace = NULL;
 #endif
     return stream;
 }
@@ -168,7 +199,7 @@ pb_istream_t pb_istream_from_buffer(const uint8_t *buf, size_t bufsize)
  * Helper functions *
  ********************/
 
-static bool checkreturn pb_decode_varint32(pb_istream_t *stream, uint32_t *dest)
+bool checkreturn pb_decode_varint32(pb_istream_t *stream, uint32_t *dest)
 {
     uint8_t byte;
     uint32_t result;
@@ -195,6 +226,10 @@ static bool checkreturn pb_decode_varint32(pb_istream_t *stream, uint32_t *dest)
             if (!pb_readbyte(stream, &byte))
                 return false;
             
+            /* The fifth byte has room only for the top 4 bits */
+            if (bitpos == 28 && (byte & 0x70) != 0)
+                PB_RETURN_ERROR(stream, "varint overflow");
+            
             result |= (uint32_t)(byte & 0x7F) << bitpos;
             bitpos = (uint8_t)(bitpos + 7);
         } while (byte & 0x80);
@@ -274,6 +309,8 @@ bool checkreturn pb_decode_tag(pb_istream_t *stream, pb_wire_type_t *wire_type,
 
 bool checkreturn pb_skip_field(pb_istream_t *stream, pb_wire_type_t wire_type)
 {
+    PB_STATS_ADD(stream, skipped_fields, 1);
+
     switch (wire_type)
     {
         case PB_WT_VARINT: return pb_skip_varint(stream);
@@ -329,12 +366,14 @@ bool checkreturn pb_make_string_substream(pb_istream_t *stream, pb_istream_t *su
     
     substream->bytes_left = size;
     stream->bytes_left -= size;
+    PB_STATS_OPEN(stream, substream);
     return true;
 }
 
 void pb_close_string_substream(pb_istream_t *stream, pb_istream_t *substream)
 {
     stream->state = substream->state;
+    PB_STATS_CLOSE(stream, substream);
 
 #ifndef PB_NO_ERRMSG
     stream->errmsg = substream->errmsg;
@@ -359,11 +398,22 @@ static bool checkreturn decode_static_field(pb_istream_t *stream, pb_wire_type_t
             return func(stream, iter->pos, iter->pData);
             
         case PB_HTYPE_OPTIONAL:
-            *(bool*)iter->pSize = true;
+            if (PB_HAS_PRESENCE_BIT(iter->pos))
+                *(pb_presence_t*)iter->dest_struct |= PB_PRESENCE_MASK(iter->pos);
+            else
+                *(bool*)iter->pSize = true;
             return func(stream, iter->pos, iter->pData);
     
         case PB_HTYPE_REPEATED:
-            if (wire_type == PB_WT_STRING
+            if (PB_LTYPE(type) == PB_LTYPE_SUBMSG_SOA)
+            {
+#ifdef PB_ENABLE_SOA
+                return decode_soa_field(stream, iter);
+#else
+                PB_RETURN_ERROR(stream, "no soa support");
+#endif
+            }
+            else if (wire_type == PB_WT_STRING
                 && PB_LTYPE(type) <= PB_LTYPE_LAST_PACKABLE)
             {
                 /* Packed array */
@@ -418,6 +468,117 @@ static bool checkreturn decode_static_field(pb_istream_t *stream, pb_wire_type_t
     }
 }
 
+#ifdef PB_ENABLE_SOA
+/* Step through the fields of a struct-of-arrays submessage type until
+ * one with the given tag is found, keeping count of the column number. */
+static bool checkreturn find_soa_column(pb_field_iter_t *iter, pb_size_t *column, uint32_t tag)
+{
+    const void *start = PB_ITER_ENTRY(iter);
+    
+    do {
+        if (iter->pos->tag == tag)
+            return true;
+        
+        if (pb_field_iter_next(iter))
+            (*column)++;
+        else
+            *column = 0;
+    } while (PB_ITER_ENTRY(iter) != start);
+    
+    return false;
+}
+
+/* Decode a new entry of a struct-of-arrays field. The fields of the
+ * submessage are stored directly in their columns. */
+static bool checkreturn decode_soa_field(pb_istream_t *stream, pb_field_iter_t *iter)
+{
+    uint8_t fields_seen[(PB_MAX_REQUIRED_FIELDS + 7) / 8] = {0, 0, 0, 0, 0, 0, 0, 0};
+    const pb_soa_t *soa = (const pb_soa_t*)iter->pos->ptr;
+    pb_size_t *size = (pb_size_t*)iter->pSize;
+    unsigned req_field_count = 0;
+    pb_field_iter_t fields;
+    pb_field_iter_t entry;
+    pb_size_t column = 0;
+    pb_istream_t substream;
+    bool status = true;
+    
+    if (soa == NULL)
+        PB_RETURN_ERROR(stream, "invalid field descriptor");
+    
+    if (*size >= iter->pos->array_size)
+        PB_RETURN_ERROR(stream, "array overflow");
+    
+    if (!pb_make_string_substream(stream, &substream))
+        return false;
+    PB_STATS_NEST(&substream);
+    
+    /* Initialize the new entry to default values */
+    if (pb_field_iter_begin(&fields, soa->fields, iter->pData))
+    {
+        do {
+            pb_field_iter_copy(&entry, &fields);
+            pb_soa_iter(&entry, &soa->columns[column], iter->pData, *size);
+            pb_field_set_to_default(&entry);
+            
+            if (PB_HTYPE(fields.pos->type) == PB_HTYPE_REQUIRED)
+                req_field_count++;
+            column++;
+        } while (pb_field_iter_next(&fields));
+    }
+    column = 0;
+    
+    while (substream.bytes_left)
+    {
+        uint32_t tag;
+        pb_wire_type_t wire_type;
+        bool eof;
+        
+        if (!pb_decode_tag(&substream, &wire_type, &tag, &eof))
+        {
+            status = eof;
+            break;
+        }
+        
+        if (!find_soa_column(&fields, &column, tag))
+        {
+            if (!pb_skip_field(&substream, wire_type))
+            {
+                status = false;
+                break;
+            }
+            continue;
+        }
+        
+        if (PB_HTYPE(fields.pos->type) == PB_HTYPE_REQUIRED
+            && fields.required_field_index < PB_MAX_REQUIRED_FIELDS)
+        {
+            uint8_t tmp = (uint8_t)(1 << (fields.required_field_index & 7));
+            fields_seen[fields.required_field_index >> 3] |= tmp;
+        }
+        
+        pb_field_iter_copy(&entry, &fields);
+        pb_soa_iter(&entry, &soa->columns[column], iter->pData, *size);
+        PB_STATS_ADD(&substream, fields, 1);
+        if (!decode_static_field(&substream, wire_type, &entry))
+        {
+            status = false;
+            break;
+        }
+    }
+    
+    pb_close_string_substream(stream, &substream);
+    
+    if (!status)
+        return false;
+    
+    if (!check_required_fields(stream, fields_seen, req_field_count))
+        return false;
+    
+    (*size)++;
+    return true;
+}
+#endif
+
 #ifdef PB_ENABLE_MALLOC
 /* Allocate storage for the field and store the pointer at iter->pData.
  * array_size is the number of entries to reserve in an array.
@@ -450,6 +611,9 @@ static bool checkreturn allocate_field(pb_istream_t *stream, void *pData, size_t
     /* Allocate new or expand previous allocation */
     /* Note: on failure the old pointer will remain in the structure,
      * the message must be freed by caller also on error return. */
+    PB_STATS_ADD(stream, allocs, ptr == NULL);
+    PB_STATS_ADD(stream, reallocs, ptr != NULL);
+    PB_STATS_ADD(stream, bytes_allocated, array_size * data_size);
     ptr = pb_realloc(ptr, array_size * data_size);
     if (ptr == NULL)
         PB_RETURN_ERROR(stream, "realloc failed");
@@ -643,6 +807,57 @@ static bool checkreturn decode_callback_field(pb_istream_t *stream, pb_wire_type
 }
 
 static bool checkreturn decode_field(pb_istream_t *stream, pb_wire_type_t wire_type, pb_field_iter_t *iter)
+{
+    PB_STATS_ADD(stream, fields, 1);
+
+#ifdef PB_ENABLE_TRACE
+    if (stream->trace != NULL)
+        return trace_decode_field(stream, wire_type, iter);
+#endif
+
+    return decode_field_by_atype(stream, wire_type, iter);
+}
+
+#ifdef PB_ENABLE_TRACE
+/* Decode the field and pass its position, size and decoding time to the
+ * trace hook. The tag has already been read, so its size is added back. */
+static bool checkreturn trace_decode_field(pb_istream_t *stream, pb_wire_type_t wire_type, pb_field_iter_t *iter)
+{
+    const pb_trace_t *trace = stream->trace;
+    uint32_t tag_value = ((uint32_t)iter->pos->tag << 3) | (uint32_t)wire_type;
+    size_t tag_size = 1;
+    size_t start_bytes;
+    pb_trace_time_t start;
+    pb_trace_event_t event;
+    bool status;
+    
+    while (tag_value >= 0x80)
+    {
+        tag_value >>= 7;
+        tag_size++;
+    }
+    
+    start_bytes = stream->stats.bytes - tag_size;
+    start = PB_TRACE_CLOCK();
+    status = decode_field_by_atype(stream, wire_type, iter);
+    event.elapsed = PB_TRACE_CLOCK() - start;
+    
+    if (status && trace->hook != NULL)
+    {
+        event.field = iter->pos;
+        event.fields = iter->start;
+        event.tag = iter->pos->tag;
+        event.offset = start_bytes;
+        event.size = stream->stats.bytes - start_bytes;
+        trace->hook(&event, trace->arg);
+    }
+    
+    return status;
+}
+#endif
+
+/* Decode a field according to its allocation type */
+static bool checkreturn decode_field_by_atype(pb_istream_t *stream, pb_wire_type_t wire_type, pb_field_iter_t *iter)
 {
 #ifdef PB_ENABLE_MALLOC
     /* When decoding an oneof field, check if there is old data that must be
@@ -715,8 +930,19 @@ static bool checkreturn decode_extension(pb_istream_t *stream,
     
     while (extension != NULL && pos == stream->bytes_left)
     {
-        bool status;
-        if (extension->type->decode)
+        bool status = true;
+        if (extension->type == &pb_extension_registry_type)
+        {
+            /* Look up the tag from the sorted table */
+            pb_extension_t *entry;
+            entry = pb_extension_registry_find((const pb_extension_registry_t*)extension->dest, tag);
+            
+            if (entry != NULL && entry->type->decode)
+                status = entry->type->decode(stream, entry, tag, wire_type);
+            else if (entry != NULL)
+                status = default_extension_decoder(stream, entry, tag, wire_type);
+        }
+        else if (extension->type->decode)
             status = extension->type->decode(stream, extension, tag, wire_type);
         else
             status = default_extension_decoder(stream, extension, tag, wire_type);
@@ -735,17 +961,120 @@ static bool checkreturn decode_extension(pb_istream_t *stream,
  * message. Returns false if no extension field is found. */
 static bool checkreturn find_extension_field(pb_field_iter_t *iter)
 {
-    const pb_field_t *start = iter->pos;
+    const void *start = PB_ITER_ENTRY(iter);
     
     do {
         if (PB_LTYPE(iter->pos->type) == PB_LTYPE_EXTENSION)
             return true;
         (void)pb_field_iter_next(iter);
-    } while (iter->pos != start);
+    } while (PB_ITER_ENTRY(iter) != start);
     
     return false;
 }
 
+#ifdef PB_ENABLE_UNKNOWN_FIELDS
+/* Step through the iterator until the unknown fields buffer is found.
+ * Returns false if the message does not preserve unknown fields. */
+static bool checkreturn find_unknown_fields_field(pb_field_iter_t *iter)
+{
+    const void *start = PB_ITER_ENTRY(iter);
+    
+    do {
+        if (PB_LTYPE(iter->pos->type) == PB_LTYPE_UNKNOWN)
+            return true;
+        (void)pb_field_iter_next(iter);
+    } while (PB_ITER_ENTRY(iter) != start);
+    
+    return false;
+}
+
+/* Append a single varint to the unknown fields buffer. */
+static bool checkreturn append_unknown_varint(pb_istream_t *stream, uint8_t *buf,
+    size_t *size, size_t max_size, uint32_t value)
+{
+    do
+    {
+        if (*size >= max_size)
+            PB_RETURN_ERROR(stream, "unknown fields overflow");
+        
+        buf[*size] = (uint8_t)(value & 0x7F);
+        value >>= 7;
+        if (value)
+            buf[*size] |= 0x80;
+        (*size)++;
+    } while (value);
+    
+    return true;
+}
+
+/* Copy an unrecognized field, including its tag, to the unknown fields
+ * buffer of the message. The data is kept in the wire format, so that
+ * the encoder can write it back out as is. */
+static bool checkreturn store_unknown_field(pb_istream_t *stream,
+    uint32_t tag, pb_wire_type_t wire_type, pb_field_iter_t *iter)
+{
+    pb_bytes_array_t *unknown = (pb_bytes_array_t*)iter->pData;
+    size_t max_size = iter->pos->data_size - offsetof(pb_bytes_array_t, bytes);
+    size_t size = unknown->size;
+    size_t count;
+    
+    if (max_size > PB_SIZE_MAX)
+        max_size = PB_SIZE_MAX;
+    
+    if (!append_unknown_varint(stream, unknown->bytes, &size, max_size,
+                               (tag << 3) | (uint32_t)wire_type))
+        return false;
+    
+    switch (wire_type)
+    {
+        case PB_WT_VARINT:
+            do
+            {
+                if (size >= max_size)
+                    PB_RETURN_ERROR(stream, "unknown fields overflow");
+                
+                if (!pb_readbyte(stream, &unknown->bytes[size]))
+                    return false;
+            } while (unknown->bytes[size++] & 0x80);
+            break;
+        
+        case PB_WT_64BIT:
+        case PB_WT_32BIT:
+            count = (wire_type == PB_WT_64BIT) ? 8 : 4;
+            if (max_size - size < count)
+                PB_RETURN_ERROR(stream, "unknown fields overflow");
+            if (!pb_read(stream, &unknown->bytes[size], count))
+                return false;
+            size += count;
+            break;
+        
+        case PB_WT_STRING:
+        {
+            uint32_t length;
+            if (!pb_decode_varint32(stream, &length))
+                return false;
+            
+            if (!append_unknown_varint(stream, unknown->bytes, &size, max_size, length))
+                return false;
+            
+            if (max_size - size < length)
+                PB_RETURN_ERROR(stream, "unknown fields overflow");
+            
+            if (!pb_read(stream, &unknown->bytes[size], length))
+                return false;
+            size += length;
+            break;
+        }
+        
+        default:
+            PB_RETURN_ERROR(stream, "invalid wire_type");
+    }
+    
+    unknown->size = (pb_size_t)size;
+    return true;
+}
+#endif
+
 /* Initialize message fields to default values, recursively */
 static void pb_field_set_to_default(pb_field_iter_t *iter)
 {
@@ -758,12 +1087,31 @@ static void pb_field_set_to_default(pb_field_iter_t *iter)
         while (ext != NULL)
         {
             pb_field_iter_t ext_iter;
-            ext->found = false;
-            iter_from_extension(&ext_iter, ext);
-            pb_field_set_to_default(&ext_iter);
+            if (ext->type == &pb_extension_registry_type)
+            {
+                const pb_extension_registry_t *registry = (const pb_extension_registry_t*)ext->dest;
+                pb_size_t i;
+                for (i = 0; i < registry->count; i++)
+                {
+                    registry->entries[i]->found = false;
+                    iter_from_extension(&ext_iter, registry->entries[i]);
+                    pb_field_set_to_default(&ext_iter);
+                }
+            }
+            else
+            {
+                ext->found = false;
+                iter_from_extension(&ext_iter, ext);
+                pb_field_set_to_default(&ext_iter);
+            }
             ext = ext->next;
         }
     }
+    else if (PB_LTYPE(type) == PB_LTYPE_UNKNOWN)
+    {
+        /* Discard any previously stored unknown fields */
+        ((pb_bytes_array_t*)iter->pData)->size = 0;
+    }
     else if (PB_ATYPE(type) == PB_ATYPE_STATIC)
     {
         bool init_data = true;
@@ -771,7 +1119,10 @@ static void pb_field_set_to_default(pb_field_iter_t *iter)
         {
             /* Set has_field to false. Still initialize the optional field
              * itself also. */
-            *(bool*)iter->pSize = false;
+            if (PB_HAS_PRESENCE_BIT(iter->pos))
+                *(pb_presence_t*)iter->dest_struct &= ~PB_PRESENCE_MASK(iter->pos);
+            else
+                *(bool*)iter->pSize = false;
         }
         else if (PB_HTYPE(type) == PB_HTYPE_REPEATED ||
                  PB_HTYPE(type) == PB_HTYPE_ONEOF)
@@ -819,15 +1170,39 @@ static void pb_field_set_to_default(pb_field_iter_t *iter)
     }
 }
 
+/* Messages with the encode_cache option have the location of their
+ * encode cache in the message information. The cache becomes out of date
+ * when the structure is changed by the decoder. */
+static void invalidate_encode_cache(const pb_message_info_t *info, void *dest_struct)
+{
+    if (info != NULL && info->cache_info != NULL)
+        pb_invalidate_cache((pb_encode_cache_t*)((char*)dest_struct + info->cache_info->cache_offset));
+}
+
 static void pb_message_set_to_defaults(const pb_field_t fields[], void *dest_struct)
 {
     pb_field_iter_t iter;
+    const pb_message_info_t *info = pb_get_message_info(fields);
+    
+    invalidate_encode_cache(info, dest_struct);
+    
+    /* If the generator provided an image of the default values, it is
+     * referenced from the message information at the end of the fields. */
+    if (info != NULL && info->default_image != NULL)
+    {
+        memcpy(dest_struct, info->default_image->data, info->default_image->size);
+        return;
+    }
 
     if (!pb_field_iter_begin(&iter, fields, dest_struct))
         return; /* Empty message type */
     
     do
     {
+        /* The presence bitmap may have bits that no field uses */
+        if (PB_HAS_PRESENCE_BIT(iter.pos))
+            *(pb_presence_t*)dest_struct = 0;
+        
         pb_field_set_to_default(&iter);
     } while (pb_field_iter_next(&iter));
 }
@@ -836,12 +1211,92 @@ static void pb_message_set_to_defaults(const pb_field_t fields[], void *dest_str
  * Decode all fields *
  *********************/
 
-bool checkreturn pb_decode_noinit(pb_istream_t *stream, const pb_field_t fields[], void *dest_struct)
+/* Tells if a static submessage field is present in the structure. */
+static bool submessage_is_present(const pb_field_iter_t *iter)
+{
+    switch (PB_HTYPE(iter->pos->type))
+    {
+        case PB_HTYPE_OPTIONAL:
+            if (PB_HAS_PRESENCE_BIT(iter->pos))
+                return (*(const pb_presence_t*)iter->dest_struct & PB_PRESENCE_MASK(iter->pos)) != 0;
+            else
+                return *(const bool*)iter->pSize;
+        
+        case PB_HTYPE_ONEOF:
+            return *(const pb_size_t*)iter->pSize == iter->pos->tag;
+        
+        default:
+            return true;
+    }
+}
+
+/* Decode a field of a message encoded with pb_encode_delta(). The entries
+ * of an array are consecutive in the input, and replace the old entries.
+ * Submessages that are already present only contain the changed fields. */
+static bool checkreturn decode_delta_field(pb_istream_t *stream, pb_wire_type_t wire_type,
+    pb_field_iter_t *iter, bool first_entry)
+{
+    pb_type_t type = iter->pos->type;
+    
+    if (PB_HTYPE(type) == PB_HTYPE_REPEATED)
+    {
+        if (first_entry && PB_ATYPE(type) == PB_ATYPE_STATIC)
+        {
+            *(pb_size_t*)iter->pSize = 0;
+        }
+#ifdef PB_ENABLE_MALLOC
+        else if (first_entry && PB_ATYPE(type) == PB_ATYPE_POINTER)
+        {
+            pb_release_single_field(iter);
+        }
+#endif
+    }
+    else if (PB_ATYPE(type) == PB_ATYPE_STATIC && PB_LTYPE(type) == PB_LTYPE_SUBMESSAGE)
+    {
+        if (submessage_is_present(iter))
+        {
+            pb_istream_t substream;
+            bool status;
+            
+            if (wire_type != PB_WT_STRING)
+                PB_RETURN_ERROR(stream, "wrong wire type");
+            
+            PB_STATS_ADD(stream, fields, 1);
+            if (!pb_make_string_substream(stream, &substream))
+                return false;
+            PB_STATS_NEST(&substream);
+            
+            status = decode_message(&substream, (const pb_field_t*)iter->pos->ptr, iter->pData, true);
+            pb_close_string_substream(stream, &substream);
+            return status;
+        }
+        else if (PB_HTYPE(type) == PB_HTYPE_OPTIONAL)
+        {
+            /* The whole submessage is in the input */
+            pb_field_set_to_default(iter);
+        }
+    }
+    
+    return decode_field(stream, wire_type, iter);
+}
+
+/* Decode the fields of a message without initializing the structure. In
+ * delta mode the input comes from pb_encode_delta(), see decode_delta_field(). */
+static bool checkreturn decode_message(pb_istream_t *stream, const pb_field_t fields[],
+    void *dest_struct, bool delta)
 {
     uint8_t fields_seen[(PB_MAX_REQUIRED_FIELDS + 7) / 8] = {0, 0, 0, 0, 0, 0, 0, 0};
     uint32_t extension_range_start = 0;
+    uint32_t prev_tag = 0;
+#ifdef PB_ENABLE_UNKNOWN_FIELDS
+    bool unknown_fields_checked = false;
+    bool has_unknown_fields = false;
+    pb_field_iter_t unknown_iter;
+#endif
     pb_field_iter_t iter;
     
+    invalidate_encode_cache(pb_get_message_info(fields), dest_struct);
+    
     /* Return value ignored, as empty message types will be correctly handled by
      * pb_field_iter_find() anyway. */
     (void)pb_field_iter_begin(&iter, fields, dest_struct);
@@ -851,6 +1306,7 @@ bool checkreturn pb_decode_noinit(pb_istream_t *stream, const pb_field_t fields[
         uint32_t tag;
         pb_wire_type_t wire_type;
         bool eof;
+        bool first_entry;
         
         if (!pb_decode_tag(stream, &wire_type, &tag, &eof))
         {
@@ -860,6 +1316,9 @@ bool checkreturn pb_decode_noinit(pb_istream_t *stream, const pb_field_t fields[
                 return false;
         }
         
+        first_entry = (tag != prev_tag);
+        prev_tag = tag;
+        
         if (!pb_field_iter_find(&iter, tag))
         {
             /* No match found, check if it matches an extension. */
@@ -885,12 +1344,40 @@ bool checkreturn pb_decode_noinit(pb_istream_t *stream, const pb_field_t fields[
                 }
             }
         
+#ifdef PB_ENABLE_UNKNOWN_FIELDS
+            /* No match found, check if the message preserves unknown fields. */
+            if (!unknown_fields_checked)
+            {
+                pb_field_iter_copy(&unknown_iter, &iter);
+                has_unknown_fields = find_unknown_fields_field(&unknown_iter);
+                unknown_fields_checked = true;
+                
+                /* A delta contains all the unknown fields if any changed */
+                if (has_unknown_fields && delta)
+                    pb_field_set_to_default(&unknown_iter);
+            }
+            
+            if (has_unknown_fields)
+            {
+                if (!store_unknown_field(stream, tag, wire_type, &unknown_iter))
+                    return false;
+                continue;
+            }
+#endif
+            
             /* No match found, skip data */
             if (!pb_skip_field(stream, wire_type))
                 return false;
             continue;
         }
         
+        if (delta)
+        {
+            if (!decode_delta_field(stream, wire_type, &iter, first_entry))
+                return false;
+            continue;
+        }
+        
         if (PB_HTYPE(iter.pos->type) == PB_HTYPE_REQUIRED
             && iter.required_field_index < PB_MAX_REQUIRED_FIELDS)
         {
@@ -902,6 +1389,9 @@ bool checkreturn pb_decode_noinit(pb_istream_t *stream, const pb_field_t fields[
             return false;
     }
     
+    if (delta)
+        return true;
+    
     /* Check that all required fields were present. */
     {
         /* First figure out the number of required fields by
@@ -910,7 +1400,6 @@ bool checkreturn pb_decode_noinit(pb_istream_t *stream, const pb_field_t fields[
          */
         unsigned req_field_count;
         pb_type_t last_type;
-        unsigned i;
         do {
             req_field_count = iter.required_field_index;
             last_type = iter.pos->type;
@@ -920,19 +1409,168 @@ bool checkreturn pb_decode_noinit(pb_istream_t *stream, const pb_field_t fields[
         if (PB_HTYPE(last_type) == PB_HTYPE_REQUIRED && iter.pos->tag != 0)
             req_field_count++;
         
-        /* Check the whole bytes */
-        for (i = 0; i < (req_field_count >> 3); i++)
+        return check_required_fields(stream, fields_seen, req_field_count);
+    }
+}
+
+bool checkreturn pb_decode_noinit(pb_istream_t *stream, const pb_field_t fields[], void *dest_struct)
+{
+    return decode_message(stream, fields, dest_struct, false);
+}
+
+bool checkreturn pb_decode_delta(pb_istream_t *stream, const pb_field_t fields[], void *dest_struct)
+{
+    return decode_message(stream, fields, dest_struct, true);
+}
+
+/* Check that the bits for all required fields are set. */
+static bool checkreturn check_required_fields(pb_istream_t *stream,
+    const uint8_t *fields_seen, unsigned req_field_count)
+{
+    unsigned i;
+    
+    if (req_field_count > PB_MAX_REQUIRED_FIELDS)
+        req_field_count = PB_MAX_REQUIRED_FIELDS;
+    
+    /* Check the whole bytes */
+    for (i = 0; i < (req_field_count >> 3); i++)
+    {
+        if (fields_seen[i] != 0xFF)
+            PB_RETURN_ERROR(stream, "missing required field");
+    }
+    
+    /* Check the remaining bits */
+    if ((req_field_count & 7) != 0 &&
+        fields_seen[req_field_count >> 3] != (0xFF >> (8 - (req_field_count & 7))))
+        PB_RETURN_ERROR(stream, "missing required field");
+    
+    return true;
+}
+
+/* Find the plan entry for a tag, starting from the entry after the previous
+ * match. Fields usually arrive in order, so the search ends quickly. */
+static bool checkreturn find_plan_field(const pb_plan_t *plan, pb_size_t *index, uint32_t tag)
+{
+    pb_size_t i = *index;
+    pb_size_t n;
+    
+    for (n = 0; n < plan->field_count; n++)
+    {
+        const pb_field_t *field = plan->entries[i].field;
+        if (field->tag == tag &&
+            PB_LTYPE(field->type) != PB_LTYPE_EXTENSION &&
+            PB_LTYPE(field->type) != PB_LTYPE_UNKNOWN)
         {
-            if (fields_seen[i] != 0xFF)
-                PB_RETURN_ERROR(stream, "missing required field");
+            *index = i;
+            return true;
         }
         
-        /* Check the remaining bits */
-        if (fields_seen[req_field_count >> 3] != (0xFF >> (8 - (req_field_count & 7))))
-            PB_RETURN_ERROR(stream, "missing required field");
+        i++;
+        if (i >= plan->field_count)
+            i = 0;
     }
     
-    return true;
+    return false;
+}
+
+bool checkreturn pb_decode_noinit_with_plan(pb_istream_t *stream, const pb_plan_t *plan, void *dest_struct)
+{
+    uint8_t fields_seen[(PB_MAX_REQUIRED_FIELDS + 7) / 8] = {0, 0, 0, 0, 0, 0, 0, 0};
+    pb_size_t index = 0;
+    pb_field_iter_t iter;
+    
+    invalidate_encode_cache(plan->info, dest_struct);
+    
+    while (stream->bytes_left)
+    {
+        uint32_t tag;
+        pb_wire_type_t wire_type;
+        bool eof;
+        
+        if (!pb_decode_tag(stream, &wire_type, &tag, &eof))
+        {
+            if (eof)
+                break;
+            else
+                return false;
+        }
+        
+        if (!find_plan_field(plan, &index, tag))
+        {
+            /* No match found, check if it matches an extension. */
+            if (plan->extension_index < plan->field_count &&
+                tag >= plan->entries[plan->extension_index].field->tag)
+            {
+                size_t pos = stream->bytes_left;
+                
+                pb_plan_iter(&iter, plan, plan->extension_index, dest_struct);
+                if (!decode_extension(stream, tag, wire_type, &iter))
+                    return false;
+                
+                if (pos != stream->bytes_left)
+                    continue;
+            }
+            
+#ifdef PB_ENABLE_UNKNOWN_FIELDS
+            if (plan->unknown_index < plan->field_count)
+            {
+                pb_plan_iter(&iter, plan, plan->unknown_index, dest_struct);
+                if (!store_unknown_field(stream, tag, wire_type, &iter))
+                    return false;
+                continue;
+            }
+#endif
+            
+            if (!pb_skip_field(stream, wire_type))
+                return false;
+            continue;
+        }
+        
+        pb_plan_iter(&iter, plan, index, dest_struct);
+        
+        if (PB_HTYPE(iter.pos->type) == PB_HTYPE_REQUIRED
+            && iter.required_field_index < PB_MAX_REQUIRED_FIELDS)
+        {
+            uint8_t tmp = (uint8_t)(1 << (iter.required_field_index & 7));
+            fields_seen[iter.required_field_index >> 3] |= tmp;
+        }
+        
+        if (!decode_field(stream, wire_type, &iter))
+            return false;
+    }
+    
+    return check_required_fields(stream, fields_seen, plan->required_count);
+}
+
+bool checkreturn pb_decode_with_plan(pb_istream_t *stream, const pb_plan_t *plan, void *dest_struct)
+{
+    bool status;
+    pb_size_t i;
+    
+    if (plan->info != NULL && plan->info->default_image != NULL)
+    {
+        memcpy(dest_struct, plan->info->default_image->data, plan->info->default_image->size);
+    }
+    else
+    {
+        for (i = 0; i < plan->field_count; i++)
+        {
+            pb_field_iter_t iter;
+            pb_plan_iter(&iter, plan, i, dest_struct);
+            if (PB_HAS_PRESENCE_BIT(iter.pos))
+                *(pb_presence_t*)dest_struct = 0;
+            pb_field_set_to_default(&iter);
+        }
+    }
+    
+    status = pb_decode_noinit_with_plan(stream, plan, dest_struct);
+    
+#ifdef PB_ENABLE_MALLOC
+    if (!status && (plan->flags & PB_PLAN_HAS_POINTERS))
+        pb_release(plan->fields, dest_struct);
+#endif
+    
+    return status;
 }
 
 bool checkreturn pb_decode(pb_istream_t *stream, const pb_field_t fields[], void *dest_struct)
@@ -962,11 +1600,149 @@ bool pb_decode_delimited(pb_istream_t *stream, const pb_field_t fields[], void *
     return status;
 }
 
+bool pb_decode_any(pb_istream_t *stream, const pb_msgid_table_t *table,
+                   uint32_t *msgid, void *dest_union)
+{
+    const pb_msgid_entry_t *entry;
+    pb_istream_t substream;
+    bool status;
+    
+    if (!pb_decode_varint32(stream, msgid))
+        return false;
+    
+    if (!pb_make_string_substream(stream, &substream))
+        return false;
+    
+    entry = pb_msgid_lookup(table, *msgid);
+    if (entry == NULL)
+    {
+        /* Skip the message, so that the next one can be decoded */
+        status = pb_read(&substream, NULL, substream.bytes_left);
+        pb_close_string_substream(stream, &substream);
+        if (status)
+            PB_SET_ERROR(stream, "unknown msgid");
+        return false;
+    }
+    
+    status = pb_decode(&substream, entry->fields, dest_union);
+    pb_close_string_substream(stream, &substream);
+    return status;
+}
+
+/* Overwrite all occurrences of the field given by tag_path in the message
+ * in a buffer stream. The stream state points to the next byte to read. */
+static bool checkreturn patch_fixed(pb_istream_t *stream, const pb_field_t fields[],
+    const uint32_t tag_path[], const void *value, bool *found)
+{
+    pb_field_iter_t iter;
+    pb_type_t ltype;
+    const void *ptr;
+    pb_wire_type_t wire_type;
+    uint32_t tag;
+    bool eof;
+    
+    /* Only the field descriptors are needed, there is no structure. */
+    if (!pb_field_iter_begin(&iter, fields, stream) ||
+        !pb_field_iter_find(&iter, tag_path[0]))
+    {
+        PB_RETURN_ERROR(stream, "field not found");
+    }
+    
+    ltype = PB_LTYPE(iter.pos->type);
+    ptr = iter.pos->ptr;
+    
+    if (tag_path[1] != 0)
+    {
+        if (ltype == PB_LTYPE_SUBMSG_SOA)
+            ptr = ((const pb_soa_t*)ptr)->fields;
+        else if (ltype != PB_LTYPE_SUBMESSAGE)
+            PB_RETURN_ERROR(stream, "invalid field type");
+    }
+    else if (ltype != PB_LTYPE_FIXED32 && ltype != PB_LTYPE_FIXED64)
+    {
+        PB_RETURN_ERROR(stream, "invalid field type");
+    }
+    
+    while (pb_decode_tag(stream, &wire_type, &tag, &eof))
+    {
+        if (tag != tag_path[0])
+        {
+            if (!pb_skip_field(stream, wire_type))
+                return false;
+        }
+        else if (tag_path[1] != 0)
+        {
+            pb_istream_t substream;
+            bool status;
+            
+            if (wire_type != PB_WT_STRING)
+                PB_RETURN_ERROR(stream, "wrong wire type");
+            
+            if (!pb_make_string_substream(stream, &substream))
+                return false;
+            
+            status = patch_fixed(&substream, (const pb_field_t*)ptr, tag_path + 1, value, found);
+            pb_close_string_substream(stream, &substream);
+            
+            if (!status)
+                return false;
+        }
+        else
+        {
+            size_t size = (ltype == PB_LTYPE_FIXED32) ? 4 : 8;
+            uint8_t *dest = (uint8_t*)stream->state;
+            uint64_t bits;
+            size_t i;
+            
+            if (wire_type != (size == 4 ? PB_WT_32BIT : PB_WT_64BIT))
+                PB_RETURN_ERROR(stream, "wrong wire type");
+            
+            if (!pb_read(stream, NULL, size))
+                return false;
+            
+            /* Write the value in little-endian order regardless of
+             * the byte order of the platform. */
+            if (size == 4)
+            {
+                uint32_t bits32;
+                memcpy(&bits32, value, 4);
+                bits = bits32;
+            }
+            else
+            {
+                memcpy(&bits, value, 8);
+            }
+            
+            for (i = 0; i < size; i++)
+            {
+                dest[i] = (uint8_t)(bits & 0xFF);
+                bits >>= 8;
+            }
+            *found = true;
+        }
+    }
+    
+    return eof;
+}
+
+bool pb_patch_fixed(uint8_t *buf, size_t len, const pb_field_t fields[],
+                    const uint32_t tag_path[], const void *value)
+{
+    pb_istream_t stream = pb_istream_from_buffer(buf, len);
+    bool found = false;
+    
+    if (tag_path[0] == 0)
+        return false;
+    
+    return patch_fixed(&stream, fields, tag_path, value, &found) && found;
+}
+
 #ifdef PB_ENABLE_MALLOC
 /* Given an oneof field, if there has already been a field inside this oneof,
  * release it before overwriting with a different one. */
 static bool pb_release_union_field(pb_istream_t *stream, pb_field_iter_t *iter)
 {
+    pb_field_iter_t old_field;
     pb_size_t old_tag = *(pb_size_t*)iter->pSize; /* Previous which_ value */
     pb_size_t new_tag = iter->pos->tag; /* New which_ value */
 
@@ -976,18 +1752,17 @@ static bool pb_release_union_field(pb_istream_t *stream, pb_field_iter_t *iter)
     if (old_tag == new_tag)
         return true; /* Ok, old data is of same type => merge */
 
-    /* Release old data. The find can fail if the message struct contains
+    /* Release old data. The old field is looked up with a new iterator,
+     * because the iterator may come from pb_plan_iter() and then cannot
+     * be advanced. The find can fail if the message struct contains
      * invalid data. */
-    if (!pb_field_iter_find(iter, old_tag))
+    if (!pb_field_iter_begin(&old_field, iter->start, iter->dest_struct) ||
+        !pb_field_iter_find(&old_field, old_tag))
+    {
         PB_RETURN_ERROR(stream, "invalid union tag");
+    }
 
-    pb_release_single_field(iter);
-
-    /* Restore iterator to where it should be.
-     * This shouldn't fail unless the pb_field_t structure is corrupted. */
-    if (!pb_field_iter_find(iter, new_tag))
-        PB_RETURN_ERROR(stream, "iterator error");
-    
+    pb_release_single_field(&old_field);
     return true;
 }
 
@@ -1012,8 +1787,21 @@ static void pb_release_single_field(const pb_field_iter_t *iter)
         while (ext != NULL)
         {
             pb_field_iter_t ext_iter;
-            iter_from_extension(&ext_iter, ext);
-            pb_release_single_field(&ext_iter);
+            if (ext->type == &pb_extension_registry_type)
+            {
+                const pb_extension_registry_t *registry = (const pb_extension_registry_t*)ext->dest;
+                pb_size_t i;
+                for (i = 0; i < registry->count; i++)
+                {
+                    iter_from_extension(&ext_iter, registry->entries[i]);
+                    pb_release_single_field(&ext_iter);
+                }
+            }
+            else
+            {
+                iter_from_extension(&ext_iter, ext);
+                pb_release_single_field(&ext_iter);
+            }
             ext = ext->next;
         }
     }
@@ -1318,6 +2106,8 @@ static bool checkreturn pb_dec_submessage(pb_istream_t *stream, const pb_field_t
     if (field->ptr == NULL)
         PB_RETURN_ERROR(stream, "invalid field descriptor");
     
+    PB_STATS_NEST(&substream);
+    
     /* New array entries need to be initialized, while required and optional
      * submessages have already been initialized in the top-level pb_decode. */
     if (PB_HTYPE(field->type) == PB_HTYPE_REPEATED)
@@ -43,6 +43,14 @@ struct pb_istream_s
 #ifndef PB_NO_ERRMSG
     const char *errmsg;
 #endif
+
+#ifdef PB_ENABLE_STATS
+    pb_stats_t stats;
+#endif
+
+#ifdef PB_ENABLE_TRACE
+    const pb_trace_t *trace;
+#endif
 };
 
 /***************************
@@ -79,12 +87,63 @@ bool pb_decode(pb_istream_t *stream, const pb_field_t fields[], void *dest_struc
  */
 bool pb_decode_noinit(pb_istream_t *stream, const pb_field_t fields[], void *dest_struct);
 
+/* Apply a message encoded with pb_encode_delta() to the structure, which
+ * should hold the same values as the previous structure given to the
+ * encoder. Works like pb_decode_noinit(), except that required fields may
+ * be missing, arrays in the input replace the previous contents, and
+ * submessages that are already present are updated recursively.
+ */
+bool pb_decode_delta(pb_istream_t *stream, const pb_field_t fields[], void *dest_struct);
+
 /* Same as pb_decode, except expects the stream to start with the message size
  * encoded as varint. Corresponds to parseDelimitedFrom() in Google's
  * protobuf API.
  */
 bool pb_decode_delimited(pb_istream_t *stream, const pb_field_t fields[], void *dest_struct);
 
+/* Decode a message written by pb_encode_any(): the msgid and the length of
+ * the message as varints, followed by the message. The msgid selects the
+ * message type from the table generated for the .proto file, and the
+ * message is decoded into dest_union, which is usually the generated union
+ * of the message types. Messages with unknown ids are skipped, and the
+ * function returns false with *msgid set.
+ *
+ * Example usage:
+ *    MYPROTO_msgid_union msg;
+ *    uint32_t msgid;
+ *
+ *    if (pb_decode_any(&stream, &MYPROTO_msgid_table, &msgid, &msg) &&
+ *        msgid == MyMessage_msgid)
+ *        handle_my_message(&msg.MyMessage_msg);
+ */
+bool pb_decode_any(pb_istream_t *stream, const pb_msgid_table_t *table,
+                   uint32_t *msgid, void *dest_union);
+
+/* Same as pb_decode and pb_decode_noinit, but take the field information
+ * from a plan created with pb_compile_plan(). The plan avoids walking the
+ * field array for every field, which is useful when decoding many messages
+ * of the same type. Submessages are still decoded using their field arrays.
+ */
+bool pb_decode_with_plan(pb_istream_t *stream, const pb_plan_t *plan, void *dest_struct);
+bool pb_decode_noinit_with_plan(pb_istream_t *stream, const pb_plan_t *plan, void *dest_struct);
+
+/* Overwrite the value of a fixed32, sfixed32, float, fixed64, sfixed64 or
+ * double field in an already encoded message of len bytes in buf. The
+ * tag_path lists the tags of the submessage fields that lead to the field,
+ * then the tag of the field itself, and is terminated by 0. The value must
+ * point to a 4- or 8-byte wide C variable, same as for pb_decode_fixed32().
+ * All occurrences of the field are overwritten, and the encoded size of the
+ * message does not change. Returns false if the field was not found or if
+ * the message could not be parsed, in which case some occurrences may have
+ * already been overwritten.
+ *
+ * Example usage:
+ *    static const uint32_t path[] = {Response_header_tag, Header_timeStamp_tag, 0};
+ *    pb_patch_fixed(buffer, size, Response_fields, path, &now);
+ */
+bool pb_patch_fixed(uint8_t *buf, size_t len, const pb_field_t fields[],
+                    const uint32_t tag_path[], const void *value);
+
 #ifdef PB_ENABLE_MALLOC
 /* Release any allocated pointer fields. If you use dynamic allocation, you should
  * call this for any successfully decoded message when you are done with it. If
@@ -126,6 +185,11 @@ bool pb_skip_field(pb_istream_t *stream, pb_wire_type_t wire_type);
  * int64, uint32 and uint64 field types. */
 bool pb_decode_varint(pb_istream_t *stream, uint64_t *dest);
 
+/* Same as pb_decode_varint, but for values that fit in 32 bits. This is
+ * used for tags and lengths, and fails on larger values, including 5-byte
+ * varints that have any of the bits 32-34 set. */
+bool pb_decode_varint32(pb_istream_t *stream, uint32_t *dest);
+
 /* Decode an integer in the zig-zagged svarint format. This works for sint32
  * and sint64. */
 bool pb_decode_svarint(pb_istream_t *stream, int64_t *dest);
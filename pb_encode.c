@@ -23,10 +23,36 @@
 typedef bool (*pb_encoder_t)(pb_ostream_t *stream, const pb_field_t *field, const void *src) checkreturn;
 
 static bool checkreturn buf_write(pb_ostream_t *stream, const uint8_t *buf, size_t count);
-static bool checkreturn encode_array(pb_ostream_t *stream, const pb_field_t *field, const void *pData, size_t count, pb_encoder_t func);
-static bool checkreturn encode_field(pb_ostream_t *stream, const pb_field_t *field, const void *pData);
+static bool checkreturn encode_tag_for_entry(pb_ostream_t *stream, const pb_field_t *field, const pb_plan_field_t *entry);
+static bool checkreturn encode_array(pb_ostream_t *stream, const pb_field_t *field, const void *pData, size_t count, pb_encoder_t func, const pb_plan_field_t *entry);
+static bool checkreturn encode_basic_field(pb_ostream_t *stream, const pb_field_t *field, const void *pData, const pb_plan_field_t *entry);
+static bool checkreturn encode_basic_field_at(pb_ostream_t *stream, const pb_field_t *field, const void *pData, const void *pSize, const pb_plan_field_t *entry);
+#ifdef PB_ENABLE_SOA
+static bool checkreturn encode_soa_entry(pb_ostream_t *stream, const pb_soa_t *soa, const void *columns, pb_size_t index);
+static bool checkreturn encode_soa_field(pb_ostream_t *stream, const pb_field_t *field, const void *columns, pb_size_t count, const pb_plan_field_t *entry);
+#endif
+static bool checkreturn encode_field(pb_ostream_t *stream, const pb_field_t *fields, const pb_field_t *field, const void *pData, const pb_plan_field_t *entry);
+static bool checkreturn encode_field_by_atype(pb_ostream_t *stream, const pb_field_t *field, const void *pData, const pb_plan_field_t *entry);
+#ifdef PB_ENABLE_TRACE
+static bool checkreturn trace_encode_field(pb_ostream_t *stream, const pb_field_t *fields, const pb_field_t *field, const void *pData, const pb_plan_field_t *entry);
+#endif
+static bool field_is_present(const pb_field_t *field, const void *src_struct);
+static pb_size_t count_trailing_zeros(pb_presence_t value);
+static size_t fixed_encoded_size(const pb_field_t fields[]);
+static bool field_has_value(const pb_field_t *field, const void *src_struct, const void *pData);
+static bool values_equal(const pb_field_t *field, const void *a, const void *b);
+static bool messages_equal(const pb_field_t fields[], const void *a, const void *b);
+static bool field_differs(const pb_field_t *field, const void *cur_struct, const void *prev_struct, const void *pData);
+static bool checkreturn encode_delta_submessage(pb_ostream_t *stream, const pb_field_t *field, const void *cur, const void *prev);
+static const pb_cache_info_t *find_cache_info(const pb_field_t fields[]);
+static const pb_cache_info_t *tracked_submessage(const pb_field_t *field);
+static bool cache_is_stale(const pb_field_t fields[], const pb_cache_info_t *info, const void *src_struct);
+static bool checkreturn encode_tracked_fields(pb_ostream_t *stream, const pb_field_t fields[], const pb_cache_info_t *info, void *src_struct);
+static bool checkreturn refresh_cache(pb_ostream_t *stream, const pb_field_t fields[], const pb_cache_info_t *info, void *src_struct);
+static void *remove_const(const void *p);
 static bool checkreturn default_extension_encoder(pb_ostream_t *stream, const pb_extension_t *extension);
 static bool checkreturn encode_extension_field(pb_ostream_t *stream, const pb_field_t *field, const void *pData);
+static bool checkreturn encode_unknown_fields(pb_ostream_t *stream, const pb_field_t *field, const void *pData);
 static bool checkreturn pb_enc_varint(pb_ostream_t *stream, const pb_field_t *field, const void *src);
 static bool checkreturn pb_enc_uvarint(pb_ostream_t *stream, const pb_field_t *field, const void *src);
 static bool checkreturn pb_enc_svarint(pb_ostream_t *stream, const pb_field_t *field, const void *src);
@@ -49,7 +75,9 @@ static const pb_encoder_t PB_ENCODERS[PB_LTYPES_COUNT] = {
     &pb_enc_bytes,
     &pb_enc_string,
     &pb_enc_submessage,
-    NULL /* extensions */
+    NULL, /* extensions */
+    NULL, /* unknown fields */
+    NULL /* struct-of-arrays submessages */
 };
 
 /*******************************
@@ -80,6 +108,12 @@ pb_ostream_t pb_ostream_from_buffer(uint8_t *buf, size_t bufsize)
     stream.bytes_written = 0;
 #ifndef PB_NO_ERRMSG
     stream.errmsg = NULL;
+#endif
+#ifdef PB_ENABLE_STATS
+    memset(&stream.stats, 0, sizeof(stream.stats));
+#endif
+#ifdef PB_ENABLE_TRACE
+    stream.trace = NULL;
 #endif
     return stream;
 }
@@ -97,7 +131,9 @@ bool checkreturn pb_write(pb_ostream_t *stream, const uint8_t *buf, size_t count
 #else        
         if (!stream->callback(stream, buf, count))
             PB_RETURN_ERROR(stream, "io error");
+        PB_STATS_ADD(stream, callbacks, stream->callback != buf_write);
 #endif
+        PB_STATS_ADD(stream, bytes, count);
     }
     
     stream->bytes_written += count;
@@ -108,9 +144,24 @@ bool checkreturn pb_write(pb_ostream_t *stream, const uint8_t *buf, size_t count
  * Encode a single field *
  *************************/
 
+/* Write the tag of a field. If a plan entry is available, the tag has
+ * already been encoded by pb_compile_plan(). */
+static bool checkreturn encode_tag_for_entry(pb_ostream_t *stream,
+    const pb_field_t *field, const pb_plan_field_t *entry)
+{
+    if (entry != NULL)
+    {
+        PB_STATS_ADD(stream, fields, 1);
+        return pb_write(stream, entry->tag_bytes, entry->tag_size);
+    }
+    else
+        return pb_encode_tag_for_field(stream, field);
+}
+
 /* Encode a static array. Handles the size calculations and possible packing. */
 static bool checkreturn encode_array(pb_ostream_t *stream, const pb_field_t *field,
-                         const void *pData, size_t count, pb_encoder_t func)
+                         const void *pData, size_t count, pb_encoder_t func,
+                         const pb_plan_field_t *entry)
 {
     size_t i;
     const void *p;
@@ -125,8 +176,15 @@ static bool checkreturn encode_array(pb_ostream_t *stream, const pb_field_t *fie
     /* We always pack arrays if the datatype allows it. */
     if (PB_LTYPE(field->type) <= PB_LTYPE_LAST_PACKABLE)
     {
-        if (!pb_encode_tag(stream, PB_WT_STRING, field->tag))
+        if (entry != NULL)
+        {
+            if (!pb_write(stream, entry->tag_bytes, entry->tag_size))
+                return false;
+        }
+        else if (!pb_encode_tag(stream, PB_WT_STRING, field->tag))
+        {
             return false;
+        }
         
         /* Determine the total size of packed array. */
         if (PB_LTYPE(field->type) == PB_LTYPE_FIXED32)
@@ -170,7 +228,7 @@ static bool checkreturn encode_array(pb_ostream_t *stream, const pb_field_t *fie
         p = pData;
         for (i = 0; i < count; i++)
         {
-            if (!pb_encode_tag_for_field(stream, field))
+            if (!encode_tag_for_entry(stream, field, entry))
                 return false;
 
             /* Normally the data is stored directly in the array entries, but
@@ -199,17 +257,28 @@ static bool checkreturn encode_array(pb_ostream_t *stream, const pb_field_t *fie
 /* Encode a field with static or pointer allocation, i.e. one whose data
  * is available to the encoder directly. */
 static bool checkreturn encode_basic_field(pb_ostream_t *stream,
-    const pb_field_t *field, const void *pData)
+    const pb_field_t *field, const void *pData, const pb_plan_field_t *entry)
+{
+    const void *pSize = NULL;
+    
+    if (field->size_offset)
+        pSize = (const char*)pData + field->size_offset;
+    
+    return encode_basic_field_at(stream, field, pData, pSize, entry);
+}
+
+/* Encode a field whose has_ or _count member is at pSize, which need not
+ * be next to the data. NULL means that the field has no such member. */
+static bool checkreturn encode_basic_field_at(pb_ostream_t *stream,
+    const pb_field_t *field, const void *pData, const void *pSize,
+    const pb_plan_field_t *entry)
 {
     pb_encoder_t func;
-    const void *pSize;
     bool implicit_has = true;
     
     func = PB_ENCODERS[PB_LTYPE(field->type)];
     
-    if (field->size_offset)
-        pSize = (const char*)pData + field->size_offset;
-    else
+    if (pSize == NULL)
         pSize = &implicit_has;
 
     if (PB_ATYPE(field->type) == PB_ATYPE_POINTER)
@@ -228,7 +297,7 @@ static bool checkreturn encode_basic_field(pb_ostream_t *stream,
         case PB_HTYPE_REQUIRED:
             if (!pData)
                 PB_RETURN_ERROR(stream, "missing required field");
-            if (!pb_encode_tag_for_field(stream, field))
+            if (!encode_tag_for_entry(stream, field, entry))
                 return false;
             if (!func(stream, field, pData))
                 return false;
@@ -237,7 +306,7 @@ static bool checkreturn encode_basic_field(pb_ostream_t *stream,
         case PB_HTYPE_OPTIONAL:
             if (*(const bool*)pSize)
             {
-                if (!pb_encode_tag_for_field(stream, field))
+                if (!encode_tag_for_entry(stream, field, entry))
                     return false;
             
                 if (!func(stream, field, pData))
@@ -246,14 +315,25 @@ static bool checkreturn encode_basic_field(pb_ostream_t *stream,
             break;
         
         case PB_HTYPE_REPEATED:
-            if (!encode_array(stream, field, pData, *(const pb_size_t*)pSize, func))
+            if (PB_LTYPE(field->type) == PB_LTYPE_SUBMSG_SOA)
+            {
+#ifdef PB_ENABLE_SOA
+                if (!encode_soa_field(stream, field, pData, *(const pb_size_t*)pSize, entry))
+                    return false;
+#else
+                PB_RETURN_ERROR(stream, "no soa support");
+#endif
+            }
+            else if (!encode_array(stream, field, pData, *(const pb_size_t*)pSize, func, entry))
+            {
                 return false;
+            }
             break;
         
         case PB_HTYPE_ONEOF:
             if (*(const pb_size_t*)pSize == field->tag)
             {
-                if (!pb_encode_tag_for_field(stream, field))
+                if (!encode_tag_for_entry(stream, field, entry))
                     return false;
 
                 if (!func(stream, field, pData))
@@ -268,6 +348,115 @@ static bool checkreturn encode_basic_field(pb_ostream_t *stream,
     return true;
 }
 
+#ifdef PB_ENABLE_SOA
+/* Encode the fields of one entry of a struct-of-arrays field, as if the
+ * entry was a submessage structure. */
+static bool checkreturn encode_soa_entry(pb_ostream_t *stream,
+    const pb_soa_t *soa, const void *columns, pb_size_t index)
+{
+    pb_field_iter_t iter;
+    pb_field_iter_t entry_iter;
+    pb_size_t column = 0;
+    
+    if (!pb_field_iter_begin(&iter, soa->fields, remove_const(columns)))
+        return true; /* Empty message type */
+    
+    do {
+        pb_field_iter_copy(&entry_iter, &iter);
+        pb_soa_iter(&entry_iter, &soa->columns[column], remove_const(columns), index);
+        
+        if (!encode_basic_field_at(stream, entry_iter.pos, entry_iter.pData,
+                                   entry_iter.pSize, NULL))
+            return false;
+        
+        column++;
+    } while (pb_field_iter_next(&iter));
+    
+    return true;
+}
+
+/* Encode the entries of a struct-of-arrays field. Each entry is encoded
+ * the same way as pb_encode_submessage() encodes a submessage. */
+static bool checkreturn encode_soa_field(pb_ostream_t *stream,
+    const pb_field_t *field, const void *columns, pb_size_t count,
+    const pb_plan_field_t *entry)
+{
+    const pb_soa_t *soa = (const pb_soa_t*)field->ptr;
+    pb_size_t i;
+    
+    if (soa == NULL)
+        PB_RETURN_ERROR(stream, "invalid field descriptor");
+    
+    if (count > field->array_size)
+        PB_RETURN_ERROR(stream, "array max size exceeded");
+    
+    for (i = 0; i < count; i++)
+    {
+        pb_ostream_t substream = PB_OSTREAM_SIZING;
+        size_t size;
+        bool status;
+        
+        if (!encode_tag_for_entry(stream, field, entry))
+            return false;
+        
+        PB_STATS_OPEN(stream, &substream);
+        PB_STATS_NEST(&substream);
+        status = encode_soa_entry(&substream, soa, columns, i);
+        PB_STATS_CLOSE(stream, &substream);
+        
+        if (!status)
+        {
+#ifndef PB_NO_ERRMSG
+            stream->errmsg = substream.errmsg;
+#endif
+            return false;
+        }
+        
+        size = substream.bytes_written;
+        
+        if (!pb_encode_varint(stream, (uint64_t)size))
+            return false;
+        
+        if (stream->callback == NULL)
+        {
+            if (!pb_write(stream, NULL, size))
+                return false;
+            continue;
+        }
+        
+        if (stream->bytes_written + size > stream->max_size)
+            PB_RETURN_ERROR(stream, "stream full");
+        
+        substream.callback = stream->callback;
+        substream.state = stream->state;
+        substream.max_size = size;
+        substream.bytes_written = 0;
+#ifndef PB_NO_ERRMSG
+        substream.errmsg = NULL;
+#endif
+        PB_STATS_OPEN(stream, &substream);
+        PB_STATS_NEST(&substream);
+        
+        status = encode_soa_entry(&substream, soa, columns, i);
+        
+        stream->bytes_written += substream.bytes_written;
+        stream->state = substream.state;
+#ifndef PB_NO_ERRMSG
+        stream->errmsg = substream.errmsg;
+#endif
+        PB_STATS_CLOSE(stream, &substream);
+        
+        if (!status)
+            return false;
+        
+        if (substream.bytes_written != size)
+            PB_RETURN_ERROR(stream, "submsg size changed");
+    }
+    
+    return true;
+}
+#endif
+
 /* Encode a field with callback semantics. This means that a user function is
  * called to provide and encode the actual data. */
 static bool checkreturn encode_callback_field(pb_ostream_t *stream,
@@ -289,15 +478,62 @@ static bool checkreturn encode_callback_field(pb_ostream_t *stream,
     return true;
 }
 
-/* Encode a single field of any callback or static type. */
-static bool checkreturn encode_field(pb_ostream_t *stream,
-    const pb_field_t *field, const void *pData)
+/* Encode a single field of any callback or static type.
+ * The fields array of the message is only used for tracing.
+ * The plan entry is optional, NULL means that the tag is encoded normally. */
+static bool checkreturn encode_field(pb_ostream_t *stream, const pb_field_t *fields,
+    const pb_field_t *field, const void *pData, const pb_plan_field_t *entry)
+{
+#ifdef PB_ENABLE_TRACE
+    /* The size calculation pass is included in the time of the
+     * enclosing submessage field, but not reported separately. */
+    if (stream->trace != NULL && stream->callback != NULL)
+        return trace_encode_field(stream, fields, field, pData, entry);
+#else
+    PB_UNUSED(fields);
+#endif
+
+    return encode_field_by_atype(stream, field, pData, entry);
+}
+
+#ifdef PB_ENABLE_TRACE
+/* Encode the field and pass its position, size and encoding time to the
+ * trace hook, if it wrote anything. */
+static bool checkreturn trace_encode_field(pb_ostream_t *stream, const pb_field_t *fields,
+    const pb_field_t *field, const void *pData, const pb_plan_field_t *entry)
+{
+    const pb_trace_t *trace = stream->trace;
+    size_t start_bytes = stream->stats.bytes;
+    pb_trace_time_t start = PB_TRACE_CLOCK();
+    pb_trace_event_t event;
+    bool status;
+    
+    status = encode_field_by_atype(stream, field, pData, entry);
+    event.elapsed = PB_TRACE_CLOCK() - start;
+    
+    if (status && trace->hook != NULL && stream->stats.bytes != start_bytes)
+    {
+        event.field = field;
+        event.fields = fields;
+        event.tag = field->tag;
+        event.offset = start_bytes;
+        event.size = stream->stats.bytes - start_bytes;
+        trace->hook(&event, trace->arg);
+    }
+    
+    return status;
+}
+#endif
+
+/* Encode a field according to its allocation type */
+static bool checkreturn encode_field_by_atype(pb_ostream_t *stream,
+    const pb_field_t *field, const void *pData, const pb_plan_field_t *entry)
 {
     switch (PB_ATYPE(field->type))
     {
         case PB_ATYPE_STATIC:
         case PB_ATYPE_POINTER:
-            return encode_basic_field(stream, field, pData);
+            return encode_basic_field(stream, field, pData, entry);
         
         case PB_ATYPE_CALLBACK:
             return encode_callback_field(stream, field, pData);
@@ -319,11 +555,11 @@ static bool checkreturn default_extension_encoder(pb_ostream_t *stream,
         /* For pointer extensions, the pointer is stored directly
          * in the extension structure. This avoids having an extra
          * indirection. */
-        return encode_field(stream, field, &extension->dest);
+        return encode_field(stream, field, field, &extension->dest, NULL);
     }
     else
     {
-        return encode_field(stream, field, extension->dest);
+        return encode_field(stream, field, field, extension->dest, NULL);
     }
 }
 
@@ -338,7 +574,22 @@ static bool checkreturn encode_extension_field(pb_ostream_t *stream,
     while (extension)
     {
         bool status;
-        if (extension->type->encode)
+        if (extension->type == &pb_extension_registry_type)
+        {
+            /* Encode the registry entries in tag order */
+            const pb_extension_registry_t *registry = (const pb_extension_registry_t*)extension->dest;
+            pb_size_t i;
+            status = true;
+            for (i = 0; i < registry->count && status; i++)
+            {
+                const pb_extension_t *entry = registry->entries[i];
+                if (entry->type->encode)
+                    status = entry->type->encode(stream, entry);
+                else
+                    status = default_extension_encoder(stream, entry);
+            }
+        }
+        else if (extension->type->encode)
             status = extension->type->encode(stream, extension);
         else
             status = default_extension_encoder(stream, extension);
@@ -352,6 +603,54 @@ static bool checkreturn encode_extension_field(pb_ostream_t *stream,
     return true;
 }
 
+/* Write out the unknown fields that were stored by the decoder.
+ * They are already in the wire format, including the tags. */
+static bool checkreturn encode_unknown_fields(pb_ostream_t *stream,
+    const pb_field_t *field, const void *pData)
+{
+    const pb_bytes_array_t *unknown = (const pb_bytes_array_t*)pData;
+    
+    if (PB_BYTES_ARRAY_T_ALLOCSIZE(unknown->size) > field->data_size)
+        PB_RETURN_ERROR(stream, "unknown fields size exceeded");
+    
+    return pb_write(stream, unknown->bytes, unknown->size);
+}
+
+/* Fields generated with the presence_bitmap option have their presence
+ * stored in the has_fields word at the start of the structure. For other
+ * fields the presence is checked by encode_basic_field(). */
+static bool field_is_present(const pb_field_t *field, const void *src_struct)
+{
+    if (PB_HAS_PRESENCE_BIT(field))
+        return (*(const pb_presence_t*)src_struct & PB_PRESENCE_MASK(field)) != 0;
+    else
+        return true;
+}
+
+/* Index of the lowest set bit, value must not be 0. */
+static pb_size_t count_trailing_zeros(pb_presence_t value)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return (pb_size_t)__builtin_ctz(value);
+#else
+    pb_size_t count = 0;
+    while (!(value & 1))
+    {
+        value >>= 1;
+        count++;
+    }
+    return count;
+#endif
+}
+
+/* Messages that always encode to the same number of bytes have the size
+ * stored in their pb_message_info_t. Returns 0 for other messages. */
+static size_t fixed_encoded_size(const pb_field_t fields[])
+{
+    const pb_message_info_t *info = pb_get_message_info(fields);
+    return (info != NULL) ? info->fixed_size : 0;
+}
+
 /*********************
  * Encode all fields *
  *********************/
@@ -381,10 +680,16 @@ bool checkreturn pb_encode(pb_ostream_t *stream, const pb_field_t fields[], cons
             if (!encode_extension_field(stream, iter.pos, iter.pData))
                 return false;
         }
-        else
+        else if (PB_LTYPE(iter.pos->type) == PB_LTYPE_UNKNOWN)
+        {
+            /* Raw data of fields that were not known to the decoder */
+            if (!encode_unknown_fields(stream, iter.pos, iter.pData))
+                return false;
+        }
+        else if (field_is_present(iter.pos, src_struct))
         {
             /* Regular field */
-            if (!encode_field(stream, iter.pos, iter.pData))
+            if (!encode_field(stream, fields, iter.pos, iter.pData, NULL))
                 return false;
         }
     } while (pb_field_iter_next(&iter));
@@ -392,15 +697,333 @@ bool checkreturn pb_encode(pb_ostream_t *stream, const pb_field_t fields[], cons
     return true;
 }
 
+bool checkreturn pb_encode_with_plan(pb_ostream_t *stream, const pb_plan_t *plan, const void *src_struct)
+{
+    pb_size_t i;
+    
+    if (plan->flags & PB_PLAN_PRESENCE_ONLY)
+    {
+        /* Only visit the fields whose presence bit is set. Bit n
+         * belongs to the entry n, so the fields are still encoded
+         * in the order of the field array. */
+        pb_presence_t present = *(const pb_presence_t*)src_struct;
+        
+        while (present)
+        {
+            const pb_plan_field_t *entry;
+            i = count_trailing_zeros(present);
+            present &= (pb_presence_t)(present - 1);
+            
+            if (i >= plan->field_count)
+                break;
+            
+            entry = &plan->entries[i];
+            if (!encode_field(stream, plan->fields, entry->field, (const char*)src_struct + entry->data_offset, entry))
+                return false;
+        }
+        
+        return true;
+    }
+    
+    for (i = 0; i < plan->field_count; i++)
+    {
+        const pb_plan_field_t *entry = &plan->entries[i];
+        const void *pData = (const char*)src_struct + entry->data_offset;
+        
+        if (i == plan->extension_index)
+        {
+            if (!encode_extension_field(stream, entry->field, pData))
+                return false;
+        }
+        else if (i == plan->unknown_index)
+        {
+            if (!encode_unknown_fields(stream, entry->field, pData))
+                return false;
+        }
+        else if (field_is_present(entry->field, src_struct))
+        {
+            if (!encode_field(stream, plan->fields, entry->field, pData, entry))
+                return false;
+        }
+    }
+    
+    return true;
+}
+
+/*****************************************
+ * Encode differences between structures *
+ *****************************************/
+
+/* Tells if a field in a structure has a value that would be encoded. */
+static bool field_has_value(const pb_field_t *field, const void *src_struct, const void *pData)
+{
+    const void *pSize = (const char*)pData + field->size_offset;
+    
+    if (PB_HAS_PRESENCE_BIT(field))
+        return field_is_present(field, src_struct);
+    
+    if (PB_ATYPE(field->type) == PB_ATYPE_POINTER &&
+        PB_HTYPE(field->type) != PB_HTYPE_REPEATED &&
+        *(const void* const*)pData == NULL)
+    {
+        return false;
+    }
+    
+    switch (PB_HTYPE(field->type))
+    {
+        case PB_HTYPE_OPTIONAL:
+            return PB_ATYPE(field->type) != PB_ATYPE_STATIC || *(const bool*)pSize;
+        
+        case PB_HTYPE_REPEATED:
+            return *(const pb_size_t*)pSize > 0;
+        
+        case PB_HTYPE_ONEOF:
+            return *(const pb_size_t*)pSize == field->tag;
+        
+        default:
+            return true;
+    }
+}
+
+/* Compare a single value of a static field. */
+static bool values_equal(const pb_field_t *field, const void *a, const void *b)
+{
+    switch (PB_LTYPE(field->type))
+    {
+        case PB_LTYPE_VARINT:
+        case PB_LTYPE_UVARINT:
+        case PB_LTYPE_SVARINT:
+        case PB_LTYPE_FIXED32:
+        case PB_LTYPE_FIXED64:
+            return memcmp(a, b, field->data_size) == 0;
+        
+        case PB_LTYPE_BYTES:
+        case PB_LTYPE_UNKNOWN:
+        {
+            const pb_bytes_array_t *x = (const pb_bytes_array_t*)a;
+            const pb_bytes_array_t *y = (const pb_bytes_array_t*)b;
+            return x->size == y->size &&
+                   PB_BYTES_ARRAY_T_ALLOCSIZE(x->size) <= field->data_size &&
+                   memcmp(x->bytes, y->bytes, x->size) == 0;
+        }
+        
+        case PB_LTYPE_STRING:
+            return strncmp((const char*)a, (const char*)b, field->data_size) == 0;
+        
+        case PB_LTYPE_SUBMESSAGE:
+            return messages_equal((const pb_field_t*)field->ptr, a, b);
+        
+        default:
+            return false;
+    }
+}
+
+/* Compare two structures field by field. Messages with callback, pointer
+ * or extension fields are never considered equal. */
+static bool messages_equal(const pb_field_t fields[], const void *a, const void *b)
+{
+    pb_field_iter_t iter;
+    
+    if (!pb_field_iter_begin(&iter, fields, remove_const(a)))
+        return true; /* Empty message type */
+    
+    do {
+        if (field_differs(iter.pos, a, b, iter.pData))
+            return false;
+    } while (pb_field_iter_next(&iter));
+    
+    return true;
+}
+
+/* Tells if the field at pData in the current structure differs from the
+ * same field in the previous structure. */
+static bool field_differs(const pb_field_t *field, const void *cur_struct,
+    const void *prev_struct, const void *pData)
+{
+    const void *pPrev = (const char*)prev_struct + ((const char*)pData - (const char*)cur_struct);
+    bool has_value = field_has_value(field, cur_struct, pData);
+    
+    if (PB_ATYPE(field->type) != PB_ATYPE_STATIC ||
+        PB_LTYPE(field->type) == PB_LTYPE_EXTENSION)
+    {
+        /* Contents are not known to the library */
+        return true;
+    }
+    
+    if (has_value != field_has_value(field, prev_struct, pPrev))
+        return true;
+    
+    if (!has_value)
+        return false;
+    
+    if (PB_HTYPE(field->type) == PB_HTYPE_REPEATED)
+    {
+        pb_size_t count = *(const pb_size_t*)((const char*)pData + field->size_offset);
+        pb_size_t i;
+        
+        if (count != *(const pb_size_t*)((const char*)pPrev + field->size_offset) ||
+            count > field->array_size ||
+            PB_LTYPE(field->type) == PB_LTYPE_SUBMSG_SOA)
+        {
+            return true;
+        }
+        
+        for (i = 0; i < count; i++)
+        {
+            size_t offset = field->data_size * (size_t)i;
+            if (!values_equal(field, (const char*)pData + offset, (const char*)pPrev + offset))
+                return true;
+        }
+        
+        return false;
+    }
+    
+    return !values_equal(field, pData, pPrev);
+}
+
+/* Encode a submessage that is present in both structures, with only the
+ * fields that differ. Nothing is written if the submessages are equal. */
+static bool checkreturn encode_delta_submessage(pb_ostream_t *stream,
+    const pb_field_t *field, const void *cur, const void *prev)
+{
+    const pb_field_t *fields = (const pb_field_t*)field->ptr;
+    pb_ostream_t substream = PB_OSTREAM_SIZING;
+    size_t size;
+    bool status;
+    
+    PB_STATS_OPEN(stream, &substream);
+    PB_STATS_NEST(&substream);
+    status = pb_encode_delta(&substream, fields, cur, prev);
+    PB_STATS_CLOSE(stream, &substream);
+    
+    if (!status)
+    {
+#ifndef PB_NO_ERRMSG
+        stream->errmsg = substream.errmsg;
+#endif
+        return false;
+    }
+    
+    size = substream.bytes_written;
+    if (size == 0)
+        return true;
+    
+    if (!pb_encode_tag_for_field(stream, field) ||
+        !pb_encode_varint(stream, (uint64_t)size))
+    {
+        return false;
+    }
+    
+    if (stream->callback == NULL)
+        return pb_write(stream, NULL, size); /* Just sizing */
+    
+    if (stream->bytes_written + size > stream->max_size)
+        PB_RETURN_ERROR(stream, "stream full");
+    
+    substream.callback = stream->callback;
+    substream.state = stream->state;
+    substream.max_size = size;
+    substream.bytes_written = 0;
+#ifndef PB_NO_ERRMSG
+    substream.errmsg = NULL;
+#endif
+    PB_STATS_OPEN(stream, &substream);
+    PB_STATS_NEST(&substream);
+    
+    status = pb_encode_delta(&substream, fields, cur, prev);
+    
+    stream->bytes_written += substream.bytes_written;
+    stream->state = substream.state;
+#ifndef PB_NO_ERRMSG
+    stream->errmsg = substream.errmsg;
+#endif
+    PB_STATS_CLOSE(stream, &substream);
+    
+    if (substream.bytes_written != size)
+        PB_RETURN_ERROR(stream, "submsg size changed");
+    
+    return status;
+}
+
+bool checkreturn pb_encode_delta(pb_ostream_t *stream, const pb_field_t fields[],
+                                 const void *cur_struct, const void *prev_struct)
+{
+    pb_field_iter_t iter;
+    if (!pb_field_iter_begin(&iter, fields, remove_const(cur_struct)))
+        return true; /* Empty message type */
+    
+    do {
+        const pb_field_t *field = iter.pos;
+        const void *pPrev = (const char*)prev_struct + ((const char*)iter.pData - (const char*)cur_struct);
+        bool status = true;
+        
+        if (PB_LTYPE(field->type) == PB_LTYPE_EXTENSION)
+        {
+            /* Extensions are always encoded */
+            status = encode_extension_field(stream, field, iter.pData);
+        }
+        else if (PB_LTYPE(field->type) == PB_LTYPE_UNKNOWN)
+        {
+            if (field_differs(field, cur_struct, prev_struct, iter.pData))
+                status = encode_unknown_fields(stream, field, iter.pData);
+        }
+        else if (!field_has_value(field, cur_struct, iter.pData))
+        {
+            /* Removing a value cannot be expressed in a merge, so the
+             * receiver would keep the old value. A oneof member that was
+             * replaced by another one is fine, the new member is sent. */
+            if (field_has_value(field, prev_struct, pPrev) &&
+                (PB_HTYPE(field->type) != PB_HTYPE_ONEOF || *(const pb_size_t*)iter.pSize == 0))
+            {
+                PB_RETURN_ERROR(stream, "field removed");
+            }
+        }
+        else if (PB_ATYPE(field->type) == PB_ATYPE_STATIC &&
+                 PB_LTYPE(field->type) == PB_LTYPE_SUBMESSAGE &&
+                 PB_HTYPE(field->type) != PB_HTYPE_REPEATED &&
+                 field_has_value(field, prev_struct, pPrev))
+        {
+            status = encode_delta_submessage(stream, field, iter.pData, pPrev);
+        }
+        else if (field_differs(field, cur_struct, prev_struct, iter.pData))
+        {
+            status = encode_field(stream, fields, field, iter.pData, NULL);
+        }
+        
+        if (!status)
+            return false;
+    } while (pb_field_iter_next(&iter));
+    
+    return true;
+}
+
 bool pb_encode_delimited(pb_ostream_t *stream, const pb_field_t fields[], const void *src_struct)
 {
     return pb_encode_submessage(stream, fields, src_struct);
 }
 
+bool pb_encode_any(pb_ostream_t *stream, const pb_msgid_table_t *table,
+                   uint32_t msgid, const void *src_struct)
+{
+    const pb_msgid_entry_t *entry = pb_msgid_lookup(table, msgid);
+    
+    if (entry == NULL)
+        PB_RETURN_ERROR(stream, "unknown msgid");
+    
+    if (!pb_encode_varint(stream, msgid))
+        return false;
+    
+    return pb_encode_submessage(stream, entry->fields, src_struct);
+}
+
 bool pb_get_encoded_size(size_t *size, const pb_field_t fields[], const void *src_struct)
 {
     pb_ostream_t stream = PB_OSTREAM_SIZING;
     
+    *size = fixed_encoded_size(fields);
+    if (*size != 0)
+        return true;
+    
     if (!pb_encode(&stream, fields, src_struct))
         return false;
     
@@ -408,6 +1031,223 @@ bool pb_get_encoded_size(size_t *size, const pb_field_t fields[], const void *sr
     return true;
 }
 
+bool pb_encode_cached(pb_ostream_t *stream, const pb_field_t fields[], const void *src_struct,
+                      pb_encode_cache_t *cache)
+{
+    if (cache->buffer == NULL)
+        return pb_encode(stream, fields, src_struct);
+    
+    if (!cache->valid)
+    {
+        pb_ostream_t substream = pb_ostream_from_buffer(cache->buffer, cache->max_size);
+        
+        if (!pb_encode(&substream, fields, src_struct))
+        {
+#ifndef PB_NO_ERRMSG
+            stream->errmsg = substream.errmsg;
+#endif
+            return false;
+        }
+        
+        cache->size = substream.bytes_written;
+        cache->valid = true;
+    }
+    
+    return pb_write(stream, cache->buffer, cache->size);
+}
+
+bool pb_get_encoded_size_cached(size_t *size, const pb_field_t fields[], const void *src_struct,
+                                pb_encode_cache_t *cache)
+{
+    if (!cache->valid)
+    {
+        if (cache->buffer != NULL)
+        {
+            pb_ostream_t stream = PB_OSTREAM_SIZING;
+            if (!pb_encode_cached(&stream, fields, src_struct, cache))
+                return false;
+        }
+        else
+        {
+            if (!pb_get_encoded_size(&cache->size, fields, src_struct))
+                return false;
+            cache->valid = true;
+        }
+    }
+    
+    *size = cache->size;
+    return true;
+}
+
+/*************************************************
+ * Encode reusing the caches of clean submessages *
+ *************************************************/
+
+/* Returns the cache information of messages with the dirty_tracking
+ * option, or NULL for other messages. Messages with only an encode cache
+ * have no dirty bits and are encoded as a whole. */
+static const pb_cache_info_t *find_cache_info(const pb_field_t fields[])
+{
+    const pb_message_info_t *info = pb_get_message_info(fields);
+    
+    if (info == NULL || info->cache_info == NULL ||
+        info->cache_info->dirty_offset == PB_NO_DIRTY_FIELDS)
+    {
+        return NULL;
+    }
+    
+    return info->cache_info;
+}
+
+/* Returns the cache information of a static, non-repeated submessage
+ * field whose type has dirty tracking, or NULL for other fields. */
+static const pb_cache_info_t *tracked_submessage(const pb_field_t *field)
+{
+    if (PB_ATYPE(field->type) != PB_ATYPE_STATIC ||
+        PB_LTYPE(field->type) != PB_LTYPE_SUBMESSAGE ||
+        PB_HTYPE(field->type) == PB_HTYPE_REPEATED)
+    {
+        return NULL;
+    }
+    
+    return find_cache_info((const pb_field_t*)field->ptr);
+}
+
+/* Tells if the cached encoding of a message is out of date, because
+ * the message itself or one of its tracked submessages has changed. */
+static bool cache_is_stale(const pb_field_t fields[], const pb_cache_info_t *info, const void *src_struct)
+{
+    const pb_encode_cache_t *cache = (const pb_encode_cache_t*)((const char*)src_struct + info->cache_offset);
+    pb_dirty_t dirty = *(const pb_dirty_t*)((const char*)src_struct + info->dirty_offset);
+    pb_field_iter_t iter;
+    
+    if (!cache->valid || cache->buffer == NULL || dirty != 0)
+        return true;
+    
+    if (!pb_field_iter_begin(&iter, fields, remove_const(src_struct)))
+        return false; /* Empty message type */
+    
+    do {
+        const pb_cache_info_t *subinfo = tracked_submessage(iter.pos);
+        
+        if (subinfo != NULL && field_has_value(iter.pos, src_struct, iter.pData) &&
+            cache_is_stale((const pb_field_t*)iter.pos->ptr, subinfo, iter.pData))
+        {
+            return true;
+        }
+    } while (pb_field_iter_next(&iter));
+    
+    return false;
+}
+
+/* Same as pb_encode(), but the tracked submessages are written from their
+ * caches. A submessage whose bit is set in the dirty bitmap is encoded
+ * again even if its own cache seems valid. Clears the dirty bitmap. */
+static bool checkreturn encode_tracked_fields(pb_ostream_t *stream, const pb_field_t fields[],
+    const pb_cache_info_t *info, void *src_struct)
+{
+    pb_dirty_t *dirty = (pb_dirty_t*)((char*)src_struct + info->dirty_offset);
+    pb_field_iter_t iter;
+    unsigned index = 0;
+    
+    if (!pb_field_iter_begin(&iter, fields, src_struct))
+        return true; /* Empty message type */
+    
+    do {
+        const pb_field_t *field = iter.pos;
+        const pb_cache_info_t *subinfo = tracked_submessage(field);
+        bool status = true;
+        
+        if (PB_LTYPE(field->type) == PB_LTYPE_EXTENSION)
+        {
+            status = encode_extension_field(stream, field, iter.pData);
+        }
+        else if (PB_LTYPE(field->type) == PB_LTYPE_UNKNOWN)
+        {
+            status = encode_unknown_fields(stream, field, iter.pData);
+        }
+        else if (subinfo != NULL)
+        {
+            if (field_has_value(field, src_struct, iter.pData))
+            {
+                const pb_field_t *subfields = (const pb_field_t*)field->ptr;
+                pb_encode_cache_t *subcache = (pb_encode_cache_t*)((char*)iter.pData + subinfo->cache_offset);
+                
+                if (index < 32 && (*dirty & ((pb_dirty_t)1 << index)))
+                    pb_invalidate_cache(subcache);
+                
+                if (!pb_encode_tag_for_field(stream, field))
+                    return false;
+                
+                if (subcache->buffer == NULL)
+                    status = pb_encode_submessage(stream, subfields, iter.pData);
+                else if (!refresh_cache(stream, subfields, subinfo, iter.pData))
+                    return false;
+                else
+                    status = pb_encode_string(stream, subcache->buffer, subcache->size);
+            }
+        }
+        else if (field_is_present(field, src_struct))
+        {
+            status = encode_field(stream, fields, field, iter.pData, NULL);
+        }
+        
+        if (!status)
+            return false;
+        
+        index++;
+    } while (pb_field_iter_next(&iter));
+    
+    *dirty = 0;
+    return true;
+}
+
+/* Encode a tracked message into its cache buffer, unless the cache is
+ * up to date. Errors are reported in the error message of stream. */
+static bool checkreturn refresh_cache(pb_ostream_t *stream, const pb_field_t fields[],
+    const pb_cache_info_t *info, void *src_struct)
+{
+    pb_encode_cache_t *cache = (pb_encode_cache_t*)((char*)src_struct + info->cache_offset);
+    pb_ostream_t substream;
+    
+    if (!cache_is_stale(fields, info, src_struct))
+        return true;
+    
+    cache->valid = false;
+    substream = pb_ostream_from_buffer(cache->buffer, cache->max_size);
+    if (!encode_tracked_fields(&substream, fields, info, src_struct))
+    {
+#ifndef PB_NO_ERRMSG
+        stream->errmsg = substream.errmsg;
+#else
+        PB_UNUSED(stream);
+#endif
+        return false;
+    }
+    
+    cache->size = substream.bytes_written;
+    cache->valid = true;
+    return true;
+}
+
+bool pb_encode_incremental(pb_ostream_t *stream, const pb_field_t fields[], void *src_struct)
+{
+    const pb_cache_info_t *info = find_cache_info(fields);
+    pb_encode_cache_t *cache;
+    
+    if (info == NULL)
+        return pb_encode(stream, fields, src_struct);
+    
+    cache = (pb_encode_cache_t*)((char*)src_struct + info->cache_offset);
+    if (cache->buffer == NULL)
+        return encode_tracked_fields(stream, fields, info, src_struct);
+    
+    if (!refresh_cache(stream, fields, info, src_struct))
+        return false;
+    
+    return pb_write(stream, cache->buffer, cache->size);
+}
+
 /********************
  * Helper functions *
  ********************/
@@ -475,9 +1315,33 @@ bool checkreturn pb_encode_fixed64(pb_ostream_t *stream, const void *value)
     #endif
 }
 
+void pb_store_fixed32(uint8_t *buf, const void *value)
+{
+    /* Shifts give little-endian order on any platform */
+    uint32_t bits;
+    memcpy(&bits, value, 4);
+    buf[0] = (uint8_t)(bits & 0xFF);
+    buf[1] = (uint8_t)((bits >> 8) & 0xFF);
+    buf[2] = (uint8_t)((bits >> 16) & 0xFF);
+    buf[3] = (uint8_t)((bits >> 24) & 0xFF);
+}
+
+void pb_store_fixed64(uint8_t *buf, const void *value)
+{
+    uint64_t bits;
+    int i;
+    memcpy(&bits, value, 8);
+    for (i = 0; i < 8; i++)
+    {
+        buf[i] = (uint8_t)(bits & 0xFF);
+        bits >>= 8;
+    }
+}
+
 bool checkreturn pb_encode_tag(pb_ostream_t *stream, pb_wire_type_t wiretype, uint32_t field_number)
 {
     uint64_t tag = ((uint64_t)field_number << 3) | wiretype;
+    PB_STATS_ADD(stream, fields, 1);
     return pb_encode_varint(stream, tag);
 }
 
@@ -503,6 +1367,7 @@ bool checkreturn pb_encode_tag_for_field(pb_ostream_t *stream, const pb_field_t
         case PB_LTYPE_BYTES:
         case PB_LTYPE_STRING:
         case PB_LTYPE_SUBMESSAGE:
+        case PB_LTYPE_SUBMSG_SOA:
             wiretype = PB_WT_STRING;
             break;
         
@@ -523,21 +1388,31 @@ bool checkreturn pb_encode_string(pb_ostream_t *stream, const uint8_t *buffer, s
 
 bool checkreturn pb_encode_submessage(pb_ostream_t *stream, const pb_field_t fields[], const void *src_struct)
 {
-    /* First calculate the message size using a non-writing substream. */
     pb_ostream_t substream = PB_OSTREAM_SIZING;
     size_t size;
     bool status;
     
-    if (!pb_encode(&substream, fields, src_struct))
+    /* First calculate the message size using a non-writing substream,
+     * unless the size is the same for all messages of this type. */
+    size = fixed_encoded_size(fields);
+    if (size == 0)
     {
+        PB_STATS_OPEN(stream, &substream);
+        PB_STATS_NEST(&substream);
+        status = pb_encode(&substream, fields, src_struct);
+        PB_STATS_CLOSE(stream, &substream);
+        
+        if (!status)
+        {
 #ifndef PB_NO_ERRMSG
-        stream->errmsg = substream.errmsg;
+            stream->errmsg = substream.errmsg;
 #endif
-        return false;
+            return false;
+        }
+        
+        size = substream.bytes_written;
     }
     
-    size = substream.bytes_written;
-    
     if (!pb_encode_varint(stream, (uint64_t)size))
         return false;
     
@@ -556,6 +1431,8 @@ bool checkreturn pb_encode_submessage(pb_ostream_t *stream, const pb_field_t fie
 #ifndef PB_NO_ERRMSG
     substream.errmsg = NULL;
 #endif
+    PB_STATS_OPEN(stream, &substream);
+    PB_STATS_NEST(&substream);
     
     status = pb_encode(&substream, fields, src_struct);
     
@@ -564,6 +1441,7 @@ bool checkreturn pb_encode_submessage(pb_ostream_t *stream, const pb_field_t fie
 #ifndef PB_NO_ERRMSG
     stream->errmsg = substream.errmsg;
 #endif
+    PB_STATS_CLOSE(stream, &substream);
     
     if (substream.bytes_written != size)
         PB_RETURN_ERROR(stream, "submsg size changed");
@@ -44,6 +44,14 @@ struct pb_ostream_s
 #ifndef PB_NO_ERRMSG
     const char *errmsg;
 #endif
+
+#ifdef PB_ENABLE_STATS
+    pb_stats_t stats;
+#endif
+
+#ifdef PB_ENABLE_TRACE
+    const pb_trace_t *trace;
+#endif
 };
 
 /***************************
@@ -71,10 +79,66 @@ bool pb_encode(pb_ostream_t *stream, const pb_field_t fields[], const void *src_
  */
 bool pb_encode_delimited(pb_ostream_t *stream, const pb_field_t fields[], const void *src_struct);
 
+/* Same as pb_encode_delimited, but first writes the msgid of the message
+ * as a varint, so that pb_decode_any() can find the message type. The
+ * table is the one generated for the .proto file that defines the message.
+ */
+bool pb_encode_any(pb_ostream_t *stream, const pb_msgid_table_t *table,
+                   uint32_t msgid, const void *src_struct);
+
 /* Encode the message to get the size of the encoded data, but do not store
  * the data. */
 bool pb_get_encoded_size(size_t *size, const pb_field_t fields[], const void *src_struct);
 
+/* Same as pb_encode, but takes the field information from a plan created
+ * with pb_compile_plan(). Avoids recomputing the field offsets and tags
+ * every time, which is useful when encoding many messages of the same type.
+ */
+bool pb_encode_with_plan(pb_ostream_t *stream, const pb_plan_t *plan, const void *src_struct);
+
+/* Same as pb_encode, but keeps the encoded message in a pb_encode_cache_t.
+ * The message is encoded only when the cache is not valid, and the cached
+ * bytes are written to the stream otherwise. Useful when the same message
+ * is sent to many streams. If the cache has no buffer, the message is
+ * encoded normally.
+ *
+ * Example usage:
+ *    uint8_t cache_buffer[MyMessage_size];
+ *    msg.encode_cache.buffer = cache_buffer;
+ *    msg.encode_cache.max_size = sizeof(cache_buffer);
+ *
+ *    MyMessage_set_field1(&msg, 42);
+ *    for (i = 0; i < count; i++)
+ *        pb_encode_cached(&streams[i], MyMessage_fields, &msg, &msg.encode_cache);
+ */
+bool pb_encode_cached(pb_ostream_t *stream, const pb_field_t fields[], const void *src_struct,
+                      pb_encode_cache_t *cache);
+
+/* Same as pb_get_encoded_size, but takes the size from the cache when it
+ * is valid. Otherwise fills in the cache, including the buffer if there is
+ * one, so that the encoded bytes can be passed directly to e.g. writev(). */
+bool pb_get_encoded_size_cached(size_t *size, const pb_field_t fields[], const void *src_struct,
+                                pb_encode_cache_t *cache);
+
+/* Encode a message with the dirty_tracking option, reusing the cached
+ * encodings of the message and of its tracked submessages that have not
+ * changed since the previous call. Only the changed submessages are
+ * encoded again. The caches are updated and the dirty bitmaps cleared.
+ * Other messages are encoded with pb_encode().
+ */
+bool pb_encode_incremental(pb_ostream_t *stream, const pb_field_t fields[], void *src_struct);
+
+/* Encode only the fields of cur_struct that differ from prev_struct, so that
+ * decoding the result with pb_decode_delta() into a copy of prev_struct gives
+ * cur_struct. Submessages present in both are compared field by field.
+ * Removing a value cannot be expressed, so the function fails with the
+ * error "field removed" if a field of prev_struct is missing from cur_struct.
+ * Send the whole message with pb_encode() in that case. Callback, pointer
+ * and extension fields are encoded whenever they are present.
+ */
+bool pb_encode_delta(pb_ostream_t *stream, const pb_field_t fields[],
+                     const void *cur_struct, const void *prev_struct);
+
 /**************************************
  * Functions for manipulating streams *
  **************************************/
@@ -98,10 +162,22 @@ pb_ostream_t pb_ostream_from_buffer(uint8_t *buf, size_t bufsize);
  *    printf("Message size is %d\n", stream.bytes_written);
  */
 #ifndef PB_NO_ERRMSG
-#define PB_OSTREAM_SIZING {0,0,0,0,0}
+#define PB_OSTREAM_SIZING_ERRMSG ,0
+#else
+#define PB_OSTREAM_SIZING_ERRMSG
+#endif
+#ifdef PB_ENABLE_STATS
+#define PB_OSTREAM_SIZING_STATS ,{0,0,0,0,0,0,0,0,0,0}
+#else
+#define PB_OSTREAM_SIZING_STATS
+#endif
+#ifdef PB_ENABLE_TRACE
+#define PB_OSTREAM_SIZING_TRACE ,0
 #else
-#define PB_OSTREAM_SIZING {0,0,0,0}
+#define PB_OSTREAM_SIZING_TRACE
 #endif
+#define PB_OSTREAM_SIZING \
+    {0,0,0,0 PB_OSTREAM_SIZING_ERRMSG PB_OSTREAM_SIZING_STATS PB_OSTREAM_SIZING_TRACE}
 
 /* Function to write into a pb_ostream_t stream. You can use this if you need
  * to append or prepend some custom headers to the message.
@@ -140,6 +216,14 @@ bool pb_encode_fixed32(pb_ostream_t *stream, const void *value);
  * You need to pass a pointer to a 8-byte wide C variable. */
 bool pb_encode_fixed64(pb_ostream_t *stream, const void *value);
 
+/* Store a fixed32, sfixed32 or float value in little-endian byte order
+ * at buf, which must have space for 4 bytes. */
+void pb_store_fixed32(uint8_t *buf, const void *value);
+
+/* Store a fixed64, sfixed64 or double value at buf, which must have
+ * space for 8 bytes. */
+void pb_store_fixed64(uint8_t *buf, const void *value);
+
 /* Encode a submessage field.
  * You need to pass the pb_field_t array and pointer to struct, just like
  * with pb_encode(). This internally encodes the submessage twice, first to
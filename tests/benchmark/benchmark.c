@@ -0,0 +1,417 @@
+/* Measures the speed of pb_encode() and pb_decode(). When built with
+ * BENCH_NESTED, nested messages of different sizes are measured. Otherwise
+ * the AllTypes message to use is read from stdin. The output has one line
+ * for each case, with the columns:
+ *
+ *   program stream operation message size depth msgs/s MB/s
+ *
+ * The size is the encoded size of the message in bytes, and the depth is
+ * the nesting depth of the message type. With the argument -q, each case
+ * is only run briefly to check that it works.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pb_encode.h>
+#include <pb_decode.h>
+#include <pb_common.h>
+#ifdef BENCH_NESTED
+#include "benchmark.pb.h"
+#else
+#include "alltypes.pb.h"
+#endif
+
+typedef struct {
+    const char *name;
+    const pb_field_t *fields;
+    void *msg;          /* Structure to encode */
+    void *scratch;      /* Structure to decode into */
+    int depth;
+} bench_case_t;
+
+typedef bool (*bench_func_t)(const bench_case_t *bench, bool use_callback);
+
+/* Minimum time to run each case, in seconds */
+static double g_min_time = 0.5;
+
+static uint8_t g_encoded[65536];
+static size_t g_encoded_size;
+static uint8_t g_output[65536];
+
+#ifndef PB_BUFFER_ONLY
+/* Streams that use a callback to access a memory buffer, for measuring the
+ * overhead of the callback interface compared to the buffer streams. */
+typedef struct {
+    uint8_t *data;
+    size_t pos;
+} memory_state_t;
+
+static bool read_memory(pb_istream_t *stream, uint8_t *buf, size_t count)
+{
+    memory_state_t *state = (memory_state_t*)stream->state;
+    memcpy(buf, state->data + state->pos, count);
+    state->pos += count;
+    return true;
+}
+
+static bool write_memory(pb_ostream_t *stream, const uint8_t *buf, size_t count)
+{
+    memory_state_t *state = (memory_state_t*)stream->state;
+    memcpy(state->data + state->pos, buf, count);
+    state->pos += count;
+    return true;
+}
+#endif
+
+static bool encode_case(const bench_case_t *bench, bool use_callback)
+{
+    pb_ostream_t stream = pb_ostream_from_buffer(g_output, sizeof(g_output));
+#ifndef PB_BUFFER_ONLY
+    memory_state_t state;
+
+    if (use_callback)
+    {
+        state.data = g_output;
+        state.pos = 0;
+        stream.callback = write_memory;
+        stream.state = &state;
+    }
+#else
+    (void)use_callback;
+#endif
+
+    return pb_encode(&stream, bench->fields, bench->msg);
+}
+
+static bool decode_case(const bench_case_t *bench, bool use_callback)
+{
+    pb_istream_t stream = pb_istream_from_buffer(g_encoded, g_encoded_size);
+    bool status;
+#ifndef PB_BUFFER_ONLY
+    memory_state_t state;
+
+    if (use_callback)
+    {
+        state.data = g_encoded;
+        state.pos = 0;
+        stream.callback = read_memory;
+        stream.state = &state;
+    }
+#else
+    (void)use_callback;
+#endif
+
+    status = pb_decode(&stream, bench->fields, bench->scratch);
+
+#ifdef PB_ENABLE_MALLOC
+    pb_release(bench->fields, bench->scratch);
+#endif
+
+    return status;
+}
+
+/* Run the operation repeatedly for at least g_min_time and print the results */
+static bool measure(const bench_case_t *bench, const char *stream_name,
+                    bool use_callback, const char *operation, bench_func_t func)
+{
+    unsigned long count = 0;
+    unsigned long batch = 1;
+    unsigned long i;
+    double seconds = 0.0;
+    clock_t start = clock();
+
+    while (seconds < g_min_time)
+    {
+        for (i = 0; i < batch; i++)
+        {
+            if (!func(bench, use_callback))
+            {
+                fprintf(stderr, "%s %s failed\n", operation, bench->name);
+                return false;
+            }
+        }
+
+        count += batch;
+        batch *= 2;
+        seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+    }
+
+    printf("%-8s %-8s %-6s %-16s %6lu %2d %12.0f %10.2f\n",
+           BENCH_NAME, stream_name, operation, bench->name,
+           (unsigned long)g_encoded_size, bench->depth,
+           count / seconds, count * (double)g_encoded_size / seconds / 1e6);
+    return true;
+}
+
+static bool run_case(const bench_case_t *bench)
+{
+    pb_ostream_t stream = pb_ostream_from_buffer(g_encoded, sizeof(g_encoded));
+
+    if (!pb_encode(&stream, bench->fields, bench->msg))
+    {
+        fprintf(stderr, "Encoding %s failed: %s\n", bench->name, PB_GET_ERROR(&stream));
+        return false;
+    }
+    g_encoded_size = stream.bytes_written;
+
+#ifndef PB_BUFFER_ONLY
+    return measure(bench, "buffer", false, "encode", encode_case) &&
+           measure(bench, "buffer", false, "decode", decode_case) &&
+           measure(bench, "callback", true, "encode", encode_case) &&
+           measure(bench, "callback", true, "decode", decode_case);
+#else
+    return measure(bench, "bufonly", false, "encode", encode_case) &&
+           measure(bench, "bufonly", false, "decode", decode_case);
+#endif
+}
+
+#ifndef BENCH_NESTED
+/* The AllTypes message, read from stdin */
+static AllTypes g_alltypes;
+static AllTypes g_alltypes_scratch;
+
+#ifdef BENCH_CALLBACKS
+/* Generic callbacks for all the fields of AllTypes. The encoder writes a
+ * small value of the right type for each field, five times for arrays. */
+static bool encode_callback(pb_ostream_t *stream, const pb_field_t *field, void * const *arg)
+{
+    int count = (PB_HTYPE(field->type) == PB_HTYPE_REPEATED) ? 5 : 1;
+    uint32_t value32 = 1234;
+    uint64_t value64 = 1234;
+    int i;
+    (void)arg;
+
+    for (i = 0; i < count; i++)
+    {
+        bool status;
+
+        if (!pb_encode_tag_for_field(stream, field))
+            return false;
+
+        switch (PB_LTYPE(field->type))
+        {
+            case PB_LTYPE_VARINT:
+            case PB_LTYPE_UVARINT:
+                status = pb_encode_varint(stream, value64);
+                break;
+
+            case PB_LTYPE_SVARINT:
+                status = pb_encode_svarint(stream, -1234);
+                break;
+
+            case PB_LTYPE_FIXED32:
+                status = pb_encode_fixed32(stream, &value32);
+                break;
+
+            case PB_LTYPE_FIXED64:
+                status = pb_encode_fixed64(stream, &value64);
+                break;
+
+            case PB_LTYPE_SUBMESSAGE:
+                status = pb_encode_string(stream, (const uint8_t*)"", 0);
+                break;
+
+            default:
+                status = pb_encode_string(stream, (const uint8_t*)"benchmark", 9);
+                break;
+        }
+
+        if (!status)
+            return false;
+    }
+
+    return true;
+}
+
+static bool decode_callback(pb_istream_t *stream, const pb_field_t *field, void **arg)
+{
+    uint32_t value32;
+    uint64_t value64;
+    (void)arg;
+
+    switch (PB_LTYPE(field->type))
+    {
+        case PB_LTYPE_VARINT:
+        case PB_LTYPE_UVARINT:
+        case PB_LTYPE_SVARINT:
+            return pb_decode_varint(stream, &value64);
+
+        case PB_LTYPE_FIXED32:
+            return pb_decode_fixed32(stream, &value32);
+
+        case PB_LTYPE_FIXED64:
+            return pb_decode_fixed64(stream, &value64);
+
+        default:
+            return pb_read(stream, NULL, stream->bytes_left);
+    }
+}
+
+static void set_callbacks(AllTypes *msg, bool decode)
+{
+    pb_field_iter_t iter;
+
+    if (!pb_field_iter_begin(&iter, AllTypes_fields, msg))
+        return;
+
+    do {
+        if (PB_ATYPE(iter.pos->type) == PB_ATYPE_CALLBACK &&
+            PB_LTYPE(iter.pos->type) != PB_LTYPE_EXTENSION)
+        {
+            pb_callback_t *callback = (pb_callback_t*)iter.pData;
+            if (decode)
+                callback->funcs.decode = decode_callback;
+            else
+                callback->funcs.encode = encode_callback;
+        }
+    } while (pb_field_iter_next(&iter));
+}
+#endif
+
+static bool read_alltypes(void)
+{
+    uint8_t buffer[1024];
+    size_t count = fread(buffer, 1, sizeof(buffer), stdin);
+    pb_istream_t stream = pb_istream_from_buffer(buffer, count);
+
+#ifdef BENCH_CALLBACKS
+    set_callbacks(&g_alltypes, false);
+    set_callbacks(&g_alltypes_scratch, true);
+    if (!pb_decode(&stream, AllTypes_fields, &g_alltypes_scratch))
+#else
+    if (!pb_decode(&stream, AllTypes_fields, &g_alltypes))
+#endif
+    {
+        fprintf(stderr, "Decoding AllTypes failed: %s\n", PB_GET_ERROR(&stream));
+        return false;
+    }
+
+    return true;
+}
+
+static bool run_alltypes(void)
+{
+    bench_case_t bench;
+
+    if (!read_alltypes())
+        return false;
+
+    bench.name = "alltypes";
+    bench.fields = AllTypes_fields;
+    bench.msg = &g_alltypes;
+    bench.scratch = &g_alltypes_scratch;
+    bench.depth = 2;
+    return run_case(&bench);
+}
+
+#else
+static Leaf g_leaf;
+static Branch g_branch;
+static Tree g_tree;
+static Forest g_forest;
+static Forest g_forest_scratch;
+
+static void fill_leaf(Leaf *leaf, pb_size_t samples)
+{
+    pb_size_t i;
+
+    leaf->id = 0xC0FFEE;
+    leaf->value = -1000;
+    leaf->has_name = (samples > 0);
+    strcpy(leaf->name, "leaf");
+    leaf->samples_count = samples;
+    for (i = 0; i < samples; i++)
+        leaf->samples[i] = 100u * i;
+}
+
+static void fill_branch(Branch *branch, pb_size_t leaves, pb_size_t samples)
+{
+    pb_size_t i;
+
+    branch->leaves_count = leaves;
+    for (i = 0; i < leaves; i++)
+        fill_leaf(&branch->leaves[i], samples);
+}
+
+static void fill_tree(Tree *tree, pb_size_t branches, pb_size_t leaves, pb_size_t samples)
+{
+    pb_size_t i;
+
+    tree->branches_count = branches;
+    for (i = 0; i < branches; i++)
+        fill_branch(&tree->branches[i], leaves, samples);
+}
+
+static void fill_forest(Forest *forest, pb_size_t trees, pb_size_t branches,
+                        pb_size_t leaves, pb_size_t samples)
+{
+    pb_size_t i;
+
+    forest->trees_count = trees;
+    for (i = 0; i < trees; i++)
+        fill_tree(&forest->trees[i], branches, leaves, samples);
+}
+
+/* Run the nested message cases, from small to large */
+static bool run_nested(void)
+{
+    bench_case_t bench;
+
+    bench.name = "leaf_small";
+    bench.fields = Leaf_fields;
+    bench.msg = &g_leaf;
+    bench.scratch = &g_forest_scratch;
+    bench.depth = 1;
+    fill_leaf(&g_leaf, 0);
+    if (!run_case(&bench))
+        return false;
+
+    bench.name = "leaf_full";
+    fill_leaf(&g_leaf, 8);
+    if (!run_case(&bench))
+        return false;
+
+    bench.name = "branch_full";
+    bench.fields = Branch_fields;
+    bench.msg = &g_branch;
+    bench.depth = 2;
+    fill_branch(&g_branch, 16, 8);
+    if (!run_case(&bench))
+        return false;
+
+    bench.name = "tree_full";
+    bench.fields = Tree_fields;
+    bench.msg = &g_tree;
+    bench.depth = 3;
+    fill_tree(&g_tree, 4, 16, 8);
+    if (!run_case(&bench))
+        return false;
+
+    bench.name = "forest_thin";
+    bench.fields = Forest_fields;
+    bench.msg = &g_forest;
+    bench.depth = 4;
+    fill_forest(&g_forest, 1, 1, 1, 0);
+    if (!run_case(&bench))
+        return false;
+
+    bench.name = "forest_full";
+    fill_forest(&g_forest, 4, 4, 16, 8);
+    return run_case(&bench);
+}
+#endif
+
+int main(int argc, char **argv)
+{
+    if (argc > 1 && strcmp(argv[1], "-q") == 0)
+        g_min_time = 0.01;
+
+    printf("# program  stream   op     message            size depth      msgs/s       MB/s\n");
+
+#ifdef BENCH_NESTED
+    return run_nested() ? 0 : 1;
+#else
+    return run_alltypes() ? 0 : 1;
+#endif
+}
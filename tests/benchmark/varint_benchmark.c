@@ -0,0 +1,536 @@
+/* Measures the speed of the varint and tag primitives that dominate the
+ * decoding and encoding of typical messages. Each operation is run with
+ * several implementations, listed in the codecs[] table: the library
+ * functions, and alternatives that work directly on the memory of a
+ * buffer stream. A new implementation can be compared by adding an entry
+ * to the table. The output has the same columns as benchmark.c:
+ *
+ *   program codec operation values size depth values/s MB/s
+ *
+ * The size is the encoded size of all the values, and the depth is 0.
+ * With the argument -q, each case is only run briefly.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pb_encode.h>
+#include <pb_decode.h>
+
+#define VALUE_COUNT 1024
+
+typedef struct {
+    const char *name;
+    bool (*decode)(pb_istream_t *stream, uint64_t *dest);
+    bool (*decode32)(pb_istream_t *stream, uint32_t *dest);
+    bool (*encode)(pb_ostream_t *stream, uint64_t value);
+    bool (*decode_tag)(pb_istream_t *stream, pb_wire_type_t *wire_type, uint32_t *tag, bool *eof);
+    bool (*encode_tag)(pb_ostream_t *stream, const pb_field_t *field);
+} varint_codec_t;
+
+/* Minimum time to run each case, in seconds */
+static double g_min_time = 0.5;
+
+static uint64_t g_values[VALUE_COUNT];
+static pb_field_t g_fields[VALUE_COUNT];
+static uint8_t g_encoded[VALUE_COUNT * 10];
+static size_t g_encoded_size;
+static uint8_t g_output[VALUE_COUNT * 10];
+static volatile uint64_t g_sink;
+
+/**********************************************************
+ * Alternative implementations working on buffer streams  *
+ **********************************************************/
+
+/* The state of a buffer stream points to the next byte */
+static bool scalar_decode(pb_istream_t *stream, uint64_t *dest)
+{
+    uint8_t *p = (uint8_t*)stream->state;
+    uint8_t *end = p + (stream->bytes_left < 10 ? stream->bytes_left : 10);
+    uint64_t result = 0;
+    unsigned shift = 0;
+
+    while (p < end)
+    {
+        uint8_t byte = *p++;
+        result |= (uint64_t)(byte & 0x7F) << shift;
+        shift += 7;
+
+        if (!(byte & 0x80))
+        {
+            stream->bytes_left -= (size_t)(p - (uint8_t*)stream->state);
+            stream->state = p;
+            *dest = result;
+            return true;
+        }
+    }
+
+    PB_RETURN_ERROR(stream, "varint overflow");
+}
+
+static bool scalar_decode32(pb_istream_t *stream, uint32_t *dest)
+{
+    uint64_t value;
+
+    if (!scalar_decode(stream, &value))
+        return false;
+
+    if (value > 0xFFFFFFFFu)
+        PB_RETURN_ERROR(stream, "varint overflow");
+
+    *dest = (uint32_t)value;
+    return true;
+}
+
+static bool scalar_encode(pb_ostream_t *stream, uint64_t value)
+{
+    uint8_t *p = (uint8_t*)stream->state;
+    size_t count = 0;
+
+    if (stream->max_size - stream->bytes_written < 10)
+        return pb_encode_varint(stream, value);
+
+    while (value >= 0x80)
+    {
+        p[count++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    p[count++] = (uint8_t)value;
+
+    stream->state = p + count;
+    stream->bytes_written += count;
+    return true;
+}
+
+/* Handles the common 1 and 2 byte values without a loop, and decodes
+ * the low 32 bits of longer values before switching to 64-bit math. */
+static bool unrolled_decode(pb_istream_t *stream, uint64_t *dest)
+{
+    uint8_t *p = (uint8_t*)stream->state;
+    uint32_t low;
+    uint64_t result;
+    size_t i;
+
+    if (stream->bytes_left >= 1 && !(p[0] & 0x80))
+    {
+        *dest = p[0];
+        i = 1;
+    }
+    else if (stream->bytes_left >= 2 && !(p[1] & 0x80))
+    {
+        *dest = (uint32_t)(p[0] & 0x7F) | ((uint32_t)p[1] << 7);
+        i = 2;
+    }
+    else if (stream->bytes_left >= 10)
+    {
+        low = (uint32_t)(p[0] & 0x7F) | ((uint32_t)(p[1] & 0x7F) << 7) |
+              ((uint32_t)(p[2] & 0x7F) << 14);
+        if (!(p[2] & 0x80))
+        {
+            *dest = low;
+            i = 3;
+        }
+        else
+        {
+            low |= (uint32_t)(p[3] & 0x7F) << 21;
+            result = low;
+            for (i = 4; i < 10; i++)
+            {
+                result |= (uint64_t)(p[i] & 0x7F) << (7 * i);
+                if (!(p[i] & 0x80))
+                    break;
+            }
+
+            if (i == 10)
+                PB_RETURN_ERROR(stream, "varint overflow");
+
+            *dest = result;
+            i++;
+        }
+    }
+    else
+    {
+        return scalar_decode(stream, dest);
+    }
+
+    stream->state = p + i;
+    stream->bytes_left -= i;
+    return true;
+}
+
+static bool unrolled_decode32(pb_istream_t *stream, uint32_t *dest)
+{
+    uint8_t *p = (uint8_t*)stream->state;
+
+    if (stream->bytes_left >= 1 && !(p[0] & 0x80))
+    {
+        *dest = p[0];
+        stream->state = p + 1;
+        stream->bytes_left -= 1;
+        return true;
+    }
+
+    return scalar_decode32(stream, dest);
+}
+
+static bool unrolled_encode(pb_ostream_t *stream, uint64_t value)
+{
+    uint8_t *p = (uint8_t*)stream->state;
+
+    if (value < 0x80 && stream->bytes_written < stream->max_size)
+    {
+        p[0] = (uint8_t)value;
+        stream->state = p + 1;
+        stream->bytes_written += 1;
+        return true;
+    }
+    else if (value < 0x4000 && stream->max_size - stream->bytes_written >= 2)
+    {
+        p[0] = (uint8_t)(value | 0x80);
+        p[1] = (uint8_t)(value >> 7);
+        stream->state = p + 2;
+        stream->bytes_written += 2;
+        return true;
+    }
+
+    return scalar_encode(stream, value);
+}
+
+/* Tag functions built on top of the varint functions of a codec */
+static pb_wire_type_t wire_type_of(const pb_field_t *field)
+{
+    switch (PB_LTYPE(field->type))
+    {
+        case PB_LTYPE_FIXED32: return PB_WT_32BIT;
+        case PB_LTYPE_FIXED64: return PB_WT_64BIT;
+        case PB_LTYPE_VARINT:
+        case PB_LTYPE_UVARINT:
+        case PB_LTYPE_SVARINT: return PB_WT_VARINT;
+        default: return PB_WT_STRING;
+    }
+}
+
+static bool split_tag(uint32_t value, pb_wire_type_t *wire_type, uint32_t *tag, bool *eof)
+{
+    *eof = (value == 0);
+    *tag = value >> 3;
+    *wire_type = (pb_wire_type_t)(value & 7);
+    return value != 0;
+}
+
+static bool scalar_decode_tag(pb_istream_t *stream, pb_wire_type_t *wire_type, uint32_t *tag, bool *eof)
+{
+    uint32_t value;
+    *eof = false;
+    return scalar_decode32(stream, &value) && split_tag(value, wire_type, tag, eof);
+}
+
+static bool scalar_encode_tag(pb_ostream_t *stream, const pb_field_t *field)
+{
+    return scalar_encode(stream, ((uint64_t)field->tag << 3) | wire_type_of(field));
+}
+
+static bool unrolled_decode_tag(pb_istream_t *stream, pb_wire_type_t *wire_type, uint32_t *tag, bool *eof)
+{
+    uint32_t value;
+    *eof = false;
+    return unrolled_decode32(stream, &value) && split_tag(value, wire_type, tag, eof);
+}
+
+static bool unrolled_encode_tag(pb_ostream_t *stream, const pb_field_t *field)
+{
+    return unrolled_encode(stream, ((uint64_t)field->tag << 3) | wire_type_of(field));
+}
+
+static const varint_codec_t codecs[] = {
+    {"library", pb_decode_varint, pb_decode_varint32, pb_encode_varint,
+                pb_decode_tag, pb_encode_tag_for_field},
+    {"scalar", scalar_decode, scalar_decode32, scalar_encode,
+               scalar_decode_tag, scalar_encode_tag},
+    {"unrolled", unrolled_decode, unrolled_decode32, unrolled_encode,
+                 unrolled_decode_tag, unrolled_encode_tag}
+};
+
+/*****************
+ * Test data     *
+ *****************/
+
+static uint32_t g_random = 12345;
+
+static uint32_t next_random(void)
+{
+    g_random = g_random * 1103515245u + 12345u;
+    return g_random >> 8;
+}
+
+/* Mostly single byte values, some two byte values */
+static void make_small(void)
+{
+    size_t i;
+    for (i = 0; i < VALUE_COUNT; i++)
+    {
+        if (next_random() % 10 == 0)
+            g_values[i] = 128 + next_random() % 16000;
+        else
+            g_values[i] = next_random() % 128;
+    }
+}
+
+/* Negative int32 values are sign extended, and encode to 10 bytes */
+static void make_negative(void)
+{
+    size_t i;
+    for (i = 0; i < VALUE_COUNT; i++)
+        g_values[i] = (uint64_t)(int64_t)-(int32_t)(1 + next_random() % 100000);
+}
+
+/* Increasing Unix timestamps in seconds, 5 bytes each */
+static void make_timestamps(void)
+{
+    size_t i;
+    uint64_t time = 1420070400;
+    for (i = 0; i < VALUE_COUNT; i++)
+    {
+        time += next_random() % 60;
+        g_values[i] = time;
+    }
+}
+
+/* Field descriptors with mostly single byte tags */
+static void make_fields(void)
+{
+    static const pb_type_t types[] = {
+        PB_LTYPE_VARINT, PB_LTYPE_SVARINT, PB_LTYPE_FIXED32,
+        PB_LTYPE_FIXED64, PB_LTYPE_STRING, PB_LTYPE_SUBMESSAGE
+    };
+    size_t i;
+
+    memset(g_fields, 0, sizeof(g_fields));
+    for (i = 0; i < VALUE_COUNT; i++)
+    {
+        if (next_random() % 5 == 0)
+            g_fields[i].tag = (pb_size_t)(16 + next_random() % 240);
+        else
+            g_fields[i].tag = (pb_size_t)(1 + next_random() % 15);
+
+        g_fields[i].type = types[next_random() % 6];
+    }
+}
+
+static bool encode_values(void)
+{
+    pb_ostream_t stream = pb_ostream_from_buffer(g_encoded, sizeof(g_encoded));
+    size_t i;
+
+    for (i = 0; i < VALUE_COUNT; i++)
+    {
+        if (!pb_encode_varint(&stream, g_values[i]))
+            return false;
+    }
+
+    g_encoded_size = stream.bytes_written;
+    return true;
+}
+
+static bool encode_tags(void)
+{
+    pb_ostream_t stream = pb_ostream_from_buffer(g_encoded, sizeof(g_encoded));
+    size_t i;
+
+    for (i = 0; i < VALUE_COUNT; i++)
+    {
+        if (!pb_encode_tag_for_field(&stream, &g_fields[i]))
+            return false;
+    }
+
+    g_encoded_size = stream.bytes_written;
+    return true;
+}
+
+/*****************
+ * Operations    *
+ *****************/
+
+typedef bool (*operation_t)(const varint_codec_t *codec);
+
+static bool op_decode(const varint_codec_t *codec)
+{
+    pb_istream_t stream = pb_istream_from_buffer(g_encoded, g_encoded_size);
+    uint64_t value, sum = 0;
+    size_t i;
+
+    for (i = 0; i < VALUE_COUNT; i++)
+    {
+        if (!codec->decode(&stream, &value))
+            return false;
+        sum += value;
+    }
+
+    g_sink = sum;
+    return true;
+}
+
+static bool op_decode32(const varint_codec_t *codec)
+{
+    pb_istream_t stream = pb_istream_from_buffer(g_encoded, g_encoded_size);
+    uint32_t value, sum = 0;
+    size_t i;
+
+    for (i = 0; i < VALUE_COUNT; i++)
+    {
+        if (!codec->decode32(&stream, &value))
+            return false;
+        sum += value;
+    }
+
+    g_sink = sum;
+    return true;
+}
+
+static bool op_encode(const varint_codec_t *codec)
+{
+    pb_ostream_t stream = pb_ostream_from_buffer(g_output, sizeof(g_output));
+    size_t i;
+
+    for (i = 0; i < VALUE_COUNT; i++)
+    {
+        if (!codec->encode(&stream, g_values[i]))
+            return false;
+    }
+
+    return stream.bytes_written == g_encoded_size &&
+           memcmp(g_output, g_encoded, g_encoded_size) == 0;
+}
+
+static bool op_decode_tag(const varint_codec_t *codec)
+{
+    pb_istream_t stream = pb_istream_from_buffer(g_encoded, g_encoded_size);
+    pb_wire_type_t wire_type;
+    uint32_t tag, sum = 0;
+    bool eof;
+    size_t i;
+
+    for (i = 0; i < VALUE_COUNT; i++)
+    {
+        if (!codec->decode_tag(&stream, &wire_type, &tag, &eof))
+            return false;
+        sum += tag + (uint32_t)wire_type;
+    }
+
+    g_sink = sum;
+    return true;
+}
+
+static bool op_encode_tag(const varint_codec_t *codec)
+{
+    pb_ostream_t stream = pb_ostream_from_buffer(g_output, sizeof(g_output));
+    size_t i;
+
+    for (i = 0; i < VALUE_COUNT; i++)
+    {
+        if (!codec->encode_tag(&stream, &g_fields[i]))
+            return false;
+    }
+
+    return stream.bytes_written == g_encoded_size &&
+           memcmp(g_output, g_encoded, g_encoded_size) == 0;
+}
+
+/* Run the operation repeatedly for at least g_min_time and print the results */
+static bool measure(const varint_codec_t *codec, const char *name,
+                    operation_t operation, const char *values)
+{
+    unsigned long count = 0;
+    unsigned long batch = 1;
+    unsigned long i;
+    double seconds = 0.0;
+    clock_t start = clock();
+
+    while (seconds < g_min_time)
+    {
+        for (i = 0; i < batch; i++)
+        {
+            if (!operation(codec))
+            {
+                fprintf(stderr, "%s %s %s failed\n", codec->name, name, values);
+                return false;
+            }
+        }
+
+        count += batch;
+        batch *= 2;
+        seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+    }
+
+    printf("%-8s %-8s %-10s %-10s %6lu %2d %12.0f %10.2f\n",
+           "varint", codec->name, name, values, (unsigned long)g_encoded_size, 0,
+           count * (double)VALUE_COUNT / seconds,
+           count * (double)g_encoded_size / seconds / 1e6);
+    return true;
+}
+
+/* Run the value operations with every codec */
+static bool run_values(const char *values, bool fits_32bit)
+{
+    size_t i;
+
+    if (!encode_values())
+        return false;
+
+    for (i = 0; i < sizeof(codecs) / sizeof(codecs[0]); i++)
+    {
+        if (!measure(&codecs[i], "decode", op_decode, values) ||
+            (fits_32bit && !measure(&codecs[i], "decode32", op_decode32, values)) ||
+            !measure(&codecs[i], "encode", op_encode, values))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool run_tags(void)
+{
+    size_t i;
+
+    if (!encode_tags())
+        return false;
+
+    for (i = 0; i < sizeof(codecs) / sizeof(codecs[0]); i++)
+    {
+        if (!measure(&codecs[i], "decode_tag", op_decode_tag, "tags") ||
+            !measure(&codecs[i], "encode_tag", op_encode_tag, "tags"))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1 && strcmp(argv[1], "-q") == 0)
+        g_min_time = 0.01;
+
+    printf("# program  codec    op         values       size depth    values/s       MB/s\n");
+
+    make_small();
+    if (!run_values("small", true))
+        return 1;
+
+    make_negative();
+    if (!run_values("negative", false))
+        return 1;
+
+    make_timestamps();
+    if (!run_values("timestamp", true))
+        return 1;
+
+    make_fields();
+    if (!run_tags())
+        return 1;
+
+    return 0;
+}
@@ -0,0 +1,204 @@
+/* Checks that messages with compact field tables are encoded and decoded
+ * the same way as with normal tables. The output of this program is
+ * compared between builds with and without PB_ENABLE_COMPACT_FIELDS. */
+
+#include <stdio.h>
+#include <string.h>
+#include <pb_encode.h>
+#include <pb_decode.h>
+#include <pb_common.h>
+#include "compact_fields.pb.h"
+#include "unittests.h"
+
+#ifdef PB_COMPACT_FIELDS
+#define SMALL_TABLE_ENTRIES 2
+#else
+#define SMALL_TABLE_ENTRIES 10
+#endif
+
+static bool encode_cb(pb_ostream_t *stream, const pb_field_t *field, void * const *arg)
+{
+    return pb_encode_tag_for_field(stream, field) &&
+           pb_encode_varint(stream, *(const int32_t*)*arg);
+}
+
+static bool decode_cb(pb_istream_t *stream, const pb_field_t *field, void **arg)
+{
+    uint64_t value;
+    (void)field;
+    if (!pb_decode_varint(stream, &value))
+        return false;
+    *(int32_t*)*arg = (int32_t)value;
+    return true;
+}
+
+static void print_hex(const uint8_t *buffer, size_t size)
+{
+    size_t i;
+    for (i = 0; i < size; i++)
+        printf("%02x", buffer[i]);
+    printf("\n");
+}
+
+int main()
+{
+    int status = 0;
+
+    COMMENT("Field tables");
+    TEST(sizeof(Small_fields) == SMALL_TABLE_ENTRIES * sizeof(pb_field_t));
+    TEST(sizeof(Wide_fields) == 3 * sizeof(pb_field_t));
+    TEST(sizeof(Outer_fields) == 4 * sizeof(pb_field_t));
+
+    {
+        pb_field_iter_t iter;
+        Small msg;
+
+        COMMENT("Iterating a message");
+        TEST(pb_field_iter_begin(&iter, Small_fields, &msg));
+        TEST(pb_field_iter_find(&iter, 6));
+        TEST(iter.pos->tag == 6 && iter.pData == (void*)msg.choice.text);
+        TEST(iter.pSize == (void*)&msg.which_choice);
+        TEST(pb_field_iter_find(&iter, 3));
+        TEST(iter.pData == (void*)msg.values && iter.pos->array_size == 4);
+        TEST(!pb_field_iter_find(&iter, 42));
+        TEST(iter.pos->tag == 3);
+    }
+
+    {
+        uint8_t buffer[512];
+        pb_ostream_t stream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+        Outer msg = Outer_init_zero;
+        int32_t cb_value = 1234;
+        int32_t ext_value = -77;
+        pb_extension_t ext;
+
+        ext.type = &small_ext;
+        ext.dest = &ext_value;
+        ext.next = NULL;
+
+        msg.small.id = 42;
+        msg.small.has_name = true;
+        strcpy(msg.small.name, "compact");
+        msg.small.values_count = 3;
+        msg.small.values[0] = 1;
+        msg.small.values[1] = 2;
+        msg.small.values[2] = 0xFFFFFFFF;
+        msg.small.has_data = true;
+        msg.small.data.size = 3;
+        memcpy(msg.small.data.bytes, "abc", 3);
+        msg.small.which_choice = Small_text_tag;
+        strcpy(msg.small.choice.text, "oneof");
+        msg.small.cb.funcs.encode = encode_cb;
+        msg.small.cb.arg = &cb_value;
+        msg.small.has_ratio = true;
+        msg.small.ratio = 2.25;
+        msg.small.extensions = &ext;
+        msg.has_wide = true;
+        msg.wide.has_high = true;
+        msg.wide.high = 999;
+        msg.list_count = 2;
+        msg.list[0].has_id = true;
+        msg.list[0].id = 5;
+        msg.list[1].unknown_fields.size = 2;
+        msg.list[1].unknown_fields.bytes[0] = 0x10;
+        msg.list[1].unknown_fields.bytes[1] = 0x07;
+
+        COMMENT("Encoding a nested message");
+        TEST(pb_encode(&stream, Outer_fields, &msg));
+        print_hex(buffer, stream.bytes_written);
+
+        {
+            Outer decoded;
+            int32_t cb_decoded = 0;
+            int32_t ext_decoded = 0;
+            pb_extension_t ext_dest;
+            pb_istream_t istream = pb_istream_from_buffer(buffer, stream.bytes_written);
+
+            ext_dest.type = &small_ext;
+            ext_dest.dest = &ext_decoded;
+            ext_dest.next = NULL;
+
+            memset(&decoded, 0, sizeof(decoded));
+            decoded.small.cb.funcs.decode = decode_cb;
+            decoded.small.cb.arg = &cb_decoded;
+            decoded.small.extensions = &ext_dest;
+
+            COMMENT("Decoding a nested message");
+            TEST(pb_decode(&istream, Outer_fields, &decoded));
+            TEST(decoded.small.id == 42);
+            TEST(strcmp(decoded.small.name, "compact") == 0);
+            TEST(decoded.small.values_count == 3 && decoded.small.values[2] == 0xFFFFFFFF);
+            TEST(decoded.small.has_data && decoded.small.data.size == 3);
+            TEST(decoded.small.which_choice == Small_text_tag);
+            TEST(strcmp(decoded.small.choice.text, "oneof") == 0);
+            TEST(cb_decoded == 1234);
+            TEST(decoded.small.has_ratio && decoded.small.ratio == 2.25);
+            TEST(ext_dest.found && ext_decoded == -77);
+            TEST(decoded.has_wide && decoded.wide.high == 999 && !decoded.wide.has_low);
+            TEST(decoded.list_count == 2 && decoded.list[0].id == 5);
+            TEST(decoded.list[1].unknown_fields.size == 2);
+        }
+    }
+
+    {
+        Small msg;
+        pb_istream_t stream = pb_istream_from_buffer((const uint8_t*)"\x08\x01", 2);
+
+        COMMENT("Default values");
+        memset(&msg, 0xAA, sizeof(msg));
+        msg.cb.funcs.decode = NULL;
+        msg.extensions = NULL;
+        TEST(pb_decode(&stream, Small_fields, &msg));
+        TEST(msg.id == 1 && !msg.has_name && strcmp(msg.name, "small") == 0);
+        TEST(msg.values_count == 0 && msg.which_choice == 0);
+        TEST(!msg.has_ratio && msg.ratio == 0.5);
+    }
+
+    {
+        const uint8_t input[] = {0x10, 0x05, 0x08, 0x01, 0x1a, 0x01, 'x'};
+        uint8_t buffer[64];
+        pb_istream_t istream = pb_istream_from_buffer(input, sizeof(input));
+        pb_ostream_t stream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+        Unknowns msg;
+
+        COMMENT("Unknown fields");
+        TEST(pb_decode(&istream, Unknowns_fields, &msg));
+        TEST(msg.has_id && msg.id == 1);
+        TEST(msg.unknown_fields.size == 5);
+        TEST(pb_encode(&stream, Unknowns_fields, &msg));
+        print_hex(buffer, stream.bytes_written);
+    }
+
+    {
+        pb_plan_field_t entries[10];
+        pb_plan_t plan;
+        uint8_t buffer1[64], buffer2[64];
+        pb_ostream_t stream1 = pb_ostream_from_buffer(buffer1, sizeof(buffer1));
+        pb_ostream_t stream2 = pb_ostream_from_buffer(buffer2, sizeof(buffer2));
+        Unknowns msg = Unknowns_init_zero;
+        Unknowns decoded;
+
+        COMMENT("Compiled plan");
+        msg.has_id = true;
+        msg.id = 300;
+        TEST(pb_compile_plan(&plan, Unknowns_fields, entries, 10));
+        TEST(plan.field_count == 2 && plan.unknown_index == 1);
+        TEST(plan.info != NULL && plan.info->default_image != NULL);
+        TEST(entries[0].field->tag == 1 && entries[1].field->tag == 1);
+        TEST(pb_encode_with_plan(&stream1, &plan, &msg));
+        TEST(pb_encode(&stream2, Unknowns_fields, &msg));
+        TEST(stream1.bytes_written == stream2.bytes_written);
+        TEST(memcmp(buffer1, buffer2, stream1.bytes_written) == 0);
+
+        {
+            pb_istream_t istream = pb_istream_from_buffer(buffer1, stream1.bytes_written);
+            TEST(pb_decode_with_plan(&istream, &plan, &decoded));
+            TEST(decoded.has_id && decoded.id == 300);
+        }
+    }
+
+    if (status != 0)
+        fprintf(stdout, "\n\nSome tests FAILED!\n");
+
+    return status;
+}
@@ -0,0 +1,83 @@
+/* Checks that pb_decode_with_plan() and pb_encode_with_plan() give the
+ * same results as pb_decode() and pb_encode(). */
+
+#include <stdio.h>
+#include <string.h>
+#include <pb_encode.h>
+#include <pb_decode.h>
+#include <pb_common.h>
+#include "alltypes.pb.h"
+#include "test_helpers.h"
+#include "unittests.h"
+
+int main()
+{
+    int status = 0;
+    uint8_t input[1024];
+    uint8_t output[1024];
+    size_t count;
+    pb_plan_field_t entries[sizeof(AllTypes_fields) / sizeof(pb_field_t)];
+    pb_plan_t plan;
+    AllTypes expected;
+    AllTypes decoded;
+    
+    SET_BINARY_MODE(stdin);
+    count = fread(input, 1, sizeof(input), stdin);
+    
+    {
+        pb_istream_t stream = pb_istream_from_buffer(input, count);
+        memset(&expected, 0, sizeof(expected));
+        if (!pb_decode(&stream, AllTypes_fields, &expected))
+        {
+            printf("Parsing failed: %s\n", PB_GET_ERROR(&stream));
+            return 1;
+        }
+    }
+    
+    COMMENT("Compile the plan")
+    {
+        pb_plan_field_t small[2];
+        pb_plan_t small_plan;
+        
+        TEST(pb_compile_plan(&plan, AllTypes_fields, entries, sizeof(entries) / sizeof(entries[0])))
+        TEST(plan.field_count == sizeof(entries) / sizeof(entries[0]) - 1)
+        TEST(plan.extension_index < plan.field_count)
+        TEST(plan.unknown_index == plan.field_count)
+        TEST(plan.flags == PB_PLAN_HAS_EXTENSIONS)
+        TEST(!pb_compile_plan(&small_plan, AllTypes_fields, small, 2))
+    }
+    
+    COMMENT("Decode with the plan")
+    {
+        pb_istream_t stream = pb_istream_from_buffer(input, count);
+        memset(&decoded, 0, sizeof(decoded));
+        TEST(pb_decode_with_plan(&stream, &plan, &decoded))
+        TEST(memcmp(&decoded, &expected, sizeof(decoded)) == 0)
+    }
+    
+    COMMENT("Encode with the plan")
+    {
+        pb_ostream_t stream = pb_ostream_from_buffer(output, sizeof(output));
+        TEST(pb_encode_with_plan(&stream, &plan, &decoded))
+        TEST(stream.bytes_written == count)
+        TEST(memcmp(output, input, count) == 0)
+    }
+    
+    COMMENT("Missing required field")
+    {
+        /* Skip the first field, which is required */
+        pb_istream_t stream = pb_istream_from_buffer(input, count);
+        pb_wire_type_t wire_type;
+        uint32_t tag;
+        bool eof;
+        TEST(pb_decode_tag(&stream, &wire_type, &tag, &eof) && tag == 1)
+        TEST(pb_skip_field(&stream, wire_type))
+        TEST(!pb_decode_with_plan(&stream, &plan, &decoded))
+        TEST(strcmp(PB_GET_ERROR(&stream), "missing required field") == 0)
+    }
+    
+    if (status != 0)
+        fprintf(stdout, "\n\nSome tests FAILED!\n");
+    
+    return status;
+}
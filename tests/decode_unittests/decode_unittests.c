@@ -101,6 +101,8 @@ int main()
         TEST((s = S("\xAC\x02"), pb_decode_varint32(&s, &u) && u == 300));
         TEST((s = S("\xFF\xFF\xFF\xFF\x0F"), pb_decode_varint32(&s, &u) && u == UINT32_MAX));
         TEST((s = S("\xFF\xFF\xFF\xFF\xFF\x01"), !pb_decode_varint32(&s, &u)));
+        TEST((s = S("\xFF\xFF\xFF\xFF\x1F"), !pb_decode_varint32(&s, &u)));
+        TEST((s = S("\x80\x80\x80\x80\x10"), !pb_decode_varint32(&s, &u)));
     }
     
     {
@@ -0,0 +1,91 @@
+/* Checks that the default image is generated only for messages without
+ * callback fields, and that decoding uses it to initialize the structure. */
+
+#include <stdio.h>
+#include <string.h>
+#include <pb_decode.h>
+#include <pb_common.h>
+#include "default_image.pb.h"
+#include "unittests.h"
+
+static const pb_default_image_t *default_image(const pb_field_t *fields)
+{
+    const pb_message_info_t *info = pb_get_message_info(fields);
+    return (info != NULL) ? info->default_image : NULL;
+}
+
+static bool dummy_callback(pb_istream_t *stream, const pb_field_t *field, void **arg)
+{
+    (void)field;
+    (*(int*)*arg)++;
+    return pb_read(stream, NULL, stream->bytes_left);
+}
+
+int main()
+{
+    int status = 0;
+
+    COMMENT("Default image presence");
+    TEST(default_image(Inner_fields) != NULL);
+    TEST(default_image(Static_fields) != NULL);
+    TEST(default_image(WithCallback_fields) == NULL);
+    TEST(default_image(WithCallbackChild_fields) == NULL);
+    TEST(default_image(NoImage_fields) == NULL);
+
+    {
+        Static msg;
+        pb_istream_t stream = pb_istream_from_buffer((const uint8_t*)"\x08\x01", 2);
+
+        COMMENT("Decoding with the default image");
+        memset(&msg, 0xAA, sizeof(msg));
+        TEST(pb_decode(&stream, Static_fields, &msg));
+        TEST(msg.req == 1);
+        TEST(!msg.has_opt && msg.opt == 123456789);
+        TEST(msg.data.size == 2 && msg.data.bytes[1] == 'b');
+        TEST(msg.list_count == 0);
+        TEST(!msg.has_inner && msg.inner.value == 42);
+        TEST(strcmp(msg.inner.name, "inner") == 0);
+        TEST(msg.which_choice == 0);
+    }
+
+    {
+        Static msg;
+        pb_istream_t stream = pb_istream_from_buffer((const uint8_t*)"\x08\x01\x32\x00", 4);
+
+        COMMENT("Submessage in oneof is initialized to defaults");
+        memset(&msg, 0xAA, sizeof(msg));
+        TEST(pb_decode(&stream, Static_fields, &msg));
+        TEST(msg.which_choice == Static_first_tag);
+        TEST(msg.choice.first.value == 42);
+        TEST(strcmp(msg.choice.first.name, "inner") == 0);
+    }
+
+    {
+        WithCallback msg;
+        int count = 0;
+        pb_istream_t stream = pb_istream_from_buffer((const uint8_t*)"\x12\x01x", 3);
+
+        COMMENT("Callbacks are preserved without a default image");
+        memset(&msg, 0xAA, sizeof(msg));
+        msg.text.funcs.decode = &dummy_callback;
+        msg.text.arg = &count;
+        TEST(pb_decode(&stream, WithCallback_fields, &msg));
+        TEST(count == 1);
+        TEST(msg.value == 5 && !msg.has_value);
+    }
+
+    {
+        NoImage msg;
+        pb_istream_t stream = pb_istream_from_buffer((const uint8_t*)"", 0);
+
+        COMMENT("Defaults are set field by field without the option");
+        memset(&msg, 0xAA, sizeof(msg));
+        TEST(pb_decode(&stream, NoImage_fields, &msg));
+        TEST(msg.value == 3 && !msg.has_value);
+    }
+
+    if (status != 0)
+        fprintf(stdout, "\n\nSome tests FAILED!\n");
+
+    return status;
+}
@@ -0,0 +1,169 @@
+/* Checks that pb_decode_delta() applies the output of pb_encode_delta()
+ * so that the previous structure becomes equal to the current one. */
+
+#include <stdio.h>
+#include <string.h>
+#include <pb_encode.h>
+#include <pb_decode.h>
+#include "delta.pb.h"
+#include "unittests.h"
+
+static void fill_settings(Settings *msg)
+{
+    msg->revision = 10;
+    msg->has_name = true;
+    strcpy(msg->name, "heater");
+    msg->limits.low = -5;
+    msg->limits.high = 40;
+    msg->points_count = 3;
+    msg->points[0] = 1;
+    msg->points[1] = 2;
+    msg->points[2] = 3;
+    msg->which_mode = Settings_level_tag;
+    msg->mode.level = 2;
+}
+
+/* Encode the delta, apply it to a copy of prev and compare with cur */
+static bool apply_delta(const Settings *cur, const Settings *prev, size_t *delta_size)
+{
+    uint8_t buffer[128];
+    pb_ostream_t ostream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+    pb_istream_t istream;
+    Settings result = *prev;
+    Settings expected = *cur;
+    
+    if (!pb_encode_delta(&ostream, Settings_fields, cur, prev))
+        return false;
+    
+    *delta_size = ostream.bytes_written;
+    istream = pb_istream_from_buffer(buffer, ostream.bytes_written);
+    if (!pb_decode_delta(&istream, Settings_fields, &result))
+        return false;
+    
+    /* Round trip through the normal encoder so that the unused
+     * parts of the arrays and strings don't matter. */
+    {
+        uint8_t buf1[128], buf2[128];
+        pb_ostream_t s1 = pb_ostream_from_buffer(buf1, sizeof(buf1));
+        pb_ostream_t s2 = pb_ostream_from_buffer(buf2, sizeof(buf2));
+        
+        if (!pb_encode(&s1, Settings_fields, &result) ||
+            !pb_encode(&s2, Settings_fields, &expected))
+            return false;
+        
+        return s1.bytes_written == s2.bytes_written &&
+               memcmp(buf1, buf2, s1.bytes_written) == 0;
+    }
+}
+
+int main()
+{
+    int status = 0;
+    Settings prev = Settings_init_default;
+    size_t full_size, delta_size;
+    
+    fill_settings(&prev);
+    TEST(pb_get_encoded_size(&full_size, Settings_fields, &prev));
+    
+    {
+        Settings cur = prev;
+        COMMENT("Unchanged message");
+        TEST(apply_delta(&cur, &prev, &delta_size) && delta_size == 0);
+    }
+    
+    {
+        Settings cur = prev;
+        COMMENT("Changed scalar in a submessage");
+        cur.revision = 11;
+        cur.limits.high = 41;
+        TEST(apply_delta(&cur, &prev, &delta_size));
+        /* revision (2 bytes) + limits header (2 bytes) + high (2 bytes) */
+        TEST(delta_size == 6);
+        TEST(delta_size < full_size);
+    }
+    
+    {
+        Settings cur = prev;
+        COMMENT("Array and string changes");
+        cur.points_count = 2;
+        cur.points[1] = 7;
+        strcpy(cur.name, "cooler");
+        TEST(apply_delta(&cur, &prev, &delta_size));
+        TEST(delta_size == 8 + 10);
+    }
+    
+    {
+        Settings cur = prev;
+        COMMENT("New optional submessage and oneof change");
+        cur.has_backup = true;
+        cur.backup.low = 1;
+        cur.backup.high = 2;
+        cur.which_mode = Settings_preset_tag;
+        strcpy(cur.mode.preset, "eco");
+        cur.has_gain = true;
+        cur.gain = 2.5;
+        TEST(apply_delta(&cur, &prev, &delta_size));
+    }
+    
+    {
+        Settings cur = prev;
+        Settings result = prev;
+        uint8_t buffer[64];
+        pb_ostream_t ostream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+        pb_istream_t istream;
+        
+        COMMENT("Optional field added to an existing submessage");
+        cur.limits.has_enabled = true;
+        cur.limits.enabled = true;
+        TEST(pb_encode_delta(&ostream, Settings_fields, &cur, &prev));
+        istream = pb_istream_from_buffer(buffer, ostream.bytes_written);
+        TEST(pb_decode_delta(&istream, Settings_fields, &result));
+        TEST(result.limits.has_enabled && result.limits.enabled);
+        TEST(result.limits.low == -5 && result.limits.high == 40);
+        TEST(result.revision == 10 && result.points_count == 3);
+    }
+    
+    {
+        uint8_t buffer[64];
+        Settings cur;
+        
+        COMMENT("Removed fields are an error");
+        cur = prev;
+        cur.has_name = false;
+        {
+            pb_ostream_t ostream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+            TEST(!pb_encode_delta(&ostream, Settings_fields, &cur, &prev));
+            TEST(strcmp(PB_GET_ERROR(&ostream), "field removed") == 0);
+        }
+        
+        cur = prev;
+        cur.points_count = 0;
+        {
+            pb_ostream_t ostream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+            TEST(!pb_encode_delta(&ostream, Settings_fields, &cur, &prev));
+        }
+        
+        cur = prev;
+        cur.which_mode = 0;
+        {
+            pb_ostream_t ostream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+            TEST(!pb_encode_delta(&ostream, Settings_fields, &cur, &prev));
+        }
+        
+        /* Also inside a submessage that is sent as a delta */
+        cur = prev;
+        cur.limits.has_enabled = false;
+        prev.limits.has_enabled = true;
+        {
+            pb_ostream_t ostream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+            TEST(!pb_encode_delta(&ostream, Settings_fields, &cur, &prev));
+            TEST(strcmp(PB_GET_ERROR(&ostream), "field removed") == 0);
+        }
+        prev.limits.has_enabled = false;
+    }
+    
+    if (status != 0)
+        fprintf(stdout, "\n\nSome tests FAILED!\n");
+    
+    return status;
+}
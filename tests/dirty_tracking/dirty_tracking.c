@@ -0,0 +1,127 @@
+/* Checks that the output of pb_encode_incremental() matches pb_encode()
+ * and that only the changed submessages are encoded again. */
+
+#include <stdio.h>
+#include <string.h>
+#include <pb_encode.h>
+#include <pb_decode.h>
+#include "dirty_tracking.pb.h"
+#include "unittests.h"
+
+static uint8_t config_buf[128];
+static uint8_t left_buf[32], right_buf[32], center_buf[32];
+
+static void setup(Config *msg)
+{
+    msg->encode_cache.buffer = config_buf;
+    msg->encode_cache.max_size = sizeof(config_buf);
+    msg->left.encode_cache.buffer = left_buf;
+    msg->left.encode_cache.max_size = sizeof(left_buf);
+    msg->right.encode_cache.buffer = right_buf;
+    msg->right.encode_cache.max_size = sizeof(right_buf);
+    msg->center.encode_cache.buffer = center_buf;
+    msg->center.encode_cache.max_size = sizeof(center_buf);
+}
+
+/* Check that incremental encoding gives the same bytes as pb_encode() */
+static bool matches_full_encoding(Config *msg)
+{
+    uint8_t buf1[128], buf2[128];
+    pb_ostream_t s1 = pb_ostream_from_buffer(buf1, sizeof(buf1));
+    pb_ostream_t s2 = pb_ostream_from_buffer(buf2, sizeof(buf2));
+    
+    if (!pb_encode_incremental(&s1, Config_fields, msg) ||
+        !pb_encode(&s2, Config_fields, msg))
+        return false;
+    
+    return s1.bytes_written == s2.bytes_written &&
+           memcmp(buf1, buf2, s1.bytes_written) == 0;
+}
+
+int main()
+{
+    int status = 0;
+    Config msg = Config_init_default;
+    
+    setup(&msg);
+    Config_set_version(&msg, 3);
+    msg.has_left = true;
+    Channel_set_gain(&msg.left, 10);
+    Channel_set_offset(&msg.left, -2);
+    Config_touch_left(&msg);
+    Channel_set_gain(&msg.center, 20);
+    
+    COMMENT("Dirty bits set by the setters");
+    TEST(msg.dirty_fields == ((1 << Config_version_dirty_bit) | (1 << Config_left_dirty_bit)));
+    TEST(msg.left.dirty_fields == ((1 << Channel_gain_dirty_bit) | (1 << Channel_offset_dirty_bit)));
+    TEST(Channel_offset_dirty_bit == 1 && Config_center_dirty_bit == 3);
+    
+    COMMENT("First encoding");
+    TEST(matches_full_encoding(&msg));
+    TEST(msg.dirty_fields == 0 && msg.left.dirty_fields == 0 && msg.center.dirty_fields == 0);
+    TEST(msg.encode_cache.valid && msg.left.encode_cache.valid && msg.center.encode_cache.valid);
+    TEST(!msg.right.encode_cache.valid);
+    TEST(msg.left.encode_cache.size == 4);
+    
+    {
+        COMMENT("Clean submessages are taken from the cache");
+        /* Change the structure behind the back of the cache: the stale
+         * value must still be in the output. */
+        msg.left.gain = 99;
+        Channel_set_gain(&msg.center, 21);
+        TEST(!msg.encode_cache.valid || msg.center.dirty_fields != 0);
+        {
+            uint8_t buffer[128];
+            pb_ostream_t stream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+            Config decoded = Config_init_zero;
+            pb_istream_t istream;
+            
+            TEST(pb_encode_incremental(&stream, Config_fields, &msg));
+            istream = pb_istream_from_buffer(buffer, stream.bytes_written);
+            TEST(pb_decode(&istream, Config_fields, &decoded));
+            TEST(decoded.left.gain == 10 && decoded.center.gain == 21);
+        }
+        
+        COMMENT("Touching a submessage field encodes it again");
+        Config_touch_left(&msg);
+        TEST(matches_full_encoding(&msg));
+        TEST(msg.left.encode_cache.valid);
+    }
+    
+    {
+        COMMENT("Strings changed in place");
+        strcpy(msg.center.label, "mid");
+        msg.center.has_label = true;
+        Channel_touch_label(&msg.center);
+        TEST(matches_full_encoding(&msg));
+        TEST(msg.center.encode_cache.size == 7);
+    }
+    
+    {
+        Config copy = msg;
+        uint8_t buffer[128];
+        pb_ostream_t stream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+        pb_istream_t istream;
+        
+        COMMENT("Decoding invalidates the caches");
+        TEST(pb_encode(&stream, Config_fields, &msg));
+        istream = pb_istream_from_buffer(buffer, stream.bytes_written);
+        TEST(pb_decode(&istream, Config_fields, &copy));
+        TEST(!copy.encode_cache.valid && !copy.left.encode_cache.valid);
+        TEST(!copy.right.encode_cache.valid && !copy.center.encode_cache.valid);
+    }
+    
+    {
+        Config nobuf = Config_init_zero;
+        COMMENT("Messages without cache buffers");
+        Config_set_version(&nobuf, 1);
+        Channel_set_gain(&nobuf.center, 5);
+        TEST(matches_full_encoding(&nobuf));
+        TEST(nobuf.dirty_fields == 0 && !nobuf.encode_cache.valid);
+    }
+    
+    if (status != 0)
+        fprintf(stdout, "\n\nSome tests FAILED!\n");
+    
+    return status;
+}
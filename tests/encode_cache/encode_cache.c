@@ -0,0 +1,221 @@
+/* Checks that the encode cache is used while it is valid, and that the
+ * generated setters invalidate it. */
+
+#include <stdio.h>
+#include <string.h>
+#include <pb_encode.h>
+#include <pb_decode.h>
+#include <pb_common.h>
+#include "encode_cache.pb.h"
+#include "unittests.h"
+
+/* Counts the calls to the write callback */
+static int write_calls;
+
+static bool count_writes(pb_ostream_t *stream, const uint8_t *buf, size_t count)
+{
+    uint8_t *dest = (uint8_t*)stream->state;
+    write_calls++;
+    memcpy(dest, buf, count);
+    stream->state = dest + count;
+    return true;
+}
+
+static pb_ostream_t counting_stream(uint8_t *buffer, size_t size)
+{
+    pb_ostream_t stream = pb_ostream_from_buffer(buffer, size);
+    stream.callback = count_writes;
+    return stream;
+}
+
+int main()
+{
+    int status = 0;
+    uint8_t cache_buffer[Status_size];
+    uint8_t expected[Status_size];
+    size_t expected_size;
+    Status msg = Status_init_default;
+
+    msg.encode_cache.buffer = cache_buffer;
+    msg.encode_cache.max_size = sizeof(cache_buffer);
+
+    Status_set_seq(&msg, 1);
+    Status_set_alarm(&msg, true);
+    strcpy(msg.name, "pump");
+    msg.has_fields |= 1 << Status_name_presence_bit;
+    pb_invalidate_cache(&msg.encode_cache);
+
+    {
+        pb_ostream_t stream = pb_ostream_from_buffer(expected, sizeof(expected));
+        TEST(pb_encode(&stream, Status_fields, &msg));
+        expected_size = stream.bytes_written;
+    }
+
+    {
+        uint8_t buffer1[Status_size], buffer2[Status_size];
+        pb_ostream_t stream1 = counting_stream(buffer1, sizeof(buffer1));
+        pb_ostream_t stream2 = counting_stream(buffer2, sizeof(buffer2));
+
+        COMMENT("Encoding to many streams");
+        TEST(!msg.encode_cache.valid);
+        TEST(pb_encode_cached(&stream1, Status_fields, &msg, &msg.encode_cache));
+        TEST(msg.encode_cache.valid && msg.encode_cache.size == expected_size);
+        write_calls = 0;
+        TEST(pb_encode_cached(&stream2, Status_fields, &msg, &msg.encode_cache));
+        TEST(write_calls == 1);
+        TEST(stream1.bytes_written == expected_size && stream2.bytes_written == expected_size);
+        TEST(memcmp(buffer1, expected, expected_size) == 0);
+        TEST(memcmp(buffer2, expected, expected_size) == 0);
+    }
+
+    {
+        uint8_t buffer[Status_size];
+        pb_ostream_t stream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+        Status decoded = Status_init_zero;
+        pb_istream_t istream;
+        size_t size;
+
+        COMMENT("Setters invalidate the cache");
+        Status_set_temperature(&msg, -40);
+        TEST(!msg.encode_cache.valid);
+        TEST(pb_get_encoded_size_cached(&size, Status_fields, &msg, &msg.encode_cache));
+        TEST(msg.encode_cache.valid && size > expected_size);
+        TEST(pb_encode_cached(&stream, Status_fields, &msg, &msg.encode_cache));
+        TEST(stream.bytes_written == size);
+        TEST(memcmp(cache_buffer, buffer, size) == 0);
+
+        istream = pb_istream_from_buffer(buffer, stream.bytes_written);
+        TEST(pb_decode(&istream, Status_fields, &decoded));
+        TEST(decoded.seq == 1 && decoded.temperature == -40 && decoded.alarm);
+        TEST(strcmp(decoded.name, "pump") == 0);
+        TEST(decoded.encode_cache.buffer == NULL && !decoded.encode_cache.valid);
+    }
+
+    {
+        Status sized = Status_init_zero;
+        size_t size1 = 0, size2 = 0;
+
+        COMMENT("Caching only the size");
+        Status_set_seq(&sized, 300);
+        TEST(pb_get_encoded_size_cached(&size1, Status_fields, &sized, &sized.encode_cache));
+        TEST(sized.encode_cache.valid && size1 == 3);
+        sized.seq = 1; /* Not through the setter, so the cache is stale */
+        TEST(pb_get_encoded_size_cached(&size2, Status_fields, &sized, &sized.encode_cache));
+        TEST(size2 == 3);
+        pb_invalidate_cache(&sized.encode_cache);
+        TEST(pb_get_encoded_size_cached(&size2, Status_fields, &sized, &sized.encode_cache));
+        TEST(size2 == 2);
+    }
+
+    {
+        uint8_t buffer[Report_size];
+        pb_ostream_t stream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+        Report report = Report_init_zero;
+        pb_istream_t istream;
+
+        COMMENT("Decoding keeps the cache buffer and invalidates the cache");
+        report.status.encode_cache.buffer = cache_buffer;
+        report.status.encode_cache.max_size = sizeof(cache_buffer);
+        report.status.encode_cache.valid = true;
+        Status_set_seq(&report.status, 5);
+        TEST(pb_encode(&stream, Report_fields, &report));
+
+        istream = pb_istream_from_buffer(buffer, stream.bytes_written);
+        TEST(pb_decode(&istream, Report_fields, &report));
+        TEST(report.status.seq == 5);
+        TEST(report.status.encode_cache.buffer == cache_buffer);
+        TEST(!report.status.encode_cache.valid);
+    }
+
+    {
+        uint8_t buffer[Status_size], output[Status_size];
+        pb_ostream_t stream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+        pb_ostream_t ostream = pb_ostream_from_buffer(output, sizeof(output));
+        uint8_t target_buffer[Status_size];
+        Status other = Status_init_zero;
+        Status target = Status_init_zero;
+        pb_istream_t istream;
+        size_t size;
+
+        COMMENT("Decoding into a message with a valid cache");
+        target.encode_cache.buffer = target_buffer;
+        target.encode_cache.max_size = sizeof(target_buffer);
+        Status_set_seq(&target, 1000);
+        Status_set_alarm(&target, true);
+        TEST(pb_get_encoded_size_cached(&size, Status_fields, &target, &target.encode_cache));
+        TEST(target.encode_cache.valid);
+
+        Status_set_seq(&other, 77);
+        TEST(pb_encode(&stream, Status_fields, &other));
+        istream = pb_istream_from_buffer(buffer, stream.bytes_written);
+        TEST(pb_decode(&istream, Status_fields, &target));
+        TEST(!target.encode_cache.valid && target.seq == 77);
+        TEST(pb_encode_cached(&ostream, Status_fields, &target, &target.encode_cache));
+        TEST(ostream.bytes_written == stream.bytes_written);
+        TEST(memcmp(output, buffer, stream.bytes_written) == 0);
+    }
+
+    {
+        uint8_t buffer[Status_size], output[Status_size];
+        pb_ostream_t stream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+        pb_plan_field_t entries[sizeof(Status_fields) / sizeof(pb_field_t)];
+        pb_plan_t plan;
+        Status other = Status_init_zero;
+        Status target = Status_init_zero;
+        pb_istream_t istream;
+        size_t size;
+
+        COMMENT("Decoding with a plan invalidates the cache");
+        TEST(pb_compile_plan(&plan, Status_fields, entries, sizeof(entries) / sizeof(entries[0])));
+        Status_set_seq(&target, 1000);
+        TEST(pb_get_encoded_size_cached(&size, Status_fields, &target, &target.encode_cache));
+        Status_set_seq(&other, 3);
+        Status_set_alarm(&other, true);
+        TEST(pb_encode(&stream, Status_fields, &other));
+
+        istream = pb_istream_from_buffer(buffer, stream.bytes_written);
+        TEST(pb_decode_noinit_with_plan(&istream, &plan, &target));
+        TEST(!target.encode_cache.valid && target.seq == 3 && target.alarm);
+        TEST(pb_get_encoded_size_cached(&size, Status_fields, &target, &target.encode_cache));
+        TEST(size == stream.bytes_written);
+
+        istream = pb_istream_from_buffer(buffer, stream.bytes_written);
+        TEST(pb_decode_with_plan(&istream, &plan, &target));
+        TEST(!target.encode_cache.valid);
+        target.encode_cache.buffer = output;
+        target.encode_cache.max_size = sizeof(output);
+        {
+            pb_ostream_t ostream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+            TEST(pb_encode_cached(&ostream, Status_fields, &target, &target.encode_cache));
+            TEST(ostream.bytes_written == size);
+            TEST(memcmp(output, buffer, size) == 0);
+        }
+    }
+
+    {
+        Ping ping = Ping_init_zero;
+        size_t size = 1;
+
+        COMMENT("Empty message");
+        TEST(pb_get_encoded_size_cached(&size, Ping_fields, &ping, &ping.encode_cache));
+        TEST(size == 0 && ping.encode_cache.valid);
+    }
+
+    {
+        uint8_t small[2];
+        pb_ostream_t stream = pb_ostream_from_buffer(expected, sizeof(expected));
+
+        COMMENT("Cache buffer too small");
+        msg.encode_cache.buffer = small;
+        msg.encode_cache.max_size = sizeof(small);
+        pb_invalidate_cache(&msg.encode_cache);
+        TEST(!pb_encode_cached(&stream, Status_fields, &msg, &msg.encode_cache));
+        TEST(strcmp(PB_GET_ERROR(&stream), "stream full") == 0);
+        TEST(!msg.encode_cache.valid);
+    }
+
+    if (status != 0)
+        fprintf(stdout, "\n\nSome tests FAILED!\n");
+
+    return status;
+}
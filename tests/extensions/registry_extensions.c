@@ -0,0 +1,131 @@
+/* Test decoding and encoding of extension fields through a
+ * pb_extension_registry_t instead of a linked list. */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pb_encode.h>
+#include <pb_decode.h>
+#include <pb_common.h>
+#include "alltypes.pb.h"
+#include "extensions.pb.h"
+#include "test_helpers.h"
+
+#define TEST(x) if (!(x)) { \
+    printf("Test " #x " failed.\n"); \
+    return 2; \
+    }
+
+int main(int argc, char **argv)
+{
+    uint8_t buffer[1024];
+    uint8_t buffer2[1024];
+    size_t count;
+    pb_istream_t stream;
+    pb_ostream_t ostream;
+    
+    AllTypes alltypes = {0};
+    int32_t extensionfield1;
+    pb_extension_t ext1;
+    ExtensionMessage extensionfield2;
+    pb_extension_t ext2;
+    pb_field_t gap_field;
+    pb_extension_type_t gap_type;
+    pb_extension_t gap;
+    pb_extension_t *entries[2];
+    pb_extension_t *sparse[2];
+    pb_extension_t *duplicates[2];
+    pb_extension_registry_t registry;
+    
+    /* Read the message data */
+    SET_BINARY_MODE(stdin);
+    count = fread(buffer, 1, sizeof(buffer), stdin);
+    stream = pb_istream_from_buffer(buffer, count);
+    
+    /* Set up the registry, deliberately out of tag order */
+    ext1.type = &AllTypes_extensionfield1;
+    ext1.dest = &extensionfield1;
+    ext1.next = NULL;
+    
+    ext2.type = &ExtensionMessage_AllTypes_extensionfield2;
+    ext2.dest = &extensionfield2;
+    ext2.next = NULL;
+    
+    entries[0] = &ext1;
+    entries[1] = &ext2;
+    TEST(pb_extension_registry_init(&registry, entries, 2))
+    TEST(entries[0] == &ext2 && entries[1] == &ext1)
+    TEST(pb_extension_registry_find(&registry, AllTypes_extensionfield1_tag) == &ext1)
+    TEST(pb_extension_registry_find(&registry, ExtensionMessage_AllTypes_extensionfield2_tag) == &ext2)
+    TEST(pb_extension_registry_find(&registry, 253) == NULL)
+    
+    alltypes.extensions = &registry.node;
+    
+    /* Decode the message */
+    if (!pb_decode(&stream, AllTypes_fields, &alltypes))
+    {
+        printf("Parsing failed: %s\n", PB_GET_ERROR(&stream));
+        return 1;
+    }
+
+    /* Check that the extensions decoded properly */
+    TEST(ext1.found)
+    TEST(extensionfield1 == 12345)
+    TEST(ext2.found)
+    TEST(strcmp(extensionfield2.test1, "test") == 0)
+    TEST(extensionfield2.test2 == 54321)
+    
+    /* Encode through the registry. The extensions come out in tag order,
+     * so only the length matches the original message. */
+    ostream = pb_ostream_from_buffer(buffer2, sizeof(buffer2));
+    if (!pb_encode(&ostream, AllTypes_fields, &alltypes))
+    {
+        printf("Encoding failed: %s\n", PB_GET_ERROR(&ostream));
+        return 1;
+    }
+    
+    TEST(ostream.bytes_written == count)
+    
+    /* Decode the re-encoded message again */
+    memset(&alltypes, 0, sizeof(alltypes));
+    alltypes.extensions = &registry.node;
+    extensionfield1 = 0;
+    memset(&extensionfield2, 0, sizeof(extensionfield2));
+    stream = pb_istream_from_buffer(buffer2, ostream.bytes_written);
+    if (!pb_decode(&stream, AllTypes_fields, &alltypes))
+    {
+        printf("Parsing failed: %s\n", PB_GET_ERROR(&stream));
+        return 1;
+    }
+    
+    TEST(ext1.found && extensionfield1 == 12345)
+    TEST(ext2.found && extensionfield2.test2 == 54321)
+    
+    /* Tags with a gap between them are found with a binary search.
+     * Only the tag of the field is used for the lookup. */
+    memset(&gap_field, 0, sizeof(gap_field));
+    gap_field.tag = 252;
+    gap_type.decode = NULL;
+    gap_type.encode = NULL;
+    gap_type.arg = &gap_field;
+    gap.type = &gap_type;
+    gap.dest = NULL;
+    gap.next = NULL;
+    sparse[0] = &ext1;
+    sparse[1] = &gap;
+    {
+        pb_extension_registry_t sparse_registry;
+        TEST(pb_extension_registry_init(&sparse_registry, sparse, 2))
+        TEST(pb_extension_registry_find(&sparse_registry, AllTypes_extensionfield1_tag) == &ext1)
+        TEST(pb_extension_registry_find(&sparse_registry, 252) == &gap)
+        TEST(pb_extension_registry_find(&sparse_registry, 253) == NULL)
+        TEST(pb_extension_registry_find(&sparse_registry, 1) == NULL)
+    }
+    
+    /* Registering the same tag twice is an error */
+    duplicates[0] = &ext1;
+    duplicates[1] = &ext1;
+    TEST(!pb_extension_registry_init(&registry, duplicates, 2))
+    
+    return 0;
+}
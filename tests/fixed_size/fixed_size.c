@@ -0,0 +1,125 @@
+/* Checks the encoded size stored for messages that only have required
+ * fixed-width fields, and that encoding with it gives the same output. */
+
+#include <stdio.h>
+#include <string.h>
+#include <pb_encode.h>
+#include <pb_decode.h>
+#include <pb_common.h>
+#include "fixed_size.pb.h"
+#include "unittests.h"
+
+/* Returns the size stored in the message information */
+static size_t stored_size(const pb_field_t *fields)
+{
+    const pb_message_info_t *info = pb_get_message_info(fields);
+    return (info != NULL) ? info->fixed_size : 0;
+}
+
+static void fill_coeffs(T_Coeffs *coeffs, float base)
+{
+    coeffs->a = base;
+    coeffs->b = base * 2;
+    coeffs->c = -base;
+    coeffs->d = 0;
+    coeffs->e = 1e30f;
+}
+
+int main()
+{
+    int status = 0;
+
+    COMMENT("Generated sizes");
+    TEST(T_Coeffs_fixed_size == 25 && T_Coeffs_fixed_size == T_Coeffs_size);
+    TEST(Sample_fixed_size == 53 && Sample_fixed_size == Sample_size);
+    TEST(stored_size(T_Coeffs_fields) == 25);
+    TEST(stored_size(Sample_fields) == 53);
+    TEST(stored_size(Counter_fields) == 0);
+    TEST(stored_size(MaybeSample_fields) == 0);
+    TEST(stored_size(Filter_fields) == 0);
+    TEST(Trio_fixed_size == 3 * (2 + 53));
+    TEST(Batch_fixed_size == 2 * (3 + Trio_fixed_size) && stored_size(Batch_fields) == Batch_fixed_size);
+
+    {
+        uint8_t buffer[T_Coeffs_size];
+        pb_ostream_t stream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+        T_Coeffs coeffs = T_Coeffs_init_zero;
+        size_t size = 0;
+
+        COMMENT("Encoding a fixed-size message");
+        TEST(pb_get_encoded_size(&size, T_Coeffs_fields, &coeffs) && size == 25);
+        TEST(pb_encode(&stream, T_Coeffs_fields, &coeffs));
+        TEST(stream.bytes_written == 25);
+    }
+
+    {
+        uint8_t buffer[Batch_size];
+        pb_ostream_t stream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+        pb_ostream_t sizing = PB_OSTREAM_SIZING;
+        Batch batch = Batch_init_zero;
+        size_t size = 0;
+
+        COMMENT("Encoding a fixed-size message above 255 bytes");
+        fill_coeffs(&batch.second.s3.coeffs, 2.0f);
+        TEST(pb_get_encoded_size(&size, Batch_fields, &batch) && size == Batch_fixed_size);
+        TEST(pb_encode(&stream, Batch_fields, &batch));
+        TEST(stream.bytes_written == Batch_fixed_size);
+        TEST(buffer[1] == 0xA5 && buffer[2] == 0x01); /* Length 165 */
+        TEST(pb_encode(&sizing, Batch_fields, &batch));
+        TEST(sizing.bytes_written == Batch_fixed_size);
+    }
+
+    {
+        uint8_t buffer[Filter_size];
+        pb_ostream_t stream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+        pb_ostream_t sizing = PB_OSTREAM_SIZING;
+        Filter filter = Filter_init_zero;
+        size_t size = 0;
+
+        COMMENT("Encoding fixed-size submessages");
+        filter.stages_count = 3;
+        fill_coeffs(&filter.stages[0], 1.5f);
+        fill_coeffs(&filter.stages[1], -2.0f);
+        fill_coeffs(&filter.stages[2], 0.25f);
+        filter.last.timestamp = 0xFFFFFFFFFFFFFFFFULL;
+        filter.last.valid = true;
+        filter.last.offset = -1;
+        filter.last.value = 3.5;
+        fill_coeffs(&filter.last.coeffs, 4.0f);
+
+        TEST(pb_encode(&stream, Filter_fields, &filter));
+        TEST(stream.bytes_written == 3 * (2 + 25) + 2 + 53);
+        TEST(pb_encode(&sizing, Filter_fields, &filter));
+        TEST(sizing.bytes_written == stream.bytes_written);
+        TEST(pb_get_encoded_size(&size, Filter_fields, &filter) && size == stream.bytes_written);
+
+        {
+            Filter decoded;
+            pb_istream_t istream = pb_istream_from_buffer(buffer, stream.bytes_written);
+
+            COMMENT("Decoding");
+            TEST(pb_decode(&istream, Filter_fields, &decoded));
+            TEST(decoded.stages_count == 3 && decoded.stages[1].b == -4.0f);
+            TEST(decoded.stages[2].e == 1e30f);
+            TEST(decoded.last.timestamp == 0xFFFFFFFFFFFFFFFFULL);
+            TEST(decoded.last.valid && decoded.last.offset == -1);
+            TEST(decoded.last.value == 3.5 && decoded.last.coeffs.c == -4.0f);
+        }
+    }
+
+    {
+        uint8_t buffer[16];
+        pb_ostream_t stream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+        MaybeSample msg = MaybeSample_init_zero;
+
+        COMMENT("Stream too small for the submessage");
+        msg.has_sample = true;
+        TEST(!pb_encode(&stream, MaybeSample_fields, &msg));
+        TEST(strcmp(PB_GET_ERROR(&stream), "stream full") == 0);
+    }
+
+    if (status != 0)
+        fprintf(stdout, "\n\nSome tests FAILED!\n");
+
+    return status;
+}
@@ -2,6 +2,7 @@
 
 #include <pb_decode.h>
 #include <pb_encode.h>
+#include <pb_common.h>
 #include <malloc_wrappers.h>
 #include <stdio.h>
 #include <test_helpers.h>
@@ -172,6 +173,30 @@ static bool test_OneofMessage()
         TEST(get_alloc_count() == 0);
     }
 
+    /* Same through a compiled plan, which must not advance its iterator
+     * when the oneof changes */
+    {
+        OneofMessage msg = OneofMessage_init_zero;
+        pb_plan_field_t entries[sizeof(OneofMessage_fields) / sizeof(pb_field_t)];
+        pb_plan_t plan;
+        pb_istream_t stream = pb_istream_from_buffer(buffer, msgsize);
+
+        TEST(pb_compile_plan(&plan, OneofMessage_fields, entries, sizeof(entries) / sizeof(entries[0])));
+        if (!pb_decode_with_plan(&stream, &plan, &msg))
+        {
+            fprintf(stderr, "Decode with plan failed: %s\n", PB_GET_ERROR(&stream));
+            return false;
+        }
+
+        TEST(msg.first == 999);
+        TEST(msg.which_msgs == OneofMessage_msg2_tag);
+        TEST(strcmp(msg.msgs.msg2.dynamic_str, "ABCD") == 0);
+        TEST(msg.last == 888);
+
+        pb_release(OneofMessage_fields, &msg);
+        TEST(get_alloc_count() == 0);
+    }
+
     return true;
 }
 
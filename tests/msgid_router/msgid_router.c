@@ -0,0 +1,95 @@
+/* Checks that messages written with pb_encode_any() are routed back to
+ * the right type by pb_decode_any(), and that unknown ids are skipped. */
+
+#include <stdio.h>
+#include <string.h>
+#include <pb_encode.h>
+#include <pb_decode.h>
+#include <pb_common.h>
+#include "msgid_router.pb.h"
+#include "unittests.h"
+
+int main()
+{
+    int status = 0;
+    uint8_t buffer[128];
+    pb_ostream_t ostream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+
+    {
+        COMMENT("Table lookup");
+        TEST(pb_msgid_lookup(&MSGID_ROUTER_msgid_table, Ping_msgid)->fields == Ping_fields);
+        TEST(pb_msgid_lookup(&MSGID_ROUTER_msgid_table, Command_msgid)->size == sizeof(Command));
+        TEST(pb_msgid_lookup(&MSGID_ROUTER_msgid_table, 0) == NULL);
+        TEST(pb_msgid_lookup(&MSGID_ROUTER_msgid_table, 3) == NULL);
+        TEST(pb_msgid_lookup(&MSGID_ROUTER_msgid_table, 6) == NULL);
+        TEST(sizeof(MSGID_ROUTER_msgid_union) >= sizeof(Command));
+        TEST(sizeof(MSGID_ROUTER_msgid_union) >= sizeof(Reading));
+    }
+
+    {
+        Ping ping = {42};
+        Reading reading = Reading_init_zero;
+        Command command = Command_init_zero;
+        NotRouted other = NotRouted_init_zero;
+
+        COMMENT("Encode a sequence of messages");
+        reading.value = -7;
+        reading.has_unit = true;
+        strcpy(reading.unit, "mV");
+        command.code = 3;
+        command.args_count = 2;
+        command.args[0] = 10;
+        command.args[1] = -20;
+
+        TEST(pb_encode_any(&ostream, &MSGID_ROUTER_msgid_table, Ping_msgid, &ping));
+        TEST(pb_encode_any(&ostream, &MSGID_ROUTER_msgid_table, Reading_msgid, &reading));
+
+        /* A message from a newer protocol version, with id 3 */
+        TEST(pb_encode_varint(&ostream, 3));
+        TEST(pb_encode_submessage(&ostream, Ping_fields, &ping));
+
+        TEST(pb_encode_any(&ostream, &MSGID_ROUTER_msgid_table, Command_msgid, &command));
+
+        TEST(!pb_encode_any(&ostream, &MSGID_ROUTER_msgid_table, 4, &other));
+        TEST(strcmp(PB_GET_ERROR(&ostream), "unknown msgid") == 0);
+    }
+
+    {
+        pb_istream_t istream = pb_istream_from_buffer(buffer, ostream.bytes_written);
+        MSGID_ROUTER_msgid_union msg;
+        uint32_t msgid;
+
+        COMMENT("Decode the messages by msgid");
+        TEST(pb_decode_any(&istream, &MSGID_ROUTER_msgid_table, &msgid, &msg));
+        TEST(msgid == Ping_msgid && msg.Ping_msg.seq == 42);
+
+        TEST(pb_decode_any(&istream, &MSGID_ROUTER_msgid_table, &msgid, &msg));
+        TEST(msgid == Reading_msgid && msg.Reading_msg.value == -7);
+        TEST(msg.Reading_msg.has_unit && strcmp(msg.Reading_msg.unit, "mV") == 0);
+
+        TEST(!pb_decode_any(&istream, &MSGID_ROUTER_msgid_table, &msgid, &msg));
+        TEST(msgid == 3);
+        TEST(strcmp(PB_GET_ERROR(&istream), "unknown msgid") == 0);
+
+        TEST(pb_decode_any(&istream, &MSGID_ROUTER_msgid_table, &msgid, &msg));
+        TEST(msgid == Command_msgid && msg.Command_msg.code == 3);
+        TEST(msg.Command_msg.args_count == 2 && msg.Command_msg.args[1] == -20);
+
+        TEST(istream.bytes_left == 0);
+    }
+
+    {
+        uint8_t truncated[] = {2, 10, 8, 1};
+        pb_istream_t istream = pb_istream_from_buffer(truncated, sizeof(truncated));
+        MSGID_ROUTER_msgid_union msg;
+        uint32_t msgid;
+
+        COMMENT("Truncated message");
+        TEST(!pb_decode_any(&istream, &MSGID_ROUTER_msgid_table, &msgid, &msg));
+    }
+
+    if (status != 0)
+        fprintf(stdout, "\n\nSome tests FAILED!\n");
+
+    return status;
+}
@@ -0,0 +1,107 @@
+/* Checks that pb_patch_fixed() overwrites the fields in an encoded message
+ * so that decoding it gives the new values. */
+
+#include <stdio.h>
+#include <string.h>
+#include <pb_encode.h>
+#include <pb_decode.h>
+#include "patch_fixed.pb.h"
+#include "unittests.h"
+
+static size_t encode_response(uint8_t *buffer, size_t size)
+{
+    Response msg = Response_init_zero;
+    pb_ostream_t stream = pb_ostream_from_buffer(buffer, size);
+
+    msg.header.sequence = 1;
+    msg.header.has_timeStamp = true;
+    msg.header.timeStamp = 1000;
+    msg.header.has_flags = true;
+    msg.header.flags = 300;
+    msg.items_count = 2;
+    strcpy(msg.items[0], "first");
+    strcpy(msg.items[1], "second");
+    msg.has_value = true;
+    msg.value = 1.5;
+    msg.history_count = 2;
+    msg.history[0].sequence = 10;
+    msg.history[1].sequence = 11;
+
+    if (!pb_encode(&stream, Response_fields, &msg))
+        return 0;
+    return stream.bytes_written;
+}
+
+static bool decode_response(const uint8_t *buffer, size_t size, Response *msg)
+{
+    pb_istream_t stream = pb_istream_from_buffer(buffer, size);
+    return pb_decode(&stream, Response_fields, msg);
+}
+
+int main()
+{
+    int status = 0;
+    uint8_t buffer[Response_size];
+    size_t size = encode_response(buffer, sizeof(buffer));
+    Response msg;
+
+    TEST(size > 0);
+
+    {
+        static const uint32_t path[] = {Response_header_tag, Header_timeStamp_tag, 0};
+        uint64_t now = 0x0123456789ABCDEFULL;
+
+        COMMENT("Nested fixed64");
+        TEST(pb_patch_fixed(buffer, size, Response_fields, path, &now));
+        TEST(decode_response(buffer, size, &msg));
+        TEST(msg.header.timeStamp == now && msg.header.sequence == 1);
+        TEST(msg.header.flags == 300 && strcmp(msg.items[1], "second") == 0);
+    }
+
+    {
+        static const uint32_t path[] = {Response_value_tag, 0};
+        double value = -2.25;
+
+        COMMENT("Top-level double");
+        TEST(pb_patch_fixed(buffer, size, Response_fields, path, &value));
+        TEST(decode_response(buffer, size, &msg));
+        TEST(msg.value == -2.25);
+    }
+
+    {
+        static const uint32_t path[] = {Response_history_tag, Header_sequence_tag, 0};
+        uint32_t sequence = 0xFFFFFFFF;
+
+        COMMENT("Field in all array entries");
+        TEST(pb_patch_fixed(buffer, size, Response_fields, path, &sequence));
+        TEST(decode_response(buffer, size, &msg));
+        TEST(msg.history_count == 2);
+        TEST(msg.history[0].sequence == 0xFFFFFFFF && msg.history[1].sequence == 0xFFFFFFFF);
+        TEST(msg.header.sequence == 1);
+    }
+
+    {
+        static const uint32_t absent[] = {Response_offset_tag, 0};
+        static const uint32_t unknown[] = {Response_header_tag, 42, 0};
+        static const uint32_t varint[] = {Response_header_tag, Header_flags_tag, 0};
+        static const uint32_t string[] = {Response_items_tag, 0};
+        static const uint32_t path[] = {Response_value_tag, 0};
+        int32_t offset = 5;
+        double value = 3.0;
+        uint8_t copy[Response_size];
+
+        COMMENT("Errors");
+        memcpy(copy, buffer, size);
+        TEST(!pb_patch_fixed(buffer, size, Response_fields, absent, &offset));
+        TEST(!pb_patch_fixed(buffer, size, Response_fields, unknown, &offset));
+        TEST(!pb_patch_fixed(buffer, size, Response_fields, varint, &offset));
+        TEST(!pb_patch_fixed(buffer, size, Response_fields, string, &offset));
+        TEST(memcmp(copy, buffer, size) == 0);
+        TEST(!pb_patch_fixed(buffer, size - 1, Response_fields, path, &value));
+    }
+
+    if (status != 0)
+        fprintf(stdout, "\n\nSome tests FAILED!\n");
+
+    return status;
+}
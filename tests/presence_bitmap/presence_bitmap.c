@@ -0,0 +1,129 @@
+/* Checks that messages with the presence bitmap are encoded and decoded
+ * the same way as messages with separate has_ fields. */
+
+#include <stdio.h>
+#include <string.h>
+#include <pb_encode.h>
+#include <pb_decode.h>
+#include <pb_common.h>
+#include "presence_bitmap.pb.h"
+#include "unittests.h"
+
+#define HAS(msg, type, field) (((msg).has_fields >> type ## _ ## field ## _presence_bit) & 1)
+#define SET(msg, type, field) ((msg).has_fields |= (pb_presence_t)1 << type ## _ ## field ## _presence_bit)
+
+int main()
+{
+    int status = 0;
+
+    COMMENT("Structure layout");
+    TEST(sizeof(Sparse) < sizeof(SparseBools));
+    TEST(Sparse_f1_presence_bit == 0 && Sparse_f24_presence_bit == 23);
+    TEST(Mixed_name_presence_bit == 0 && Mixed_last_presence_bit == 2);
+
+    {
+        Sparse msg = Sparse_init_zero;
+        SparseBools ref = SparseBools_init_zero;
+        uint8_t buffer1[256], buffer2[256], buffer3[256];
+        pb_ostream_t stream1 = pb_ostream_from_buffer(buffer1, sizeof(buffer1));
+        pb_ostream_t stream2 = pb_ostream_from_buffer(buffer2, sizeof(buffer2));
+        pb_ostream_t stream3 = pb_ostream_from_buffer(buffer3, sizeof(buffer3));
+        pb_plan_field_t entries[24];
+        pb_plan_t plan;
+
+        COMMENT("Encoding a sparse message");
+        msg.f2 = -5; SET(msg, Sparse, f2);
+        msg.f8[0] = 'x'; SET(msg, Sparse, f8);
+        msg.f23 = 1234; SET(msg, Sparse, f23);
+        msg.f12 = 7; /* Not present */
+        ref.f2 = -5; ref.has_f2 = true;
+        ref.f8[0] = 'x'; ref.has_f8 = true;
+        ref.f23 = 1234; ref.has_f23 = true;
+        ref.f12 = 7;
+
+        TEST(pb_encode(&stream1, Sparse_fields, &msg));
+        TEST(pb_encode(&stream2, SparseBools_fields, &ref));
+        TEST(stream1.bytes_written == stream2.bytes_written);
+        TEST(memcmp(buffer1, buffer2, stream1.bytes_written) == 0);
+
+        COMMENT("Encoding a sparse message with a plan");
+        TEST(pb_compile_plan(&plan, Sparse_fields, entries, 24));
+        TEST(plan.flags & PB_PLAN_PRESENCE_ONLY);
+        TEST(pb_encode_with_plan(&stream3, &plan, &msg));
+        TEST(stream3.bytes_written == stream1.bytes_written);
+        TEST(memcmp(buffer3, buffer1, stream1.bytes_written) == 0);
+
+        {
+            Sparse decoded;
+            pb_istream_t istream = pb_istream_from_buffer(buffer2, stream2.bytes_written);
+
+            COMMENT("Decoding a sparse message");
+            memset(&decoded, 0xAA, sizeof(decoded));
+            TEST(pb_decode(&istream, Sparse_fields, &decoded));
+            TEST(decoded.has_fields == msg.has_fields);
+            TEST(decoded.f2 == -5 && strcmp(decoded.f8, "x") == 0 && decoded.f23 == 1234);
+            TEST(!HAS(decoded, Sparse, f12) && decoded.f12 == 0);
+        }
+
+        {
+            SpecializedSparse decoded;
+            pb_istream_t istream = pb_istream_from_buffer(buffer1, stream1.bytes_written);
+            pb_ostream_t ostream = pb_ostream_from_buffer(buffer3, sizeof(buffer3));
+
+            COMMENT("Specialized functions with the presence bitmap");
+            TEST(pb_decode_SpecializedSparse(&istream, &decoded));
+            TEST(decoded.has_fields == msg.has_fields);
+            TEST(pb_encode_SpecializedSparse(&ostream, &decoded));
+            TEST(ostream.bytes_written == stream1.bytes_written);
+            TEST(memcmp(buffer3, buffer1, stream1.bytes_written) == 0);
+        }
+    }
+
+    {
+        Mixed msg = Mixed_init_default;
+        MixedBools ref = MixedBools_init_default;
+        uint8_t buffer1[128], buffer2[128];
+        pb_ostream_t stream1 = pb_ostream_from_buffer(buffer1, sizeof(buffer1));
+        pb_ostream_t stream2 = pb_ostream_from_buffer(buffer2, sizeof(buffer2));
+        pb_plan_field_t entries[8];
+        pb_plan_t plan;
+
+        COMMENT("Bitmap together with other kinds of fields");
+        TEST(msg.has_fields == 0 && strcmp(msg.name, "abc") == 0 && msg.last == 99);
+        msg.req = 3;
+        msg.list_count = 2; msg.list[0] = 1; msg.list[1] = 2;
+        msg.inner.has_value = true; msg.inner.value = 5; SET(msg, Mixed, inner);
+        msg.which_choice = Mixed_a_tag; msg.choice.a = 10;
+        msg.last = 100; SET(msg, Mixed, last);
+        ref.req = 3;
+        ref.list_count = 2; ref.list[0] = 1; ref.list[1] = 2;
+        ref.inner.has_value = true; ref.inner.value = 5; ref.has_inner = true;
+        ref.which_choice = MixedBools_a_tag; ref.choice.a = 10;
+        ref.last = 100; ref.has_last = true;
+
+        TEST(pb_encode(&stream1, Mixed_fields, &msg));
+        TEST(pb_encode(&stream2, MixedBools_fields, &ref));
+        TEST(stream1.bytes_written == stream2.bytes_written);
+        TEST(memcmp(buffer1, buffer2, stream1.bytes_written) == 0);
+
+        TEST(pb_compile_plan(&plan, Mixed_fields, entries, 8));
+        TEST(!(plan.flags & PB_PLAN_PRESENCE_ONLY));
+
+        {
+            Mixed decoded;
+            pb_istream_t istream = pb_istream_from_buffer(buffer2, stream2.bytes_written);
+
+            memset(&decoded, 0xAA, sizeof(decoded));
+            TEST(pb_decode_with_plan(&istream, &plan, &decoded));
+            TEST(decoded.has_fields == msg.has_fields);
+            TEST(!HAS(decoded, Mixed, name) && strcmp(decoded.name, "abc") == 0);
+            TEST(decoded.inner.value == 5 && decoded.last == 100);
+            TEST(decoded.list_count == 2 && decoded.choice.a == 10);
+        }
+    }
+
+    if (status != 0)
+        fprintf(stdout, "\n\nSome tests FAILED!\n");
+
+    return status;
+}
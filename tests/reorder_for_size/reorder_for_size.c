@@ -0,0 +1,104 @@
+/* Checks that messages with reordered structure members are encoded and
+ * decoded the same way as messages in the .proto order. */
+
+#include <stdio.h>
+#include <string.h>
+#include <pb_encode.h>
+#include <pb_decode.h>
+#include <pb_common.h>
+#include "reorder_for_size.pb.h"
+#include "unittests.h"
+
+int main()
+{
+    int status = 0;
+    Original orig = Original_init_default;
+    Reordered reord = Reordered_init_default;
+    ReorderedBitmap bitmap = ReorderedBitmap_init_default;
+    uint8_t buffer1[128], buffer2[128], buffer3[128];
+    pb_ostream_t stream1 = pb_ostream_from_buffer(buffer1, sizeof(buffer1));
+    pb_ostream_t stream2 = pb_ostream_from_buffer(buffer2, sizeof(buffer2));
+    pb_ostream_t stream3 = pb_ostream_from_buffer(buffer3, sizeof(buffer3));
+
+    COMMENT("Structure layout");
+    TEST(sizeof(Reordered) < sizeof(Original));
+    TEST(sizeof(ReorderedInner) < sizeof(OriginalInner));
+    TEST(offsetof(Reordered, big) == 0);
+    TEST(reord.ratio == 1.5f && strcmp(reord.name, "x") == 0 && reord.last == -3);
+
+    orig.has_flag = true; orig.flag = true;
+    orig.big = 1234567890123ULL;
+    orig.has_inner = true; orig.inner.has_b = true; orig.inner.b = 2.5; orig.inner.has_c = true; orig.inner.c = true;
+    orig.values_count = 2; orig.values[0] = -1; orig.values[1] = 100;
+    orig.which_choice = Original_yes_tag; orig.choice.yes = true;
+    orig.has_last = true; orig.last = -100;
+    orig.has_data = true; orig.data.size = 2; orig.data.bytes[0] = 1; orig.data.bytes[1] = 2;
+
+    reord.has_flag = true; reord.flag = true;
+    reord.big = 1234567890123ULL;
+    reord.has_inner = true; reord.inner.has_b = true; reord.inner.b = 2.5; reord.inner.has_c = true; reord.inner.c = true;
+    reord.values_count = 2; reord.values[0] = -1; reord.values[1] = 100;
+    reord.which_choice = Reordered_yes_tag; reord.choice.yes = true;
+    reord.has_last = true; reord.last = -100;
+    reord.has_data = true; reord.data.size = 2; reord.data.bytes[0] = 1; reord.data.bytes[1] = 2;
+
+    bitmap.has_fields = (1 << ReorderedBitmap_flag_presence_bit) | (1 << ReorderedBitmap_inner_presence_bit) |
+                        (1 << ReorderedBitmap_last_presence_bit) | (1 << ReorderedBitmap_data_presence_bit);
+    bitmap.flag = true;
+    bitmap.big = 1234567890123ULL;
+    bitmap.inner = reord.inner;
+    bitmap.values_count = 2; bitmap.values[0] = -1; bitmap.values[1] = 100;
+    bitmap.which_choice = ReorderedBitmap_yes_tag; bitmap.choice.yes = true;
+    bitmap.last = -100;
+    bitmap.data.size = 2; bitmap.data.bytes[0] = 1; bitmap.data.bytes[1] = 2;
+
+    COMMENT("Encoding");
+    TEST(pb_encode(&stream1, Original_fields, &orig));
+    TEST(pb_encode(&stream2, Reordered_fields, &reord));
+    TEST(pb_encode(&stream3, ReorderedBitmap_fields, &bitmap));
+    TEST(stream1.bytes_written == stream2.bytes_written);
+    TEST(memcmp(buffer1, buffer2, stream1.bytes_written) == 0);
+    TEST(stream1.bytes_written == stream3.bytes_written);
+    TEST(memcmp(buffer1, buffer3, stream1.bytes_written) == 0);
+
+    {
+        Reordered decoded;
+        pb_istream_t stream = pb_istream_from_buffer(buffer1, stream1.bytes_written);
+
+        COMMENT("Decoding");
+        memset(&decoded, 0xAA, sizeof(decoded));
+        TEST(pb_decode(&stream, Reordered_fields, &decoded));
+        TEST(decoded.has_flag && decoded.flag);
+        TEST(decoded.big == 1234567890123ULL);
+        TEST(!decoded.has_ratio && decoded.ratio == 1.5f);
+        TEST(decoded.has_inner && decoded.inner.b == 2.5 && decoded.inner.c && !decoded.inner.has_a);
+        TEST(decoded.values_count == 2 && decoded.values[1] == 100);
+        TEST(!decoded.has_name && strcmp(decoded.name, "x") == 0);
+        TEST(decoded.which_choice == Reordered_yes_tag && decoded.choice.yes);
+        TEST(decoded.has_last && decoded.last == -100);
+        TEST(decoded.has_data && decoded.data.size == 2 && decoded.data.bytes[1] == 2);
+    }
+
+    {
+        pb_plan_field_t entries[10];
+        pb_plan_t plan;
+        ReorderedBitmap decoded;
+        pb_istream_t stream = pb_istream_from_buffer(buffer1, stream1.bytes_written);
+        pb_ostream_t ostream = pb_ostream_from_buffer(buffer3, sizeof(buffer3));
+
+        COMMENT("Compiled plan with reordered structure");
+        TEST(pb_compile_plan(&plan, ReorderedBitmap_fields, entries, 10));
+        TEST(entries[1].data_offset == offsetof(ReorderedBitmap, big));
+        TEST(pb_decode_with_plan(&stream, &plan, &decoded));
+        TEST(decoded.has_fields == bitmap.has_fields);
+        TEST(decoded.last == -100 && decoded.values[0] == -1);
+        TEST(pb_encode_with_plan(&ostream, &plan, &decoded));
+        TEST(ostream.bytes_written == stream1.bytes_written);
+        TEST(memcmp(buffer1, buffer3, stream1.bytes_written) == 0);
+    }
+
+    if (status != 0)
+        fprintf(stdout, "\n\nSome tests FAILED!\n");
+
+    return status;
+}
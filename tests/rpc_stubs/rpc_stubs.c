@@ -0,0 +1,269 @@
+/* Checks the stubs generated for a service: calls are encoded by the client
+ * functions, dispatched to the handlers by pb_rpc_serve() and the responses
+ * are matched back to the calls by their call id. */
+
+#include <stdio.h>
+#include <string.h>
+#include <pb_encode.h>
+#include <pb_decode.h>
+#include <pb_rpc.h>
+#include "rpc_stubs.pb.h"
+#include "unittests.h"
+
+#define KEYS 4
+
+static char g_values[KEYS][16];
+static int g_callbacks;
+
+static bool handle_get(const rpc_GetRequest *request, rpc_GetResponse *response, void *arg)
+{
+    (void)arg;
+    if (request->key >= KEYS)
+        return false;
+
+    response->key = request->key;
+    response->has_value = (g_values[request->key][0] != '\0');
+    strcpy(response->value, g_values[request->key]);
+    return true;
+}
+
+static bool handle_set(const rpc_SetRequest *request, rpc_Empty *response, void *arg)
+{
+    (void)response;
+    (void)arg;
+    if (request->key >= KEYS)
+        return false;
+
+    strcpy(g_values[request->key], request->value);
+    return true;
+}
+
+/* Clear has no handler */
+static const rpc_Store_handlers_t g_handlers = {&handle_get, &handle_set, NULL};
+
+static void count_callback(pb_rpc_call_t *call)
+{
+    (void)call;
+    g_callbacks++;
+}
+
+/* Serve all the requests in the buffer, and write each response to a
+ * buffer of its own, so that the test can send them in any order. */
+static int serve_all(const uint8_t *requests, size_t size,
+                     uint8_t responses[][64], size_t *lengths, int max)
+{
+    rpc_Store_request_union request;
+    rpc_Store_response_union response;
+    pb_rpc_server_t server;
+    pb_istream_t input = pb_istream_from_buffer(requests, size);
+    int count = 0;
+
+    server.service = &rpc_Store_service;
+    server.handlers = &g_handlers;
+    server.arg = NULL;
+    server.request = &request;
+    server.response = &response;
+
+    while (input.bytes_left > 0 && count < max)
+    {
+        pb_ostream_t output = pb_ostream_from_buffer(responses[count], 64);
+        if (!pb_rpc_serve(&server, &input, &output))
+            return -1;
+        lengths[count++] = output.bytes_written;
+    }
+
+    return count;
+}
+
+int main()
+{
+    int status = 0;
+
+    {
+        COMMENT("Service table");
+        TEST(rpc_Store_service.method_count == 3);
+        TEST(strcmp(rpc_Store_service.name, "rpc.Store") == 0);
+        TEST(pb_rpc_find_method(&rpc_Store_service, rpc_Store_Set_methodid)->request_fields == rpc_SetRequest_fields);
+        TEST(pb_rpc_find_method(&rpc_Store_service, 0) == NULL);
+        TEST(pb_rpc_find_method(&rpc_Store_service, 4) == NULL);
+        TEST(sizeof(rpc_Store_request_union) >= sizeof(rpc_SetRequest));
+    }
+
+    {
+        uint8_t requests[256];
+        uint8_t responses[8][64];
+        size_t lengths[8];
+        uint8_t answers[512];
+        pb_ostream_t output = pb_ostream_from_buffer(requests, sizeof(requests));
+        pb_istream_t input;
+        pb_ostream_t answer_stream = pb_ostream_from_buffer(answers, sizeof(answers));
+        pb_rpc_client_t client;
+        pb_rpc_call_t calls[5];
+        rpc_SetRequest set = {1, "one"};
+        rpc_GetRequest get = {1};
+        rpc_GetRequest get_bad = {KEYS};
+        rpc_Empty empty = {0};
+        rpc_Empty set_response, clear_response;
+        rpc_GetResponse get_response, get_bad_response;
+        int count, i;
+
+        COMMENT("Many calls in flight, answered in reverse order");
+        memset(calls, 0, sizeof(calls));
+        for (i = 0; i < 5; i++)
+            calls[i].callback = count_callback;
+
+        pb_rpc_client_init(&client);
+        TEST(rpc_Store_Set_start(&client, &output, &calls[0], &set, &set_response));
+        TEST(rpc_Store_Get_start(&client, &output, &calls[1], &get, &get_response));
+        TEST(rpc_Store_Get_start(&client, &output, &calls[2], &get_bad, &get_bad_response));
+        TEST(rpc_Store_Clear_start(&client, &output, &calls[3], &empty, &clear_response));
+
+        /* A call to a method that the server does not know */
+        {
+            static const pb_rpc_method_t unknown = {9, "Unknown", rpc_Empty_fields, sizeof(rpc_Empty),
+                                                    rpc_Empty_fields, sizeof(rpc_Empty), NULL};
+            TEST(pb_rpc_start(&client, &output, &calls[4], &unknown, &empty, &clear_response));
+        }
+
+        count = serve_all(requests, output.bytes_written, responses, lengths, 8);
+        TEST(count == 5);
+
+        for (i = count - 1; i >= 0; i--)
+            TEST(pb_write(&answer_stream, responses[i], lengths[i]));
+
+        input = pb_istream_from_buffer(answers, answer_stream.bytes_written);
+        while (input.bytes_left > 0)
+            TEST(pb_rpc_receive(&client, &input));
+
+        TEST(g_callbacks == 5);
+        TEST(client.pending == NULL);
+        TEST(calls[0].done && calls[0].status == PB_RPC_OK);
+        TEST(strcmp(g_values[1], "one") == 0);
+        TEST(calls[1].done && calls[1].status == PB_RPC_OK);
+        TEST(get_response.key == 1 && get_response.has_value);
+        TEST(strcmp(get_response.value, "one") == 0);
+        TEST(calls[2].done && calls[2].status == PB_RPC_FAILED);
+        TEST(calls[3].done && calls[3].status == PB_RPC_UNKNOWN_METHOD);
+        TEST(calls[4].done && calls[4].status == PB_RPC_UNKNOWN_METHOD);
+    }
+
+    {
+        uint8_t requests[64];
+        uint8_t responses[2][64];
+        size_t lengths[2];
+        pb_ostream_t output = pb_ostream_from_buffer(requests, sizeof(requests));
+        pb_istream_t input;
+        pb_rpc_client_t client;
+        pb_rpc_call_t cancelled, waited;
+        rpc_GetRequest get = {1};
+        rpc_GetResponse response1, response2;
+        uint8_t answers[128];
+
+        COMMENT("Late response to a cancelled call, and pb_rpc_wait()");
+        memset(&cancelled, 0, sizeof(cancelled));
+        memset(&waited, 0, sizeof(waited));
+        pb_rpc_client_init(&client);
+        TEST(rpc_Store_Get_start(&client, &output, &cancelled, &get, &response1));
+        TEST(rpc_Store_Get_start(&client, &output, &waited, &get, &response2));
+        pb_rpc_cancel(&client, &cancelled);
+
+        TEST(serve_all(requests, output.bytes_written, responses, lengths, 2) == 2);
+        memcpy(answers, responses[0], lengths[0]);
+        memcpy(answers + lengths[0], responses[1], lengths[1]);
+        input = pb_istream_from_buffer(answers, lengths[0] + lengths[1]);
+
+        TEST(pb_rpc_wait(&client, &input, &waited) == PB_RPC_OK);
+        TEST(!cancelled.done);
+        TEST(strcmp(response2.value, "one") == 0);
+        TEST(input.bytes_left == 0);
+    }
+
+    {
+        uint8_t requests[64];
+        uint8_t responses[2][64];
+        size_t lengths[2];
+        pb_ostream_t output = pb_ostream_from_buffer(requests, sizeof(requests));
+        pb_ostream_t discard = PB_OSTREAM_SIZING;
+        pb_istream_t input;
+        pb_rpc_client_t client;
+        pb_rpc_call_t bad, good;
+        rpc_SetRequest set = {1, "one"};
+        rpc_GetRequest get = {1};
+        rpc_Empty set_response;
+        rpc_GetResponse get_response;
+
+        /* A Set request whose string value claims to be longer than the
+         * message, in place of the one the client encoded, followed by a
+         * valid Get request. */
+        static const uint8_t bad_request[] = {rpc_Store_Set_methodid, 1, 4, 0x08, 0x01, 0x12, 0x05};
+
+        COMMENT("Request that the server cannot decode");
+        memset(&bad, 0, sizeof(bad));
+        memset(&good, 0, sizeof(good));
+        pb_rpc_client_init(&client);
+        TEST(rpc_Store_Set_start(&client, &discard, &bad, &set, &set_response));
+        TEST(bad.call_id == 1);
+        TEST(pb_write(&output, bad_request, sizeof(bad_request)));
+        TEST(rpc_Store_Get_start(&client, &output, &good, &get, &get_response));
+
+        TEST(serve_all(requests, output.bytes_written, responses, lengths, 2) == 2);
+        input = pb_istream_from_buffer(responses[0], lengths[0]);
+        TEST(pb_rpc_receive(&client, &input));
+        input = pb_istream_from_buffer(responses[1], lengths[1]);
+        TEST(pb_rpc_receive(&client, &input));
+        TEST(bad.done && bad.status == PB_RPC_BAD_REQUEST);
+        TEST(good.done && good.status == PB_RPC_OK);
+        TEST(get_response.key == 1 && strcmp(get_response.value, "one") == 0);
+    }
+
+    {
+        uint8_t answers[64];
+        pb_ostream_t output = pb_ostream_from_buffer(answers, sizeof(answers));
+        pb_ostream_t requests = PB_OSTREAM_SIZING;
+        pb_istream_t input;
+        pb_rpc_client_t client;
+        pb_rpc_call_t bad, good;
+        rpc_GetRequest get = {1};
+        rpc_GetResponse bad_response, good_response;
+
+        /* A Get response with a truncated string, and a valid response
+         * to the other call. */
+        static const uint8_t bad_answer[] = {1, PB_RPC_OK, 4, 0x08, 0x01, 0x12, 0x05};
+        static const uint8_t good_answer[] = {2, PB_RPC_OK, 5, 0x08, 0x03, 0x12, 0x01, 'x'};
+
+        COMMENT("Response that the client cannot decode");
+        memset(&bad, 0, sizeof(bad));
+        memset(&good, 0, sizeof(good));
+        pb_rpc_client_init(&client);
+        TEST(rpc_Store_Get_start(&client, &requests, &bad, &get, &bad_response));
+        TEST(rpc_Store_Get_start(&client, &requests, &good, &get, &good_response));
+        TEST(pb_write(&output, bad_answer, sizeof(bad_answer)));
+        TEST(pb_write(&output, good_answer, sizeof(good_answer)));
+
+        input = pb_istream_from_buffer(answers, output.bytes_written);
+        TEST(pb_rpc_wait(&client, &input, &good) == PB_RPC_OK);
+        TEST(bad.done && bad.status == PB_RPC_BAD_RESPONSE);
+        TEST(good_response.key == 3 && strcmp(good_response.value, "x") == 0);
+        TEST(input.bytes_left == 0);
+    }
+
+    {
+        uint8_t buffer[64];
+        pb_ostream_t output = pb_ostream_from_buffer(buffer, sizeof(buffer));
+        pb_istream_t input;
+        pb_rpc_client_t client;
+        rpc_GetRequest get = {2};
+        rpc_GetResponse response;
+
+        COMMENT("Blocking call with a truncated response");
+        pb_rpc_client_init(&client);
+        input = pb_istream_from_buffer(buffer, 2);
+        TEST(rpc_Store_Get_call(&client, &output, &input, &get, &response) == PB_RPC_STREAM_ERROR);
+        TEST(client.pending == NULL);
+    }
+
+    if (status != 0)
+        fprintf(stdout, "\n\nSome tests FAILED!\n");
+
+    return status;
+}
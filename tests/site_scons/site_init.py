@@ -105,5 +105,41 @@ def add_nanopb_builders(env):
 
     match_builder = Builder(action = match_files, suffix = '.matched')
     env.Append(BUILDERS = {'Match': match_builder})
+
+    # Build command that compares benchmark results in source1 against the
+    # baseline in source2. Each line has the columns
+    #   program stream operation message size depth msgs/s MB/s
+    # Fails if a case is slower than the baseline by more than TOLERANCE.
+    def compare_benchmark(target, source, env):
+        def load(filename):
+            results = {}
+            for line in open(filename):
+                columns = line.split()
+                if len(columns) == 8 and not line.startswith('#'):
+                    results[tuple(columns[0:4])] = float(columns[6])
+            return results
+        
+        results = load(str(source[0]))
+        baseline = load(str(source[1]))
+        tolerance = float(env.get('TOLERANCE', 0.25))
+        report = open(str(target[0]), 'w')
+        status = 0
+        for key in sorted(results.keys()):
+            if key not in baseline:
+                report.write('%s: no baseline\n' % ' '.join(key))
+                continue
+            
+            ratio = results[key] / baseline[key]
+            report.write('%s: %.2f\n' % (' '.join(key), ratio))
+            if ratio < 1.0 - tolerance:
+                print '\033[31m[FAIL]\033[0m   Slower than baseline: %s (%.2f)' % (' '.join(key), ratio)
+                status = 1
+        
+        if status == 0:
+            print '\033[32m[ OK ]\033[0m   Benchmark within baseline: ' + str(source[0])
+        return status
+    
+    benchmark_builder = Builder(action = compare_benchmark, suffix = '.compared')
+    env.Append(BUILDERS = {'CompareBenchmark': benchmark_builder})
     
 
@@ -0,0 +1,157 @@
+/* Checks that a struct-of-arrays field is encoded and decoded the same
+ * way as a normal array of submessage structures. */
+
+#include <stdio.h>
+#include <string.h>
+#include <pb_encode.h>
+#include <pb_decode.h>
+#include <pb_common.h>
+#include "soa.pb.h"
+#include "unittests.h"
+
+/* Fill in the same data in both layouts */
+static void fill_series(Series *soa, SeriesArray *aos)
+{
+    pb_size_t i;
+
+    strcpy(soa->name, "temps");
+    strcpy(aos->name, "temps");
+    soa->values_count = aos->values_count = 4;
+
+    for (i = 0; i < 4; i++)
+    {
+        Values *v = &aos->values[i];
+
+        v->timestamp = soa->values.timestamp[i] = 1400000000 + 60 * (int64_t)i;
+
+        if (i != 1)
+        {
+            v->has_temperature = soa->values.has_temperature[i] = true;
+            v->temperature = soa->values.temperature[i] = 21.5f + (float)i;
+        }
+
+        v->samples_count = soa->values.samples_count[i] = i % 3;
+        v->samples[0] = soa->values.samples[i][0] = -1;
+        v->samples[1] = soa->values.samples[i][1] = 100;
+
+        if (i == 2)
+        {
+            v->has_label = soa->values.has_label[i] = true;
+            strcpy(v->label, "peak");
+            strcpy(soa->values.label[i], "peak");
+            v->has_inner = soa->values.has_inner[i] = true;
+            v->inner.id = soa->values.inner[i].id = 77;
+        }
+    }
+
+    soa->has_after = aos->has_after = true;
+    soa->after = aos->after = -3;
+}
+
+int main()
+{
+    int status = 0;
+    uint8_t buffer1[256], buffer2[256];
+    size_t size1, size2;
+
+    COMMENT("Structure layout");
+    TEST(Series_values_max_count == 6);
+    TEST(sizeof(((Series*)0)->values.temperature) == 6 * sizeof(float));
+
+    {
+        Series soa = Series_init_zero;
+        SeriesArray aos = SeriesArray_init_zero;
+        pb_ostream_t stream1 = pb_ostream_from_buffer(buffer1, sizeof(buffer1));
+        pb_ostream_t stream2 = pb_ostream_from_buffer(buffer2, sizeof(buffer2));
+
+        COMMENT("Encoding");
+        fill_series(&soa, &aos);
+        TEST(pb_encode(&stream1, Series_fields, &soa));
+        TEST(pb_encode(&stream2, SeriesArray_fields, &aos));
+        size1 = stream1.bytes_written;
+        size2 = stream2.bytes_written;
+        TEST(size1 == size2);
+        TEST(memcmp(buffer1, buffer2, size1) == 0);
+        TEST(pb_get_encoded_size(&size2, Series_fields, &soa) && size2 == size1);
+    }
+
+    {
+        Series soa;
+        pb_istream_t stream = pb_istream_from_buffer(buffer2, size1);
+
+        COMMENT("Decoding");
+        memset(&soa, 0xAA, sizeof(soa));
+        TEST(pb_decode(&stream, Series_fields, &soa));
+        TEST(strcmp(soa.name, "temps") == 0);
+        TEST(soa.values_count == 4);
+        TEST(soa.values.timestamp[3] == 1400000000 + 180);
+        TEST(soa.values.has_temperature[0] && soa.values.temperature[0] == 21.5f);
+        TEST(!soa.values.has_temperature[1] && soa.values.temperature[1] == 20.5f);
+        TEST(soa.values.samples_count[2] == 2 && soa.values.samples[2][1] == 100);
+        TEST(soa.values.samples_count[3] == 0);
+        TEST(soa.values.has_label[2] && strcmp(soa.values.label[2], "peak") == 0);
+        TEST(!soa.values.has_label[3] && soa.values.label[3][0] == '\0');
+        TEST(soa.values.has_inner[2] && soa.values.inner[2].id == 77);
+        TEST(!soa.values.has_inner[0] && soa.values.inner[0].id == 0);
+        TEST(soa.has_after && soa.after == -3);
+    }
+
+    {
+        Series soa = Series_init_default;
+        pb_plan_field_t entries[3];
+        pb_plan_t plan;
+        pb_ostream_t stream = pb_ostream_from_buffer(buffer2, sizeof(buffer2));
+        SeriesArray aos = SeriesArray_init_zero;
+
+        COMMENT("Encoding with a plan");
+        TEST(soa.values.temperature[5] == 20.5f);
+        fill_series(&soa, &aos);
+        TEST(pb_compile_plan(&plan, Series_fields, entries, 3));
+        TEST(pb_encode_with_plan(&stream, &plan, &soa));
+        TEST(stream.bytes_written == size1);
+        TEST(memcmp(buffer1, buffer2, size1) == 0);
+
+        {
+            Series decoded;
+            pb_istream_t istream = pb_istream_from_buffer(buffer2, stream.bytes_written);
+            TEST(pb_decode_with_plan(&istream, &plan, &decoded));
+            TEST(decoded.values_count == 4 && decoded.values.inner[2].id == 77);
+        }
+    }
+
+    {
+        /* Entry without the required timestamp */
+        const uint8_t input[] = {0x0a, 0x01, 'x', 0x12, 0x02, 0x18, 0x02};
+        pb_istream_t stream = pb_istream_from_buffer(input, sizeof(input));
+        Series soa;
+
+        COMMENT("Missing required field in an entry");
+        TEST(!pb_decode(&stream, Series_fields, &soa));
+        TEST(strcmp(PB_GET_ERROR(&stream), "missing required field") == 0);
+    }
+
+    {
+        /* Seven entries that only have the timestamp */
+        uint8_t input[32];
+        pb_istream_t stream;
+        Series soa;
+        int i;
+
+        COMMENT("Too many entries");
+        for (i = 0; i < 7; i++)
+        {
+            input[4 * i] = 0x12;
+            input[4 * i + 1] = 0x02;
+            input[4 * i + 2] = 0x08;
+            input[4 * i + 3] = (uint8_t)i;
+        }
+        stream = pb_istream_from_buffer(input, 28);
+        TEST(!pb_decode(&stream, Series_fields, &soa));
+        TEST(strcmp(PB_GET_ERROR(&stream), "array overflow") == 0);
+    }
+
+    if (status != 0)
+        fprintf(stdout, "\n\nSome tests FAILED!\n");
+
+    return status;
+}
@@ -0,0 +1,221 @@
+/* Checks that the specialized encoding and decoding functions give the
+ * same results as the generic pb_encode() and pb_decode(). */
+
+#include <stdio.h>
+#include <string.h>
+#include <pb_encode.h>
+#include <pb_decode.h>
+#include "specialized.pb.h"
+#include "unittests.h"
+
+static void fill_scalars(Scalars *msg)
+{
+    Scalars tmp = Scalars_init_default;
+    *msg = tmp;
+    msg->i32 = -1234;
+    msg->has_i64 = true;
+    msg->i64 = -9876543210LL;
+    msg->u32 = 4000000000U;
+    msg->has_u64 = true;
+    msg->u64 = 18000000000000000000ULL;
+    msg->s32 = -5;
+    msg->has_s64 = true;
+    msg->s64 = -300000;
+    msg->flag = true;
+    msg->has_f32 = true;
+    msg->f32 = 0x12345678;
+    msg->fl = 3.25f;
+    msg->has_kind = true;
+    msg->kind = Kind_KIND_NEGATIVE;
+    msg->has_str = true;
+    strcpy(msg->str, "hello");
+    msg->has_data = true;
+    msg->data.size = 3;
+    memcpy(msg->data.bytes, "\x01\x02\x03", 3);
+    msg->stamp.tv_sec = 1400000000;
+    msg->stamp.tv_nsec = 999999999;
+    msg->has_other = true;
+    msg->other.tv_sec = 1;
+    msg->has_big_tag = true;
+    msg->big_tag = 200;
+}
+
+int main()
+{
+    int status = 0;
+    uint8_t generic[256];
+    uint8_t special[256];
+    size_t generic_size;
+    Scalars msg;
+    
+    fill_scalars(&msg);
+    
+    COMMENT("Encode Scalars")
+    {
+        pb_ostream_t s1 = pb_ostream_from_buffer(generic, sizeof(generic));
+        pb_ostream_t s2 = pb_ostream_from_buffer(special, sizeof(special));
+        TEST(pb_encode(&s1, Scalars_fields, &msg))
+        TEST(pb_encode_Scalars(&s2, &msg))
+        TEST(s1.bytes_written == s2.bytes_written)
+        TEST(memcmp(generic, special, s1.bytes_written) == 0)
+        generic_size = s1.bytes_written;
+    }
+    
+    COMMENT("Decode Scalars")
+    {
+        Scalars decoded;
+        pb_istream_t stream = pb_istream_from_buffer(generic, generic_size);
+        pb_ostream_t ostream = pb_ostream_from_buffer(special, sizeof(special));
+        TEST(pb_decode_Scalars(&stream, &decoded))
+        TEST(decoded.i32 == -1234 && decoded.i64 == -9876543210LL)
+        TEST(decoded.u32 == 4000000000U && decoded.u64 == 18000000000000000000ULL)
+        TEST(decoded.s32 == -5 && decoded.s64 == -300000)
+        TEST(decoded.flag && decoded.f32 == 0x12345678 && decoded.fl == 3.25f)
+        TEST(!decoded.has_sf64 && !decoded.has_db && decoded.db == 1.5)
+        TEST(decoded.kind == Kind_KIND_NEGATIVE)
+        TEST(strcmp(decoded.str, "hello") == 0)
+        TEST(decoded.data.size == 3 && memcmp(decoded.data.bytes, "\x01\x02\x03", 3) == 0)
+        TEST(decoded.stamp.tv_sec == 1400000000 && decoded.stamp.tv_nsec == 999999999)
+        TEST(decoded.has_other && decoded.other.tv_sec == 1)
+        TEST(decoded.has_big_tag && decoded.big_tag == 200)
+        
+        /* Re-encoding with the generic encoder gives the same data */
+        TEST(pb_encode(&ostream, Scalars_fields, &decoded))
+        TEST(ostream.bytes_written == generic_size)
+        TEST(memcmp(generic, special, generic_size) == 0)
+    }
+    
+    COMMENT("Defaults and unknown fields")
+    {
+        /* Required fields only, plus an unknown field 99 */
+        uint8_t buffer[] = {0x08, 0x01, 0x18, 0x02, 0x28, 0x03, 0x38, 0x01,
+                            0x55, 0x00, 0x00, 0x80, 0x3f,
+                            0x7a, 0x04, 0x08, 0x00, 0x10, 0x00,
+                            0x98, 0x06, 0x05};
+        Scalars decoded;
+        pb_istream_t stream = pb_istream_from_buffer(buffer, sizeof(buffer));
+        TEST(pb_decode_Scalars(&stream, &decoded))
+        TEST(decoded.i32 == 1 && decoded.fl == 1.0f)
+        TEST(decoded.kind == Kind_KIND_B && decoded.db == 1.5)
+        TEST(!decoded.has_str && !decoded.has_other)
+    }
+    
+    COMMENT("Errors")
+    {
+        uint8_t missing[] = {0x08, 0x01};
+        uint8_t wrong_type[] = {0x0a, 0x00};
+        uint8_t long_string[] = {0x6a, 0x10};
+        Scalars decoded;
+        pb_istream_t stream;
+        
+        stream = pb_istream_from_buffer(missing, sizeof(missing));
+        TEST(!pb_decode_Scalars(&stream, &decoded))
+        TEST(strcmp(PB_GET_ERROR(&stream), "missing required field") == 0)
+        
+        stream = pb_istream_from_buffer(wrong_type, sizeof(wrong_type));
+        TEST(!pb_decode_Scalars(&stream, &decoded))
+        TEST(strcmp(PB_GET_ERROR(&stream), "wrong wire type") == 0)
+        
+        stream = pb_istream_from_buffer(long_string, sizeof(long_string));
+        TEST(!pb_decode_Scalars(&stream, &decoded))
+        TEST(strcmp(PB_GET_ERROR(&stream), "string overflow") == 0)
+    }
+    
+    COMMENT("Integers that do not fit in the field")
+    {
+        /* Each value is rejected by the generic decoder, except the last
+         * ones, which fit. */
+        static const uint8_t cases[][8] = {
+            {3, 0x08, 0xc8, 0x01},                    /* i8 = 200 */
+            {4, 0x10, 0xf0, 0xa2, 0x04},              /* u16 = 70000 */
+            {3, 0x18, 0x90, 0x03},                    /* s8 = 200 */
+            {6, 0x08, 0xff, 0xff, 0xff, 0xff, 0x0f},  /* i8 = -1 in 32 bits */
+            {4, 0x10, 0xff, 0xff, 0x03},              /* u16 = 65535 */
+            {2, 0x18, 0x01}                           /* s8 = -1 */
+        };
+        uint8_t u32_too_large[] = {0x18, 0x80, 0x80, 0x80, 0x80, 0x10};
+        Scalars scalars;
+        Narrow decoded;
+        pb_istream_t stream;
+        bool generic_ok;
+        int i;
+        
+        for (i = 0; i < 6; i++)
+        {
+            stream = pb_istream_from_buffer(&cases[i][1], cases[i][0]);
+            generic_ok = pb_decode(&stream, Narrow_fields, &decoded);
+            TEST(generic_ok == (i >= 3))
+            
+            stream = pb_istream_from_buffer(&cases[i][1], cases[i][0]);
+            TEST(pb_decode_Narrow(&stream, &decoded) == generic_ok)
+            if (!generic_ok)
+            {
+                TEST(strcmp(PB_GET_ERROR(&stream), "integer too large") == 0)
+            }
+        }
+        TEST(decoded.s8 == -1)
+        
+        stream = pb_istream_from_buffer(u32_too_large, sizeof(u32_too_large));
+        TEST(!pb_decode_Scalars(&stream, &scalars))
+        TEST(strcmp(PB_GET_ERROR(&stream), "integer too large") == 0)
+    }
+    
+    COMMENT("Fallback to generic functions")
+    {
+        Fallback fb = Fallback_init_zero;
+        Fallback decoded;
+        uint8_t buffer[64];
+        pb_ostream_t ostream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+        pb_istream_t istream;
+        
+        fb.values_count = 2;
+        fb.values[0] = 5;
+        fb.values[1] = -5;
+        fb.has_stamp = true;
+        fb.stamp.tv_sec = 7;
+        TEST(pb_encode_Fallback(&ostream, &fb))
+        
+        istream = pb_istream_from_buffer(buffer, ostream.bytes_written);
+        TEST(pb_decode_Fallback(&istream, &decoded))
+        TEST(decoded.values_count == 2 && decoded.values[1] == -5)
+        TEST(decoded.has_stamp && decoded.stamp.tv_sec == 7)
+    }
+    
+    COMMENT("Encode from template")
+    {
+        Values values = Values_init_zero;
+        Values decoded;
+        uint8_t buffer1[Values_size];
+        uint8_t buffer2[Values_size];
+        pb_ostream_t s1 = pb_ostream_from_buffer(buffer1, sizeof(buffer1));
+        pb_ostream_t s2 = pb_ostream_from_buffer(buffer2, sizeof(buffer2));
+        pb_ostream_t sizing = PB_OSTREAM_SIZING;
+        pb_istream_t istream;
+        
+        values.stamp.tv_sec = 1400000000;
+        values.stamp.tv_nsec = 0xFFFFFFFF;
+        values.temperature = -12.5f;
+        values.pressure = 1013.25;
+        values.valid = true;
+        values.sequence = -2;
+        TEST(pb_encode(&s1, Values_fields, &values))
+        TEST(pb_encode_Values(&s2, &values))
+        TEST(s1.bytes_written == Values_fixed_size && s2.bytes_written == Values_fixed_size)
+        TEST(memcmp(buffer1, buffer2, Values_fixed_size) == 0)
+        TEST(pb_encode_Values(&sizing, &values) && sizing.bytes_written == Values_fixed_size)
+        
+        s2 = pb_ostream_from_buffer(buffer2, Values_fixed_size - 1);
+        TEST(!pb_encode_Values(&s2, &values))
+        
+        istream = pb_istream_from_buffer(buffer1, Values_fixed_size);
+        TEST(pb_decode_Values(&istream, &decoded))
+        TEST(decoded.stamp.tv_sec == 1400000000 && decoded.stamp.tv_nsec == 0xFFFFFFFF)
+        TEST(decoded.temperature == -12.5f && decoded.pressure == 1013.25)
+        TEST(decoded.valid && decoded.sequence == -2)
+    }
+    
+    if (status != 0)
+        fprintf(stdout, "\n\nSome tests FAILED!\n");
+    
+    return status;
+}
@@ -0,0 +1,116 @@
+/* Checks the counters that the streams collect when PB_ENABLE_STATS
+ * is defined. */
+
+#include <stdio.h>
+#include <string.h>
+#include <pb_encode.h>
+#include <pb_decode.h>
+#include "stats.pb.h"
+#include "malloc_wrappers.h"
+#include "unittests.h"
+
+/* Input stream callback that counts its calls */
+static size_t g_reads;
+
+static bool read_callback(pb_istream_t *stream, uint8_t *buf, size_t count)
+{
+    uint8_t **pos = (uint8_t**)stream->state;
+    if (buf != NULL)
+        memcpy(buf, *pos, count);
+    *pos += count;
+    g_reads++;
+    return true;
+}
+
+int main()
+{
+    int status = 0;
+    uint8_t buffer[128];
+    size_t size;
+
+    {
+        Outer msg = Outer_init_zero;
+        Inner children[2] = {Inner_init_zero, Inner_init_zero};
+        char name[] = "abc";
+        pb_ostream_t stream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+
+        COMMENT("Encoding");
+        msg.inner.value = 1;
+        msg.inner.numbers_count = 3;
+        msg.inner.numbers[0] = 1;
+        msg.inner.numbers[1] = 2;
+        msg.inner.numbers[2] = 3;
+        children[0].value = 2;
+        children[1].value = 3;
+        msg.children_count = 2;
+        msg.children = children;
+        msg.name = name;
+
+        TEST(stream.stats.bytes == 0 && stream.stats.fields == 0);
+        TEST(pb_encode(&stream, Outer_fields, &msg));
+        size = stream.bytes_written;
+        TEST(stream.stats.bytes == size);
+        TEST(stream.stats.callbacks == 0);
+
+        /* Submessage fields are counted in both the size calculation
+         * pass and the writing pass */
+        TEST(stream.stats.fields == 4 + 2 * 2 + 2 * 2);
+        TEST(stream.stats.skipped_fields == 0);
+        TEST(stream.stats.substreams == 6);
+        TEST(stream.stats.depth == 0);
+        TEST(stream.stats.max_depth == 1);
+        TEST(stream.stats.allocs == 0);
+    }
+
+    {
+        Outer msg;
+        uint8_t *pos = buffer;
+        pb_istream_t stream = {&read_callback, NULL, 0};
+
+        COMMENT("Decoding with a callback stream");
+        stream.state = &pos;
+        stream.bytes_left = size;
+        g_reads = 0;
+
+        TEST(pb_decode(&stream, Outer_fields, &msg));
+        TEST(msg.children_count == 2 && strcmp(msg.name, "abc") == 0);
+        TEST(stream.stats.bytes == size);
+        TEST(stream.stats.callbacks == g_reads && g_reads > 0);
+        TEST(stream.stats.fields == 4 + 2 + 2);
+        TEST(stream.stats.skipped_fields == 0);
+        TEST(stream.stats.substreams == 4);
+        TEST(stream.stats.depth == 0);
+        TEST(stream.stats.max_depth == 1);
+
+        /* The children array is allocated and then grown, the name is
+         * allocated once with space for the terminator */
+        TEST(stream.stats.allocs == 2);
+        TEST(stream.stats.reallocs == 1);
+        TEST(stream.stats.bytes_allocated == 3 * sizeof(Inner) + 4);
+
+        pb_release(Outer_fields, &msg);
+        TEST(get_alloc_count() == 0);
+    }
+
+    {
+        Outer msg;
+        pb_istream_t stream;
+
+        COMMENT("Skipping unknown fields");
+        buffer[size] = 0x28; /* Field 5, varint */
+        buffer[size + 1] = 0x05;
+        stream = pb_istream_from_buffer(buffer, size + 2);
+
+        TEST(pb_decode(&stream, Outer_fields, &msg));
+        TEST(stream.stats.bytes == size + 2);
+        TEST(stream.stats.callbacks == 0);
+        TEST(stream.stats.fields == 4 + 2 + 2);
+        TEST(stream.stats.skipped_fields == 1);
+        pb_release(Outer_fields, &msg);
+    }
+
+    if (status != 0)
+        fprintf(stdout, "\n\nSome tests FAILED!\n");
+
+    return status;
+}
@@ -0,0 +1,180 @@
+/* Checks that the stream tap passes the calls through to the wrapped
+ * streams and counts them. */
+
+#include <stdio.h>
+#include <string.h>
+#include <pb_encode.h>
+#include <pb_decode.h>
+#include "pb_stream_tap.h"
+#include "stream_tap.pb.h"
+#include "unittests.h"
+
+/* Input stream over a buffer, like a file that ends at end */
+typedef struct {
+    const uint8_t *pos;
+    const uint8_t *end;
+    size_t calls;
+} source_t;
+
+static bool read_callback(pb_istream_t *stream, uint8_t *buf, size_t count)
+{
+    source_t *source = (source_t*)stream->state;
+    source->calls++;
+
+    if ((size_t)(source->end - source->pos) < count)
+    {
+        /* Same as the timeout handling of examples/prodm_unitTests */
+        stream->bytes_left = 0;
+        return false;
+    }
+
+    if (buf != NULL)
+        memcpy(buf, source->pos, count);
+    source->pos += count;
+    return true;
+}
+
+static size_t g_writes;
+
+static bool write_callback(pb_ostream_t *stream, const uint8_t *buf, size_t count)
+{
+    uint8_t **pos = (uint8_t**)stream->state;
+    memcpy(*pos, buf, count);
+    *pos += count;
+    g_writes++;
+    return true;
+}
+
+int main()
+{
+    int status = 0;
+    uint8_t buffer[64];
+    size_t size;
+
+    {
+        pb_tap_histogram_t histogram;
+        uint64_t value;
+
+        COMMENT("Histogram buckets");
+        memset(&histogram, 0, sizeof(histogram));
+        for (value = 1; value <= 10; value++)
+            pb_tap_histogram_add(&histogram, value);
+
+        TEST(histogram.count == 10 && histogram.min == 1 && histogram.max == 10);
+        TEST(pb_tap_histogram_percentile(&histogram, 50) == 5);
+        TEST(pb_tap_histogram_percentile(&histogram, 100) == 10);
+
+        pb_tap_histogram_add(&histogram, 1000);
+        pb_tap_histogram_add(&histogram, 100000);
+        pb_tap_histogram_add(&histogram, 100000);
+        value = pb_tap_histogram_percentile(&histogram, 80);
+        TEST(value >= 1000 && value < 1000 + 1000 / PB_TAP_SUB_BUCKETS);
+        TEST(pb_tap_histogram_percentile(&histogram, 99) == 100000);
+
+        pb_tap_histogram_add(&histogram, UINT64_MAX);
+        TEST(pb_tap_histogram_percentile(&histogram, 100) == UINT64_MAX);
+    }
+
+    {
+        Record msg = Record_init_zero;
+        pb_stream_tap_t tap;
+        uint8_t *pos = buffer;
+        pb_ostream_t inner = {&write_callback, NULL, SIZE_MAX, 0};
+        pb_ostream_t stream;
+
+        COMMENT("Encoding through a tap");
+        msg.id = 150;
+        strcpy(msg.name, "tap");
+        msg.has_name = true;
+        msg.values_count = 3;
+        msg.values[0] = 1;
+        msg.values[1] = 2;
+        msg.values[2] = 300;
+
+        inner.state = &pos;
+        g_writes = 0;
+        pb_stream_tap_init(&tap);
+        stream = pb_ostream_tap(&tap, &inner);
+
+        TEST(pb_encode(&stream, Record_fields, &msg));
+        size = stream.bytes_written;
+        TEST(pos == buffer + size);
+        TEST(tap.bytes.count == g_writes && g_writes > 0);
+        TEST(tap.bytes.sum == size);
+        TEST(tap.blocked.count == g_writes);
+        TEST(tap.failures == 0);
+    }
+
+    {
+        Record msg;
+        pb_stream_tap_t tap;
+        source_t source;
+        pb_istream_t inner = {&read_callback, NULL, SIZE_MAX};
+        pb_istream_t stream;
+        FILE *log = tmpfile();
+        int lines = 0;
+        int c;
+
+        COMMENT("Decoding through a tap");
+        source.pos = buffer;
+        source.end = buffer + size;
+        source.calls = 0;
+        inner.state = &source;
+        pb_stream_tap_init(&tap);
+        tap.log = log;
+        stream = pb_istream_tap(&tap, &inner);
+        stream.bytes_left = size;
+
+        TEST(pb_decode(&stream, Record_fields, &msg));
+        TEST(msg.id == 150 && strcmp(msg.name, "tap") == 0 && msg.values[2] == 300);
+        TEST(stream.bytes_left == 0);
+        TEST(tap.bytes.count == source.calls && source.calls > 0);
+        TEST(tap.bytes.sum == size);
+        TEST(tap.failures == 0);
+
+        rewind(log);
+        while ((c = fgetc(log)) != EOF)
+        {
+            if (c == '\n')
+                lines++;
+        }
+        TEST(lines == (int)source.calls);
+        fclose(log);
+
+        pb_tap_histogram_export(&tap.bytes, stdout, 1.0);
+        pb_stream_tap_print(&tap, "input", stdout);
+    }
+
+    {
+        Record msg;
+        pb_stream_tap_t tap;
+        source_t source;
+        pb_istream_t inner = {&read_callback, NULL, SIZE_MAX};
+        pb_istream_t stream;
+
+        COMMENT("End of stream signalled by the wrapped callback");
+        source.pos = buffer;
+        source.end = buffer + size - 1;
+        source.calls = 0;
+        inner.state = &source;
+        pb_stream_tap_init(&tap);
+        stream = pb_istream_tap(&tap, &inner);
+
+        TEST(!pb_decode(&stream, Record_fields, &msg));
+        TEST(tap.failures == 1);
+        TEST(strcmp(PB_GET_ERROR(&stream), "io error") == 0);
+        TEST(tap.bytes.count == source.calls);
+
+        source.pos = buffer;
+        inner.bytes_left = SIZE_MAX;
+        stream = pb_istream_tap(&tap, &inner);
+        TEST(!pb_read(&stream, buffer + 32, size));
+        TEST(stream.bytes_left == 0);
+        TEST(tap.failures == 2);
+    }
+
+    if (status != 0)
+        fprintf(stdout, "\n\nSome tests FAILED!\n");
+
+    return status;
+}
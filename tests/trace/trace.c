@@ -0,0 +1,137 @@
+/* Checks the events that the streams pass to the trace hook when
+ * PB_ENABLE_TRACE is defined, and collects histograms of them. */
+
+#include <stdio.h>
+#include <string.h>
+#include <pb_encode.h>
+#include <pb_decode.h>
+#include "pb_trace_collector.h"
+#include "trace.pb.h"
+#include "unittests.h"
+
+#define MAX_EVENTS 16
+
+typedef struct {
+    pb_trace_event_t events[MAX_EVENTS];
+    int count;
+} event_log_t;
+
+static void log_event(const pb_trace_event_t *event, void *arg)
+{
+    event_log_t *log = (event_log_t*)arg;
+    if (log->count < MAX_EVENTS)
+        log->events[log->count++] = *event;
+}
+
+/* The field descriptor is not checked, as it is valid only during the hook */
+static bool check_event(const pb_trace_event_t *event, const pb_field_t *fields,
+                        uint32_t tag, size_t offset, size_t size)
+{
+    return event->fields == fields && event->tag == tag &&
+           event->offset == offset && event->size == size;
+}
+
+int main()
+{
+    int status = 0;
+    uint8_t buffer[64];
+    size_t size;
+
+    {
+        Sample msg = Sample_init_zero;
+        event_log_t log;
+        pb_trace_t trace;
+        pb_ostream_t stream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+
+        COMMENT("Encoding");
+        msg.id = 300;
+        msg.has_point = true;
+        msg.point.x = 1;
+        msg.point.y = -2;
+        msg.raw_count = 2;
+        msg.raw[0] = 1;
+        msg.raw[1] = 2;
+
+        log.count = 0;
+        trace.hook = &log_event;
+        trace.arg = &log;
+        stream.trace = &trace;
+
+        TEST(pb_encode(&stream, Sample_fields, &msg));
+        size = stream.bytes_written;
+        TEST(size == 19);
+
+        /* The absent label is not reported, and the packed array is one event */
+        TEST(log.count == 5);
+        TEST(check_event(&log.events[0], Sample_fields, 1, 0, 3));
+        TEST(check_event(&log.events[1], Point_fields, 1, 5, 2));
+        TEST(check_event(&log.events[2], Point_fields, 2, 7, 2));
+        TEST(check_event(&log.events[3], Sample_fields, 2, 3, 6));
+        TEST(check_event(&log.events[4], Sample_fields, 3, 9, 10));
+        TEST(log.events[3].elapsed >= log.events[1].elapsed);
+    }
+
+    {
+        Sample msg;
+        event_log_t log;
+        pb_trace_t trace;
+        pb_istream_t stream = pb_istream_from_buffer(buffer, size);
+
+        COMMENT("Decoding");
+        log.count = 0;
+        trace.hook = &log_event;
+        trace.arg = &log;
+        stream.trace = &trace;
+
+        TEST(pb_decode(&stream, Sample_fields, &msg));
+        TEST(msg.point.y == -2 && msg.raw_count == 2);
+        TEST(log.count == 5);
+        TEST(check_event(&log.events[0], Sample_fields, 1, 0, 3));
+        TEST(check_event(&log.events[1], Point_fields, 1, 5, 2));
+        TEST(check_event(&log.events[2], Point_fields, 2, 7, 2));
+        TEST(check_event(&log.events[3], Sample_fields, 2, 3, 6));
+        TEST(check_event(&log.events[4], Sample_fields, 3, 9, 10));
+    }
+
+    {
+        static pb_trace_collector_t collector;
+        const pb_trace_message_stats_t *sample = &collector.messages[0];
+        const pb_trace_message_stats_t *point = &collector.messages[1];
+        int i;
+
+        COMMENT("Collecting histograms");
+        pb_trace_collector_init(&collector);
+        TEST(pb_trace_collector_add(&collector, "Sample", Sample_fields));
+        TEST(pb_trace_collector_add(&collector, "Point", Point_fields));
+
+        for (i = 0; i < 10; i++)
+        {
+            Sample msg;
+            pb_istream_t stream = pb_istream_from_buffer(buffer, size);
+            pb_trace_time_t start = PB_TRACE_CLOCK();
+
+            stream.trace = &collector.trace;
+            if (!pb_decode(&stream, Sample_fields, &msg))
+                break;
+            pb_trace_collector_record(&collector, Sample_fields, size, PB_TRACE_CLOCK() - start);
+        }
+
+        TEST(i == 10);
+        TEST(sample->time.count == 10 && sample->size.max == 19);
+        TEST(sample->field_stats[0].size.count == 10);
+        TEST(sample->field_stats[1].size.count == 10);
+        TEST(sample->field_stats[2].size.max == 10);
+        TEST(pb_histogram_percentile(&sample->field_stats[2].size, 50) == 10);
+        TEST(sample->field_stats[3].size.count == 0);
+        TEST(point->time.count == 10 && point->size.max == 6);
+        TEST(point->field_stats[0].size.count == 10);
+        TEST(collector.other_fields == 0);
+
+        pb_trace_collector_print(&collector, stdout);
+    }
+
+    if (status != 0)
+        fprintf(stdout, "\n\nSome tests FAILED!\n");
+
+    return status;
+}
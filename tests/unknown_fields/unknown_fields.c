@@ -0,0 +1,111 @@
+/* Checks that fields unknown to the decoder are stored in the message
+ * and written back out by the encoder. */
+
+#include <stdio.h>
+#include <string.h>
+#include <pb_encode.h>
+#include <pb_decode.h>
+#include "unknown_fields.pb.h"
+#include "unittests.h"
+
+/* Encode a MessageV2 with all fields set */
+static bool encode_v2(uint8_t *buffer, size_t bufsize, size_t *size)
+{
+    MessageV2 msg = MessageV2_init_zero;
+    pb_ostream_t stream = pb_ostream_from_buffer(buffer, bufsize);
+    
+    msg.int32_field = -1;
+    msg.has_string_field = true;
+    strcpy(msg.string_field, "hello");
+    msg.has_fixed64_field = true;
+    msg.fixed64_field = 0x0102030405060708ULL;
+    msg.has_submsg = true;
+    msg.submsg.value = 42;
+    msg.submsg.has_note = true;
+    strcpy(msg.submsg.note, "inner");
+    msg.packed_field_count = 3;
+    msg.packed_field[0] = 1;
+    msg.packed_field[1] = -200;
+    msg.packed_field[2] = 30000;
+    msg.has_float_field = true;
+    msg.float_field = 1.5f;
+    msg.has_int64_field = true;
+    msg.int64_field = 1234567890123LL;
+    
+    if (!pb_encode(&stream, MessageV2_fields, &msg))
+    {
+        printf("Encode failed: %s\n", PB_GET_ERROR(&stream));
+        return false;
+    }
+    
+    *size = stream.bytes_written;
+    return true;
+}
+
+int main()
+{
+    int status = 0;
+    uint8_t buffer[256];
+    uint8_t buffer2[256];
+    size_t size, size2;
+    
+    if (!encode_v2(buffer, sizeof(buffer), &size))
+        return 1;
+    
+    {
+        MessageV1 old = MessageV1_init_zero;
+        MessageV2 msg = MessageV2_init_zero;
+        pb_istream_t istream;
+        pb_ostream_t ostream;
+        
+        COMMENT("Decode with the old version, unknown fields are stored")
+        istream = pb_istream_from_buffer(buffer, size);
+        TEST(pb_decode(&istream, MessageV1_fields, &old));
+        TEST(old.int32_field == -1);
+        TEST(old.has_submsg && old.submsg.value == 42);
+        TEST(old.unknown_fields.size > 0);
+        TEST(old.submsg.unknown_fields.size == 7);
+        
+        COMMENT("Re-encode with the old version")
+        ostream = pb_ostream_from_buffer(buffer2, sizeof(buffer2));
+        TEST(pb_encode(&ostream, MessageV1_fields, &old));
+        size2 = ostream.bytes_written;
+        TEST(size2 == size);
+        
+        COMMENT("Decode the result with the new version, nothing is lost")
+        istream = pb_istream_from_buffer(buffer2, size2);
+        TEST(pb_decode(&istream, MessageV2_fields, &msg));
+        TEST(msg.int32_field == -1);
+        TEST(msg.has_string_field && strcmp(msg.string_field, "hello") == 0);
+        TEST(msg.has_fixed64_field && msg.fixed64_field == 0x0102030405060708ULL);
+        TEST(msg.has_submsg && msg.submsg.value == 42);
+        TEST(msg.submsg.has_note && strcmp(msg.submsg.note, "inner") == 0);
+        TEST(msg.packed_field_count == 3 && msg.packed_field[1] == -200);
+        TEST(msg.has_float_field && msg.float_field == 1.5f);
+        TEST(msg.has_int64_field && msg.int64_field == 1234567890123LL);
+        
+        COMMENT("Decoding again clears the previously stored fields")
+        {
+            const uint8_t known_only[] = {0x08, 0x05};
+            istream = pb_istream_from_buffer(known_only, sizeof(known_only));
+            TEST(pb_decode(&istream, MessageV1_fields, &old));
+            TEST(old.int32_field == 5);
+            TEST(old.unknown_fields.size == 0);
+        }
+    }
+    
+    {
+        SmallBuffer small = SmallBuffer_init_zero;
+        pb_istream_t istream;
+        
+        COMMENT("Too many unknown fields is an error")
+        istream = pb_istream_from_buffer(buffer, size);
+        TEST(!pb_decode(&istream, SmallBuffer_fields, &small));
+        TEST(strcmp(PB_GET_ERROR(&istream), "unknown fields overflow") == 0);
+    }
+    
+    if (status != 0)
+        fprintf(stdout, "\n\nSome tests FAILED!\n");
+    
+    return status;
+}